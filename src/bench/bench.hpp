@@ -0,0 +1,48 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace TinyCDN::Bench {
+
+//! Keeps the optimizer from discarding a computed value
+template <typename T>
+inline void doNotOptimize(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+//! Wall-clock seconds spent running fn once
+template <typename Function>
+inline double time(Function&& fn) {
+  auto const start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+//! Runs fn(i) for i in [0, iterations) and prints ns/op and ops/s under the given name
+template <typename Function>
+inline double run(std::string const& name, std::uint64_t iterations, Function&& fn) {
+  auto const seconds = time([&] {
+    for (std::uint64_t i = 0; i < iterations; i++) fn(i);
+  });
+
+  std::cout << std::left << std::setw(48) << name
+            << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+            << seconds * 1e9 / iterations << " ns/op"
+            << std::setw(14) << std::setprecision(0) << iterations / seconds << " ops/s"
+            << std::endl;
+
+  return seconds;
+}
+
+//! Prints bytes/seconds as GB/s under the given name
+inline void reportThroughput(std::string const& name, std::uint64_t bytes, double seconds) {
+  std::cout << std::left << std::setw(48) << name
+            << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+            << bytes / seconds / 1e9 << " GB/s" << std::endl;
+}
+}
@@ -0,0 +1,177 @@
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/compressed.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_gB;
+
+namespace fs = std::experimental::filesystem;
+
+#ifdef TINYCDN_HAVE_ZSTD
+namespace {
+struct Kind {
+  std::string contentType;
+  std::string extension;
+  std::string (*make)(std::mt19937_64& random, std::size_t size);
+};
+
+std::string pick(std::mt19937_64& random, const std::vector<std::string>& words) {
+  return words[random() % words.size()];
+}
+
+std::string json(std::mt19937_64& random, std::size_t size) {
+  static const std::vector<std::string> names = {"logo", "hero", "avatar", "banner", "thumbnail", "icon", "cover"};
+  std::string text = "[";
+  while (text.size() < size) {
+    text += "{\"id\":" + std::to_string(random() % 1000000) + ",\"name\":\"" + pick(random, names) + "-" + std::to_string(random() % 500)
+      + "\",\"width\":" + std::to_string(random() % 4096) + ",\"public\":" + (random() % 2 ? "true" : "false") + "},\n";
+  }
+  text.resize(size);
+  return text;
+}
+
+std::string javascript(std::mt19937_64& random, std::size_t size) {
+  static const std::vector<std::string> names = {"element", "state", "props", "index", "value", "node", "callback", "options"};
+  std::string text;
+  while (text.size() < size) {
+    auto const a = pick(random, names), b = pick(random, names);
+    text += "function update" + std::to_string(random() % 2000) + "(" + a + ", " + b + ") {\n  if (!" + a + ") return " + b + ";\n  const "
+      + "next = Object.assign({}, " + b + ", { " + a + ": " + std::to_string(random() % 100) + " });\n  return render(next);\n}\n";
+  }
+  text.resize(size);
+  return text;
+}
+
+std::string svg(std::mt19937_64& random, std::size_t size) {
+  std::string text = "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"0 0 512 512\">\n";
+  while (text.size() < size) {
+    text += "  <path fill=\"#" + std::to_string(100000 + random() % 900000) + "\" d=\"M" + std::to_string(random() % 512) + " "
+      + std::to_string(random() % 512) + "L" + std::to_string(random() % 512) + " " + std::to_string(random() % 512) + "Z\"/>\n";
+  }
+  text.resize(size);
+  return text;
+}
+
+//! Compressed media is as good as random bytes
+std::string image(std::mt19937_64& random, std::size_t size) {
+  std::string bytes(size, '\0');
+  for (std::size_t i = 0; i < size; i += 8) {
+    auto const value = random();
+    std::memcpy(bytes.data() + i, &value, std::min<std::size_t>(8, size - i));
+  }
+  return bytes;
+}
+
+std::unique_ptr<StoredFile> upload(const fs::path& location, const std::string& contents, const std::string& contentType) {
+  fs::create_directories(location.parent_path());
+  std::ofstream(location, std::ios::binary) << contents;
+  auto file = std::make_unique<StoredFile>(Size{contents.size()}, location, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{});
+  file->contentType = contentType;
+  return file;
+}
+
+//! Looks up random files and reads length bytes of each, at a random offset if ranged
+template <typename Storage>
+double serve(Storage& storage, const std::vector<fileId>& ids, std::size_t count, std::size_t length, bool ranged) {
+  std::mt19937_64 random{7};
+  std::vector<unsigned char> buffer(length);
+
+  return Bench::time([&] {
+    for (std::size_t i = 0; i < count; i++) {
+      auto const file = storage.lookup(ids[random() % ids.size()]);
+      std::shared_ptr<const Utility::ChunkSource> contents = file->contents;
+      if (!contents) contents = Utility::FileHandle::open(file->location.string());
+      auto const offset = ranged ? random() % (file->size - length) : 0;
+      Bench::doNotOptimize(contents->readAt(buffer.data(), std::min<std::size_t>(length, file->size), offset));
+    }
+  });
+}
+}
+
+int main(int argc, char** argv) {
+  std::size_t const filesPerKind = argc > 1 ? std::stoull(argv[1]) : 100;
+  std::size_t const fileSize = argc > 2 ? std::stoull(argv[2]) : 256_kB;
+  std::size_t const count = argc > 3 ? std::stoull(argv[3]) : 2000;
+  auto const root = fs::temp_directory_path() / "bench-compression";
+
+  std::vector<Kind> const kinds = {
+    {"application/json", ".json", json},
+    {"application/javascript", ".js", javascript},
+    {"image/svg+xml", ".svg", svg},
+    {"image/png", ".png", image},
+    // What a bucket that takes images would enable, which entropy sampling has to turn down
+    {"image/jpeg", ".jpg", image}
+  };
+
+  std::cout << filesPerKind << " files of " << (fileSize >> 10) << "kB per content type, " << count << " requests" << std::endl;
+  std::cout << std::left << std::setw(24) << "content type" << std::right << std::setw(10) << "stored" << std::setw(8) << "ratio"
+            << std::setw(12) << "add MB/s" << std::setw(10) << "raw" << std::setw(12) << "compressed" << std::setw(10) << "raw"
+            << std::setw(12) << "compressed" << std::endl;
+  std::cout << std::left << std::setw(54) << "" << std::right << std::setw(22) << "us/full read" << std::setw(22) << "us/16kB range" << std::endl;
+
+  for (auto const& kind : kinds) {
+    fs::remove_all(root);
+    fs::create_directories(root / "raw");
+    fs::create_directories(root / "compressed");
+
+    std::mt19937_64 random{42};
+    std::vector<std::string> contents;
+    for (std::size_t i = 0; i < filesPerKind; i++) contents.push_back(kind.make(random, fileSize));
+
+    // add() logs every file
+    std::cout.setstate(std::ios::failbit);
+    FilesystemStorage raw(Size{64_gB}, root / "raw", false);
+    CompressionPolicy policy;
+    policy.enable({"image"});
+    CompressedStorage<FilesystemStorage> compressed(Size{64_gB}, root / "compressed", false, policy);
+
+    std::vector<fileId> rawIds, compressedIds;
+    for (std::size_t i = 0; i < filesPerKind; i++) {
+      rawIds.push_back(raw.add(upload(root / "uploads" / (std::to_string(i) + kind.extension), contents[i], kind.contentType))->id.value());
+    }
+    auto const adding = Bench::time([&] {
+      for (std::size_t i = 0; i < filesPerKind; i++) {
+	auto const location = root / "uploads" / (std::to_string(i) + kind.extension);
+	compressedIds.push_back(compressed.add(upload(location, contents[i], kind.contentType))->id.value());
+      }
+    });
+
+    // The first pass brings everything into the page cache for both
+    serve(raw, rawIds, count, fileSize, false);
+    serve(compressed, compressedIds, count, fileSize, false);
+    auto const rawFull = serve(raw, rawIds, count, fileSize, false);
+    auto const compressedFull = serve(compressed, compressedIds, count, fileSize, false);
+    auto const rawRange = serve(raw, rawIds, count, 16_kB, true);
+    auto const compressedRange = serve(compressed, compressedIds, count, 16_kB, true);
+    auto const stats = compressed.stats();
+    std::cout.clear();
+
+    std::cout << std::left << std::setw(24) << kind.contentType << std::right << std::setw(8) << (compressed.getAllocatedSize() >> 10) << "kB"
+              << std::setw(8) << std::fixed << std::setprecision(2) << static_cast<double>(raw.getAllocatedSize()) / compressed.getAllocatedSize()
+              << std::setw(12) << std::setprecision(0) << filesPerKind * fileSize / adding / 1e6
+              << std::setw(10) << std::setprecision(1) << rawFull * 1e6 / count << std::setw(12) << compressedFull * 1e6 / count
+              << std::setw(10) << rawRange * 1e6 / count << std::setw(12) << compressedRange * 1e6 / count
+              << "   (" << stats.compressed << " compressed, " << stats.incompressible << " incompressible)" << std::endl;
+  }
+
+  fs::remove_all(root);
+  return 0;
+}
+#else
+int main() {
+  std::cout << "CompressedStorage needs zstd" << std::endl;
+  return 0;
+}
+#endif
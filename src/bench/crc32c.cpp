@@ -0,0 +1,84 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/crc32c.hpp"
+#include "src/middlewares/FileStorage/haystack.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+//! Checksums buffer in 256kB blocks, the size a needle's checksums cover, `passes` times
+double checksumSeconds(Crc32c::Engine engine, std::vector<char> const& buffer, int passes) {
+  return Bench::time([&] {
+    for (int pass = 0; pass < passes; pass++) {
+      for (std::size_t offset = 0; offset < buffer.size(); offset += NeedleHeader::checksumBlockSize) {
+        Bench::doNotOptimize(Crc32c::extend(engine, 0, buffer.data() + offset,
+                                            std::min<std::size_t>(NeedleHeader::checksumBlockSize, buffer.size() - offset)));
+      }
+    }
+  });
+}
+
+//! Reads size bytes out of source in 32kB chunks, like a ChunkedCursor serving a client
+double serveSeconds(const Utility::ChunkSource& source, std::uintmax_t offset, std::uintmax_t size, int passes) {
+  std::vector<unsigned char> chunk(32_kB);
+  return Bench::time([&] {
+    for (int pass = 0; pass < passes; pass++) {
+      for (std::uintmax_t position = 0; position < size; position += chunk.size()) {
+        Bench::doNotOptimize(source.readAt(chunk.data(), chunk.size(), offset + position));
+      }
+    }
+  });
+}
+
+int main(int argc, char** argv) {
+  int const passes = argc > 1 ? std::stoi(argv[1]) : 16;
+
+  // 64MB of random data, larger than any cache
+  std::vector<char> buffer(64_mB);
+  std::mt19937_64 re{42};
+  for (auto& c : buffer) c = static_cast<char>(re());
+  auto const bytes = static_cast<std::uint64_t>(buffer.size()) * passes;
+
+  std::vector<std::pair<std::string, Crc32c::Engine>> engines{{"portable", Crc32c::Engine::Portable}};
+  if (Crc32c::bestEngine() != Crc32c::Engine::Portable) engines.emplace_back("SSE4.2", Crc32c::Engine::Sse42);
+  if (Crc32c::bestEngine() == Crc32c::Engine::Sse42Pclmul) engines.emplace_back("SSE4.2 + PCLMUL", Crc32c::Engine::Sse42Pclmul);
+
+  for (auto const& [name, engine] : engines) {
+    Bench::reportThroughput("CRC32C " + name, bytes, checksumSeconds(engine, buffer, passes));
+  }
+
+  // Hot reads of a needle, with its blocks verified on the first pass only, against plain preads
+  auto const root = fs::temp_directory_path() / "bench-crc32c";
+  fs::remove_all(root);
+  fs::create_directories(root / "uploads");
+  auto const upload = root / "uploads" / "file";
+  std::ofstream(upload, std::ios::binary).write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+
+  Haystack haystack(Size{buffer.size() + 1_mB}, root / "volume", false);
+  auto const file = haystack.add(std::make_unique<StoredFile>(
+    Size{buffer.size()}, upload, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+  auto const volume = Utility::FileHandle::open(haystack.volumePath().string());
+
+  // Warm the page cache
+  serveSeconds(*volume, file->position->first, buffer.size(), 1);
+
+  Bench::reportThroughput("serve unverified (pread)", buffer.size(),
+                          serveSeconds(*volume, file->position->first, buffer.size(), 1));
+  Bench::reportThroughput("serve, first read verifies", buffer.size(),
+                          serveSeconds(*file->contents, 0, buffer.size(), 1));
+  Bench::reportThroughput("serve, verified", bytes, serveSeconds(*file->contents, 0, buffer.size(), passes));
+
+  fs::remove_all(root);
+  return 0;
+}
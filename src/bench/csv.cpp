@@ -0,0 +1,80 @@
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/utility.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility;
+
+//! fromCSV before CSVTokenizer: a substr per field, which also copies the rest of the line every time
+std::vector<std::string> legacyFromCSV(std::string csv) {
+  std::vector<std::string> values;
+  if (csv.length() != 0) {
+    auto nextComma = csv.find(',');
+    if (nextComma == std::string::npos) {
+      values.push_back(csv);
+    }
+    else {
+      values.push_back(csv.substr(0, nextComma));
+      auto nextCSV = csv.substr(nextComma+1);
+      nextComma = nextCSV.find(',');
+      while (nextComma != std::string::npos) {
+        values.push_back(nextCSV.substr(nextComma));
+        nextCSV = nextCSV.substr(nextComma+1);
+        nextComma = nextCSV.find(',');
+      }
+      values.push_back(nextCSV);
+    }
+  }
+  return values;
+}
+
+//! asCSV before writeCSV: appends piece by piece
+std::string legacyAsCSV(std::vector<std::string> const& container) {
+  std::string csv;
+  if (container.size() == 1) {
+    csv.append(container[0]);
+    return csv;
+  }
+  for (auto elem : container) {
+    csv.append(static_cast<std::string>(elem));
+    csv.append(",");
+  }
+  return csv;
+}
+
+int main(int argc, char** argv) {
+  std::uint64_t const iterations = argc > 1 ? std::stoull(argv[1]) : 20000;
+
+  for (std::size_t typeCount : {10, 100, 500}) {
+    std::vector<std::string> types;
+    for (std::size_t i = 0; i < typeCount; i++) {
+      types.push_back("application/x-type-" + std::to_string(i));
+    }
+    auto const line = asCSV(types);
+    auto const suffix = " (" + std::to_string(typeCount) + " types)";
+
+    Bench::run("legacy fromCSV" + suffix, iterations, [&](auto) {
+      Bench::doNotOptimize(legacyFromCSV(line));
+    });
+    Bench::run("fromCSV" + suffix, iterations, [&](auto) {
+      Bench::doNotOptimize(fromCSV(line));
+    });
+    Bench::run("CSVTokenizer" + suffix, iterations, [&](auto) {
+      std::size_t total = 0;
+      for (auto const field : CSVTokenizer(line)) total += field.size();
+      Bench::doNotOptimize(total);
+    });
+
+    Bench::run("legacy asCSV" + suffix, iterations, [&](auto) {
+      Bench::doNotOptimize(legacyAsCSV(types));
+    });
+    std::vector<char> buffer(line.size());
+    Bench::run("writeCSV into a buffer" + suffix, iterations, [&](auto) {
+      Bench::doNotOptimize(writeCSV(types, buffer.data(), buffer.size()));
+    });
+  }
+
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <cmath>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/dedup.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+using TinyCDN::Utility::operator""_gB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+std::string randomBytes(std::mt19937_64& random, std::size_t size) {
+  std::string bytes(size, '\0');
+  for (std::size_t i = 0; i < size; i += 8) {
+    auto const value = random();
+    std::memcpy(bytes.data() + i, &value, std::min<std::size_t>(8, size - i));
+  }
+  return bytes;
+}
+
+/*!
+ * \brief Uploads the way users make them: the same assets over and over, edited copies, and some new ones
+ * Assets are incompressible, like images, between 10kB and 2MB, log-uniformly. Popular assets are uploaded more often.
+ * An edited copy has its first few kB, where an image's metadata is, rewritten to a different length.
+ */
+std::vector<std::string> corpus(std::size_t uploads, std::size_t assets, double reuploaded, double edited) {
+  std::mt19937_64 random{42};
+  std::uniform_real_distribution<double> uniform;
+  std::vector<std::string> library;
+  std::vector<std::string> contents;
+
+  auto const newAsset = [&] {
+    auto const size = static_cast<std::size_t>(std::exp(std::log(10_kB) + uniform(random) * (std::log(2_mB) - std::log(10_kB))));
+    library.push_back(randomBytes(random, size));
+    return library.back();
+  };
+  for (std::size_t i = 0; i < assets; i++) newAsset();
+
+  for (std::size_t i = 0; i < uploads; i++) {
+    // Zipf-like, the first assets are the popular ones
+    auto const& asset = library[static_cast<std::size_t>(std::pow(uniform(random), 2.0) * library.size())];
+    auto const kind = uniform(random);
+    if (kind < reuploaded) {
+      contents.push_back(asset);
+    }
+    else if (kind < reuploaded + edited) {
+      auto const header = std::min<std::size_t>(asset.size(), 1_kB + random() % 3_kB);
+      contents.push_back(randomBytes(random, 1_kB + random() % 3_kB) + asset.substr(header));
+    }
+    else {
+      contents.push_back(newAsset());
+    }
+  }
+  return contents;
+}
+
+std::vector<std::unique_ptr<StoredFile>> writeUploads(const fs::path& uploads, const std::vector<std::string>& contents) {
+  fs::remove_all(uploads);
+  fs::create_directories(uploads);
+  std::vector<std::unique_ptr<StoredFile>> files;
+  for (std::size_t i = 0; i < contents.size(); i++) {
+    auto const location = uploads / (std::to_string(i) + ".jpg");
+    std::ofstream(location, std::ios::binary) << contents[i];
+    files.push_back(std::make_unique<StoredFile>(Size{contents[i].size()}, location, true,
+                                                 std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+  }
+  return files;
+}
+
+void report(const std::string& name, std::size_t count, std::uint64_t bytes, double seconds, std::uint64_t stored) {
+  std::cout << std::left << std::setw(36) << name
+            << std::right << std::setw(8) << std::fixed << std::setprecision(0) << count / seconds << " uploads/s"
+            << std::setw(8) << bytes / seconds / 1e6 << " MB/s"
+            << std::setw(8) << (stored >> 20) << "MB stored" << std::endl;
+}
+}
+
+int main(int argc, char** argv) {
+  std::size_t const uploads = argc > 1 ? std::stoull(argv[1]) : 1000;
+  std::size_t const assets = argc > 2 ? std::stoull(argv[2]) : 200;
+  std::size_t const batchSize = 64;
+  auto const root = fs::temp_directory_path() / "bench-dedup";
+
+  // 60% re-uploads of a known asset, 20% edited copies, 20% new assets
+  auto const contents = corpus(uploads, assets, 0.6, 0.2);
+  std::uint64_t bytes = 0;
+  for (auto const& upload : contents) bytes += upload.size();
+
+  // add() logs every file
+  std::cout.setstate(std::ios::failbit);
+  struct Result {
+    std::string name;
+    double seconds;
+    std::uint64_t stored;
+  };
+  std::vector<Result> results;
+  DedupStats stats;
+
+  auto const measure = [&](const std::string& name, auto&& open, bool batched) {
+    fs::remove_all(root / "storage");
+    auto files = writeUploads(root / "uploads", contents);
+    auto storage = open();
+    auto const seconds = Bench::time([&] {
+      if (!batched) {
+        for (auto& file : files) storage->add(std::move(file));
+        return;
+      }
+      for (std::size_t i = 0; i < files.size(); i += batchSize) {
+        std::vector<std::unique_ptr<StoredFile>> batch;
+        for (auto j = i; j < std::min(files.size(), i + batchSize); j++) batch.push_back(std::move(files[j]));
+        storage->addBatch(std::move(batch));
+      }
+    });
+    results.push_back(Result{name, seconds, static_cast<std::uint64_t>(storage->getAllocatedSize())});
+    if constexpr (std::is_same_v<std::decay_t<decltype(*storage)>, DedupStorage>) stats = storage->stats();
+  };
+  auto const filesystem = [&] {
+    fs::create_directories(root / "storage");
+    return std::make_unique<FilesystemStorage>(Size{64_gB}, root / "storage", false);
+  };
+  auto const dedup = [&] { return std::make_unique<DedupStorage>(Size{64_gB}, root / "storage", false); };
+
+  measure("FilesystemStorage, add", filesystem, false);
+  measure("DedupStorage, add", dedup, false);
+  measure("FilesystemStorage, addBatch of 64", filesystem, true);
+  measure("DedupStorage, addBatch of 64", dedup, true);
+  std::cout.clear();
+
+  std::cout << uploads << " uploads of " << assets << "+ assets, " << (bytes >> 20) << "MB in all" << std::endl;
+  for (auto const& result : results) report(result.name, uploads, bytes, result.seconds, result.stored);
+  std::cout << "dedup ratio " << std::setprecision(2) << stats.ratio() << ", " << stats.chunks << " chunks of "
+            << stats.storedBytes / std::max<std::uint64_t>(stats.chunks, 1) << " bytes on average" << std::endl;
+
+  fs::remove_all(root);
+  return 0;
+}
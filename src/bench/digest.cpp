@@ -0,0 +1,56 @@
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/digest.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+
+//! Hashes buffer in 256kB updates (the size FilesystemStorage copies with) `passes` times on `threads` threads
+double hashSeconds(Sha256::Engine engine, std::vector<char> const& buffer, int passes, unsigned threads) {
+  return Bench::time([&] {
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([&] {
+        Sha256 sha(engine);
+        for (int pass = 0; pass < passes; pass++) {
+          for (std::size_t offset = 0; offset < buffer.size(); offset += 256 * 1024) {
+            sha.update(buffer.data() + offset, std::min<std::size_t>(256 * 1024, buffer.size() - offset));
+          }
+        }
+        Bench::doNotOptimize(sha.finish());
+      });
+    }
+    for (auto& worker : workers) worker.join();
+  });
+}
+
+int main(int argc, char** argv) {
+  int const passes = argc > 1 ? std::stoi(argv[1]) : 16;
+
+  // 64MB of random data, larger than any cache
+  std::vector<char> buffer(64 * 1024 * 1024);
+  std::mt19937_64 re{42};
+  for (auto& c : buffer) c = static_cast<char>(re());
+
+  auto const threads = std::max(1u, std::thread::hardware_concurrency());
+  auto const bytes = static_cast<std::uint64_t>(buffer.size()) * passes;
+
+  std::vector<std::pair<std::string, Sha256::Engine>> engines{{"portable", Sha256::Engine::Portable}};
+  if (Sha256::bestEngine() == Sha256::Engine::ShaNi) {
+    engines.emplace_back("SHA-NI", Sha256::Engine::ShaNi);
+  }
+
+  for (auto const& [name, engine] : engines) {
+    Bench::reportThroughput("SHA-256 " + name + ", 1 core", bytes, hashSeconds(engine, buffer, passes, 1));
+
+    // Aggregate throughput divided by the number of cores shows whether hashing scales per core
+    auto const seconds = hashSeconds(engine, buffer, passes, threads);
+    Bench::reportThroughput("SHA-256 " + name + ", " + std::to_string(threads) + " cores (per core)", bytes, seconds);
+  }
+
+  return 0;
+}
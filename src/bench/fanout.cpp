@@ -0,0 +1,100 @@
+#include <cinttypes>
+#include <cstdio>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "src/hashing.hpp"
+
+using namespace TinyCDN;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+//! One store directory holding every file, which is what name collisions being the only way to a new store came to
+fs::path flatPath(const fs::path& root, std::uint64_t id) {
+  return root / "flat" / std::to_string(id);
+}
+
+//! FilesystemStorage's fan-out: stores of 1000 consecutive ids, spread over 256 buckets by a hash of the store's id
+fs::path fanOutPath(const fs::path& root, std::uint64_t id) {
+  auto const storeId = id / 1000;
+  char bucket[3];
+  std::snprintf(bucket, sizeof(bucket), "%02" PRIx64, Utility::Hashing::IdHasher::mix(storeId) % 256);
+  return root / "by-id" / bucket / std::to_string(storeId) / std::to_string(id);
+}
+
+bool create(const fs::path& path) {
+  auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0 && errno == ENOENT) {
+    fs::create_directories(path.parent_path());
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  }
+  if (fd < 0) return false;
+  ::close(fd);
+  return true;
+}
+
+//! Drops the dentry and inode caches if allowed, so opens have to read the directories. Only works as root
+bool dropCaches() {
+  ::sync();
+  std::ofstream dropCaches("/proc/sys/vm/drop_caches");
+  dropCaches << "2" << std::flush;
+  return dropCaches.good();
+}
+}
+
+int main(int argc, char** argv) {
+  fs::path const root = argc > 1 ? fs::path(argv[1]) : fs::current_path() / "bench-fanout";
+  std::uint64_t const largest = argc > 2 ? std::stoull(argv[2]) : 100000;
+  std::uint64_t const probes = 1000;
+
+  fs::remove_all(root);
+  fs::create_directories(root / "flat");
+
+  struct Layout {
+    std::string name;
+    fs::path (*pathOf)(const fs::path&, std::uint64_t);
+  };
+  std::vector<Layout> const layouts{{"one directory", flatPath}, {"fan-out", fanOutPath}};
+
+  std::uint64_t filled = 0;
+  for (std::uint64_t size = 1000; size <= largest; size *= 10) {
+    // Both layouts grow to size files, ids after size are left for the creates that are measured
+    for (auto const& layout : layouts) {
+      for (auto id = filled + 1; id <= size; id++) create(layout.pathOf(root, id));
+    }
+    filled = size;
+
+    for (auto const& layout : layouts) {
+      auto const label = layout.name + ", " + std::to_string(size) + " files";
+
+      // Both start from the disk where possible, the directories the other layout left cached would skew them
+      auto const cold = std::string(dropCaches() ? " (cold), " : ", ");
+      Bench::run("create" + cold + label, probes, [&](std::uint64_t i) {
+        Bench::doNotOptimize(create(layout.pathOf(root, size + 1 + i)));
+      });
+
+      dropCaches();
+      std::mt19937_64 random{size};
+      Bench::run("open" + cold + label, probes, [&](std::uint64_t) {
+        auto const fd = ::open(layout.pathOf(root, random() % size + 1).c_str(), O_RDONLY | O_CLOEXEC);
+        Bench::doNotOptimize(fd);
+        ::close(fd);
+      });
+
+      // The measured creates are taken back so both layouts stay the same size
+      for (std::uint64_t i = 0; i < probes; i++) ::unlink(layout.pathOf(root, size + 1 + i).c_str());
+    }
+  }
+
+  fs::remove_all(root);
+  return 0;
+}
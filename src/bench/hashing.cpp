@@ -0,0 +1,140 @@
+#include <bitset>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/hashing.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+
+//! The std::bitset + std::stringstream Id that Id<N> replaced, kept here as the baseline
+template <int fixedSize>
+struct LegacyId {
+  std::bitset<fixedSize> _value;
+
+  static const char* hexCharToBinary(char c) {
+    static const char* nibbles[16] = {
+      "0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+      "1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111"};
+    auto const n = hexNibbles[static_cast<unsigned char>(c)];
+    return n < 16 ? nibbles[n] : "????";
+  }
+
+  LegacyId& operator=(std::string val) {
+    std::string hexVal;
+    std::istringstream(val) >> std::hex >> hexVal;
+
+    std::stringstream result;
+    for (auto const c : hexVal) {
+      result << hexCharToBinary(c);
+    }
+    _value = std::bitset<fixedSize>(result.str());
+    return *this;
+  }
+
+  std::string str() const {
+    std::stringstream hex;
+    auto const str = _value.to_string();
+    for (std::size_t i = 0; i < str.length(); i += 4) {
+      hex << std::hex << std::stoi(str.substr(i, 4), nullptr, 2);
+    }
+    return hex.str();
+  }
+};
+
+template <int fixedSize>
+void benchmarkSize(std::uint64_t iterations) {
+  // A ring of random ids so every iteration parses different input
+  std::vector<std::string> inputs;
+  std::mt19937_64 re{42};
+  for (int i = 0; i < 1024; i++) {
+    typename Id<fixedSize>::Words words;
+    for (auto& w : words) w = re();
+    inputs.push_back(Id<fixedSize>::fromWords(words).str());
+  }
+  auto const size = std::to_string(fixedSize);
+
+  Bench::run("LegacyId<" + size + "> parse", iterations, [&](auto i) {
+    LegacyId<fixedSize> id;
+    id = inputs[i % inputs.size()];
+    Bench::doNotOptimize(id._value);
+  });
+  Bench::run("Id<" + size + "> parse", iterations, [&](auto i) {
+    Id<fixedSize> id{inputs[i % inputs.size()]};
+    Bench::doNotOptimize(id.words());
+  });
+
+  std::vector<LegacyId<fixedSize>> legacyIds(inputs.size());
+  std::vector<Id<fixedSize>> ids(inputs.size());
+  for (std::size_t i = 0; i < inputs.size(); i++) {
+    legacyIds[i] = inputs[i];
+    ids[i] = inputs[i];
+  }
+
+  Bench::run("LegacyId<" + size + "> str", iterations, [&](auto i) {
+    Bench::doNotOptimize(legacyIds[i % ids.size()].str());
+  });
+  Bench::run("Id<" + size + "> str", iterations, [&](auto i) {
+    Bench::doNotOptimize(ids[i % ids.size()].str());
+  });
+  Bench::run("Id<" + size + "> toChars", iterations, [&](auto i) {
+    char out[Id<fixedSize>::hexLength];
+    ids[i % ids.size()].toChars(out);
+    Bench::doNotOptimize(out);
+  });
+}
+
+void benchmarkGeneration(std::uint64_t iterations) {
+  PseudoRandomHexFactory hexGenerator;
+  Bench::run("UUID4 via PseudoRandomHexFactory", iterations, [&](auto) {
+    auto* id32 = hexGenerator(32);
+    UUID4 id;
+    id = std::string(id32);
+    delete[] id32;
+    Bench::doNotOptimize(id.words());
+  });
+
+  UUID4Factory factory;
+  Bench::run("UUID4Factory", iterations, [&](auto) {
+    Bench::doNotOptimize(factory().words());
+  });
+
+  std::vector<UUID4> batch(256);
+  Bench::run("UUID4Factory batch of 256 (per batch)", iterations / batch.size(), [&](auto) {
+    factory(batch.begin(), batch.end());
+    Bench::doNotOptimize(batch.front().words());
+  });
+
+  RandomIdFactory<Id<64>> fbIdFactory;
+  Bench::run("RandomIdFactory<Id<64>>", iterations, [&](auto) {
+    Bench::doNotOptimize(fbIdFactory().words());
+  });
+
+  auto const threads = std::max(2u, std::thread::hardware_concurrency());
+  auto const seconds = Bench::time([&] {
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([&] {
+        for (std::uint64_t i = 0; i < iterations; i++) {
+          Bench::doNotOptimize(factory().words());
+        }
+      });
+    }
+    for (auto& worker : workers) worker.join();
+  });
+  std::cout << "UUID4Factory on " << threads << " threads: "
+            << threads * iterations / seconds << " ids/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::uint64_t const iterations = argc > 1 ? std::stoull(argv[1]) : 1000000;
+
+  benchmarkSize<64>(iterations);
+  benchmarkSize<128>(iterations);
+  benchmarkGeneration(iterations);
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/haystack.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+//! Bytes of path that are currently in the page cache
+std::uintmax_t residentBytes(const fs::path& path) {
+  auto const fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return 0;
+  auto const size = static_cast<std::size_t>(fs::file_size(path));
+
+  auto* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) return 0;
+
+  auto const pageSize = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+  std::vector<unsigned char> pages((size + pageSize - 1) / pageSize);
+  ::mincore(mapping, size, pages.data());
+  ::munmap(mapping, size);
+
+  std::uintmax_t resident = 0;
+  for (auto const page : pages) resident += (page & 1) * pageSize;
+  return resident;
+}
+
+//! Ingests files of fileSize into a new Haystack and reports throughput and how much of the volume stays cached
+void ingest(const fs::path& root, Haystack::WriteMode mode, std::size_t files, std::size_t fileSize) {
+  auto const name = mode == Haystack::WriteMode::Direct ? std::string("direct") : std::string("buffered");
+  auto const uploads = root / "uploads";
+  fs::remove_all(root);
+  fs::create_directories(uploads);
+
+  std::string const contents(fileSize, 'x');
+  std::vector<fs::path> paths;
+  for (std::size_t i = 0; i < files; i++) {
+    paths.push_back(uploads / std::to_string(i));
+    std::ofstream(paths.back(), std::ios::binary) << contents;
+  }
+
+  auto const volumeSize = files * (fileSize + 8_kB) + 1_mB;
+  Haystack haystack(Size{volumeSize}, root / name, false, mode);
+  if (haystack.writeMode() != mode) {
+    std::cout << name << ": not supported on this filesystem" << std::endl;
+    return;
+  }
+
+  // Durability is part of the comparison, a buffered ingest isn't done until its pages are written back
+  auto const seconds = Bench::time([&] {
+    for (auto const& path : paths) {
+      auto file = std::make_unique<StoredFile>(Size{fileSize}, path, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{});
+      Bench::doNotOptimize(haystack.add(std::move(file)));
+    }
+    auto const fd = ::open(haystack.volumePath().c_str(), O_RDONLY);
+    ::fdatasync(fd);
+    ::close(fd);
+  });
+
+  Bench::reportThroughput("ingest " + name + " (" + std::to_string(fileSize / 1_kB) + "kB files)", files * fileSize, seconds);
+  std::cout << std::left << std::setw(48) << ("page cache held by the volume (" + name + ")")
+            << std::right << std::setw(10) << std::fixed << std::setprecision(1)
+            << residentBytes(haystack.volumePath()) / 1e6 << " MB" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  // The volume has to live on a filesystem with O_DIRECT, which tmpfs /tmp often isn't
+  fs::path const root = argc > 1 ? fs::path(argv[1]) : fs::current_path() / "bench-haystack";
+  std::size_t const files = argc > 2 ? std::stoul(argv[2]) : 256;
+  std::size_t const fileSize = (argc > 3 ? std::stoul(argv[3]) : 1024) * 1_kB;
+
+  ingest(root, Haystack::WriteMode::Buffered, files, fileSize);
+  ingest(root, Haystack::WriteMode::Direct, files, fileSize);
+
+  fs::remove_all(root);
+  return 0;
+}
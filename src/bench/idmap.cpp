@@ -0,0 +1,54 @@
+#include <bitset>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/idmap.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+
+using VolumeId = Id<64>;
+
+//! The IdHasher that IdMap replaced: copies the Id into a bitset and hashes that
+struct BitsetIdHasher {
+  std::size_t operator()(const VolumeId& id) const {
+    return std::hash<std::bitset<64>>()(id.value());
+  }
+};
+
+template <typename Map>
+void benchmarkMap(std::string const& name, std::vector<VolumeId> const& ids, std::vector<VolumeId> const& misses) {
+  Map map;
+  Bench::run(name + " insert", ids.size(), [&](auto i) {
+    map[ids[i]] = i;
+  });
+
+  // Look ids up in a different order than they were inserted
+  std::uint64_t sum = 0;
+  Bench::run(name + " lookup hit", ids.size(), [&](auto i) {
+    sum += map.find(ids[(i * 7919) % ids.size()])->second;
+  });
+  Bench::run(name + " lookup miss", misses.size(), [&](auto i) {
+    sum += map.find(misses[i]) == map.end();
+  });
+  Bench::doNotOptimize(sum);
+}
+
+int main(int argc, char** argv) {
+  std::size_t const entries = argc > 1 ? std::stoull(argv[1]) : 1000000;
+
+  std::vector<VolumeId> ids(entries);
+  std::vector<VolumeId> misses(entries);
+  RandomIdFactory<VolumeId> generator;
+  generator(ids.begin(), ids.end());
+  generator(misses.begin(), misses.end());
+
+  std::cout << entries << " entries" << std::endl;
+  benchmarkMap<std::unordered_map<VolumeId, std::uint64_t, BitsetIdHasher>>("unordered_map + bitset hash", ids, misses);
+  benchmarkMap<std::unordered_map<VolumeId, std::uint64_t, IdHasher>>("unordered_map + IdHasher", ids, misses);
+  benchmarkMap<IdMap<VolumeId, std::uint64_t>>("IdMap", ids, misses);
+
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/middlewares/FileStorage/groupcommit.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+using TinyCDN::Utility::operator""_gB;
+
+namespace fs = std::experimental::filesystem;
+
+//! Writes count uploads of fileSize bytes
+std::vector<std::unique_ptr<StoredFile>> writeUploads(const fs::path& uploads, std::size_t count, std::size_t fileSize) {
+  fs::remove_all(uploads);
+  fs::create_directories(uploads);
+  std::string const contents(fileSize, 'x');
+  std::vector<std::unique_ptr<StoredFile>> files;
+  for (std::size_t i = 0; i < count; i++) {
+    auto const location = uploads / (std::to_string(i) + ".jpg");
+    std::ofstream(location, std::ios::binary) << contents;
+    files.push_back(std::make_unique<StoredFile>(Size{fileSize}, location, true,
+                                                 std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+  }
+  return files;
+}
+
+struct Result {
+  std::string name;
+  std::size_t count;
+  std::size_t fileSize;
+  double seconds;
+  IngestStats stats;
+};
+
+void report(const Result& result) {
+  std::cout << std::left << std::setw(48) << result.name
+            << std::right << std::setw(10) << std::fixed << std::setprecision(0) << result.count / result.seconds << " uploads/s"
+            << std::setw(10) << std::setprecision(2) << result.count * result.fileSize / result.seconds / 1e9 << " GB/s ";
+
+  for (std::size_t method = 0; method < ingestMethodCount; method++) {
+    if (result.stats.files[method] == 0) continue;
+    std::cout << " " << ingestMethodName(static_cast<IngestMethod>(method)) << " " << result.stats.files[method];
+  }
+  std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+  std::size_t const count = argc > 1 ? std::stoull(argv[1]) : 4096;
+  std::size_t const fileSize = argc > 2 ? std::stoull(argv[2]) : 8_kB;
+  auto const root = fs::temp_directory_path() / "bench-ingest";
+
+  // add() logs every file, which would be most of what's measured
+  std::cout.setstate(std::ios::failbit);
+  std::vector<Result> results;
+  auto const measureFrom = [&](const fs::path& uploads, const std::string& name, std::size_t count, std::size_t fileSize,
+                               auto&& ingest) {
+    fs::remove_all(root / "storage");
+    fs::create_directories(root / "storage");
+    auto files = writeUploads(uploads, count, fileSize);
+    FilesystemStorage storage(Size{64_gB}, root / "storage", false);
+    auto const seconds = Bench::time([&] { ingest(storage, files); });
+    results.push_back(Result{name, count, fileSize, seconds, storage.ingestStats()});
+    fs::remove_all(uploads);
+  };
+  auto const measure = [&](const std::string& name, auto&& ingest) {
+    measureFrom(root / "uploads", name, count, fileSize, ingest);
+  };
+  auto const addEach = [](FilesystemStorage& storage, auto& files) {
+    for (auto& file : files) storage.add(std::move(file));
+  };
+
+  measure("add(), not synced", addEach);
+
+  for (std::size_t const batchSize : {1, 8, 64, 512}) {
+    measure("addBatch(), " + std::to_string(batchSize) + " per batch", [batchSize](FilesystemStorage& storage, auto& files) {
+      for (std::size_t first = 0; first < files.size(); first += batchSize) {
+        std::vector<std::unique_ptr<StoredFile>> batch;
+        for (std::size_t i = first; i < std::min(files.size(), first + batchSize); i++) batch.push_back(std::move(files[i]));
+        storage.addBatch(std::move(batch));
+      }
+    });
+  }
+
+  measure("GroupCommitter, 8 uploaders, 2ms window", [](FilesystemStorage& storage, auto& files) {
+    GroupCommitter committer(storage);
+    std::vector<std::future<void>> uploaders;
+    for (std::size_t uploader = 0; uploader < 8; uploader++) {
+      uploaders.push_back(std::async(std::launch::async, [&, uploader] {
+        // Every uploader waits for its file to be stored before sending the next one, like a client would
+        for (std::size_t i = uploader; i < files.size(); i += 8) committer.submit(std::move(files[i])).get();
+      }));
+    }
+    for (auto& uploader : uploaders) uploader.get();
+  });
+
+  // Large uploads show what ingesting without copying saves, tmpfs stands in for an upload directory on another disk
+  std::size_t const largeCount = 64;
+  measureFrom(root / "uploads", "4MB uploads from the same filesystem", largeCount, 4_mB, addEach);
+  if (fs::exists("/dev/shm")) {
+    measureFrom("/dev/shm/bench-ingest", "4MB uploads from another filesystem", largeCount, 4_mB, addEach);
+  }
+
+  std::cout.clear();
+  std::cout << count << " uploads of " << fileSize << " bytes, then " << largeCount << " of 4MB" << std::endl;
+  for (auto const& result : results) report(result);
+
+  fs::remove_all(root);
+  return 0;
+}
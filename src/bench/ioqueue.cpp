@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "src/ioqueue.hpp"
+
+using namespace TinyCDN;
+using Utility::IOQueue;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+constexpr std::size_t blockSize = 4096;
+
+/*!
+ * \brief Keeps depth random block reads outstanding from one thread until count have completed
+ * Each completion submits the next read in its place, the way a server streaming many files keeps its queue full.
+ */
+double readRandomly(IOQueue& queue, int fd, std::uint64_t blocks, std::size_t depth, std::size_t count) {
+  std::vector<char*> buffers(depth);
+  for (auto& buffer : buffers) buffer = static_cast<char*>(std::aligned_alloc(blockSize, blockSize));
+
+  std::atomic<std::size_t> submitted{0};
+  std::atomic<std::size_t> completed{0};
+  std::mt19937_64 random{depth};
+  std::mutex randomMutex;
+  auto const nextOffset = [&] {
+    std::lock_guard<std::mutex> lock(randomMutex);
+    return (random() % blocks) * blockSize;
+  };
+
+  std::function<void(std::size_t)> readInto = [&](std::size_t slot) {
+    queue.read(fd, buffers[slot], blockSize, nextOffset(), [&, slot](std::int64_t) {
+      if (submitted++ < count) readInto(slot);
+      // Counted last, nothing here is touched once the last read is
+      completed++;
+    });
+  };
+
+  auto const seconds = Bench::time([&] {
+    for (std::size_t slot = 0; slot < depth; slot++) {
+      submitted++;
+      readInto(slot);
+    }
+    while (completed < std::max(count, depth)) std::this_thread::yield();
+  });
+
+  for (auto buffer : buffers) std::free(buffer);
+  return seconds;
+}
+}
+
+int main(int argc, char** argv) {
+  fs::path const path = argc > 1 ? fs::path(argv[1]) : fs::current_path() / "bench-ioqueue";
+  std::uint64_t const fileSize = argc > 2 ? std::stoull(argv[2]) : std::uint64_t{1} << 30;
+  std::size_t const count = argc > 3 ? std::stoull(argv[3]) : 20000;
+
+  {
+    auto const fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::vector<char> chunk(1 << 20, 'x');
+    for (std::uint64_t written = 0; written < fileSize; written += chunk.size()) {
+      if (::write(fd, chunk.data(), chunk.size()) != static_cast<ssize_t>(chunk.size())) return 1;
+    }
+    ::fsync(fd);
+    ::close(fd);
+  }
+
+  // O_DIRECT keeps the page cache out of it, so every read goes to the disk
+  auto const fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+  if (fd < 0) {
+    std::cerr << "O_DIRECT isn't supported on " << path << std::endl;
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<IOQueue>> queues;
+  queues.push_back(std::make_unique<Utility::ThreadPoolIOQueue>());
+  auto ring = IOQueue::create(256);
+  if (std::string(ring->name()) != queues.front()->name()) queues.push_back(std::move(ring));
+
+  std::cout << count << " random 4kB reads from " << (fileSize >> 20) << "MB, thread pool of "
+            << Utility::IOExecutor::shared().threadCount() << " threads" << std::endl;
+  for (auto const depth : {1, 4, 16, 64, 128}) {
+    for (auto& queue : queues) {
+      auto const seconds = readRandomly(*queue, fd, fileSize / blockSize, depth, count);
+      std::cout << std::left << std::setw(48) << (std::string(queue->name()) + ", " + std::to_string(depth) + " outstanding")
+                << std::right << std::setw(10) << std::fixed << std::setprecision(0) << count / seconds << " reads/s"
+                << std::setw(10) << std::setprecision(1) << seconds * 1e6 / count * depth << " us/read" << std::endl;
+    }
+  }
+
+  ::close(fd);
+  fs::remove(path);
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/xattr.h>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_gB;
+
+namespace fs = std::experimental::filesystem;
+
+int main(int argc, char** argv) {
+  std::size_t const count = argc > 1 ? std::stoull(argv[1]) : 100000;
+  auto const root = fs::temp_directory_path() / "bench-lookup";
+  fs::remove_all(root);
+  fs::create_directories(root / "storage");
+  fs::create_directories(root / "uploads");
+
+  // add() logs every file
+  std::cout.setstate(std::ios::failbit);
+  std::unique_ptr<FilesystemStorage> storage = std::make_unique<FilesystemStorage>(Size{1_gB}, root / "storage", false);
+  for (std::size_t i = 0; i < count; i++) {
+    auto const upload = root / "uploads" / std::to_string(i);
+    std::ofstream(upload) << i;
+    storage->add(std::make_unique<StoredFile>(Size{std::to_string(i).size()}, upload, true,
+                                              std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+  }
+
+  // The links/ layout lookups used to resolve every file through
+  fs::create_directories(root / "links");
+  for (std::size_t id = 1; id <= count; id++) {
+    fs::create_symlink(storage->lookup(static_cast<fileId>(id))->location, root / "links" / std::to_string(id));
+  }
+  std::cout.clear();
+  std::cout << count << " files" << std::endl;
+
+  std::mt19937_64 random{42};
+  Bench::run("lookup through links/ (readlink + getxattr)", count, [&](std::uint64_t) {
+    auto const id = random() % count + 1;
+    auto const target = fs::read_symlink(root / "links" / std::to_string(id));
+    Utility::Hashing::Digest digest;
+    Bench::doNotOptimize(::getxattr(target.c_str(), "user.tinycdn.sha256", digest.bytes.data(), digest.bytes.size()));
+  });
+
+  Bench::run("lookup through the index", count, [&](std::uint64_t) {
+    Bench::doNotOptimize(storage->lookup(static_cast<fileId>(random() % count + 1)));
+  });
+
+  // Readers only ever share the stripes' locks, so threads looking up different files don't wait on each other
+  for (std::size_t const threads : {2, 8}) {
+    auto const seconds = Bench::time([&] {
+      std::vector<std::future<void>> readers;
+      for (std::size_t thread = 0; thread < threads; thread++) {
+        readers.push_back(std::async(std::launch::async, [&, thread] {
+          std::mt19937_64 random{thread};
+          for (std::size_t i = 0; i < count; i++) Bench::doNotOptimize(storage->lookup(static_cast<fileId>(random() % count + 1)));
+        }));
+      }
+      for (auto& reader : readers) reader.get();
+    });
+    std::cout << std::left << std::setw(48) << ("lookup through the index, " + std::to_string(threads) + " threads")
+              << std::right << std::setw(10) << std::fixed << std::setprecision(0) << threads * count / seconds << " ops/s"
+              << std::endl;
+  }
+
+  auto const closing = Bench::time([&] { storage.reset(); });
+  std::cout << std::setprecision(3) << "close and snapshot: " << closing << " s" << std::endl;
+
+  std::cout.setstate(std::ios::failbit);
+  auto const opening = Bench::time([&] {
+    storage = std::make_unique<FilesystemStorage>(Size{1_gB}, root / "storage", true);
+  });
+  std::cout.clear();
+  std::cout << "open from the snapshot: " << opening << " s" << std::endl;
+
+  fs::remove_all(root);
+  return 0;
+}
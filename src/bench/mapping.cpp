@@ -0,0 +1,75 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/crc32c.hpp"
+#include "src/middlewares/FileStorage/storedfile.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+int main(int argc, char** argv) {
+  std::size_t const fileSize = argc > 1 ? std::stoull(argv[1]) : 64_mB;
+  int const passes = argc > 2 ? std::stoi(argv[2]) : 20;
+  auto const path = fs::temp_directory_path() / "bench-mapping.bin";
+  std::ofstream(path, std::ios::binary) << std::string(fileSize, 'x');
+
+  StoredFile const file(Size{fileSize}, path, false, std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+  std::uint64_t const bytes = std::uint64_t{fileSize} * passes;
+  // Every way of reading hands each byte to a consumer, a checksum here, the way a writer would take them
+  std::vector<char> buffer(32_kB);
+
+  // The file's in the page cache for all of them
+  auto const streamed = Bench::time([&] {
+    for (int pass = 0; pass < passes; pass++) {
+      std::ifstream stream(path, std::ios::binary);
+      std::uint32_t crc = 0;
+      while (stream.read(buffer.data(), buffer.size()) || stream.gcount() > 0) {
+        crc = Utility::Hashing::Crc32c::extend(crc, buffer.data(), static_cast<std::size_t>(stream.gcount()));
+      }
+      Bench::doNotOptimize(crc);
+    }
+  });
+
+  auto const pread = Bench::time([&] {
+    for (int pass = 0; pass < passes; pass++) {
+      auto const handle = Utility::FileHandle::open(path.string());
+      std::uint32_t crc = 0;
+      for (std::uintmax_t offset = 0;;) {
+        auto const read = handle->readAt(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size(), offset);
+        if (read == 0) break;
+        crc = Utility::Hashing::Crc32c::extend(crc, buffer.data(), read);
+        offset += read;
+      }
+      Bench::doNotOptimize(crc);
+    }
+  });
+
+  auto const mapped = Bench::time([&] {
+    for (int pass = 0; pass < passes; pass++) {
+      auto const contents = file.map(Utility::FileMapping::Access::Sequential);
+      std::uint32_t crc = 0;
+      for (std::size_t offset = 0; offset < contents->bytes.size(); offset += buffer.size()) {
+        auto const chunk = contents->bytes.substr(offset, buffer.size());
+        crc = Utility::Hashing::Crc32c::extend(crc, chunk.data(), chunk.size());
+      }
+      Bench::doNotOptimize(crc);
+    }
+  });
+
+  std::cout << passes << " reads of a " << (fileSize >> 20) << "MB file in 32kB chunks" << std::endl;
+  Bench::reportThroughput("ifstream into a buffer", bytes, streamed);
+  Bench::reportThroughput("FileHandle::readAt into a buffer", bytes, pread);
+  Bench::reportThroughput("StoredFile::map, read in place", bytes, mapped);
+
+  fs::remove(path);
+  return 0;
+}
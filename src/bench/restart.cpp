@@ -0,0 +1,131 @@
+#include <cstring>
+#include <experimental/filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/haystack.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+//! Each needle is a header and a one byte name, padded to the 8 byte alignment
+constexpr std::uint64_t needleLength = 72;
+
+//! Drops path from the page cache, so the next open reads it from disk
+void evict(const fs::path& path) {
+  auto const fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  ::fdatasync(fd);
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  ::close(fd);
+}
+
+/*!
+ * Writes a volume file of empty needles straight away, adding them one by one would mostly measure creating uploads.
+ * \return The volume's size
+ */
+std::uint64_t writeVolume(const fs::path& directory, std::uint64_t needles, std::uint64_t volumeId) {
+  fs::create_directories(directory);
+  auto const size = Haystack::dataOffset + needles * needleLength + 1_mB;
+
+  auto const fd = ::open((directory / Haystack::volumeFileName).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  Utility::FileHandle volume(fd);
+  ::ftruncate(fd, static_cast<off_t>(size));
+
+  HaystackSuperblock superblock;
+  superblock.size = size;
+  superblock.lastFileId = needles;
+  superblock.volumeId = volumeId;
+  volume.writeAt(&superblock, sizeof(superblock), 0);
+
+  // 64MB at a time
+  std::vector<char> buffer(64_mB / needleLength * needleLength);
+  auto offset = Haystack::dataOffset;
+  for (std::uint64_t id = 1; id <= needles;) {
+    std::size_t used = 0;
+    for (; used < buffer.size() && id <= needles; used += needleLength, id++) {
+      NeedleHeader header;
+      header.id = id;
+      header.nameLength = 1;
+      std::memcpy(buffer.data() + used, &header, sizeof(header));
+      buffer[used + sizeof(header)] = 'x';
+    }
+    volume.writeAt(buffer.data(), used, offset);
+    offset += used;
+  }
+  return size;
+}
+
+//! Writes the snapshot the Haystack would save for the volume from writeVolume()
+void writeSnapshot(const fs::path& directory, std::uint64_t needles, std::uint64_t volumeId) {
+  HaystackIndexWriter writer(directory / Haystack::indexFileName);
+  for (std::uint64_t id = 1; id <= needles; id++) {
+    writer.append(HaystackIndexEntry{id, Haystack::dataOffset + (id - 1) * needleLength, 0, 0, 1});
+  }
+
+  HaystackIndexHeader header;
+  header.volumeId = volumeId;
+  header.volumeEnd = Haystack::dataOffset + needles * needleLength;
+  header.lastFileId = needles;
+  writer.finish(header);
+}
+
+//! Opens the Haystack and times it, then times random lookups
+void restart(const std::string& name, const fs::path& directory, std::uint64_t size, std::uint64_t needles) {
+  evict(directory / Haystack::volumeFileName);
+  evict(directory / Haystack::indexFileName);
+
+  std::unique_ptr<Haystack> haystack;
+  auto const seconds = Bench::time([&] {
+    haystack = std::make_unique<Haystack>(Size{size}, directory, true);
+  });
+  std::cout << std::left << std::setw(48) << ("open, " + name)
+            << std::right << std::setw(10) << std::fixed << std::setprecision(3) << seconds << " s"
+            << "  (" << haystack->fileCount() << " files)" << std::endl;
+
+  // The first lookups fault in the pages they touch, the same lookups again show the cached cost
+  for (auto const pass : {"cold", "warm"}) {
+    std::mt19937_64 random{42};
+    Bench::run(std::string("lookup (") + pass + "), " + name, 100000, [&](std::uint64_t) {
+      Bench::doNotOptimize(haystack->lookup(static_cast<fileId>(random() % needles + 1)));
+    });
+  }
+
+  // Closing saves the snapshot, which isn't what's being measured
+  auto const closing = Bench::time([&] { haystack.reset(); });
+  std::cout << std::left << std::setw(48) << ("close and save the index, " + name)
+            << std::right << std::setw(10) << std::fixed << std::setprecision(3) << closing << " s" << std::endl;
+}
+}
+
+int main(int argc, char** argv) {
+  fs::path const root = argc > 1 ? fs::path(argv[1]) : fs::current_path() / "bench-restart";
+  std::uint64_t const needles = argc > 2 ? std::stoull(argv[2]) : 10000000;
+  // Scanning builds the whole index in memory, which doesn't fit for the largest volumes
+  bool const scan = argc > 3 ? std::stoi(argv[3]) != 0 : true;
+
+  fs::remove_all(root);
+  std::uint64_t const volumeId = 0x5eed;
+  auto const size = writeVolume(root, needles, volumeId);
+  std::cout << needles << " needles" << std::endl;
+
+  if (scan) restart("scanning the volume", root, size, needles);
+  else writeSnapshot(root, needles, volumeId);
+
+  restart("from the index snapshot", root, size, needles);
+
+  fs::remove_all(root);
+  return 0;
+}
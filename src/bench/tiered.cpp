@@ -0,0 +1,79 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/middlewares/FileStorage/tiered.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_gB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+//! Looks up random files and reads them whole, the way they'd be served
+template <typename Storage>
+double serve(Storage& storage, fileId files, std::size_t count, std::size_t fileSize) {
+  std::mt19937_64 random{42};
+  std::vector<unsigned char> buffer(fileSize);
+
+  return Bench::time([&] {
+    for (std::size_t i = 0; i < count; i++) {
+      auto const file = storage.lookup(static_cast<fileId>(random() % files + 1));
+      std::shared_ptr<const Utility::ChunkSource> contents = file->contents;
+      if (!contents) contents = Utility::FileHandle::open(file->location.string());
+      Bench::doNotOptimize(contents->readAt(buffer.data(), buffer.size(), 0));
+    }
+  });
+}
+}
+
+int main(int argc, char** argv) {
+  fileId const files = argc > 1 ? std::stoul(argv[1]) : 2000;
+  std::size_t const fileSize = argc > 2 ? std::stoull(argv[2]) : 4_kB;
+  std::size_t const count = argc > 3 ? std::stoull(argv[3]) : 200000;
+  auto const root = fs::temp_directory_path() / "bench-tiered";
+  fs::remove_all(root);
+  fs::create_directories(root / "storage");
+
+  // add() logs every file
+  std::cout.setstate(std::ios::failbit);
+  {
+    FilesystemStorage storage(Size{64_gB}, root / "storage", false);
+    std::string const contents(fileSize, 'x');
+    for (fileId id = 1; id <= files; id++) {
+      auto const upload = root / "uploads" / std::to_string(id);
+      fs::create_directories(upload.parent_path());
+      std::ofstream(upload, std::ios::binary) << contents;
+      storage.add(std::make_unique<StoredFile>(Size{fileSize}, upload, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+    }
+  }
+
+  FilesystemStorage disk(Size{64_gB}, root / "storage", true);
+  auto const fromDisk = serve(disk, files, count, fileSize);
+
+  TieredStorage<FilesystemStorage> tiered(Size{64_gB}, root / "storage", true, Size{256_mB});
+  // The first pass takes every file into memory
+  serve(tiered, files, count, fileSize);
+  auto const fromMemory = serve(tiered, files, count, fileSize);
+  auto const stats = tiered.memoryStats();
+  std::cout.clear();
+
+  std::cout << count << " lookups and reads of " << files << " files of " << fileSize << " bytes" << std::endl;
+  for (auto const& [name, seconds] : {std::make_pair("FilesystemStorage", fromDisk), std::make_pair("TieredStorage, all in memory", fromMemory)}) {
+    std::cout << std::left << std::setw(32) << name << std::right << std::setw(12) << std::fixed << std::setprecision(0)
+              << count / seconds << " files/s" << std::setw(10) << std::setprecision(2) << seconds * 1e6 / count << " us/file" << std::endl;
+  }
+  std::cout << "memory tier: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.files << " files in "
+            << (stats.reservedBytes >> 20) << "MB" << std::endl;
+
+  fs::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+
+#include "bench.hpp"
+#include "src/middlewares/FileStorage/haystacktransforms.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+//! Streams the upload through transforms into output, like ingesting it, with maxInFlight blocks at a time
+double ingestSeconds(const fs::path& upload, const fs::path& output, const HaystackTransformChain& transforms,
+                     std::size_t maxInFlight) {
+  auto const source = Utility::FileHandle::open(upload.string());
+  Utility::FileHandle destination(::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  auto const size = fs::file_size(upload);
+
+  return Bench::time([&] {
+    HaystackReadWriteCursor cursor(source, size, transforms, 256_kB, maxInFlight);
+    std::uintmax_t written = 0;
+    while (cursor.hasNext()) {
+      auto const block = cursor.next().get();
+      destination.writeAt(block.data(), block.size(), written);
+      written += block.size();
+    }
+  });
+}
+
+int main(int argc, char** argv) {
+  std::size_t const size = argc > 1 ? std::stoull(argv[1]) * 1_mB : 256_mB;
+
+  auto const root = fs::temp_directory_path() / "bench-transforms";
+  fs::remove_all(root);
+  fs::create_directories(root);
+
+  // Half random bytes and half text, so compression has something to do and something it can't do
+  std::string contents;
+  std::mt19937_64 random{42};
+  while (contents.size() < size) {
+    for (int i = 0; i < 4096; i++) contents.push_back(static_cast<char>(random()));
+    for (int i = 0; i < 128; i++) contents += "needle, ";
+  }
+  contents.resize(size);
+  auto const upload = root / "upload";
+  std::ofstream(upload, std::ios::binary) << contents;
+
+  std::vector<std::pair<std::string, HaystackTransformChain>> chains{{"copy", {}}};
+#ifdef TINYCDN_HAVE_OPENSSL
+  HaystackAesCtrCipher::Key const key{};
+  HaystackAesCtrCipher::Nonce const nonce{};
+  chains.emplace_back("AES-256-CTR", HaystackTransformChain{std::make_shared<HaystackAesCtrCipher>(key, nonce)});
+#endif
+#ifdef TINYCDN_HAVE_ZSTD
+  chains.emplace_back("zstd -3", HaystackTransformChain{std::make_shared<HaystackZstdCompressor>(3)});
+#endif
+#if defined(TINYCDN_HAVE_OPENSSL) && defined(TINYCDN_HAVE_ZSTD)
+  chains.emplace_back("zstd -3, AES-256-CTR", HaystackTransformChain{std::make_shared<HaystackZstdCompressor>(3),
+                                                                     std::make_shared<HaystackAesCtrCipher>(key, nonce)});
+#endif
+
+  for (auto const& [name, transforms] : chains) {
+    for (std::size_t const inFlight : {1, 4, 16}) {
+      Bench::reportThroughput(name + ", " + std::to_string(inFlight) + " blocks in flight", size,
+                              ingestSeconds(upload, root / "output", transforms, inFlight));
+    }
+  }
+
+  fs::remove_all(root);
+  return 0;
+}
@@ -0,0 +1,184 @@
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TINYCDN_X86_64 1
+#endif
+
+#include "crc32c.hpp"
+
+namespace TinyCDN::Utility::Hashing {
+
+namespace {
+//! The Castagnoli polynomial, bit-reflected
+constexpr std::uint32_t polynomial = 0x82F63B78;
+
+//! Slicing-by-8 tables: tables[k][b] is the CRC of byte b followed by k zero bytes
+constexpr std::array<std::array<std::uint32_t, 256>, 8> makeTables() {
+  std::array<std::array<std::uint32_t, 256>, 8> tables{};
+  for (std::uint32_t b = 0; b < 256; b++) {
+    auto crc = b;
+    for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ ((crc & 1) ? polynomial : 0);
+    tables[0][b] = crc;
+  }
+  for (std::size_t k = 1; k < 8; k++) {
+    for (std::size_t b = 0; b < 256; b++) {
+      tables[k][b] = (tables[k - 1][b] >> 8) ^ tables[0][tables[k - 1][b] & 0xFF];
+    }
+  }
+  return tables;
+}
+
+constexpr auto tables = makeTables();
+
+//! Every engine works on the raw register, extend() does the pre- and post-inversion
+std::uint32_t updatePortable(std::uint32_t crc, const std::uint8_t* data, std::size_t length) {
+  for (; length > 0 && reinterpret_cast<std::uintptr_t>(data) % 8 != 0; length--) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+  }
+
+  for (; length >= 8; length -= 8, data += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data, 8);
+    word ^= crc;
+    crc = tables[7][word & 0xFF] ^ tables[6][(word >> 8) & 0xFF]
+      ^ tables[5][(word >> 16) & 0xFF] ^ tables[4][(word >> 24) & 0xFF]
+      ^ tables[3][(word >> 32) & 0xFF] ^ tables[2][(word >> 40) & 0xFF]
+      ^ tables[1][(word >> 48) & 0xFF] ^ tables[0][word >> 56];
+  }
+
+  for (; length > 0; length--) {
+    crc = (crc >> 8) ^ tables[0][(crc ^ *data++) & 0xFF];
+  }
+  return crc;
+}
+
+#ifdef TINYCDN_X86_64
+__attribute__((target("sse4.2")))
+std::uint32_t updateSse42(std::uint32_t crc, const std::uint8_t* data, std::size_t length) {
+  for (; length > 0 && reinterpret_cast<std::uintptr_t>(data) % 8 != 0; length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+  std::uint64_t crc64 = crc;
+  for (; length >= 8; length -= 8, data += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<std::uint32_t>(crc64);
+
+  for (; length > 0; length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+  return crc;
+}
+
+//! x^n mod the polynomial, bit-reflected
+constexpr std::uint32_t xPowerMod(std::uint64_t n) {
+  std::uint32_t value = 0x80000000; // x^0
+  for (std::uint64_t i = 0; i < n; i++) value = (value >> 1) ^ ((value & 1) ? polynomial : 0);
+  return value;
+}
+
+/*
+ * Streams are this long, and each stream's register is shifted past the bytes of the streams after it
+ * by multiplying it with x^(8 * length - 33): the carry-less product of two reflected values carries an
+ * extra factor of x, and the final crc32 of the 64-bit product multiplies by x^32.
+ */
+constexpr std::size_t longStream = 8192;
+constexpr std::size_t shortStream = 256;
+
+struct StreamShift {
+  std::size_t length;
+  std::uint32_t once;
+  std::uint32_t twice;
+};
+
+constexpr StreamShift longShift{longStream, xPowerMod(8 * longStream - 33), xPowerMod(16 * longStream - 33)};
+constexpr StreamShift shortShift{shortStream, xPowerMod(8 * shortStream - 33), xPowerMod(16 * shortStream - 33)};
+
+__attribute__((target("sse4.2,pclmul")))
+inline std::uint64_t shift(std::uint32_t crc, std::uint32_t constant) {
+  auto const product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                            _mm_cvtsi32_si128(static_cast<int>(constant)), 0);
+  return static_cast<std::uint64_t>(_mm_cvtsi128_si64(product));
+}
+
+//! Runs 3 streams of shift.length bytes through crc32 in parallel, as many times as they fit
+__attribute__((target("sse4.2,pclmul")))
+std::uint32_t updateStreams(std::uint32_t crc, const std::uint8_t*& data, std::size_t& length, const StreamShift& streams) {
+  while (length >= 3 * streams.length) {
+    std::uint64_t a = crc, b = 0, c = 0;
+    auto const* const end = data + streams.length;
+
+    for (; data < end; data += 8) {
+      std::uint64_t wordA, wordB, wordC;
+      std::memcpy(&wordA, data, 8);
+      std::memcpy(&wordB, data + streams.length, 8);
+      std::memcpy(&wordC, data + 2 * streams.length, 8);
+      a = _mm_crc32_u64(a, wordA);
+      b = _mm_crc32_u64(b, wordB);
+      c = _mm_crc32_u64(c, wordC);
+    }
+
+    // crc(A B C) = crc(A) * x^(2 * 8L) + crc(B) * x^(8L) + crc(C)
+    auto const shifted = shift(static_cast<std::uint32_t>(a), streams.twice) ^ shift(static_cast<std::uint32_t>(b), streams.once);
+    crc = static_cast<std::uint32_t>(c ^ _mm_crc32_u64(0, shifted));
+
+    data += 2 * streams.length;
+    length -= 3 * streams.length;
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+std::uint32_t updateSse42Pclmul(std::uint32_t crc, const std::uint8_t* data, std::size_t length) {
+  for (; length > 0 && reinterpret_cast<std::uintptr_t>(data) % 8 != 0; length--) {
+    crc = _mm_crc32_u8(crc, *data++);
+  }
+
+  crc = updateStreams(crc, data, length, longShift);
+  crc = updateStreams(crc, data, length, shortShift);
+
+  return updateSse42(crc, data, length);
+}
+#endif
+
+using Update = std::uint32_t (*)(std::uint32_t crc, const std::uint8_t* data, std::size_t length);
+
+Update updateFor(Crc32c::Engine engine) {
+#ifdef TINYCDN_X86_64
+  switch (engine) {
+  case Crc32c::Engine::Sse42Pclmul: return updateSse42Pclmul;
+  case Crc32c::Engine::Sse42: return updateSse42;
+  case Crc32c::Engine::Portable: break;
+  }
+#else
+  (void) engine;
+#endif
+  return updatePortable;
+}
+}
+
+Crc32c::Engine Crc32c::bestEngine() noexcept {
+#ifdef TINYCDN_X86_64
+  static const Engine best = !__builtin_cpu_supports("sse4.2") ? Engine::Portable
+    : __builtin_cpu_supports("pclmul") ? Engine::Sse42Pclmul
+    : Engine::Sse42;
+  return best;
+#else
+  return Engine::Portable;
+#endif
+}
+
+std::uint32_t Crc32c::extend(std::uint32_t crc, const void* data, std::size_t length) noexcept {
+  static const Update update = updateFor(bestEngine());
+  return ~update(~crc, static_cast<const std::uint8_t*>(data), length);
+}
+
+std::uint32_t Crc32c::extend(Engine engine, std::uint32_t crc, const void* data, std::size_t length) noexcept {
+  return ~updateFor(engine)(~crc, static_cast<const std::uint8_t*>(data), length);
+}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TinyCDN::Utility::Hashing {
+
+/*!
+ * \brief CRC32C (Castagnoli) for checksumming stored blocks
+ * Uses the SSE4.2 crc32 instruction when the CPU has it. Long buffers are split into three streams that run
+ * in parallel through the instruction's pipeline and are recombined with a carry-less multiply (PCLMUL).
+ * The engine is picked once at startup, like Sha256's.
+ */
+class Crc32c {
+public:
+  enum class Engine {
+    Portable,
+    Sse42,
+    Sse42Pclmul
+  };
+
+  //! The fastest engine this CPU supports
+  static Engine bestEngine() noexcept;
+
+  //! The CRC32C of the bytes before data followed by data, given crc, the CRC32C of the bytes before data
+  static std::uint32_t extend(std::uint32_t crc, const void* data, std::size_t length) noexcept;
+  static std::uint32_t extend(Engine engine, std::uint32_t crc, const void* data, std::size_t length) noexcept;
+
+  //! CRC32C of a single buffer
+  static inline std::uint32_t of(const void* data, std::size_t length) noexcept {
+    return extend(0, data, length);
+  }
+};
+}
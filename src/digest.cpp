@@ -0,0 +1,234 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TINYCDN_X86 1
+#endif
+
+#include "digest.hpp"
+#include "hashing.hpp"
+
+namespace TinyCDN::Utility::Hashing {
+
+namespace {
+alignas(16) constexpr std::uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+constexpr std::array<std::uint32_t, 8> initialState = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+inline std::uint32_t rotr(std::uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+void compressPortable(std::uint32_t* state, const std::uint8_t* blocks, std::size_t count) {
+  for (; count > 0; count--, blocks += 64) {
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+      w[i] = (std::uint32_t{blocks[4 * i]} << 24) | (std::uint32_t{blocks[4 * i + 1]} << 16)
+        | (std::uint32_t{blocks[4 * i + 2]} << 8) | std::uint32_t{blocks[4 * i + 3]};
+    }
+    for (int i = 16; i < 64; i++) {
+      auto const s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      auto const s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto a = state[0], b = state[1], c = state[2], d = state[3];
+    auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+      auto const t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+      auto const t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#ifdef TINYCDN_X86
+/*
+ * SHA-NI works on the state as two ABEF/CDGH halves. Each group of 4 rounds adds the round constants
+ * to 4 message words, runs two sha256rnds2, and computes the message schedule 4 words ahead with
+ * sha256msg1/sha256msg2, rotating through msg[0..3].
+ */
+__attribute__((target("sha,sse4.1")))
+void compressShaNi(std::uint32_t* state, const std::uint8_t* blocks, std::size_t count) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+  auto tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+  auto state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);               // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);         // EFGH
+  auto state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);      // CDGH
+
+  for (; count > 0; count--, blocks += 64) {
+    auto const abefSave = state0;
+    auto const cdghSave = state1;
+    __m128i msg[4];
+
+#pragma GCC unroll 16
+    for (int g = 0; g < 16; g++) {
+      auto& current = msg[g % 4];
+      if (g < 4) {
+        current = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(blocks + 16 * g)), byteSwap);
+      }
+
+      auto words = _mm_add_epi32(current, _mm_load_si128(reinterpret_cast<const __m128i*>(&K[4 * g])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+
+      if (g >= 3 && g <= 14) {
+        auto& next = msg[(g + 1) % 4];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(g + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, current);
+      }
+
+      words = _mm_shuffle_epi32(words, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+
+      if (g >= 1 && g <= 12) {
+        auto& previous = msg[(g + 3) % 4];
+        previous = _mm_sha256msg1_epu32(previous, current);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);            // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);         // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);      // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);         // ABEF
+
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+#endif
+}
+
+std::string Digest::str() const {
+  std::string hex(bytes.size() * 2, '0');
+  for (std::size_t i = 0; i < bytes.size(); i += 4) {
+    std::uint32_t const word = (std::uint32_t{bytes[i]} << 24) | (std::uint32_t{bytes[i + 1]} << 16)
+      | (std::uint32_t{bytes[i + 2]} << 8) | std::uint32_t{bytes[i + 3]};
+    encodeHex8(word, hex.data() + 2 * i);
+  }
+  return hex;
+}
+
+std::optional<Digest> Digest::parse(std::string_view hex) {
+  if (hex.size() != 64) return {};
+
+  Digest digest;
+  std::uint8_t invalid = 0;
+  for (std::size_t i = 0; i < digest.bytes.size(); i++) {
+    auto const high = hexNibbles[static_cast<unsigned char>(hex[2 * i])];
+    auto const low = hexNibbles[static_cast<unsigned char>(hex[2 * i + 1])];
+    invalid |= high | low;
+    digest.bytes[i] = static_cast<std::uint8_t>(((high & 0xF) << 4) | (low & 0xF));
+  }
+
+  if (invalid & 0x10) return {};
+  return digest;
+}
+
+Sha256::Engine Sha256::bestEngine() noexcept {
+#ifdef TINYCDN_X86
+  static const Engine best = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")
+    ? Engine::ShaNi
+    : Engine::Portable;
+  return best;
+#else
+  return Engine::Portable;
+#endif
+}
+
+Sha256::Sha256() noexcept : Sha256(bestEngine()) {}
+
+Sha256::Sha256(Engine engine) noexcept : _engine(engine), compress(compressPortable) {
+#ifdef TINYCDN_X86
+  if (engine == Engine::ShaNi) compress = compressShaNi;
+#else
+  _engine = Engine::Portable;
+#endif
+  reset();
+}
+
+void Sha256::reset() noexcept {
+  state = initialState;
+  buffered = 0;
+  totalLength = 0;
+}
+
+void Sha256::update(const void* data, std::size_t length) noexcept {
+  auto const* bytes = static_cast<const std::uint8_t*>(data);
+  totalLength += length;
+
+  // Top up a partially filled block first
+  if (buffered > 0) {
+    auto const take = std::min(length, buffer.size() - buffered);
+    std::memcpy(buffer.data() + buffered, bytes, take);
+    buffered += take;
+    bytes += take;
+    length -= take;
+
+    if (buffered < buffer.size()) return;
+    compress(state.data(), buffer.data(), 1);
+    buffered = 0;
+  }
+
+  // Whole blocks are compressed straight from the caller's buffer
+  if (auto const blocks = length / 64; blocks > 0) {
+    compress(state.data(), bytes, blocks);
+    bytes += blocks * 64;
+    length -= blocks * 64;
+  }
+
+  std::memcpy(buffer.data(), bytes, length);
+  buffered = length;
+}
+
+Digest Sha256::finish() noexcept {
+  auto const bitLength = totalLength * 8;
+
+  // 0x80, zeroes up to 56 mod 64, then the big-endian bit length
+  std::uint8_t padding[72] = {0x80};
+  auto const padLength = (buffered < 56 ? 56 : 120) - buffered;
+  for (int i = 0; i < 8; i++) {
+    padding[padLength + i] = static_cast<std::uint8_t>(bitLength >> (56 - 8 * i));
+  }
+  auto const savedLength = totalLength;
+  update(padding, padLength + 8);
+  totalLength = savedLength;
+
+  Digest digest;
+  for (std::size_t i = 0; i < state.size(); i++) {
+    digest.bytes[4 * i] = static_cast<std::uint8_t>(state[i] >> 24);
+    digest.bytes[4 * i + 1] = static_cast<std::uint8_t>(state[i] >> 16);
+    digest.bytes[4 * i + 2] = static_cast<std::uint8_t>(state[i] >> 8);
+    digest.bytes[4 * i + 3] = static_cast<std::uint8_t>(state[i]);
+  }
+  return digest;
+}
+
+Digest Sha256::of(const void* data, std::size_t length) noexcept {
+  Sha256 sha;
+  sha.update(data, length);
+  return sha.finish();
+}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace TinyCDN::Utility::Hashing {
+
+//! A SHA-256 digest of a file's contents
+struct Digest {
+  std::array<std::uint8_t, 32> bytes{};
+
+  //! Lowercase hex, as used for ETags
+  std::string str() const;
+
+  //! Parses 64 hex characters, returns nothing if the input isn't a digest
+  static std::optional<Digest> parse(std::string_view hex);
+
+  inline bool operator==(const Digest& other) const noexcept { return bytes == other.bytes; }
+  inline bool operator!=(const Digest& other) const noexcept { return bytes != other.bytes; }
+};
+
+/*!
+ * \brief Incremental SHA-256 for hashing a file while it is being copied
+ * Blocks are compressed with the x86 SHA extensions (SHA-NI) when the CPU has them, and in portable C++ otherwise.
+ * The engine is picked once at startup, so update() costs one indirect call per batch of blocks.
+ */
+class Sha256 {
+public:
+  enum class Engine {
+    Portable,
+    ShaNi
+  };
+
+  //! The fastest engine this CPU supports
+  static Engine bestEngine() noexcept;
+
+  void update(const void* data, std::size_t length) noexcept;
+  //! Pads the message and returns its digest, the instance must be reset() before reuse
+  Digest finish() noexcept;
+  void reset() noexcept;
+
+  inline Engine engine() const noexcept { return _engine; }
+
+  //! Digest of a single buffer
+  static Digest of(const void* data, std::size_t length) noexcept;
+
+  Sha256() noexcept;
+  explicit Sha256(Engine engine) noexcept;
+
+private:
+  using Compress = void (*)(std::uint32_t* state, const std::uint8_t* blocks, std::size_t count);
+
+  Engine _engine;
+  Compress compress;
+  std::array<std::uint32_t, 8> state;
+  std::array<std::uint8_t, 64> buffer;
+  std::size_t buffered;
+  std::uint64_t totalLength;
+};
+}
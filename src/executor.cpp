@@ -0,0 +1,46 @@
+#include <algorithm>
+
+#include "executor.hpp"
+
+namespace TinyCDN::Utility {
+
+IOExecutor& IOExecutor::shared() {
+  // Blocked threads don't use a core, so keep a few more than there are cores
+  static IOExecutor executor(std::max<std::size_t>(4, 2 * std::thread::hardware_concurrency()));
+  return executor;
+}
+
+IOExecutor::IOExecutor(std::size_t threads) {
+  workers.reserve(threads);
+  for (std::size_t i = 0; i < threads; i++) {
+    workers.emplace_back([this]{ work(); });
+  }
+}
+
+IOExecutor::~IOExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  available.notify_all();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void IOExecutor::work() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      available.wait(lock, [this]{ return stopping || !tasks.empty(); });
+      if (tasks.empty()) return;
+
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+}
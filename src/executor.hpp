@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace TinyCDN::Utility {
+
+/*!
+ * \brief A fixed pool of threads that runs blocking I/O tasks in submission order
+ * Tasks are expected to spend most of their time in pread/pwrite, so the pool is sized for keeping
+ * several requests outstanding rather than for the number of cores.
+ */
+class IOExecutor {
+public:
+  //! The executor shared by every storage backend
+  static IOExecutor& shared();
+
+  //! Queues fn to run on one of the pool's threads. The future holds fn's result or the exception it threw.
+  template <typename Function>
+  std::future<std::invoke_result_t<Function>> submit(Function&& fn) {
+    using Result = std::invoke_result_t<Function>;
+
+    // std::function has to be copyable, a packaged_task isn't
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Function>(fn));
+    auto future = task->get_future();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.emplace_back([task]{ (*task)(); });
+    }
+    available.notify_one();
+
+    return future;
+  }
+
+  inline std::size_t threadCount() const noexcept { return workers.size(); }
+
+  explicit IOExecutor(std::size_t threads);
+  IOExecutor(const IOExecutor&) = delete;
+  IOExecutor& operator=(const IOExecutor&) = delete;
+  //! Runs every queued task before joining the threads
+  ~IOExecutor();
+
+private:
+  std::mutex mutex;
+  std::condition_variable available;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+
+  std::vector<std::thread> workers;
+
+  void work();
+};
+}
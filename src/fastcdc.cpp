@@ -0,0 +1,95 @@
+#include "fastcdc.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace TinyCDN::Utility::Hashing {
+
+namespace {
+//! A random number for every byte value, the same ones everywhere and forever, or nothing is cut where it was before
+constexpr std::array<std::uint64_t, 256> makeGear() {
+  std::array<std::uint64_t, 256> gear{};
+  std::uint64_t state = 0x5443444E46434443; // "TCDNFCDC"
+  for (auto& value : gear) {
+    // splitmix64
+    auto z = (state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    value = z ^ (z >> 31);
+  }
+  return gear;
+}
+
+constexpr auto gear = makeGear();
+
+constexpr std::array<std::uint64_t, 256> makeGearShifted() {
+  std::array<std::uint64_t, 256> shifted{};
+  for (std::size_t i = 0; i < shifted.size(); i++) shifted[i] = gear[i] << 1;
+  return shifted;
+}
+
+constexpr auto gearShifted = makeGearShifted();
+
+/*!
+ * \brief bits ones just below the top bit
+ * The hash's high bits depend on the most bytes. The top one is left out, so the mask can be shifted up by one for
+ * the first byte of a pair.
+ */
+constexpr std::uint64_t maskOf(unsigned bits) {
+  return ((std::uint64_t{1} << bits) - 1) << (63 - bits);
+}
+
+/*!
+ * \brief Rolls the hash over data from i until a cut point or until, returns the chunk's length, or 0 without a cut
+ * Takes two bytes a round, the way FastCDC 2020 does. The first byte's hash is left shifted by one, so both bytes
+ * are checked with the same mask and only one shift is needed per pair.
+ */
+inline std::size_t scan(const unsigned char* data, std::size_t& i, std::size_t until, std::uint64_t& hash, std::uint64_t mask) {
+  auto const maskShifted = mask << 1;
+  for (; i + 2 <= until; i += 2) {
+    hash = (hash << 2) + gearShifted[data[i]];
+    if (!(hash & maskShifted)) {
+      i += 1;
+      return i;
+    }
+    hash += gear[data[i + 1]];
+    if (!(hash & mask)) {
+      i += 2;
+      return i;
+    }
+  }
+  if (i < until) {
+    hash = (hash << 1) + gear[data[i++]];
+    if (!(hash & mask)) return i;
+  }
+  return 0;
+}
+
+unsigned log2Of(std::size_t value) {
+  unsigned bits = 0;
+  while ((std::size_t{1} << (bits + 1)) <= value) bits++;
+  return bits;
+}
+}
+
+FastCdc::FastCdc(std::size_t minSize, std::size_t averageSize, std::size_t maxSize) noexcept
+  : minimum(minSize),
+    average(averageSize),
+    maximum(maxSize),
+    maskSmall(maskOf(log2Of(averageSize) + 2)),
+    maskLarge(maskOf(log2Of(averageSize) - 2)) {}
+
+std::size_t FastCdc::cut(const unsigned char* data, std::size_t length) const noexcept {
+  if (length <= minimum) return length;
+
+  auto const end = std::min(length, maximum);
+  auto const normal = std::min(end, average);
+
+  // Cut points in the first minSize bytes would make chunks too small, so they aren't even hashed
+  std::uint64_t hash = 0;
+  std::size_t i = minimum;
+  if (auto const cut = scan(data, i, normal, hash, maskSmall)) return cut;
+  if (auto const cut = scan(data, i, end, hash, maskLarge)) return cut;
+  return end;
+}
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TinyCDN::Utility::Hashing {
+
+/*!
+ * \brief Cuts contents into chunks where the contents say to, with FastCDC's gear hash
+ * A cut point only depends on the 64 bytes before it, so inserting or deleting bytes only moves the cut points next to
+ * the change, and the rest is cut the same as before. That's what lets the same bytes be found again in other files.
+ * Chunks are at least minSize and at most maxSize bytes, and averageSize on average. Like FastCDC's normalized
+ * chunking, a cut is harder to find before averageSize and easier after it, which keeps chunk sizes near the average.
+ */
+class FastCdc {
+public:
+  static constexpr std::size_t defaultMinSize = 2048;
+  static constexpr std::size_t defaultAverageSize = 8192;
+  static constexpr std::size_t defaultMaxSize = 65536;
+
+  /*!
+   * \brief The length of the chunk that starts at data
+   * Without a cut point in the first maxSize bytes, that's all of length, so unless data runs to the end of the
+   * contents at least maxSize bytes have to be passed for the cut to be where the contents put it.
+   */
+  std::size_t cut(const unsigned char* data, std::size_t length) const noexcept;
+
+  inline std::size_t minSize() const noexcept { return minimum; }
+  inline std::size_t maxSize() const noexcept { return maximum; }
+
+  //! averageSize has to be a power of two
+  explicit FastCdc(std::size_t minSize = defaultMinSize, std::size_t averageSize = defaultAverageSize,
+                   std::size_t maxSize = defaultMaxSize) noexcept;
+
+private:
+  std::size_t minimum;
+  std::size_t average;
+  std::size_t maximum;
+  //! Checked before averageSize, with two more bits than log2(averageSize)
+  std::uint64_t maskSmall;
+  //! Checked after averageSize, with two less
+  std::uint64_t maskLarge;
+};
+}
@@ -1,39 +1,102 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <bitset>
+#include <cstdint>
+#include <ostream>
 #include <random>
+#include <stdexcept>
 #include <string>
-#include <cstring>
-#include <sstream>
-//#include <iomanip>
-#include <ctype.h>
+#include <string_view>
 
 namespace TinyCDN::Utility::Hashing {
 
-template <typename T>
-const char* hexCharToBinary(T c) {
-  switch(toupper(c)) {
-  case '0': return "0000";
-  case '1': return "0001";
-  case '2': return "0010";
-  case '3': return "0011";
-  case '4': return "0100";
-  case '5': return "0101";
-  case '6': return "0110";
-  case '7': return "0111";
-  case '8': return "1000";
-  case '9': return "1001";
-  case 'A': return "1010";
-  case 'B': return "1011";
-  case 'C': return "1100";
-  case 'D': return "1101";
-  case 'E': return "1110";
-  case 'F': return "1111";
-  default: return "????";
+//! Hex nibble value of every ASCII character, 0x10 marks characters that aren't hex digits
+constexpr std::array<std::uint8_t, 256> hexNibbles = [] {
+  std::array<std::uint8_t, 256> table{};
+  for (auto& nibble : table) nibble = 0x10;
+  for (int c = '0'; c <= '9'; c++) table[c] = static_cast<std::uint8_t>(c - '0');
+  for (int c = 'a'; c <= 'f'; c++) table[c] = static_cast<std::uint8_t>(c - 'a' + 10);
+  for (int c = 'A'; c <= 'F'; c++) table[c] = static_cast<std::uint8_t>(c - 'A' + 10);
+  return table;
+}();
+
+/*!
+ * \brief Converts 32 bits into 8 lowercase hex characters without branching.
+ * The nibbles are spread into one byte each (SWAR), then offset into '0'-'9' or 'a'-'f' all at once.
+ * \param out Receives the characters, most significant nibble first
+ */
+constexpr void encodeHex8(std::uint32_t value, char* out) noexcept {
+  std::uint64_t v = value;
+  v = ((v & 0x00000000FFFF0000ull) << 16) | (v & 0x000000000000FFFFull);
+  v = ((v & 0x0000FF000000FF00ull) << 8) | (v & 0x000000FF000000FFull);
+  v = ((v & 0x00F000F000F000F0ull) << 4) | (v & 0x000F000F000F000Full);
+
+  // Every byte whose nibble is >= 10 gets 1, it is shifted up by 'a' - '0' - 10
+  auto const letters = ((v + 0x0606060606060606ull) >> 4) & 0x0101010101010101ull;
+  v += 0x3030303030303030ull + letters * 0x27;
+
+  // Byte 0 holds the least significant nibble
+  for (int i = 0; i < 8; i++) {
+    out[i] = static_cast<char>(v >> (8 * (7 - i)));
   }
 }
 
+/*!
+ * \brief xoshiro256** pseudo random generator
+ * Four words of state and a handful of shifts per output, which is all id generation needs.
+ * It is not cryptographically secure; ids are meant to be unique, not secret.
+ */
+class Xoshiro256 {
+public:
+  using result_type = std::uint64_t;
+
+  static constexpr result_type min() noexcept { return 0; }
+  static constexpr result_type max() noexcept { return ~result_type{0}; }
+
+  result_type operator()() noexcept {
+    auto const result = rotl(state[1] * 5, 7) * 9;
+    auto const t = state[1] << 17;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 45);
+
+    return result;
+  }
+
+  //! Expands a single seed into the full state with splitmix64, as recommended by the xoshiro authors
+  explicit Xoshiro256(std::uint64_t seed) noexcept {
+    for (auto& word : state) {
+      seed += 0x9E3779B97F4A7C15ull;
+      auto z = seed;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      word = z ^ (z >> 31);
+    }
+  }
+
+private:
+  std::array<std::uint64_t, 4> state;
+
+  static constexpr std::uint64_t rotl(std::uint64_t x, int k) noexcept {
+    return (x << k) | (x >> (64 - k));
+  }
+};
+
+//! The calling thread's generator, seeded from std::random_device on first use; no two threads share state so no locking is needed
+inline Xoshiro256& threadRandomGenerator() {
+  thread_local Xoshiro256 generator{[] {
+    std::random_device r;
+    return (std::uint64_t{r()} << 32) | r();
+  }()};
+  return generator;
+}
+
 class PseudoRandomHexFactory {
 public:
   PseudoRandomHexFactory() {
@@ -59,117 +122,204 @@ private:
   static constexpr char hex[17]{"0123456789ABCDEF"};
 };
 
-//! Wrapper type for fixed-size bitset with hex conversion to/from a string
+/*!
+ * \brief Fixed-size identifier with hex conversion to/from a string
+ * The value is kept in 64-bit words, least significant word first, so parsing, formatting, comparing and hashing work a word at a time.
+ * Parsing is constexpr, which lets literal ids be checked at compile time.
+ */
 template <int fixedSize>
 class Id {
+  static_assert(fixedSize > 0 && fixedSize % 4 == 0, "Id size must be a whole number of hex digits");
+
 public:
-  Id& operator=(std::string val) {
-    _value = std::bitset<fixedSize>(hexToBinary(val));
+  static constexpr std::size_t wordCount = (fixedSize + 63) / 64;
+  static constexpr std::size_t hexLength = fixedSize / 4;
+  using Words = std::array<std::uint64_t, wordCount>;
+
+  constexpr Id& operator=(std::string_view val) {
+    _words = parse(val);
 
     return *this;
   }
 
-  bool operator==(const Id<fixedSize> &other) const {
-    return this->_value == other.value();
+  constexpr bool operator==(const Id<fixedSize> &other) const noexcept {
+    for (std::size_t i = 0; i < wordCount; i++) {
+      if (_words[i] != other._words[i]) return false;
+    }
+    return true;
+  }
+
+  constexpr bool operator!=(const Id<fixedSize> &other) const noexcept {
+    return !(*this == other);
   }
 
   friend std::ostream& operator<< (std::ostream &out, const Id<fixedSize> &id) {
-    out << id.str();
+    char hex[hexLength];
+    id.toChars(hex);
+    out.write(hex, hexLength);
     return out;
   }
 
   friend std::ostream& operator<< (std::ostream &out, Id<fixedSize> &id) {
-    out << id.str();
-    return out;
+    return out << static_cast<const Id<fixedSize>&>(id);
   }
 
   std::string str() const {
-    std::stringstream hex;
+    std::string hex(hexLength, '0');
+    toChars(hex.data());
 
-    auto const str = _value.to_string();
+    return hex;
+  }
 
-    for (int i = 0; i < str.length(); i+=4) {
-      auto const val = std::stoi(str.substr(i,4), nullptr, 2);
-      hex << std::hex << val;
+  //! Writes exactly hexLength lowercase hex characters to out, without allocating
+  constexpr void toChars(char* out) const noexcept {
+    // Always encode whole words, then copy out the digits that belong to this Id
+    char buffer[wordCount * 16]{};
+    for (std::size_t i = 0; i < wordCount; i++) {
+      auto const word = _words[wordCount - 1 - i];
+      encodeHex8(static_cast<std::uint32_t>(word >> 32), buffer + i * 16);
+      encodeHex8(static_cast<std::uint32_t>(word), buffer + i * 16 + 8);
     }
 
-    return hex.str();
+    for (std::size_t i = 0; i < hexLength; i++) {
+      out[i] = buffer[wordCount * 16 - hexLength + i];
+    }
   }
 
-  inline std::bitset<fixedSize> value() const noexcept {
-    return _value;
+  //! Converts the words into a bitset, kept for callers that operate on individual bits
+  std::bitset<fixedSize> value() const noexcept {
+    std::bitset<fixedSize> bits;
+    for (std::size_t i = wordCount; i-- > 0;) {
+      bits <<= 64;
+      bits |= std::bitset<fixedSize>(_words[i]);
+    }
+    return bits;
   }
 
-  constexpr int size() noexcept {
-    return fixedSize;
+  constexpr const Words& words() const noexcept {
+    return _words;
   }
 
-  constexpr int length() noexcept {
+  static constexpr Id<fixedSize> fromWords(const Words& words) noexcept {
+    Id<fixedSize> id;
+    id._words = words;
+    if constexpr (fixedSize % 64 != 0) {
+      id._words[wordCount - 1] &= (std::uint64_t{1} << (fixedSize % 64)) - 1;
+    }
+    return id;
+  }
+
+  constexpr int size() const noexcept {
     return fixedSize;
   }
 
-  inline std::string hexToBinary(std::string hexInput) {
-    std::string hexVal;
-    std::istringstream(hexInput) >> std::hex >> hexVal;
+  constexpr int length() const noexcept {
+    return fixedSize;
+  }
 
-    std::stringstream result;
+  /*!
+   * \brief Converts a hex string into words.
+   * Like the bitset constructor this replaced, only the first hexLength digits are read and a shorter string is right-aligned.
+   * Every character is looked up in hexNibbles and the invalid bits are collected, so there is a single check per call.
+   * \throws std::invalid_argument if a character isn't a hex digit
+   */
+  static constexpr Words parse(std::string_view hex) {
+    Words words{};
+    auto const digits = std::min(hex.size(), hexLength);
+    std::uint8_t invalid = 0;
+
+    // Fill words from the least significant end of the string, 16 digits per word
+    for (std::size_t i = 0; i < wordCount && i * 16 < digits; i++) {
+      auto const end = digits - i * 16;
+      auto const begin = end > 16 ? end - 16 : 0;
+
+      std::uint64_t word = 0;
+      for (auto j = begin; j < end; j++) {
+        auto const nibble = hexNibbles[static_cast<unsigned char>(hex[j])];
+        invalid |= nibble;
+        word = (word << 4) | (nibble & 0xF);
+      }
+      words[i] = word;
+    }
 
-    for (auto const c : hexVal) {
-      result << hexCharToBinary<const char>(c);
+    if (invalid & 0x10) {
+      throw std::invalid_argument("Id: not a hex string");
     }
 
-    return result.str();
+    return words;
   }
 
-  Id() = default;
+  constexpr Id() = default;
 
-  inline Id(std::string val) {
-    this = val;
-  };
+  constexpr Id(std::string_view val) : _words(parse(val)) {}
 
 protected:
-  std::bitset<fixedSize> _value;
+  Words _words{};
 };
 
+/*!
+ * \brief Hashes an Id a word at a time
+ * Each word is folded in with a multiply-xorshift and the result goes through the murmur3 finalizer,
+ * so every input bit affects the low bits that open-addressing tables index with.
+ */
 class IdHasher {
 public:
   template <int fixedSize>
-  std::size_t operator()(const Id<fixedSize> &id) const {
-    const std::bitset<fixedSize> id2 = id.value();
-    return std::hash<std::bitset<fixedSize>>()(id2);
+  constexpr std::size_t operator()(const Id<fixedSize> &id) const noexcept {
+    std::uint64_t h = 0x9E3779B97F4A7C15ull ^ fixedSize;
+    for (auto const word : id.words()) {
+      h = (h ^ word) * 0xD6E8FEB86659FD93ull;
+      h ^= h >> 32;
+    }
+    return static_cast<std::size_t>(mix(h));
+  }
+
+  //! Murmur3's 64-bit finalizer
+  static constexpr std::uint64_t mix(std::uint64_t h) noexcept {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
   }
 };
 
 class UUID4 : public Id<128> {
 public:
-  UUID4& operator=(std::string val) {
-    std::string hexVal;
-    auto _val = val.substr();
-
+  constexpr UUID4& operator=(std::string_view val) {
     // Remove any hyphens
-    _val.erase(std::remove(_val.begin(), _val.end(), '-'), _val.end());
-    Id::operator=(_val);
-
-    // Assign UUID version to 4
-    // Set 4 most significant bytes of 7th most significent byte to 4
-    _value.reset(76); // 0
-    _value.reset(77); // 0
-    _value.set(78); // 1
-    _value.reset(79); // 0
-
-    // Set 2 most significant bytes of 9th most significent byte (reserved UUID bits)
-    _value.reset(62);
-    _value.set(63);
+    char hex[hexLength]{};
+    std::size_t length = 0;
+    for (auto const c : val) {
+      if (c == '-') continue;
+      if (length == hexLength) break;
+      hex[length++] = c;
+    }
+    Id::operator=(std::string_view(hex, length));
+    setVersion();
 
     return *this;
   }
 
+  //! Makes a UUID4 out of 128 random bits, overwriting its version and reserved bits
+  static constexpr UUID4 fromWords(const Words& words) noexcept {
+    UUID4 id;
+    id._words = words;
+    id.setVersion();
+    return id;
+  }
+
   std::string str() const {
-    auto out = Id::str();
-    out.insert(8, "-");
-    out.insert(13, "-");
-    out.insert(18, "-");
-    out.insert(23, "-");
+    char hex[hexLength];
+    toChars(hex);
+
+    std::string out(hexLength + 4, '-');
+    out.replace(0, 8, hex, 8);
+    out.replace(9, 4, hex + 8, 4);
+    out.replace(14, 4, hex + 12, 4);
+    out.replace(19, 4, hex + 16, 4);
+    out.replace(24, 12, hex + 20, 12);
 
     return out;
   }
@@ -183,26 +333,54 @@ public:
     out << id.str();
     return out;
   }
-};
 
-class UUID4Factory {
-public:
-  UUID4Factory() {}
+  constexpr UUID4() = default;
 
-  UUID4 operator()() {
-    auto* id32 = generator(32);
+  constexpr UUID4(std::string_view val) {
+    *this = val;
+  }
 
-    UUID4 output;
-    std::string s(id32);
-    // UUID4 operator= sets version for us
-    output = s;
+private:
+  constexpr void setVersion() noexcept {
+    // Assign UUID version to 4
+    // Set 4 most significant bits of the 7th most significant byte (bits 76-79) to 0100
+    _words[1] = (_words[1] & ~(std::uint64_t{0xF} << 12)) | (std::uint64_t{0x4} << 12);
 
-    delete id32;
+    // Set 2 most significant bits of the 9th most significant byte (reserved UUID bits 62-63) to 10
+    _words[0] = (_words[0] & ~(std::uint64_t{0x3} << 62)) | (std::uint64_t{0x2} << 62);
+  }
+};
 
-    return output;
+/*!
+ * \brief Generates random ids of IdType straight from the calling thread's Xoshiro256
+ * Nothing is allocated and nothing is shared between threads, so any number of callers can generate concurrently.
+ * IdType needs a static fromWords(), which is how UUID4 gets its version bits set.
+ */
+template <typename IdType>
+class RandomIdFactory {
+public:
+  IdType operator()() const {
+    return IdType::fromWords(randomWords(threadRandomGenerator()));
+  }
+
+  //! Fills [first, last) with fresh ids, for services that hand ids out in batches
+  template <typename OutputIt>
+  void operator()(OutputIt first, OutputIt last) const {
+    auto& generator = threadRandomGenerator();
+    for (; first != last; ++first) {
+      *first = IdType::fromWords(randomWords(generator));
+    }
   }
 
 private:
-  PseudoRandomHexFactory generator;
+  static typename IdType::Words randomWords(Xoshiro256& generator) noexcept {
+    typename IdType::Words words;
+    for (auto& word : words) {
+      word = generator();
+    }
+    return words;
+  }
 };
+
+using UUID4Factory = RandomIdFactory<UUID4>;
 }
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+
+#include "hashing.hpp"
+
+namespace TinyCDN::Utility::Hashing {
+
+/*!
+ * \brief Open-addressing hash map for Id-keyed tables
+ * Entries live inline in a single slot array probed linearly, next to a parallel array of one-byte tags
+ * (the top 7 bits of the hash), so a miss is usually decided without touching the entry itself.
+ * Erasing shifts the following entries back instead of leaving tombstones, so probe sequences never degrade.
+ * Values only need to be movable; wrap non-movable values such as mutexes in a std::unique_ptr.
+ * Inserting may rehash and erasing may move entries, either of which invalidates iterators and references.
+ */
+template <typename Key, typename Value, typename Hasher = IdHasher>
+class IdMap {
+public:
+  using key_type = Key;
+  using mapped_type = Value;
+  using value_type = std::pair<Key, Value>;
+  using size_type = std::size_t;
+
+  template <bool isConst>
+  class Iterator {
+    using Map = std::conditional_t<isConst, const IdMap, IdMap>;
+
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = IdMap::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = std::conditional_t<isConst, const value_type*, value_type*>;
+    using reference = std::conditional_t<isConst, const value_type&, value_type&>;
+
+    reference operator*() const { return map->slot(index); }
+    pointer operator->() const { return &map->slot(index); }
+
+    Iterator& operator++() {
+      index = map->nextOccupied(index + 1);
+      return *this;
+    }
+
+    bool operator==(const Iterator& rhs) const { return index == rhs.index; }
+    bool operator!=(const Iterator& rhs) const { return index != rhs.index; }
+
+    //! Allows converting an iterator to a const_iterator
+    operator Iterator<true>() const { return Iterator<true>{map, index}; }
+
+    Iterator(Map* map, std::size_t index) : map(map), index(index) {}
+
+  private:
+    Map* map;
+    std::size_t index;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  iterator begin() noexcept { return iterator{this, nextOccupied(0)}; }
+  iterator end() noexcept { return iterator{this, capacity}; }
+  const_iterator begin() const noexcept { return const_iterator{this, nextOccupied(0)}; }
+  const_iterator end() const noexcept { return const_iterator{this, capacity}; }
+
+  size_type size() const noexcept { return entryCount; }
+  bool empty() const noexcept { return entryCount == 0; }
+
+  iterator find(const Key& key) noexcept {
+    return iterator{this, findIndex(key)};
+  }
+
+  const_iterator find(const Key& key) const noexcept {
+    return const_iterator{this, findIndex(key)};
+  }
+
+  size_type count(const Key& key) const noexcept {
+    return contains(key) ? 1 : 0;
+  }
+
+  bool contains(const Key& key) const noexcept {
+    return findIndex(key) != capacity;
+  }
+
+  //! Inserts Value{args...} under key unless key is already present
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    // Grow before probing so the returned index stays valid
+    if ((entryCount + 1) * 8 > capacity * 7) {
+      rehash(capacity == 0 ? 16 : capacity * 2);
+    }
+
+    auto const hash = hasher(key);
+    auto const tag = tagOf(hash);
+
+    for (auto i = hash & mask;; i = (i + 1) & mask) {
+      if (tags[i] == empty_) {
+        new (&slots[i]) value_type(std::piecewise_construct,
+                                   std::forward_as_tuple(key),
+                                   std::forward_as_tuple(std::forward<Args>(args)...));
+        tags[i] = tag;
+        entryCount++;
+        return {iterator{this, i}, true};
+      }
+      if (tags[i] == tag && slot(i).first == key) {
+        return {iterator{this, i}, false};
+      }
+    }
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(const Key& key, Args&&... args) {
+    return try_emplace(key, std::forward<Args>(args)...);
+  }
+
+  Value& operator[](const Key& key) {
+    return try_emplace(key).first->second;
+  }
+
+  //! Removes key if present and returns the number of removed entries (0 or 1)
+  size_type erase(const Key& key) {
+    auto hole = findIndex(key);
+    if (hole == capacity) return 0;
+
+    // Backward-shift every following entry whose ideal slot lies at or before the hole
+    for (auto i = (hole + 1) & mask; tags[i] != empty_; i = (i + 1) & mask) {
+      auto const ideal = hasher(slot(i).first) & mask;
+      auto const stays = hole <= i ? (hole < ideal && ideal <= i) : (hole < ideal || ideal <= i);
+      if (stays) continue;
+
+      slot(hole) = std::move(slot(i));
+      tags[hole] = tags[i];
+      hole = i;
+    }
+
+    slot(hole).~value_type();
+    tags[hole] = empty_;
+    entryCount--;
+    return 1;
+  }
+
+  void clear() noexcept {
+    for (std::size_t i = 0; i < capacity; i++) {
+      if (tags[i] != empty_) {
+        slot(i).~value_type();
+        tags[i] = empty_;
+      }
+    }
+    entryCount = 0;
+  }
+
+  //! Makes room for n entries without rehashing
+  void reserve(size_type n) {
+    std::size_t wanted = 16;
+    while (wanted * 7 < n * 8) wanted *= 2;
+    if (wanted > capacity) rehash(wanted);
+  }
+
+  IdMap() = default;
+  IdMap(const IdMap&) = delete;
+  IdMap& operator=(const IdMap&) = delete;
+
+  IdMap(IdMap&& other) noexcept
+    : tags(std::move(other.tags)), slots(std::move(other.slots)),
+      capacity(other.capacity), mask(other.mask), entryCount(other.entryCount) {
+    other.capacity = other.mask = other.entryCount = 0;
+  }
+
+  IdMap& operator=(IdMap&& other) noexcept {
+    if (this != &other) {
+      clear();
+      tags = std::move(other.tags);
+      slots = std::move(other.slots);
+      capacity = other.capacity;
+      mask = other.mask;
+      entryCount = other.entryCount;
+      other.capacity = other.mask = other.entryCount = 0;
+    }
+    return *this;
+  }
+
+  ~IdMap() {
+    clear();
+  }
+
+private:
+  //! Tag of an empty slot; occupied slots always have the high bit set
+  static constexpr std::uint8_t empty_ = 0;
+
+  using Storage = std::aligned_storage_t<sizeof(value_type), alignof(value_type)>;
+
+  std::unique_ptr<std::uint8_t[]> tags;
+  std::unique_ptr<Storage[]> slots;
+  std::size_t capacity = 0;
+  std::size_t mask = 0;
+  std::size_t entryCount = 0;
+  Hasher hasher;
+
+  static std::uint8_t tagOf(std::size_t hash) noexcept {
+    return static_cast<std::uint8_t>(0x80 | (hash >> (sizeof(std::size_t) * 8 - 7)));
+  }
+
+  value_type& slot(std::size_t i) noexcept {
+    return *std::launder(reinterpret_cast<value_type*>(&slots[i]));
+  }
+
+  const value_type& slot(std::size_t i) const noexcept {
+    return *std::launder(reinterpret_cast<const value_type*>(&slots[i]));
+  }
+
+  std::size_t nextOccupied(std::size_t i) const noexcept {
+    while (i < capacity && tags[i] == empty_) i++;
+    return i;
+  }
+
+  //! Index of key's slot, or capacity when it isn't present
+  std::size_t findIndex(const Key& key) const noexcept {
+    if (entryCount == 0) return capacity;
+
+    auto const hash = hasher(key);
+    auto const tag = tagOf(hash);
+
+    for (auto i = hash & mask; tags[i] != empty_; i = (i + 1) & mask) {
+      if (tags[i] == tag && slot(i).first == key) return i;
+    }
+    return capacity;
+  }
+
+  void rehash(std::size_t newCapacity) {
+    auto oldTags = std::move(tags);
+    auto oldSlots = std::move(slots);
+    auto const oldCapacity = capacity;
+
+    tags = std::make_unique<std::uint8_t[]>(newCapacity);
+    slots = std::make_unique<Storage[]>(newCapacity);
+    capacity = newCapacity;
+    mask = newCapacity - 1;
+
+    for (std::size_t i = 0; i < oldCapacity; i++) {
+      if (oldTags[i] == empty_) continue;
+
+      auto& entry = *std::launder(reinterpret_cast<value_type*>(&oldSlots[i]));
+      auto j = hasher(entry.first) & mask;
+      while (tags[j] != empty_) j = (j + 1) & mask;
+
+      new (&slots[j]) value_type(std::move(entry));
+      tags[j] = oldTags[i];
+      entry.~value_type();
+    }
+  }
+};
+}
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define TINYCDN_HAVE_IO_URING
+#endif
+
+#include "ioqueue.hpp"
+
+namespace TinyCDN::Utility {
+
+namespace {
+std::int64_t perform(const IORequest& request) {
+  for (;;) {
+    ssize_t result = 0;
+    switch (request.type) {
+    case IORequest::Read: result = ::pread(request.fd, request.buffer, request.length, static_cast<off_t>(request.offset)); break;
+    case IORequest::Write: result = ::pwrite(request.fd, request.buffer, request.length, static_cast<off_t>(request.offset)); break;
+    case IORequest::Sync: result = ::fdatasync(request.fd); break;
+    }
+    if (result >= 0) return result;
+    if (errno != EINTR) return -errno;
+  }
+}
+
+#ifdef TINYCDN_HAVE_IO_URING
+/*!
+ * \brief An IOQueue on an io_uring, set up with the raw system calls so nothing but the kernel's headers is needed
+ * Submitting fills in a submission queue entry and enters the ring, and a thread of the queue's waits for
+ * completions and calls their Completions. Requests are readv, writev and fsync, which every kernel with
+ * io_uring has. Each outstanding request holds a slot, with its iovec and its Completion, until it completes.
+ */
+class IoUringQueue : public IOQueue {
+public:
+  //! nullptr if io_uring isn't there or isn't allowed, i.e. by kernel.io_uring_disabled or seccomp
+  static std::unique_ptr<IoUringQueue> create(unsigned depth);
+
+  void submit(const IORequest& request, Completion done) override;
+  inline const char* name() const noexcept override { return "io_uring"; }
+
+  using IOQueue::submit;
+
+  IoUringQueue(const IoUringQueue&) = delete;
+  //! Waits for the requests that are outstanding
+  ~IoUringQueue();
+
+private:
+  IoUringQueue() = default;
+
+  //! Marks the no-op that tells the completion thread to stop
+  static constexpr std::uint64_t stopMarker = ~std::uint64_t{0};
+
+  int ring = -1;
+  void* submissionRing = MAP_FAILED;
+  std::size_t submissionRingSize = 0;
+  void* completionRing = MAP_FAILED;
+  std::size_t completionRingSize = 0;
+  io_uring_sqe* entries = static_cast<io_uring_sqe*>(MAP_FAILED);
+  std::size_t entriesSize = 0;
+
+  unsigned* submissionTail = nullptr;
+  unsigned submissionMask = 0;
+  unsigned* submissionArray = nullptr;
+  unsigned* completionHead = nullptr;
+  unsigned* completionTail = nullptr;
+  unsigned completionMask = 0;
+  io_uring_cqe* completions = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable slotFreed;
+  std::vector<Completion> slots;
+  std::vector<iovec> vectors;
+  std::vector<std::uint32_t> freeSlots;
+
+  std::thread completer;
+
+  /*!
+   * \brief Fills in the next submission queue entry and enters the ring, with mutex held
+   * \return 0, or -errno if the kernel didn't take the entry, which is then taken back out of the queue
+   */
+  int push(const io_uring_sqe& entry);
+  void complete();
+};
+
+std::unique_ptr<IoUringQueue> IoUringQueue::create(unsigned depth) {
+  std::unique_ptr<IoUringQueue> queue(new IoUringQueue());
+
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  queue->ring = static_cast<int>(::syscall(__NR_io_uring_setup, depth, &params));
+  if (queue->ring < 0) return nullptr;
+
+  queue->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  queue->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool const singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (singleMap) {
+    queue->submissionRingSize = queue->completionRingSize = std::max(queue->submissionRingSize, queue->completionRingSize);
+  }
+
+  queue->submissionRing = ::mmap(nullptr, queue->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 queue->ring, IORING_OFF_SQ_RING);
+  if (queue->submissionRing == MAP_FAILED) return nullptr;
+  if (singleMap) {
+    queue->completionRing = queue->submissionRing;
+  }
+  else {
+    queue->completionRing = ::mmap(nullptr, queue->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   queue->ring, IORING_OFF_CQ_RING);
+    if (queue->completionRing == MAP_FAILED) return nullptr;
+  }
+  queue->entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+  queue->entries = static_cast<io_uring_sqe*>(::mmap(nullptr, queue->entriesSize, PROT_READ | PROT_WRITE,
+                                                     MAP_SHARED | MAP_POPULATE, queue->ring, IORING_OFF_SQES));
+  if (queue->entries == MAP_FAILED) return nullptr;
+
+  auto const submission = static_cast<char*>(queue->submissionRing);
+  queue->submissionTail = reinterpret_cast<unsigned*>(submission + params.sq_off.tail);
+  queue->submissionMask = *reinterpret_cast<unsigned*>(submission + params.sq_off.ring_mask);
+  queue->submissionArray = reinterpret_cast<unsigned*>(submission + params.sq_off.array);
+
+  auto const completion = static_cast<char*>(queue->completionRing);
+  queue->completionHead = reinterpret_cast<unsigned*>(completion + params.cq_off.head);
+  queue->completionTail = reinterpret_cast<unsigned*>(completion + params.cq_off.tail);
+  queue->completionMask = *reinterpret_cast<unsigned*>(completion + params.cq_off.ring_mask);
+  queue->completions = reinterpret_cast<io_uring_cqe*>(completion + params.cq_off.cqes);
+
+  // No more requests are outstanding than there are submission entries, so the completion queue never overflows
+  queue->slots.resize(params.sq_entries);
+  queue->vectors.resize(params.sq_entries);
+  for (auto slot = params.sq_entries; slot > 0; slot--) queue->freeSlots.push_back(slot - 1);
+
+  queue->completer = std::thread([queue = queue.get()] { queue->complete(); });
+  return queue;
+}
+
+int IoUringQueue::push(const io_uring_sqe& entry) {
+  // Only submitters write the tail, and they hold mutex
+  auto const tail = *submissionTail;
+  auto const index = tail & submissionMask;
+  entries[index] = entry;
+  submissionArray[index] = index;
+  __atomic_store_n(submissionTail, tail + 1, __ATOMIC_RELEASE);
+
+  for (;;) {
+    if (::syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0) >= 0) return 0;
+    if (errno != EINTR) break;
+  }
+
+  // The kernel only reads the queue when it's entered, and took nothing this time, so the entry can't be left for
+  // the next request's enter to submit in its place
+  auto const error = errno;
+  __atomic_store_n(submissionTail, tail, __ATOMIC_RELEASE);
+  return -error;
+}
+
+void IoUringQueue::submit(const IORequest& request, Completion done) {
+  std::unique_lock<std::mutex> lock(mutex);
+  slotFreed.wait(lock, [this] { return !freeSlots.empty(); });
+  auto const slot = freeSlots.back();
+  freeSlots.pop_back();
+  slots[slot] = std::move(done);
+
+  io_uring_sqe entry;
+  std::memset(&entry, 0, sizeof(entry));
+  entry.fd = request.fd;
+  entry.user_data = slot;
+  if (request.type == IORequest::Sync) {
+    entry.opcode = IORING_OP_FSYNC;
+    entry.fsync_flags = IORING_FSYNC_DATASYNC;
+  }
+  else {
+    // The iovec has to stay put until the request completes, older kernels read it when they get to the request
+    vectors[slot] = iovec{request.buffer, request.length};
+    entry.opcode = request.type == IORequest::Read ? IORING_OP_READV : IORING_OP_WRITEV;
+    entry.addr = reinterpret_cast<std::uint64_t>(&vectors[slot]);
+    entry.len = 1;
+    entry.off = request.offset;
+  }
+
+  auto const error = push(entry);
+  if (error == 0) return;
+
+  // The request never reached the kernel, so it completes here and gives its slot back
+  done = std::move(slots[slot]);
+  freeSlots.push_back(slot);
+  lock.unlock();
+  slotFreed.notify_one();
+  done(error);
+}
+
+void IoUringQueue::complete() {
+  for (;;) {
+    auto head = *completionHead;
+    auto const tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+      while (::syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno == EINTR) {}
+      continue;
+    }
+
+    for (; head != tail; head++) {
+      auto const& completion = completions[head & completionMask];
+      if (completion.user_data == stopMarker) {
+        __atomic_store_n(completionHead, head + 1, __ATOMIC_RELEASE);
+        return;
+      }
+
+      auto const slot = static_cast<std::uint32_t>(completion.user_data);
+      auto const result = completion.res;
+      Completion done;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = std::move(slots[slot]);
+        freeSlots.push_back(slot);
+      }
+      slotFreed.notify_one();
+
+      done(result);
+    }
+    __atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+  }
+}
+
+IoUringQueue::~IoUringQueue() {
+  if (completer.joinable()) {
+    std::unique_lock<std::mutex> lock(mutex);
+    slotFreed.wait(lock, [this] { return freeSlots.size() == slots.size(); });
+
+    io_uring_sqe stop;
+    std::memset(&stop, 0, sizeof(stop));
+    stop.opcode = IORING_OP_NOP;
+    stop.user_data = stopMarker;
+    // Nothing is outstanding, so a ring that's short of resources only needs another try
+    for (auto error = push(stop); error == -EAGAIN || error == -EBUSY; error = push(stop)) std::this_thread::yield();
+    lock.unlock();
+
+    completer.join();
+  }
+
+  if (entries != MAP_FAILED) ::munmap(entries, entriesSize);
+  if (completionRing != MAP_FAILED && completionRing != submissionRing) ::munmap(completionRing, completionRingSize);
+  if (submissionRing != MAP_FAILED) ::munmap(submissionRing, submissionRingSize);
+  if (ring >= 0) ::close(ring);
+}
+#endif
+}
+
+std::future<std::int64_t> IOQueue::submit(const IORequest& request) {
+  // Completion has to be copyable, a promise isn't
+  auto promise = std::make_shared<std::promise<std::int64_t>>();
+  auto future = promise->get_future();
+  submit(request, [promise](std::int64_t result) { promise->set_value(result); });
+  return future;
+}
+
+std::unique_ptr<IOQueue> IOQueue::create(unsigned depth) {
+#ifdef TINYCDN_HAVE_IO_URING
+  if (auto queue = IoUringQueue::create(depth)) return queue;
+#endif
+  return std::make_unique<ThreadPoolIOQueue>();
+}
+
+IOQueue& IOQueue::shared() {
+  static auto const queue = [] {
+    auto queue = create();
+    std::cout << "IOQueue::shared using " << queue->name() << std::endl;
+    return queue;
+  }();
+  return *queue;
+}
+
+void ThreadPoolIOQueue::submit(const IORequest& request, Completion done) {
+  executor.submit([request, done = std::move(done)] { done(perform(request)); });
+}
+}
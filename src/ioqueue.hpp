@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "executor.hpp"
+
+namespace TinyCDN::Utility {
+
+//! A positional read, write or data sync on a file descriptor, as an IOQueue carries it out
+struct IORequest {
+  enum Type {
+    Read,
+    Write,
+    //! Flushes the file's data like fdatasync, buffer, length and offset are ignored
+    Sync
+  };
+
+  Type type = Read;
+  int fd = -1;
+  void* buffer = nullptr;
+  std::size_t length = 0;
+  std::uint64_t offset = 0;
+};
+
+/*!
+ * \brief Carries out reads and writes without the caller waiting on them, so one thread can keep many outstanding
+ * Every request completes by calling its Completion once, on a thread of the queue's, with what pread, pwrite or
+ * fdatasync would have returned, or -errno. A request the queue couldn't take at all completes with -errno on the
+ * submitting thread, before submit() returns. Completions should be short and hand anything that blocks on.
+ */
+class IOQueue {
+public:
+  using Completion = std::function<void(std::int64_t result)>;
+
+  virtual void submit(const IORequest& request, Completion done) = 0;
+  //! The name of the implementation, i.e. for logs and benchmarks
+  virtual const char* name() const noexcept = 0;
+
+  inline void read(int fd, void* buffer, std::size_t length, std::uint64_t offset, Completion done) {
+    submit(IORequest{IORequest::Read, fd, buffer, length, offset}, std::move(done));
+  }
+  inline void write(int fd, const void* buffer, std::size_t length, std::uint64_t offset, Completion done) {
+    submit(IORequest{IORequest::Write, fd, const_cast<void*>(buffer), length, offset}, std::move(done));
+  }
+  inline void sync(int fd, Completion done) {
+    submit(IORequest{IORequest::Sync, fd, nullptr, 0, 0}, std::move(done));
+  }
+
+  //! Submits the request and returns a future for its result
+  std::future<std::int64_t> submit(const IORequest& request);
+
+  /*!
+   * \brief Returns a queue on io_uring if the kernel has it and allows it, and one on the shared IOExecutor otherwise
+   * \param depth How many requests the io_uring queue keeps outstanding, submitting more waits for one to complete
+   */
+  static std::unique_ptr<IOQueue> create(unsigned depth = 256);
+  //! The queue shared by every storage backend, from create()
+  static IOQueue& shared();
+
+  virtual ~IOQueue() = default;
+};
+
+//! Carries out each request with a blocking call on an IOExecutor's thread, for kernels without io_uring
+class ThreadPoolIOQueue : public IOQueue {
+public:
+  void submit(const IORequest& request, Completion done) override;
+  inline const char* name() const noexcept override { return "thread pool"; }
+
+  using IOQueue::submit;
+
+  explicit ThreadPoolIOQueue(IOExecutor& executor = IOExecutor::shared()) : executor(executor) {}
+
+private:
+  IOExecutor& executor;
+};
+}
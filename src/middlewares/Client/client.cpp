@@ -235,30 +235,40 @@ extern "C" {
     std::ios::sync_with_stdio();
 
     auto size = session->hostingFile->getRealSize();
+    // Files packed into a shared volume file (i.e. a Haystack needle) start somewhere inside it,
+    // unless they come with a source of their own contents
+    auto const offset = !session->hostingFile->contents && session->hostingFile->position.has_value()
+      ? session->hostingFile->position->first : 0;
     std::cout << "cc_FileHostingSession_chunkFile | size: " << size << std::endl;
 
+    auto source = session->hostingService->hostFile(
+      std::move(session->hostingFile),
+      std::move(session->bucket),
+      session->registryItem);
+
     session->cursor = std::make_unique<Utility::ChunkedCursor>(
       32_kB,
       size,
-      0,
-      [&session](std::ifstream& stream) {
-	session->hostingService->hostFile(
-	  stream,
-	  std::move(session->hostingFile),
-	  std::move(session->bucket),
-	  session->registryItem);
-      });
+      offset,
+      std::move(source));
   }
 
   /*
     Returns a 0 if the chunking should continue
     Returns a non-0 chunk length if this is the last chunk
+    Returns a -1 if the chunk failed its checksum, the chunking can't continue
   */
   int cc_FileHostingSession_yieldChunk (struct FileHostingSession* _session, unsigned char* cffiResult) {
     std::cout << "cc_FileHostingSession_yieldChunk" << std::endl;
 
     auto session = reinterpret_cast<FileHostingSession*>(_session);
-    session->cursor->nextChunk(cffiResult);
+    try {
+      session->cursor->nextChunk(cffiResult);
+    }
+    catch (const Middleware::FileStorage::CorruptBlockError& e) {
+      std::cout << "cc_FileHostingSession_yieldChunk " << e.what() << std::endl;
+      return -1;
+    }
 
     std::cout << "cc_FileHostingSession_yieldChunk finished | forwardsAmount: " << session->cursor->forwardsAmount << std::endl;
     if (session->cursor->isLastChunk) {
@@ -2,6 +2,7 @@
 #include <tuple>
 
 #include "middlewares/file.hpp"
+#include "middlewares/FileStorage/asyncstorage.hpp"
 #include "services.hpp"
 namespace TinyCDN {
 using namespace Middleware::File;
@@ -35,27 +36,31 @@ std::future<std::tuple<std::optional<std::unique_ptr<FileBucket>>, std::optional
 }
 
 std::future<std::tuple<std::optional<std::unique_ptr<FileStorage::StoredFile>>, bool>> FileHostingService::obtainStoredFile(std::unique_ptr<FileBucket>& bucket, Storage::fileId cId, std::string fileName) {
-  // TODO actually make this async
-  std::promise<std::tuple<std::optional<std::unique_ptr<FileStorage::StoredFile>>, bool>> test;
-
-  std::optional<std::unique_ptr<FileStorage::StoredFile>> maybeFile;
-  auto exists = false;
-
   // TODO ask master to contact storage cluster
-  auto storedFile = bucket->storage->lookup(cId);
+  auto storedFile = FileStorage::AsyncFileStorage(*bucket->storage).lookup(cId);
 
-  exists = true;
+  // The lookup carries on in the background, this only waits for it once the file is asked for
+  return std::async(std::launch::deferred, [storedFile = std::move(storedFile), fileName = std::move(fileName)]() mutable {
+    std::optional<std::unique_ptr<FileStorage::StoredFile>> maybeFile;
+    auto file = storedFile.get();
+    auto const exists = file != nullptr;
 
-  if (storedFile->location.filename() == fileName) {
-    maybeFile = std::move(storedFile);
-  }
+    if (exists && file->filename() == fileName) {
+      maybeFile = std::move(file);
+    }
 
-  test.set_value(std::make_tuple(std::move(maybeFile), exists));
-  return test.get_future();
+    return std::make_tuple(std::move(maybeFile), exists);
+  });
 }
 
 int FileHostingService::hostFile(std::ifstream& stream, std::unique_ptr<FileStorage::StoredFile> file, std::unique_ptr<FileBucket> bucket, std::shared_ptr<FileBucketRegistryItem>& item) {
   // TODO safely obtain a lock to the file from the bucket?
+  if (verifyIntegrity && !file->verify()) {
+    std::cout << "FileHostingService::hostFile digest mismatch: " << file->location << std::endl;
+    item->fileBucket = std::move(bucket);
+    return -1;
+  }
+
   stream = file->getStream<std::ifstream>();
   auto const fbId = bucket->id;
 
@@ -64,5 +69,23 @@ int FileHostingService::hostFile(std::ifstream& stream, std::unique_ptr<FileStor
   return fbId;
 }
 
+std::shared_ptr<const Utility::ChunkSource> FileHostingService::hostFile(std::unique_ptr<FileStorage::StoredFile> file, std::unique_ptr<FileBucket> bucket, std::shared_ptr<FileBucketRegistryItem>& item) {
+  item->fileBucket = std::move(bucket);
+
+  if (verifyIntegrity && !file->verify()) {
+    std::cout << "FileHostingService::hostFile digest mismatch: " << file->location << std::endl;
+    return nullptr;
+  }
+
+  // Backends that check the contents while they're read hand them out themselves
+  if (file->contents) return file->contents;
+
+  // Every session hosting this file shares one mapping, which chunks are read straight out of
+  if (auto const mapped = file->map(Utility::FileMapping::Access::Sequential)) return mapped->source;
+
+  // Every session hosting this file shares one descriptor
+  return Utility::FileHandle::open(file->location);
+}
+
 
 }
@@ -37,6 +37,9 @@ public:
 
 class FileHostingService {
 public:
+  //! Re-hash every file against its stored digest before hosting it. Costs a full read of the file per request.
+  bool verifyIntegrity = false;
+
   // Tries to obtain a FileBucket given an id
   std::future<std::optional<std::unique_ptr<FileBucket>>> obtainFileBucket(FileBucketId fbId);
 
@@ -45,7 +48,12 @@ public:
   std::future<std::tuple<std::optional<std::unique_ptr<FileStorage::StoredFile>>, bool>> obtainnStoredFile(std::unique_ptr<FileBucket>& bucket, Storage::fileId cId, std::string fileName);
 
   //! Safely obtains a stream to the files contents and destroys the StoredFile instance, readds the bucket to the registry, returns the bucket id
+  //! Returns -1 without opening a stream when verifyIntegrity is set and the contents don't match the stored digest
   int hostFile(std::ifstream& stream, std::unique_ptr<FileStorage::StoredFile> file, std::unique_ptr<FileBucket> bucket);
+
+  //! Like hostFile, but returns a shared mapping (or pread source) of the contents for a ChunkedCursor instead of opening a stream
+  //! Returns the file's own contents source if it has one, and nullptr if the file can't be opened or fails verification
+  std::shared_ptr<const Utility::ChunkSource> hostFile(std::unique_ptr<FileStorage::StoredFile> file, std::unique_ptr<FileBucket> bucket, std::shared_ptr<FileBucketRegistryItem>& item);
 };
 
 #else
@@ -0,0 +1,102 @@
+#include "asyncstorage.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+
+namespace TinyCDN::Middleware::FileStorage {
+
+AsyncFileStorage::AsyncFileStorage(FileStorage& storage, Utility::IOExecutor& executor, Utility::IOQueue& queue)
+  : storage(storage), executor(executor), queue(queue) {}
+
+namespace {
+//! Releases the lock a backend took for a file, which has to be done on the thread that took it
+void unlock(StoredFile& file)
+{
+  file.lock = std::unique_ptr<std::shared_lock<std::shared_mutex>>{};
+}
+}
+
+std::future<std::unique_ptr<StoredFile>> AsyncFileStorage::lookup(fileId id)
+{
+  return executor.submit([&storage = storage, id] {
+    auto file = storage.lookup(id);
+    if (file) unlock(*file);
+    return file;
+  });
+}
+
+std::future<std::unique_ptr<StoredFile>> AsyncFileStorage::add(std::unique_ptr<StoredFile> file)
+{
+  return executor.submit([&storage = storage, file = std::move(file)]() mutable { return storage.add(std::move(file)); });
+}
+
+std::future<std::vector<std::unique_ptr<StoredFile>>> AsyncFileStorage::addBatch(std::vector<std::unique_ptr<StoredFile>> files)
+{
+  return executor.submit([&storage = storage, files = std::move(files)]() mutable { return storage.addBatch(std::move(files)); });
+}
+
+std::future<void> AsyncFileStorage::remove(std::unique_ptr<StoredFile> file)
+{
+  // The file is let go of on the executor, so a lock from looking it up on this thread is released here
+  if (file) unlock(*file);
+  return executor.submit([&storage = storage, file = std::move(file)]() mutable { storage.remove(std::move(file)); });
+}
+
+void AsyncFileStorage::read(const StoredFile& file, void* buffer, std::size_t length, std::uintmax_t offset,
+                            Utility::IOQueue::Completion done)
+{
+  if (file.contents) {
+    executor.submit([contents = file.contents, buffer, length, offset, done = std::move(done)] {
+      std::int64_t result;
+      try {
+        result = static_cast<std::int64_t>(contents->readAt(static_cast<unsigned char*>(buffer), length, offset));
+      }
+      catch (const CorruptBlockError&) {
+        result = -EIO;
+      }
+      done(result);
+    });
+    return;
+  }
+
+  // The contents are the whole file, or the range of it the backend gave as the file's position
+  std::uintmax_t begin = 0;
+  if (file.position.has_value()) {
+    begin = file.position->first;
+    if (offset >= file.position->second) {
+      done(0);
+      return;
+    }
+    length = static_cast<std::size_t>(std::min<std::uintmax_t>(length, file.position->second - offset));
+  }
+
+  errno = 0;
+  auto handle = Utility::FileHandle::open(file.location.string());
+  if (!handle) {
+    done(errno != 0 ? -errno : -ENOENT);
+    return;
+  }
+
+  auto const fd = handle->descriptor();
+  // The handle keeps the descriptor open until the read completes
+  queue.read(fd, buffer, length, begin + offset, [handle = std::move(handle), done = std::move(done)](std::int64_t result) {
+    done(result);
+  });
+}
+
+std::future<std::size_t> AsyncFileStorage::read(const StoredFile& file, void* buffer, std::size_t length, std::uintmax_t offset)
+{
+  // Completion has to be copyable, a promise isn't
+  auto promise = std::make_shared<std::promise<std::size_t>>();
+  auto future = promise->get_future();
+  read(file, buffer, length, offset, [promise](std::int64_t result) {
+    if (result < 0) {
+      promise->set_exception(std::make_exception_ptr(std::system_error(static_cast<int>(-result), std::generic_category())));
+      return;
+    }
+    promise->set_value(static_cast<std::size_t>(result));
+  });
+  return future;
+}
+}
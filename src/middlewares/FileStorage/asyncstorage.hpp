@@ -0,0 +1,52 @@
+#pragma once
+
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "../../executor.hpp"
+#include "../../ioqueue.hpp"
+#include "storage.hpp"
+#include "storedfile.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+/*!
+ * \brief Runs a FileStorage's operations without the caller waiting on them
+ * Adds, lookups and removes go to an IOExecutor, since they're a mix of system calls no queue takes on their own.
+ * Reading a file's contents goes to an IOQueue, io_uring where the kernel has it, so a storage node can have reads
+ * outstanding on every volume it serves without a thread for each. Contents a backend checks while they're read
+ * (i.e. a Haystack needle's checksummed blocks) are read on the IOExecutor instead.
+ * Operations only hold on to the storage, the executor and the queue, which have to outlive them, not to this.
+ * The lock a backend holds for a looked up file (i.e. FilesystemStorage's, which keeps its old name from being removed
+ * by a migration) can only be released by the thread that took it, so files looked up here come without one. Such a
+ * file can be moved or removed while it's read, which completes the read with -ENOENT, and is looked up again then.
+ */
+class AsyncFileStorage {
+public:
+  std::future<std::unique_ptr<StoredFile>> lookup(fileId id);
+  std::future<std::unique_ptr<StoredFile>> add(std::unique_ptr<StoredFile> file);
+  std::future<std::vector<std::unique_ptr<StoredFile>>> addBatch(std::vector<std::unique_ptr<StoredFile>> files);
+  std::future<void> remove(std::unique_ptr<StoredFile> file);
+
+  /*!
+   * \brief Reads up to length bytes of a looked up file's contents, from offset within them
+   * done is called with how many bytes were read, 0 past the end, or -errno. Contents that don't match their
+   * checksum complete with -EIO. The file and buffer have to stay around until then.
+   */
+  void read(const StoredFile& file, void* buffer, std::size_t length, std::uintmax_t offset, Utility::IOQueue::Completion done);
+  //! read() with how many bytes were read in a future, which holds a std::system_error if the read failed
+  std::future<std::size_t> read(const StoredFile& file, void* buffer, std::size_t length, std::uintmax_t offset);
+
+  inline FileStorage& backend() noexcept { return storage; }
+
+  explicit AsyncFileStorage(FileStorage& storage,
+                            Utility::IOExecutor& executor = Utility::IOExecutor::shared(),
+                            Utility::IOQueue& queue = Utility::IOQueue::shared());
+
+private:
+  FileStorage& storage;
+  Utility::IOExecutor& executor;
+  Utility::IOQueue& queue;
+};
+}
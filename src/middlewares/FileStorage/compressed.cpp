@@ -0,0 +1,122 @@
+#include "compressed.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <unordered_map>
+
+namespace TinyCDN::Middleware::FileStorage {
+
+namespace {
+std::string lowercase(std::string_view text) {
+  std::string lowered(text);
+  std::transform(lowered.begin(), lowered.end(), lowered.begin(), [](unsigned char c) { return std::tolower(c); });
+  return lowered;
+}
+
+//! The type and subtype alone, without parameters like charset, lowercase
+std::string essenceOf(std::string_view contentType) {
+  auto const parameters = contentType.find(';');
+  if (parameters != std::string_view::npos) contentType = contentType.substr(0, parameters);
+  while (!contentType.empty() && std::isspace(static_cast<unsigned char>(contentType.back()))) contentType.remove_suffix(1);
+  while (!contentType.empty() && std::isspace(static_cast<unsigned char>(contentType.front()))) contentType.remove_prefix(1);
+  return lowercase(contentType);
+}
+}
+
+const std::vector<std::string> CompressionPolicy::textContentTypes = {
+  "text",
+  "application/json",
+  "application/javascript",
+  "application/xml",
+  "application/wasm",
+  "image/svg+xml"
+};
+
+bool CompressionPolicy::covers(std::string_view contentType) const {
+  auto const essence = essenceOf(contentType);
+  if (essence.empty()) return false;
+
+  for (auto const& type : contentTypes) {
+    auto const covered = essenceOf(type);
+    if (covered == essence) return true;
+    if (covered.find('/') == std::string::npos && essence.size() > covered.size()
+        && essence.compare(0, covered.size(), covered) == 0 && essence[covered.size()] == '/') return true;
+  }
+  return false;
+}
+
+void CompressionPolicy::enable(const std::vector<std::string>& types) {
+  for (auto const& type : types) {
+    if (!covers(type)) contentTypes.push_back(type);
+  }
+}
+
+std::string CompressionPolicy::contentTypeOf(const fs::path& filename) {
+  static const std::unordered_map<std::string, std::string> types = {
+    {".html", "text/html"},
+    {".htm", "text/html"},
+    {".css", "text/css"},
+    {".csv", "text/csv"},
+    {".txt", "text/plain"},
+    {".md", "text/markdown"},
+    {".js", "application/javascript"},
+    {".mjs", "application/javascript"},
+    {".json", "application/json"},
+    {".map", "application/json"},
+    {".xml", "application/xml"},
+    {".wasm", "application/wasm"},
+    {".svg", "image/svg+xml"},
+    {".png", "image/png"},
+    {".jpg", "image/jpeg"},
+    {".jpeg", "image/jpeg"},
+    {".gif", "image/gif"},
+    {".webp", "image/webp"},
+    {".ico", "image/x-icon"},
+    {".mp4", "video/mp4"},
+    {".webm", "video/webm"},
+    {".mp3", "audio/mpeg"},
+    {".woff", "font/woff"},
+    {".woff2", "font/woff2"},
+    {".zip", "application/zip"},
+    {".gz", "application/gzip"}
+  };
+
+  auto const found = types.find(lowercase(filename.extension().string()));
+  return found == types.end() ? "application/octet-stream" : found->second;
+}
+
+double CompressionPolicy::entropyOf(const Utility::ChunkSource& source, std::uint64_t size) {
+  constexpr std::size_t samples = 16;
+  constexpr std::size_t sampleSize = 4_kB;
+
+  std::array<std::uint64_t, 256> counts{};
+  std::vector<unsigned char> sample(sampleSize);
+  std::uint64_t total = 0;
+
+  // Small files are read whole, larger ones at evenly spread offsets
+  auto const stride = size <= samples * sampleSize ? sampleSize : (size - sampleSize) / (samples - 1);
+  for (std::uint64_t offset = 0; offset < size && total < samples * sampleSize; offset += stride) {
+    std::size_t read;
+    try {
+      read = source.readAt(sample.data(), sampleSize, offset);
+    }
+    catch (const std::exception&) {
+      break;
+    }
+    if (read == 0) break;
+    for (std::size_t i = 0; i < read; i++) counts[sample[i]]++;
+    total += read;
+  }
+  if (total == 0) return 0.0;
+
+  double entropy = 0.0;
+  for (auto const count : counts) {
+    if (count == 0) continue;
+    auto const p = static_cast<double>(count) / static_cast<double>(total);
+    entropy -= p * std::log2(p);
+  }
+  return entropy;
+}
+}
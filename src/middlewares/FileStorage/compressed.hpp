@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "seekablezstd.hpp"
+#include "storage.hpp"
+#include "storedfile.hpp"
+
+using TinyCDN::Utility::operator""_kB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+//! Which files a CompressedStorage compresses, and how
+struct CompressionPolicy {
+  //! Content types that compress well, what's compressed unless a storage is told otherwise
+  static const std::vector<std::string> textContentTypes;
+
+  //! A type matches itself, and one without a subtype matches every type under it, i.e. "text" matches "text/css"
+  std::vector<std::string> contentTypes = textContentTypes;
+  int level = 3;
+  //! Contents bytes per zstd frame, the most a range read decompresses that it doesn't need
+  std::uint32_t blockSize = 64_kB;
+  //! Files smaller than this aren't worth the header and seek table
+  std::uint64_t smallestCompressed = 512;
+  //! Files with more bits of information per byte than this in their samples, like compressed media, are stored as they are
+  double largestEntropy = 7.5;
+  //! Compressing has to save at least this much of a file's size, or it's stored as it is
+  double leastSaving = 0.1;
+
+  bool covers(std::string_view contentType) const;
+  //! Adds the content types, i.e. a FileBucket's types, to those compressed
+  void enable(const std::vector<std::string>& types);
+
+  //! The content type of a file named filename, for uploads that don't say. "application/octet-stream" if unknown
+  static std::string contentTypeOf(const fs::path& filename);
+  //! Shannon entropy of samples spread over size bytes of source, in bits per byte: 8 is random, text is around 4 to 5
+  static double entropyOf(const Utility::ChunkSource& source, std::uint64_t size);
+};
+
+struct CompressionStats {
+  //! Files stored compressed
+  std::uint64_t compressed = 0;
+  //! Files stored as they are because of their content type or size
+  std::uint64_t skipped = 0;
+  //! Files of a compressed content type stored as they are because their samples or compressing them said it wasn't worth it
+  std::uint64_t incompressible = 0;
+  //! The sizes of all files added, as uploaded
+  std::uint64_t uploadedBytes = 0;
+  //! The sizes of all files added, as handed to the backend
+  std::uint64_t storedBytes = 0;
+
+  //! How many bytes of uploads there are for every byte stored
+  inline double ratio() const noexcept {
+    return storedBytes == 0 ? 1.0 : static_cast<double>(uploadedBytes) / static_cast<double>(storedBytes);
+  }
+};
+
+#ifdef TINYCDN_HAVE_ZSTD
+/*!
+ * \brief Compresses files of the content types a policy names before the backend stores them
+ * Files are compressed in blocks, a zstd frame per block, with a seek table at the end (see SeekableZstdHeader), so a
+ * looked up file reads decompressed through its contents, and a range read only decompresses the blocks it touches.
+ * The backend stores and sees only what it's handed: ids, sizes and the space allocated are all its own, while a
+ * looked up file has the size and digest it was uploaded with.
+ * An upload is stored as it is if its content type isn't covered, if it's tiny, if samples of it look compressed
+ * already, or if compressing it doesn't save enough. An upload that happens to start like a compressed file is always
+ * compressed, so a file stored as it is is never read as one that wasn't.
+ */
+template <typename Backend>
+class CompressedStorage : public FileStorage {
+public:
+  inline void allocate() {
+    backend->allocate();
+  }
+
+  inline void destroy() {
+    backend->destroy();
+  }
+
+  inline std::unique_ptr<StoredFile> lookup(fileId id) {
+    return decompressed(backend->lookup(id));
+  }
+
+  std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file) {
+    std::vector<std::unique_ptr<StoredFile>> files;
+    files.push_back(std::move(file));
+    return std::move(addBatch(std::move(files)).front());
+  }
+
+  std::vector<std::unique_ptr<StoredFile>> addBatch(std::vector<std::unique_ptr<StoredFile>> files) {
+    std::vector<fs::path> uploads;
+    for (auto& file : files) {
+      auto const upload = file->location;
+      file = compressed(std::move(file));
+      // Compressed copies are the backend's to take, the uploads they were made from are ours to remove
+      uploads.push_back(file->location == upload ? fs::path{} : upload);
+    }
+
+    std::vector<fs::path> copies;
+    for (auto const& file : files) copies.push_back(file->location);
+
+    auto stored = backend->addBatch(std::move(files));
+    syncAllocatedSize();
+
+    for (std::size_t i = 0; i < stored.size(); i++) {
+      if (uploads[i].empty()) continue;
+      std::error_code error;
+      // A failed add leaves the upload for the caller, as the backend would have
+      fs::remove(stored[i] ? uploads[i] : copies[i], error);
+    }
+    for (auto& file : stored) file = decompressed(std::move(file));
+    return stored;
+  }
+
+  void remove(std::unique_ptr<StoredFile> file) {
+    if (!file->id.has_value()) return;
+    auto const id = file->id.value();
+    // It may read through our contents, the backend removes its own
+    file.reset();
+
+    auto stored = backend->lookup(id);
+    if (stored) backend->remove(std::move(stored));
+    syncAllocatedSize();
+  }
+
+  inline CompressionPolicy policy() const {
+    std::shared_lock<std::shared_mutex> lock(policyMutex);
+    return currentPolicy;
+  }
+
+  //! Applies to files added from now on, those stored already are read back however they were stored
+  inline void setPolicy(CompressionPolicy policy) {
+    std::unique_lock<std::shared_mutex> lock(policyMutex);
+    currentPolicy = std::move(policy);
+  }
+
+  inline CompressionStats stats() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return counters;
+  }
+
+  inline Backend& uncompressed() noexcept { return *backend; }
+
+  CompressedStorage(Size size, fs::path location, bool preallocated, CompressionPolicy policy = CompressionPolicy{})
+    : FileStorage(size, location, preallocated),
+      backend(std::make_unique<Backend>(size, location, preallocated)),
+      currentPolicy(std::move(policy)) {
+    syncAllocatedSize();
+  }
+
+private:
+  std::unique_ptr<Backend> backend;
+
+  mutable std::shared_mutex policyMutex;
+  CompressionPolicy currentPolicy;
+
+  mutable std::mutex statsMutex;
+  CompressionStats counters;
+
+  std::mutex sizeMutex;
+
+  //! Ids are the backend's
+  inline fileId getUniqueFileId() { return 0; }
+
+  //! Space is only ever allocated by the backend
+  inline void syncAllocatedSize() {
+    std::lock_guard<std::mutex> lock(sizeMutex);
+    allocatedSize = std::make_unique<Size>(backend->getAllocatedSize());
+  }
+
+  inline void count(std::uint64_t CompressionStats::* outcome, std::uint64_t uploaded, std::uint64_t stored) {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    counters.*outcome += 1;
+    counters.uploadedBytes += uploaded;
+    counters.storedBytes += stored;
+  }
+
+  //! The upload compressed into a copy next to it, or the upload itself if it's better stored as it is
+  std::unique_ptr<StoredFile> compressed(std::unique_ptr<StoredFile> file) {
+    auto const upload = Utility::FileHandle::open(file->location.string());
+    // Left for the backend to fail
+    if (!upload) return file;
+
+    auto const policy = this->policy();
+    auto const size = static_cast<std::uint64_t>(upload->size());
+    auto const contentType = file->contentType.value_or(CompressionPolicy::contentTypeOf(file->filename()));
+    auto const ambiguous = SeekableZstd::headerOf(*upload, 0).has_value();
+
+    if (!ambiguous && (!policy.covers(contentType) || size < policy.smallestCompressed)) {
+      count(&CompressionStats::skipped, size, size);
+      return file;
+    }
+    if (!ambiguous && CompressionPolicy::entropyOf(*upload, size) > policy.largestEntropy) {
+      count(&CompressionStats::incompressible, size, size);
+      return file;
+    }
+
+    auto const copy = file->location.parent_path() / ("." + file->location.filename().string() + ".zst");
+    auto const written = SeekableZstd::compress(*upload, size, copy, policy.blockSize, policy.level);
+    auto const worthIt = written.has_value()
+      && (ambiguous || written->compressedSize <= static_cast<double>(size) * (1.0 - policy.leastSaving));
+    if (!worthIt) {
+      std::error_code error;
+      fs::remove(copy, error);
+      count(&CompressionStats::incompressible, size, size);
+      return file;
+    }
+    count(&CompressionStats::compressed, size, written->compressedSize);
+
+    auto compressedFile = std::make_unique<StoredFile>(Size{written->compressedSize}, copy, true,
+                                                       std::unique_ptr<std::unique_lock<std::shared_mutex>>{});
+    compressedFile->lock = std::move(file->lock);
+    compressedFile->name = file->filename().string();
+    compressedFile->contentType = contentType;
+    return compressedFile;
+  }
+
+  //! The stored file reading decompressed if the backend stored it compressed, otherwise as it is
+  std::unique_ptr<StoredFile> decompressed(std::unique_ptr<StoredFile> file) const {
+    if (!file) return file;
+
+    auto source = file->contents;
+    std::uintmax_t offset = 0;
+    if (!source) {
+      source = Utility::FileHandle::open(file->location.string());
+      if (file->position.has_value()) offset = file->position->first;
+    }
+    if (!source) return file;
+
+    auto const header = SeekableZstd::headerOf(*source, offset);
+    if (!header.has_value()) return file;
+
+    auto const storedSize = file->position.has_value() ? file->position->second : file->size;
+    auto contents = std::make_shared<SeekableZstdSource>(std::move(source), offset, storedSize, header.value());
+
+    auto opened = std::make_unique<StoredFile>(Size{header->size}, file->location, file->temporary,
+                                               std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+    opened->lock = std::move(file->lock);
+    opened->id = file->id;
+    opened->name = file->filename().string();
+    opened->contentType = file->contentType;
+    opened->contents = std::move(contents);
+    opened->digest = Utility::Hashing::Digest{header->digest};
+    return opened;
+  }
+};
+
+template <typename Storage>
+constexpr bool isCompressedStorage = false;
+
+template <typename Backend>
+constexpr bool isCompressedStorage<CompressedStorage<Backend>> = true;
+#endif
+}
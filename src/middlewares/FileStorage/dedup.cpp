@@ -0,0 +1,605 @@
+#include "dedup.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../crc32c.hpp"
+
+using TinyCDN::Utility::operator""_mB;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+const fs::path DedupStorage::chunksFileName = fs::path{"chunks"};
+const fs::path DedupStorage::recipesFileName = fs::path{"recipes"};
+
+namespace {
+std::uint32_t checksumOf(DedupRecord record, std::string_view rest) {
+  record.checksum = 0;
+  auto const crc = Utility::Hashing::Crc32c::of(&record, sizeof(record));
+  return Utility::Hashing::Crc32c::extend(crc, rest.data(), rest.size());
+}
+
+void encode(std::string& buffer, DedupRecord record, const std::string& name, const std::vector<DedupChunkRef>& refs) {
+  std::string rest(name);
+  rest.append(reinterpret_cast<const char*>(refs.data()), refs.size() * sizeof(DedupChunkRef));
+
+  record.nameLength = static_cast<std::uint32_t>(name.size());
+  record.chunkCount = static_cast<std::uint32_t>(refs.size());
+  record.checksum = checksumOf(record, rest);
+
+  buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  buffer.append(rest);
+}
+
+inline Utility::Hashing::Digest fingerprintOf(const DedupChunkRef& ref) {
+  Utility::Hashing::Digest fingerprint;
+  fingerprint.bytes = ref.fingerprint;
+  return fingerprint;
+}
+}
+
+//! Reads a file's contents chunk by chunk from the chunks file, through its recipe
+class DedupStorage::Contents : public Utility::ChunkSource {
+public:
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override {
+    if (offset >= size) return 0;
+
+    auto const& starts = recipe->starts;
+    auto i = static_cast<std::size_t>(std::upper_bound(starts.begin(), starts.end(), offset) - starts.begin()) - 1;
+
+    std::size_t done = 0;
+    for (; done < length && i < recipe->chunks.size(); i++) {
+      auto const& chunk = recipe->chunks[i];
+      auto const within = offset + done - starts[i];
+      auto const amount = static_cast<std::size_t>(std::min<std::uintmax_t>(length - done, chunk.length - within));
+      auto const read = chunksFile->readAt(buffer + done, amount, chunk.offset + within);
+      done += read;
+      if (read != amount) break;
+    }
+    return done;
+  }
+
+  Contents(std::shared_ptr<const Recipe> recipe, std::shared_ptr<const Utility::FileHandle> chunksFile, std::uint64_t size)
+    : recipe(std::move(recipe)), chunksFile(std::move(chunksFile)), size(size) {}
+
+private:
+  const std::shared_ptr<const Recipe> recipe;
+  const std::shared_ptr<const Utility::FileHandle> chunksFile;
+  const std::uint64_t size;
+};
+
+DedupStorage::DedupStorage(Size size, fs::path location, bool preallocated, Utility::Hashing::FastCdc chunker)
+  : FileStorage(size, location, preallocated), chunker(chunker) {
+  fileUniqueId = 0;
+  allocatedSize = std::make_unique<Size>(0);
+
+  if (!preallocated) allocate();
+  else {
+    resolveCompaction();
+    if (open(false)) load();
+  }
+}
+
+void DedupStorage::allocate()
+{
+  fs::create_directories(this->location);
+  open(true);
+}
+
+void DedupStorage::destroy()
+{
+  std::lock_guard<std::mutex> writeLock(writeMutex);
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  chunks = {};
+  files = {};
+  logicalBytes = 0;
+  // Files looked up before keep their handle, and can still be read
+  chunksFile.reset();
+  recipesFile.reset();
+  fs::remove_all(this->location);
+}
+
+fileId DedupStorage::getUniqueFileId()
+{
+  return ++fileUniqueId;
+}
+
+void DedupStorage::resolveCompaction()
+{
+  auto const compactingChunks = compactingPath(chunksPath());
+  auto const compactingRecipes = compactingPath(recipesPath());
+  std::error_code error;
+
+  // The new chunks file is renamed over the old one only once the new recipes file is complete on disk
+  if (fs::exists(compactingRecipes, error) && !fs::exists(compactingChunks, error)) {
+    std::cout << "DedupStorage::open finishing an interrupted compaction of " << this->location << std::endl;
+    if (::rename(compactingRecipes.c_str(), recipesPath().c_str()) == 0) Utility::syncDirectory(this->location.string());
+    return;
+  }
+  fs::remove(compactingChunks, error);
+  fs::remove(compactingRecipes, error);
+}
+
+bool DedupStorage::open(bool truncating)
+{
+  auto const flags = O_RDWR | O_CREAT | O_CLOEXEC | (truncating ? O_TRUNC : 0);
+  auto const chunksFd = ::open(chunksPath().c_str(), flags, 0644);
+  auto const recipesFd = ::open(recipesPath().c_str(), flags, 0644);
+  if (chunksFd >= 0) chunksFile = std::make_shared<Utility::FileHandle>(chunksFd);
+  if (recipesFd >= 0) recipesFile = std::make_unique<Utility::FileHandle>(recipesFd);
+
+  if (!chunksFile || !recipesFile) {
+    std::cout << "DedupStorage::open couldn't open " << this->location << std::endl;
+    chunksFile.reset();
+    recipesFile.reset();
+    return false;
+  }
+  return true;
+}
+
+void DedupStorage::load()
+{
+  // Recipes are 48 bytes for every chunk of 8kB or so, and they're all kept in memory anyway
+  std::string buffer(recipesFile->size(), '\0');
+  buffer.resize(recipesFile->readAt(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size(), 0));
+
+  fileId lastId = 0;
+  std::size_t offset = 0;
+  while (buffer.size() - offset >= sizeof(DedupRecord)) {
+    DedupRecord record;
+    std::memcpy(&record, buffer.data() + offset, sizeof(record));
+    auto const length = sizeof(record) + std::uint64_t{record.nameLength} + std::uint64_t{record.chunkCount} * sizeof(DedupChunkRef);
+    if (buffer.size() - offset < length) break;
+
+    std::string_view const rest(buffer.data() + offset + sizeof(record), length - sizeof(record));
+    if (checksumOf(record, rest) != record.checksum) break;
+    if (record.type != DedupRecord::Add && record.type != DedupRecord::Remove) break;
+
+    auto const id = static_cast<fileId>(record.id);
+    lastId = std::max(lastId, id);
+
+    if (record.type == DedupRecord::Remove) {
+      dereference(id);
+    }
+    else {
+      auto recipe = std::make_shared<Recipe>();
+      recipe->chunks.resize(record.chunkCount);
+      std::memcpy(recipe->chunks.data(), rest.data() + record.nameLength, record.chunkCount * sizeof(DedupChunkRef));
+      std::uint64_t start = 0;
+      for (auto const& chunk : recipe->chunks) {
+        recipe->starts.push_back(start);
+        start += chunk.length;
+      }
+
+      Utility::Hashing::Digest digest;
+      digest.bytes = record.digest;
+      reference(id, Entry{record.size, std::string(rest.substr(0, record.nameLength)), digest, std::move(recipe)});
+      chunksEnd = std::max(chunksEnd, record.chunksEnd);
+    }
+    offset += length;
+  }
+
+  if (offset < buffer.size()) {
+    std::cout << "DedupStorage::load dropping a torn record at " << offset << " of " << recipesPath() << std::endl;
+    ::ftruncate(recipesFile->descriptor(), static_cast<off_t>(offset));
+  }
+  recipesEnd = offset;
+
+  // Chunks of an add that was never logged
+  if (chunksFile->size() > chunksEnd) {
+    std::cout << "DedupStorage::load dropping " << chunksFile->size() - chunksEnd << " bytes of unlogged chunks" << std::endl;
+    ::ftruncate(chunksFile->descriptor(), static_cast<off_t>(chunksEnd));
+  }
+
+  fileUniqueId = lastId;
+  allocatedSize = std::make_unique<Size>(chunksEnd);
+}
+
+void DedupStorage::reference(fileId id, Entry entry)
+{
+  for (auto const& ref : entry.recipe->chunks) {
+    auto const [chunk, added] = chunks.try_emplace(fingerprintOf(ref), Chunk{ref.offset, ref.length, 0});
+    chunk->second.references++;
+  }
+  logicalBytes += entry.size;
+  files.try_emplace(id, std::move(entry));
+}
+
+void DedupStorage::dereference(fileId id)
+{
+  auto const it = files.find(id);
+  if (it == files.end()) return;
+
+  for (auto const& ref : it->second.recipe->chunks) {
+    auto const chunk = chunks.find(fingerprintOf(ref));
+    if (chunk != chunks.end() && chunk->second.references > 0) chunk->second.references--;
+  }
+  logicalBytes -= it->second.size;
+  files.erase(id);
+}
+
+std::optional<DedupStorage::Cut> DedupStorage::cut(std::unique_ptr<StoredFile> file) const
+{
+  auto const upload = Utility::FileHandle::open(file->location.string());
+  if (!upload) return {};
+
+  Cut cut{std::move(file), {}, 0, std::make_shared<Recipe>()};
+  Utility::Hashing::Sha256 sha;
+
+  // There's always a whole chunk's worth in the buffer, so every cut is where the contents put it
+  std::vector<unsigned char> buffer(std::max<std::size_t>(4_mB, 2 * chunker.maxSize()));
+  std::uint64_t bufferAt = 0;
+  std::size_t begin = 0;
+  std::size_t filled = 0;
+  bool ended = false;
+
+  for (;;) {
+    if (!ended && filled - begin < chunker.maxSize()) {
+      std::memmove(buffer.data(), buffer.data() + begin, filled - begin);
+      bufferAt += begin;
+      filled -= begin;
+      begin = 0;
+
+      while (filled < buffer.size()) {
+        auto const read = upload->readAt(buffer.data() + filled, buffer.size() - filled, bufferAt + filled);
+        if (read == 0) {
+          ended = true;
+          break;
+        }
+        filled += read;
+      }
+    }
+    if (begin == filled) break;
+
+    auto const length = chunker.cut(buffer.data() + begin, filled - begin);
+    DedupChunkRef ref;
+    ref.fingerprint = Utility::Hashing::Sha256::of(buffer.data() + begin, length).bytes;
+    ref.length = static_cast<std::uint32_t>(length);
+    sha.update(buffer.data() + begin, length);
+
+    cut.recipe->chunks.push_back(ref);
+    cut.recipe->starts.push_back(bufferAt + begin);
+    begin += length;
+  }
+
+  cut.size = bufferAt + filled;
+  cut.digest = sha.finish();
+  return cut;
+}
+
+std::vector<std::unique_ptr<StoredFile>> DedupStorage::store(std::vector<Cut> cuts)
+{
+  std::vector<std::unique_ptr<StoredFile>> stored(cuts.size());
+
+  std::lock_guard<std::mutex> writeLock(writeMutex);
+  if (!chunksFile || !recipesFile) return stored;
+
+  // New chunks are gathered here and written in large appends
+  std::vector<unsigned char> pending;
+  auto const flushAt = 8_mB;
+  auto end = chunksEnd;
+  bool written = true;
+
+  // New in this batch, so the same chunk in two of its files is only stored once
+  Utility::Hashing::IdMap<Utility::Hashing::Digest, std::uint64_t, FingerprintHasher> added;
+  std::vector<bool> accepted(cuts.size(), false);
+  std::vector<fileId> ids(cuts.size(), 0);
+
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+
+    for (std::size_t n = 0; n < cuts.size() && written; n++) {
+      auto& cut = cuts[n];
+      auto const upload = Utility::FileHandle::open(cut.file->location.string());
+      if (!upload) continue;
+
+      // Taken back if the file doesn't make it, which leaves what's before it as it was
+      auto const pendingBefore = pending.size();
+      auto const endBefore = end;
+      std::vector<Utility::Hashing::Digest> addedHere;
+      bool complete = true;
+
+      for (std::size_t i = 0; i < cut.recipe->chunks.size(); i++) {
+        auto& ref = cut.recipe->chunks[i];
+        auto const fingerprint = fingerprintOf(ref);
+
+        auto const existing = chunks.find(fingerprint);
+        if (existing != chunks.end()) {
+          ref.offset = existing->second.offset;
+          continue;
+        }
+        auto const [it, isNew] = added.try_emplace(fingerprint, end);
+        ref.offset = it->second;
+        if (!isNew) continue;
+        addedHere.push_back(fingerprint);
+
+        // The upload is read again, and has to be what was fingerprinted, or the chunk would be stored under another's name
+        auto const at = pending.size();
+        pending.resize(at + ref.length);
+        if (upload->readAt(pending.data() + at, ref.length, cut.recipe->starts[i]) != ref.length
+            || Utility::Hashing::Sha256::of(pending.data() + at, ref.length) != fingerprint) {
+          complete = false;
+          break;
+        }
+        end += ref.length;
+      }
+
+      if (!complete || end > static_cast<std::uint64_t>(size)) {
+        std::cout << "DedupStorage::add " << cut.file->location << (complete ? " doesn't fit" : " changed while it was added") << std::endl;
+        for (auto const& fingerprint : addedHere) added.erase(fingerprint);
+        pending.resize(pendingBefore);
+        end = endBefore;
+        continue;
+      }
+      accepted[n] = true;
+
+      if (pending.size() >= flushAt) {
+        written = chunksFile->writeAt(pending.data(), pending.size(), end - pending.size());
+        pending.clear();
+      }
+    }
+  }
+
+  if (written && !pending.empty()) written = chunksFile->writeAt(pending.data(), pending.size(), end - pending.size());
+  if (written && end > chunksEnd) written = ::fdatasync(chunksFile->descriptor()) == 0;
+
+  std::string records;
+  for (std::size_t n = 0; n < cuts.size() && written; n++) {
+    if (!accepted[n]) continue;
+    ids[n] = getUniqueFileId();
+
+    DedupRecord record;
+    record.type = DedupRecord::Add;
+    record.id = ids[n];
+    record.size = cuts[n].size;
+    record.chunksEnd = end;
+    record.digest = cuts[n].digest.bytes;
+    encode(records, record, cuts[n].file->filename().string(), cuts[n].recipe->chunks);
+  }
+
+  written = written && recipesFile->writeAt(records.data(), records.size(), recipesEnd)
+    && ::fdatasync(recipesFile->descriptor()) == 0;
+  if (!written) {
+    // Whatever was appended is overwritten by the next add, and cut off if the storage's opened before that
+    std::cout << "DedupStorage::add failed writing to " << this->location << std::endl;
+    return stored;
+  }
+  chunksEnd = end;
+  recipesEnd += records.size();
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  for (std::size_t n = 0; n < cuts.size(); n++) {
+    if (!accepted[n]) continue;
+    auto& cut = cuts[n];
+    Entry entry{cut.size, cut.file->filename().string(), cut.digest, cut.recipe};
+    reference(ids[n], entry);
+    stored[n] = storedFile(ids[n], entry);
+  }
+  allocatedSize = std::make_unique<Size>(chunksEnd);
+  lock.unlock();
+
+  for (std::size_t n = 0; n < cuts.size(); n++) {
+    if (!accepted[n]) continue;
+    std::error_code error;
+    fs::remove(cuts[n].file->location, error);
+    std::cout << "DedupStorage::add " << cuts[n].file->location << " as " << ids[n] << " in "
+              << cuts[n].recipe->chunks.size() << " chunks" << std::endl;
+  }
+  return stored;
+}
+
+std::unique_ptr<StoredFile> DedupStorage::storedFile(fileId id, const Entry& entry) const
+{
+  auto stFile = std::make_unique<StoredFile>(Size{entry.size}, this->location, false, std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+  stFile->id = id;
+  stFile->name = entry.name;
+  stFile->digest = entry.digest;
+  stFile->contents = std::make_shared<Contents>(entry.recipe, chunksFile, entry.size);
+  return stFile;
+}
+
+std::unique_ptr<StoredFile> DedupStorage::lookup(fileId id)
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  auto const it = files.find(id);
+  if (it == files.end()) return nullptr;
+  return storedFile(id, it->second);
+}
+
+std::unique_ptr<StoredFile> DedupStorage::add(std::unique_ptr<StoredFile> file)
+{
+  std::vector<std::unique_ptr<StoredFile>> files;
+  files.push_back(std::move(file));
+  return std::move(addBatch(std::move(files)).front());
+}
+
+std::vector<std::unique_ptr<StoredFile>> DedupStorage::addBatch(std::vector<std::unique_ptr<StoredFile>> files)
+{
+  std::vector<std::unique_ptr<StoredFile>> stored(files.size());
+
+  // Cutting and fingerprinting is most of the work, and doesn't need any locks
+  std::vector<Cut> cuts;
+  std::vector<std::size_t> positions;
+  for (std::size_t n = 0; n < files.size(); n++) {
+    auto const location = files[n]->location;
+    auto cut = this->cut(std::move(files[n]));
+    if (!cut.has_value()) {
+      std::cout << "DedupStorage::add couldn't read " << location << std::endl;
+      continue;
+    }
+    cuts.push_back(std::move(cut.value()));
+    positions.push_back(n);
+  }
+
+  auto added = store(std::move(cuts));
+  for (std::size_t i = 0; i < added.size(); i++) stored[positions[i]] = std::move(added[i]);
+  return stored;
+}
+
+void DedupStorage::remove(std::unique_ptr<StoredFile> file)
+{
+  if (!file->id.has_value()) return;
+  auto const id = file->id.value();
+  file.reset();
+
+  std::lock_guard<std::mutex> writeLock(writeMutex);
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    if (files.find(id) == files.end() || !recipesFile) return;
+  }
+
+  DedupRecord record;
+  record.type = DedupRecord::Remove;
+  record.id = id;
+  record.chunksEnd = chunksEnd;
+  std::string records;
+  encode(records, record, std::string{}, {});
+
+  if (!recipesFile->writeAt(records.data(), records.size(), recipesEnd) || ::fdatasync(recipesFile->descriptor()) != 0) {
+    std::cout << "DedupStorage::remove failed writing to " << recipesPath() << std::endl;
+    return;
+  }
+  recipesEnd += records.size();
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  dereference(id);
+  std::cout << "DedupStorage::remove " << id << std::endl;
+}
+
+std::uint64_t DedupStorage::compact()
+{
+  // Adds and removes wait, so the chunks and files looked at here are the ones there are when it's done
+  std::lock_guard<std::mutex> writeLock(writeMutex);
+  if (!chunksFile || !recipesFile) return 0;
+
+  std::vector<std::pair<Utility::Hashing::Digest, Chunk>> live;
+  std::vector<std::pair<fileId, Entry>> entries;
+  std::uint64_t unreferenced = 0;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (auto const& [fingerprint, chunk] : chunks) {
+      if (chunk.references > 0) live.emplace_back(fingerprint, chunk);
+      else unreferenced += chunk.length;
+    }
+    entries.assign(files.begin(), files.end());
+  }
+  if (unreferenced == 0) return 0;
+
+  // Copying in the order the chunks are stored reads the old chunks file sequentially
+  std::sort(live.begin(), live.end(), [](const auto& a, const auto& b) { return a.second.offset < b.second.offset; });
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  auto const chunksTarget = compactingPath(chunksPath());
+  auto const recipesTarget = compactingPath(recipesPath());
+  auto const flags = O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC;
+  auto const chunksFd = ::open(chunksTarget.c_str(), flags, 0644);
+  auto const recipesFd = ::open(recipesTarget.c_str(), flags, 0644);
+  auto const compactedChunks = chunksFd >= 0 ? std::make_shared<Utility::FileHandle>(chunksFd) : nullptr;
+  auto compactedRecipes = recipesFd >= 0 ? std::make_unique<Utility::FileHandle>(recipesFd) : nullptr;
+
+  auto const fail = [&](const char* reason) {
+    std::cout << "DedupStorage::compact " << reason << ": " << std::strerror(errno) << std::endl;
+    std::error_code error;
+    fs::remove(chunksTarget, error);
+    fs::remove(recipesTarget, error);
+    return std::uint64_t{0};
+  };
+  if (!compactedChunks || !compactedRecipes) return fail("couldn't create the new files");
+
+  Utility::Hashing::IdMap<Utility::Hashing::Digest, std::uint64_t, FingerprintHasher> moved;
+  moved.reserve(live.size());
+  std::vector<unsigned char> pending;
+  auto const flushAt = 8_mB;
+  std::uint64_t end = 0;
+  for (auto const& [fingerprint, chunk] : live) {
+    auto const at = pending.size();
+    pending.resize(at + chunk.length);
+    if (chunksFile->readAt(pending.data() + at, chunk.length, chunk.offset) != chunk.length) return fail("failed reading a chunk");
+    moved.try_emplace(fingerprint, end);
+    end += chunk.length;
+
+    if (pending.size() >= flushAt) {
+      if (!compactedChunks->writeAt(pending.data(), pending.size(), end - pending.size())) return fail("failed writing a chunk");
+      pending.clear();
+    }
+  }
+  if (!pending.empty() && !compactedChunks->writeAt(pending.data(), pending.size(), end - pending.size())) {
+    return fail("failed writing a chunk");
+  }
+
+  // Every file is logged again as added, so the new recipes file is all there is to replay
+  std::vector<std::shared_ptr<const Recipe>> recipes;
+  std::string records;
+  for (auto const& [id, entry] : entries) {
+    auto recipe = std::make_shared<Recipe>(*entry.recipe);
+    for (auto& ref : recipe->chunks) ref.offset = moved.find(fingerprintOf(ref))->second;
+
+    DedupRecord record;
+    record.type = DedupRecord::Add;
+    record.id = id;
+    record.size = entry.size;
+    record.chunksEnd = end;
+    record.digest = entry.digest.bytes;
+    encode(records, record, entry.name, recipe->chunks);
+    recipes.push_back(std::move(recipe));
+  }
+  // Ids are never handed out again, so the last one is kept even if its file is gone
+  if (entries.empty() || entries.back().first != fileUniqueId) {
+    DedupRecord record;
+    record.type = DedupRecord::Remove;
+    record.id = fileUniqueId;
+    record.chunksEnd = end;
+    encode(records, record, std::string{}, {});
+  }
+  if (!compactedRecipes->writeAt(records.data(), records.size(), 0)) return fail("failed writing the recipes");
+
+  // Both new files have to be complete on disk before either replaces an old one
+  if (::fdatasync(chunksFd) != 0 || ::fdatasync(recipesFd) != 0) return fail("failed syncing the new files");
+  Utility::syncDirectory(this->location.string());
+  if (::rename(chunksTarget.c_str(), chunksPath().c_str()) != 0) return fail("failed replacing the chunks file");
+  // Opening the storage finishes the compaction from here on
+  if (::rename(recipesTarget.c_str(), recipesPath().c_str()) != 0) {
+    std::cout << "DedupStorage::compact failed replacing the recipes file: " << std::strerror(errno) << std::endl;
+  }
+  Utility::syncDirectory(this->location.string());
+
+  auto const reclaimed = chunksEnd - end;
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  chunksFile = compactedChunks;
+  recipesFile = std::move(compactedRecipes);
+  chunksEnd = end;
+  recipesEnd = records.size();
+
+  chunks = {};
+  for (auto const& [fingerprint, chunk] : live) {
+    chunks.try_emplace(fingerprint, Chunk{moved.find(fingerprint)->second, chunk.length, chunk.references});
+  }
+  for (std::size_t n = 0; n < entries.size(); n++) files.find(entries[n].first)->second.recipe = std::move(recipes[n]);
+  allocatedSize = std::make_unique<Size>(chunksEnd);
+
+  std::cout << "DedupStorage::compact reclaimed " << reclaimed << " bytes of " << this->location << std::endl;
+  return reclaimed;
+}
+
+DedupStats DedupStorage::stats() const
+{
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  DedupStats stats;
+  stats.files = files.size();
+  stats.logicalBytes = logicalBytes;
+  for (auto const& [fingerprint, chunk] : chunks) {
+    if (chunk.references > 0) {
+      stats.chunks++;
+      stats.storedBytes += chunk.length;
+    }
+    else {
+      stats.unreferencedBytes += chunk.length;
+    }
+  }
+  return stats;
+}
+}
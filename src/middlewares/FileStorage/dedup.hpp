@@ -0,0 +1,201 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "../../idmap.hpp"
+#include "../../fastcdc.hpp"
+#include "storage.hpp"
+#include "storedfile.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+//! Where one of a file's chunks is in the chunks file, as a recipe lists them
+struct DedupChunkRef {
+  //! SHA-256 of the chunk
+  std::array<std::uint8_t, 32> fingerprint{};
+  std::uint64_t offset = 0;
+  std::uint32_t length = 0;
+  std::uint32_t reserved = 0;
+};
+static_assert(sizeof(DedupChunkRef) == 48, "DedupChunkRef is part of the on-disk format");
+
+/*!
+ * \brief A file added to or removed from a DedupStorage, as it's logged in the recipes file
+ * An add's record is followed by the file's name and then the refs of its chunks in order. A remove's only has the id.
+ */
+struct DedupRecord {
+  enum Type : std::uint16_t {
+    Add = 1,
+    Remove = 2
+  };
+
+  //! CRC32C of the rest of the record, the name and the chunk refs
+  std::uint32_t checksum = 0;
+  std::uint16_t type = Add;
+  std::uint16_t reserved = 0;
+  std::uint32_t nameLength = 0;
+  std::uint32_t chunkCount = 0;
+  std::uint64_t id = 0;
+  //! Size of the file
+  std::uint64_t size = 0;
+  //! How long the chunks file was once the add's chunks were on it. Anything past the last add's is a torn write
+  std::uint64_t chunksEnd = 0;
+  //! SHA-256 of the file
+  std::array<std::uint8_t, 32> digest{};
+};
+static_assert(sizeof(DedupRecord) == 72, "DedupRecord is part of the on-disk format");
+
+struct DedupStats {
+  std::uint64_t files = 0;
+  //! Chunks at least one file is made of
+  std::uint64_t chunks = 0;
+  //! The sizes of the files added up, what storing a copy of each would take
+  std::uint64_t logicalBytes = 0;
+  //! The sizes of the chunks files are made of added up
+  std::uint64_t storedBytes = 0;
+  //! Chunks no file is made of any more, which are reused if the same bytes come back until compact() drops them
+  std::uint64_t unreferencedBytes = 0;
+
+  //! How many bytes of files there are for every byte stored
+  inline double ratio() const noexcept {
+    return storedBytes == 0 ? 1.0 : static_cast<double>(logicalBytes) / static_cast<double>(storedBytes);
+  }
+};
+
+/*!
+ * \brief Stores each distinct chunk of contents once, however many files it's in
+ * Uploads are cut into chunks by content (see Utility::Hashing::FastCdc). Each chunk is fingerprinted with SHA-256,
+ * and only chunks not stored yet are appended to the chunks file. A file is stored as a recipe, the list of its
+ * chunks, which is logged in the recipes file. Re-uploads, the same asset in many buckets and edited copies that
+ * only differ in places all end up sharing most of their chunks.
+ * The chunks file is synced before the recipes that refer to its new chunks. An add cut short by a crash leaves
+ * chunks past the end its record would have logged, and those are cut off when the storage is opened again.
+ * Chunks are counted by the files made of them. A chunk no file refers to any more stays where it is, and is reused
+ * if its bytes are added again, until compact() gives its space back. getAllocatedSize() is the size of the chunks file.
+ * A looked up file reads through its recipe, and stays readable after it's removed and after a compaction.
+ */
+class DedupStorage : public FileStorage {
+public:
+  static const fs::path chunksFileName;
+  static const fs::path recipesFileName;
+
+  void allocate();
+  void destroy();
+
+  std::unique_ptr<StoredFile> lookup(fileId id);
+  //! Stores the upload's chunks that aren't stored yet, logs its recipe, and removes it
+  std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file);
+  //! Like add, with the chunks and the recipes of all of the files synced together
+  std::vector<std::unique_ptr<StoredFile>> addBatch(std::vector<std::unique_ptr<StoredFile>> files);
+  void remove(std::unique_ptr<StoredFile> file);
+
+  /*!
+   * \brief Copies the chunks files are made of into a new chunks file, and their recipes into a new recipes file
+   * The new chunks file is renamed over the old one first and the recipes file last, and opening the storage carries
+   * a compaction through if it got as far as the first rename, so the two always go together. Files looked up before
+   * keep reading the old chunks file through their own handle. Adds and removes wait for the compaction.
+   * \return The bytes reclaimed, 0 if there was nothing to reclaim or the compaction failed
+   */
+  std::uint64_t compact();
+
+  DedupStats stats() const;
+
+  DedupStorage(Size size, fs::path location, bool preallocated,
+               Utility::Hashing::FastCdc chunker = Utility::Hashing::FastCdc{});
+  DedupStorage(const DedupStorage&) = delete;
+
+private:
+  //! Fingerprints are SHA-256 digests, so any 8 of their bytes are already well mixed
+  struct FingerprintHasher {
+    inline std::size_t operator()(const Utility::Hashing::Digest& fingerprint) const noexcept {
+      std::uint64_t h;
+      std::memcpy(&h, fingerprint.bytes.data(), sizeof(h));
+      return static_cast<std::size_t>(h);
+    }
+  };
+
+  struct Chunk {
+    std::uint64_t offset;
+    std::uint32_t length;
+    //! Stored files made of the chunk, counting a file as many times as the chunk is in it
+    std::uint32_t references;
+  };
+
+  //! A file's chunks in order, shared by the stored file and the contents of every lookup of it
+  struct Recipe {
+    std::vector<DedupChunkRef> chunks;
+    //! Where each chunk starts within the file
+    std::vector<std::uint64_t> starts;
+  };
+
+  struct Entry {
+    std::uint64_t size;
+    std::string name;
+    Utility::Hashing::Digest digest;
+    std::shared_ptr<const Recipe> recipe;
+  };
+
+  //! An upload cut into chunks, before any of it is stored
+  struct Cut {
+    std::unique_ptr<StoredFile> file;
+    Utility::Hashing::Digest digest;
+    std::uint64_t size;
+    //! The chunks' offsets aren't known until they're stored, their starts are where they are in the upload too
+    std::shared_ptr<Recipe> recipe;
+  };
+
+  class Contents;
+
+  const Utility::Hashing::FastCdc chunker;
+
+  //! Guards chunks and files
+  mutable std::shared_mutex mutex;
+  Utility::Hashing::IdMap<Utility::Hashing::Digest, Chunk, FingerprintHasher> chunks;
+  Utility::Hashing::IdMap<fileId, Entry, FileIdHasher> files;
+  std::uint64_t logicalBytes = 0;
+
+  //! Held while appending, so chunks and recipes go on disk in the order they're logged
+  std::mutex writeMutex;
+  //! Shared with the contents of looked up files, which read through it
+  std::shared_ptr<Utility::FileHandle> chunksFile;
+  std::unique_ptr<Utility::FileHandle> recipesFile;
+  std::uint64_t chunksEnd = 0;
+  std::uint64_t recipesEnd = 0;
+
+  fileId getUniqueFileId();
+
+  inline fs::path chunksPath() const { return location / chunksFileName; }
+  inline fs::path recipesPath() const { return location / recipesFileName; }
+  //! Where a compaction writes the new files before they replace the old ones
+  inline fs::path compactingPath(const fs::path& path) const { return path.string() + ".compacting"; }
+
+  //! Finishes or drops a compaction a crash interrupted, going by whether its chunks file was swapped in
+  void resolveCompaction();
+  //! Opens the chunks and recipes files, creating them if they aren't there and emptying them if truncating
+  bool open(bool truncating);
+  //! Replays the recipes file into files and chunks, and cuts off whatever a crash left half written
+  void load();
+  //! Counts the file's chunks as used by it, with mutex held
+  void reference(fileId id, Entry entry);
+  //! Forgets the file and lets go of its chunks, with mutex held
+  void dereference(fileId id);
+
+  //! Reads an upload and cuts it into fingerprinted chunks, nothing if it can't be read in full
+  std::optional<Cut> cut(std::unique_ptr<StoredFile> file) const;
+  //! Stores the new chunks of the cuts, logs their recipes, and returns them as looked up
+  std::vector<std::unique_ptr<StoredFile>> store(std::vector<Cut> cuts);
+
+  std::unique_ptr<StoredFile> storedFile(fileId id, const Entry& entry) const;
+};
+}
@@ -1,48 +1,273 @@
 #include "filesystem.hpp"
 #include "storedfile.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+using TinyCDN::Utility::operator""_kB;
 
 namespace TinyCDN::Middleware::FileStorage {
 
 const fs::path FilesystemStorage::linkDirName = fs::path{"links/"};
 const int FilesystemStorage::storeFileThreshold = 1000;
+const fs::path FilesystemStorage::fanOutDirName = fs::path{"store/by-id"};
+const char* const FilesystemStorage::digestAttributeName = "user.tinycdn.sha256";
+const char* const FilesystemStorage::nameAttributeName = "user.tinycdn.name";
 
-fileId FilesystemStorage::getUniqueFileId()
+std::optional<Utility::Hashing::Digest> FilesystemStorage::copyHashed(const fs::path& from, const fs::path& to)
 {
-  auto const id = ++fileUniqueId;
+  auto const in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return {};
+  auto const out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out < 0) {
+    ::close(in);
+    return {};
+  }
+  ::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  Utility::Hashing::Sha256 sha;
+  std::vector<char> buffer(256_kB);
+  bool failed = false;
+
+  for (;;) {
+    auto const got = ::read(in, buffer.data(), buffer.size());
+    if (got == 0) break;
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      break;
+    }
 
-  // Persist incremented id to META
-  persist();
-  return id;
+    sha.update(buffer.data(), static_cast<std::size_t>(got));
+
+    for (ssize_t written = 0; written < got;) {
+      auto const n = ::write(out, buffer.data() + written, static_cast<std::size_t>(got - written));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        failed = true;
+        break;
+      }
+      written += n;
+    }
+    if (failed) break;
+  }
+
+  ::close(in);
+  failed = ::close(out) != 0 || failed;
+
+  if (failed) return {};
+  return sha.finish();
+}
+
+std::optional<Utility::Hashing::Digest> FilesystemStorage::hashFile(const fs::path& path)
+{
+  auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return {};
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  Utility::Hashing::Sha256 sha;
+  std::vector<char> buffer(256_kB);
+  bool failed = false;
+
+  for (;;) {
+    auto const got = ::read(fd, buffer.data(), buffer.size());
+    if (got == 0) break;
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      break;
+    }
+    sha.update(buffer.data(), static_cast<std::size_t>(got));
+  }
+  ::close(fd);
+
+  if (failed) return {};
+  return sha.finish();
 }
 
-fileId FilesystemStorage::getUniqueStoreId()
+std::optional<FilesystemStorage::Ingested> FilesystemStorage::ingest(const fs::path& from, const fs::path& to)
 {
-  std::cout << "getUniqueStoreId " << storeUniqueId << std::endl;
-  auto const id = ++storeUniqueId;
+  struct stat upload, store;
+  if (::stat(from.c_str(), &upload) != 0) return {};
+  auto const size = static_cast<std::uintmax_t>(upload.st_size);
+
+  // Across filesystems all that's left is copying, which hashes the contents on the way
+  if (::stat(to.parent_path().c_str(), &store) != 0 || store.st_dev != upload.st_dev) {
+    auto const digest = copyHashed(from, to);
+    if (!digest.has_value()) return {};
+    return Ingested{digest.value(), IngestMethod::Copy, size};
+  }
 
-  // Create the store's directory
-  fs::create_directory(this->location / "store" / std::to_string(id));
+  // The upload is hashed where it is, it was just written so it's most likely still cached
+  auto const digest = hashFile(from);
+  if (!digest.has_value()) return {};
 
-  // Persist incremented id to META
-  persist();
-  return id;
+  if (::rename(from.c_str(), to.c_str()) == 0) return Ingested{digest.value(), IngestMethod::Rename, size};
+
+  // Linking can't replace the name that was claimed for the file, so the link is renamed over it
+  auto const linked = to.string() + ".ingest";
+  if (::link(from.c_str(), linked.c_str()) == 0) {
+    if (::rename(linked.c_str(), to.c_str()) == 0) {
+      ::unlink(from.c_str());
+      return Ingested{digest.value(), IngestMethod::Link, size};
+    }
+    ::unlink(linked.c_str());
+  }
+
+  auto const in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) return {};
+  auto const out = ::open(to.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+  if (out < 0) {
+    ::close(in);
+    return {};
+  }
+
+  std::optional<IngestMethod> method;
+  if (::ioctl(out, FICLONE, in) == 0) {
+    method = IngestMethod::Reflink;
+  }
+  else {
+    loff_t inOffset = 0, outOffset = 0;
+    while (static_cast<std::uintmax_t>(inOffset) < size) {
+      auto const copied = ::copy_file_range(in, &inOffset, out, &outOffset, size - static_cast<std::uintmax_t>(inOffset), 0);
+      if (copied < 0 && errno == EINTR) continue;
+      if (copied <= 0) break;
+    }
+    if (static_cast<std::uintmax_t>(inOffset) == size) method = IngestMethod::CopyFileRange;
+  }
+
+  ::close(in);
+  if (::close(out) != 0) method.reset();
+
+  if (method.has_value()) return Ingested{digest.value(), method.value(), size};
+
+  auto const copied = copyHashed(from, to);
+  if (!copied.has_value()) return {};
+  return Ingested{copied.value(), IngestMethod::Copy, size};
+}
+
+bool FilesystemStorage::giveBack(const Ingested& ingested, const fs::path& stored, const fs::path& upload)
+{
+  if (ingested.method != IngestMethod::Rename && ingested.method != IngestMethod::Link) return true;
+  if (::rename(stored.c_str(), upload.c_str()) != 0) return false;
+  ::removexattr(upload.c_str(), digestAttributeName);
+  ::removexattr(upload.c_str(), nameAttributeName);
+  return true;
+}
+
+void FilesystemStorage::recordIngest(const fs::path& location, const Ingested& ingested)
+{
+  auto const method = static_cast<std::size_t>(ingested.method);
+  ingestedFiles[method]++;
+  ingestedBytes[method] += ingested.size;
+
+  std::cout << "FileSystemStorage::ingest " << ingestMethodName(ingested.method) << ": " << location << std::endl;
+}
+
+IngestStats FilesystemStorage::ingestStats() const
+{
+  IngestStats stats;
+  for (std::size_t i = 0; i < ingestMethodCount; i++) {
+    stats.files[i] = ingestedFiles[i];
+    stats.bytes[i] = ingestedBytes[i];
+  }
+  return stats;
+}
+
+const char* ingestMethodName(IngestMethod method)
+{
+  switch (method) {
+  case IngestMethod::Rename: return "rename";
+  case IngestMethod::Link: return "link";
+  case IngestMethod::Reflink: return "reflink";
+  case IngestMethod::CopyFileRange: return "copy_file_range";
+  case IngestMethod::Copy: return "copy";
+  }
+  return "unknown";
+}
+
+fileId FilesystemStorage::leaseIds(fileId count)
+{
+  auto const first = fileUniqueId.fetch_add(count) + 1;
+  auto const last = first + count - 1;
+
+  // The new lease is on disk before any of its ids are handed out, so a crash can skip ids but never reuse them
+  if (last > leasedUntil) {
+    leasedUntil = last + idLeaseSize;
+    persist();
+  }
+  return static_cast<fileId>(first);
+}
+
+fileId FilesystemStorage::getUniqueFileId()
+{
+  return leaseIds(1);
+}
+
+fs::path FilesystemStorage::fanOutStore(fileId id) const
+{
+  auto const storeId = static_cast<std::uint64_t>(id) / storeFileThreshold;
+  char bucket[3];
+  std::snprintf(bucket, sizeof(bucket), "%02" PRIx64, Utility::Hashing::IdHasher::mix(storeId) % fanOut);
+  return this->location / fanOutDirName / bucket / std::to_string(storeId);
+}
+
+fs::path FilesystemStorage::pathOf(fileId id, const FilesystemEntry& entry) const
+{
+  if (entry.fannedOut) return fanOutStore(id) / std::to_string(id);
+  return this->location / "store" / std::to_string(entry.storeId) / entry.name;
+}
+
+bool FilesystemStorage::claim(const fs::path& path)
+{
+  auto fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 && errno == ENOENT) {
+    // The first file of a store creates its directory
+    std::error_code error;
+    fs::create_directories(path.parent_path(), error);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+  if (fd < 0) return false;
+  ::close(fd);
+  return true;
 }
 
 void FilesystemStorage::persist() {
   META.seekp(0);
-  META << storeUniqueId << ";" << fileUniqueId << ';' << getAllocatedSize();
+  META << storeUniqueId << ";" << leasedUntil << ';' << getAllocatedSize();
   META.flush();
+
+  // What's left of a longer previous write would otherwise trail the new one
+  std::error_code error;
+  fs::resize_file(this->location / "META", static_cast<std::uintmax_t>(META.tellp()), error);
+
+  auto const fd = ::open((this->location / "META").c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    ::fdatasync(fd);
+    ::close(fd);
+  }
 }
 
 void FilesystemStorage::allocate()
 {
   fileUniqueId = 0;
+  leasedUntil = 0;
   storeUniqueId = 1;
 
-  fs::create_directory(this->location / "links");
   fs::create_directory(this->location / "store");
-  fs::create_directory(this->location / "store" / std::to_string(1));
+  fs::create_directory(this->location / fanOutDirName);
 
   persist();
 }
@@ -55,18 +280,25 @@ void FilesystemStorage::destroy()
 // cdn-website.com/<bucket_id>/<file_id>/file.jpg
 std::unique_ptr<StoredFile> FilesystemStorage::lookup(fileId id)
 {
-  // auto search = fileMutexes.find(id);
+  if (!index) return nullptr;
+  auto const entry = index->find(id);
+  if (!entry.has_value()) return nullptr;
+
   auto lock = std::make_unique<std::shared_lock<std::shared_mutex>>(fileMutexes[id]);
 
-  auto stFile = std::make_unique<StoredFile>(
-    fs::read_symlink(this->location / this->linkDirName / std::to_string(id)), false, std::move(lock));
+  auto stFile = std::make_unique<StoredFile>(Size{entry->size}, pathOf(id, entry.value()), false, std::move(lock));
 
   stFile->id = id;
+  stFile->name = entry->name;
+  stFile->digest = entry->digest;
+
   return stFile;
 }
 
 std::unique_ptr<StoredFile> FilesystemStorage::add(std::unique_ptr<StoredFile> file)
 {
+  if (!index || !journal) return nullptr;
+
   std::unique_lock<std::mutex> storageLock(mutex);
   allocatedSize = std::make_unique<Size>(getAllocatedSize() + file->size);
 
@@ -74,72 +306,589 @@ std::unique_ptr<StoredFile> FilesystemStorage::add(std::unique_ptr<StoredFile> f
 
   file->id = assignedId;
 
-  auto assignedStoreId = storeUniqueId.load();
-
-  std::unique_lock<std::shared_mutex> storeLock(storeMutexes[assignedStoreId]);
+  // No mutations on the storage instance's properties will be made following this
+  storageLock.unlock();
 
-  auto assignedLocation = this->location / "store" / fs::path(std::to_string(assignedStoreId)) / file->location.filename();
+  // Files are named by their id, so there's never a name to claim under a lock
+  auto const assignedLocation = fanOutStore(assignedId) / std::to_string(assignedId);
+  auto const name = file->filename().string();
 
   std::ios::sync_with_stdio();
   std::cout << "FileSystemStorage::add assignedLocation: " << assignedLocation << std::endl;
-  // TODO increment store's amount of files stored
-  if (fs::exists(assignedLocation)) {
-    // The likelihood that a file in a separate would have the same filename is very low, so just create a new store folder for now
-    // TODO reuse existing stores, don't always create new ones in this situation
-    assignedStoreId = getUniqueStoreId();
 
-    assignedLocation = this->location / "store" / fs::path(std::to_string(assignedStoreId)) / file->location.filename();
+  // Gives back the space, once whatever was claimed for the file is gone
+  auto const abandon = [&] {
+    std::error_code error;
+    fs::remove(assignedLocation, error);
+    journal->finish({assignedId});
+    storageLock.lock();
+    allocatedSize = std::make_unique<Size>(getAllocatedSize() - file->size);
+  };
+
+  if (!journal->begin(addIntent(assignedId, assignedLocation, file->location))) {
+    abandon();
+    return nullptr;
   }
+  reached(FilesystemStep::Journaled);
 
-  // No mutations on the storage instance's properties will be made following this
-  storageLock.unlock();
+  if (!claim(assignedLocation)) {
+    abandon();
+    return nullptr;
+  }
+  reached(FilesystemStep::Claimed);
 
-  {
-    std::ofstream stream(assignedLocation);
-    if (!stream.is_open() || stream.bad()) {
-      storageLock.lock();
-      allocatedSize = std::make_unique<Size>(getAllocatedSize() - file->size);
-      storageLock.unlock();
-      storeLock.unlock();
-      return;
+  // Moves the upload into the store if it can, so its contents aren't written a second time
+  auto const ingested = ingest(file->location, assignedLocation);
+  if (!ingested.has_value()) {
+    abandon();
+    return nullptr;
+  }
+  recordIngest(assignedLocation, ingested.value());
+  auto const digest = std::make_optional(ingested->digest);
+
+  // Keep the digest next to the file; filesystems without user xattrs simply won't have ETags
+  ::setxattr(assignedLocation.c_str(), digestAttributeName, digest->bytes.data(), digest->bytes.size(), 0);
+  ::setxattr(assignedLocation.c_str(), nameAttributeName, name.data(), name.size(), 0);
+  file->digest = digest;
+  reached(FilesystemStep::Ingested);
+
+  FilesystemEntry entry;
+  entry.storeId = static_cast<std::uint32_t>(assignedId / storeFileThreshold);
+  entry.size = ingested->size;
+  entry.digest = digest;
+  entry.name = name;
+  entry.fannedOut = true;
+  if (!index->insert(assignedId, entry)) {
+    // A moved upload has to go back, it's the only copy there is. If it can't, the intent is left for recovery
+    if (!giveBack(ingested.value(), assignedLocation, file->location)) {
+      std::cout << "FilesystemStorage::add couldn't give back " << file->location << ", it's kept at " << assignedLocation << std::endl;
+      return nullptr;
     }
+    abandon();
+    return nullptr;
   }
-  // Uniqueness of filename in this directory is now guaranteed, so unlock this
-  storeLock.unlock();
-
-  // std::cout << "location: " << file->location << "\n";
-  // std::cout << "assignedLocation: " << assignedLocation << "\n";
+  reached(FilesystemStep::Indexed);
 
-  fs::copy(file->location, assignedLocation, fs::copy_options::overwrite_existing);
+  // A copied upload is only removed once the file is in the index, until then it's all there is
   fs::remove(file->location);
-
-  // Create a link that points to this file
-  fs::create_symlink(assignedLocation, this->location / this->linkDirName / std::to_string(assignedId));
+  finishJournaled({assignedId});
 
   file->location = assignedLocation;
+  file->name = name;
   file->temporary = false;
 
   return file;
 }
 
+std::vector<std::unique_ptr<StoredFile>> FilesystemStorage::addBatch(std::vector<std::unique_ptr<StoredFile>> files)
+{
+  std::vector<std::unique_ptr<StoredFile>> stored(files.size());
+  if (files.empty() || !index) return stored;
+
+  std::uintmax_t batchSize = 0;
+  for (auto const& file : files) batchSize += file->size;
+
+  // Ids and space for the whole batch at once
+  std::unique_lock<std::mutex> storageLock(mutex);
+  allocatedSize = std::make_unique<Size>(getAllocatedSize() + batchSize);
+  auto const firstId = leaseIds(static_cast<fileId>(files.size()));
+  storageLock.unlock();
+
+  // The whole batch's intents go into the journal with one sync
+  std::vector<FilesystemJournal::Intent> intents;
+  std::vector<fileId> ids;
+  for (std::size_t i = 0; i < files.size(); i++) {
+    auto const id = static_cast<fileId>(firstId + i);
+    intents.push_back(addIntent(id, fanOutStore(id) / std::to_string(id), files[i]->location));
+    ids.push_back(id);
+  }
+  if (!journal || !journal->begin(intents)) {
+    if (journal) journal->finish(ids);
+    storageLock.lock();
+    allocatedSize = std::make_unique<Size>(getAllocatedSize() - batchSize);
+    return stored;
+  }
+  reached(FilesystemStep::Journaled);
+
+  // Every file has a path of its own, so claiming them doesn't wait on anything
+  std::vector<fs::path> assignedLocations(files.size());
+  std::set<fs::path> touchedStores;
+  for (std::size_t i = 0; i < files.size(); i++) {
+    auto const& path = intents[i].path;
+    if (!claim(path)) continue;
+    assignedLocations[i] = path;
+    touchedStores.insert(path.parent_path());
+  }
+  reached(FilesystemStep::Claimed);
+
+  std::uintmax_t failedSize = 0;
+  std::vector<std::pair<fileId, FilesystemEntry>> entries;
+  std::vector<std::optional<Ingested>> ingestedUploads(files.size());
+  for (std::size_t i = 0; i < files.size(); i++) {
+    auto& ingested = ingestedUploads[i];
+    if (!assignedLocations[i].empty()) ingested = ingest(files[i]->location, assignedLocations[i]);
+
+    if (!ingested.has_value()) {
+      if (!assignedLocations[i].empty()) fs::remove(assignedLocations[i]);
+      assignedLocations[i].clear();
+      failedSize += files[i]->size;
+      continue;
+    }
+    recordIngest(assignedLocations[i], ingested.value());
+    auto const name = files[i]->filename().string();
+    ::setxattr(assignedLocations[i].c_str(), digestAttributeName, ingested->digest.bytes.data(), ingested->digest.bytes.size(), 0);
+    ::setxattr(assignedLocations[i].c_str(), nameAttributeName, name.data(), name.size(), 0);
+
+    FilesystemEntry entry;
+    entry.storeId = static_cast<std::uint32_t>((firstId + i) / storeFileThreshold);
+    entry.size = ingested->size;
+    entry.digest = ingested->digest;
+    entry.name = name;
+    entry.fannedOut = true;
+    entries.emplace_back(static_cast<fileId>(firstId + i), std::move(entry));
+  }
+  reached(FilesystemStep::Ingested);
+
+  // One sync for the contents of the whole batch, instead of an fsync for every file
+  {
+    auto const store = ::open((this->location / "store").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store >= 0) {
+      ::syncfs(store);
+      ::close(store);
+    }
+  }
+
+  // The new names are durable once their directories are, and a store that was just created once its bucket is
+  for (auto const& store : touchedStores) {
+    Utility::syncDirectory(store.string());
+    Utility::syncDirectory(store.parent_path().string());
+  }
+
+  // The whole batch goes into the index log with one write and one sync
+  if (!index->insert(entries)) {
+    std::vector<fileId> kept;
+    for (auto const& [id, entry] : entries) {
+      auto const i = static_cast<std::size_t>(id - firstId);
+      // Moved uploads go back to their callers, those that can't are left for recovery with their intents
+      if (giveBack(ingestedUploads[i].value(), assignedLocations[i], files[i]->location)) fs::remove(assignedLocations[i]);
+      else kept.push_back(id);
+      assignedLocations[i].clear();
+      failedSize += files[i]->size;
+    }
+    entries.clear();
+    if (!kept.empty()) {
+      std::cout << "FilesystemStorage::addBatch couldn't give back " << kept.size() << " uploads, they're kept in the store" << std::endl;
+      ids.erase(std::remove_if(ids.begin(), ids.end(), [&kept](fileId id) {
+        return std::find(kept.begin(), kept.end(), id) != kept.end();
+      }), ids.end());
+    }
+  }
+  // The entries are in the index either way, so the files stay. Their intents are only checkpointed away once a
+  // sync of the whole filesystem succeeds, and until then recovery takes them in again if the log loses them
+  else if (!index->sync()) {
+    std::cout << "FilesystemStorage::addBatch couldn't sync the index, " << entries.size() << " files aren't durable yet" << std::endl;
+  }
+  if (!entries.empty()) reached(FilesystemStep::Indexed);
+
+  for (auto const& [id, entry] : entries) {
+    auto const i = static_cast<std::size_t>(id - firstId);
+    stored[i] = std::move(files[i]);
+    stored[i]->id = id;
+    stored[i]->name = entry.name;
+    stored[i]->digest = entry.digest;
+  }
+
+  for (std::size_t i = 0; i < stored.size(); i++) {
+    if (!stored[i]) continue;
+    fs::remove(stored[i]->location);
+    stored[i]->location = assignedLocations[i];
+    stored[i]->temporary = false;
+  }
+  finishJournaled(ids);
+
+  if (failedSize > 0) {
+    storageLock.lock();
+    allocatedSize = std::make_unique<Size>(getAllocatedSize() - failedSize);
+  }
+
+  return stored;
+}
+
 void FilesystemStorage::remove(std::unique_ptr<StoredFile> file)
 {
   if (!file->id.has_value()) return;
+  auto const id = file->id.value();
+
+  // The file may have been moved into the fan-out since it was added, the index knows where it is now
+  auto const locate = [&] {
+    auto const entry = index ? index->find(id) : std::nullopt;
+    return entry.has_value() ? pathOf(id, entry.value()) : file->location;
+  };
+
+  // The intent is synced before the storage is locked, so other operations don't wait on it
+  auto location = locate();
+  if (journal && !journal->begin({FilesystemJournalRecord::Remove, id, location, {}})) {
+    std::cout << "FilesystemStorage::remove couldn't journal removing " << location << std::endl;
+    journal->finish({id});
+    return;
+  }
+  reached(FilesystemStep::Journaled);
 
   std::unique_lock<std::mutex> storageLock(mutex);
 
-  fs::remove(this->location / this->linkDirName / std::to_string(file->id.value()));
+  // A migration moved the file in the meantime, which is only ever done under the lock
+  if (journal && locate() != location) {
+    location = locate();
+    if (!journal->begin({FilesystemJournalRecord::Remove, id, location, {}})) {
+      std::cout << "FilesystemStorage::remove couldn't journal removing " << location << std::endl;
+      storageLock.unlock();
+      journal->finish({id});
+      return;
+    }
+  }
+  if (index) index->erase(id);
+  reached(FilesystemStep::Erased);
 
   allocatedSize = file->size != 0
     ? std::make_unique<Size>(getAllocatedSize() - file->size)
     : std::make_unique<Size>(getAllocatedSize() - file->getRealSize());
 
-  fs::remove(file->location);
+  fs::remove(location);
+  storageLock.unlock();
 
-  persist();
+  if (journal) finishJournaled({id});
+}
+
+void FilesystemStorage::finishJournaled(const std::vector<fileId>& ids)
+{
+  journal->finish(ids);
+  if (journal->checkpointDue()) checkpointJournal();
+}
+
+bool FilesystemStorage::checkpointJournal()
+{
+  auto const mark = journal->mark();
+
+  // Files added and removed by the finished operations have to be on disk, as well as the index's record of them
+  auto const fd = ::open(this->location.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return false;
+  auto const synced = ::syncfs(fd) == 0;
+  ::close(fd);
+
+  return synced && journal->checkpoint(mark);
+}
+
+void FilesystemStorage::recover()
+{
+  auto const& interrupted = journal->interrupted();
+  if (interrupted.empty()) return;
+
+  std::cout << "FilesystemStorage::recover resolving " << interrupted.size() << " interrupted operations" << std::endl;
+
+  std::size_t undone = 0, redone = 0, completed = 0;
+  std::vector<fileId> ids;
+  for (auto const& intent : interrupted) {
+    ids.push_back(intent.id);
+    auto const entry = index->find(intent.id);
+
+    if (intent.type == FilesystemJournalRecord::Add) {
+      // Finished adds are only dropped at a checkpoint, and their uploads' names may be new uploads' by now
+      auto const uploadKept = holdsUpload(intent);
+      if (entry.has_value()) {
+        // Only removing a copied upload was left, a moved one is gone already
+        if (uploadKept) ::unlink(intent.upload.c_str());
+        completed++;
+        continue;
+      }
+      // The index's record was lost, but the file was taken in and may have been handed out, so it's put back
+      auto const ingested = entryOfIngested(intent);
+      if (ingested.has_value()) {
+        if (!index->insert(intent.id, ingested.value())) {
+          std::cout << "FilesystemStorage::recover couldn't index " << intent.path << " again, it's resolved next time" << std::endl;
+          ids.pop_back();
+          continue;
+        }
+        // Linked in, with the crash before the upload's name was removed
+        if (uploadKept) ::unlink(intent.upload.c_str());
+        redone++;
+        continue;
+      }
+      // Whatever was claimed or copied in is dropped, no one was given the id
+      ::unlink(intent.path.c_str());
+      ::unlink((intent.path.string() + ".ingest").c_str());
+      undone++;
+      continue;
+    }
+
+    if (entry.has_value()) index->erase(intent.id);
+    ::unlink(intent.path.c_str());
+    completed++;
+  }
+
+  // The intents are only checkpointed away once the adds that were put back are on disk
+  if (redone > 0 && !index->sync()) {
+    std::cout << "FilesystemStorage::recover couldn't sync the index, it's resolved again next time" << std::endl;
+    return;
+  }
+  journal->finish(ids);
+  if (!checkpointJournal()) {
+    std::cout << "FilesystemStorage::recover couldn't checkpoint the journal, it's resolved again next time" << std::endl;
+  }
+  std::cout << "FilesystemStorage::recover undid " << undone << ", redid " << redone << " and completed " << completed << " operations" << std::endl;
+}
+
+FilesystemJournal::Intent FilesystemStorage::addIntent(fileId id, const fs::path& path, const fs::path& upload)
+{
+  FilesystemJournal::Intent intent{FilesystemJournalRecord::Add, id, path, upload};
+  struct stat status;
+  if (::stat(upload.c_str(), &status) == 0) {
+    intent.uploadDevice = static_cast<std::uint64_t>(status.st_dev);
+    intent.uploadInode = static_cast<std::uint64_t>(status.st_ino);
+  }
+  return intent;
+}
+
+bool FilesystemStorage::isUpload(const FilesystemJournal::Intent& intent, const fs::path& path)
+{
+  struct stat status;
+  return intent.uploadInode != 0 && ::stat(path.c_str(), &status) == 0
+    && static_cast<std::uint64_t>(status.st_dev) == intent.uploadDevice
+    && static_cast<std::uint64_t>(status.st_ino) == intent.uploadInode;
+}
+
+bool FilesystemStorage::holdsUpload(const FilesystemJournal::Intent& intent)
+{
+  if (intent.upload.empty()) return false;
+  // Journals from before uploads were identified only have the name to go by
+  std::error_code error;
+  if (intent.uploadInode == 0) return fs::exists(intent.upload, error);
+  return isUpload(intent, intent.upload);
+}
+
+std::optional<FilesystemEntry> FilesystemStorage::entryOfIngested(const FilesystemJournal::Intent& intent) const
+{
+  // A moved or linked upload is whole the moment it's there. A copy is only whole once its digest is set, and isn't
+  // needed while the upload it's a copy of is still there to be added again
+  auto const movedIn = isUpload(intent, intent.path);
+  if (!movedIn && holdsUpload(intent)) return {};
+
+  Utility::Hashing::Digest digest;
+  auto const digestSize = ::getxattr(intent.path.c_str(), digestAttributeName, digest.bytes.data(), digest.bytes.size());
+  auto const hasDigest = digestSize == static_cast<ssize_t>(digest.bytes.size());
+  if (!hasDigest && !movedIn) return {};
+
+  std::error_code error;
+  auto const size = fs::file_size(intent.path, error);
+  if (error) return {};
+
+  FilesystemEntry entry;
+  entry.storeId = static_cast<std::uint32_t>(intent.id / storeFileThreshold);
+  entry.size = size;
+  entry.fannedOut = true;
+
+  // A crash right after the upload was moved in leaves the file without its attributes, it's hashed again then
+  entry.digest = hasDigest ? std::make_optional(digest) : hashFile(intent.path);
+  if (!entry.digest.has_value()) return {};
+
+  auto nameSize = ::getxattr(intent.path.c_str(), nameAttributeName, nullptr, 0);
+  if (nameSize > 0) {
+    entry.name.resize(static_cast<std::size_t>(nameSize));
+    nameSize = ::getxattr(intent.path.c_str(), nameAttributeName, entry.name.data(), entry.name.size());
+    entry.name.resize(nameSize > 0 ? static_cast<std::size_t>(nameSize) : 0);
+  }
+  if (entry.name.empty()) entry.name = intent.upload.filename().string();
+  return entry;
+}
+
+void FilesystemStorage::migrateLinks()
+{
+  std::cout << "FilesystemStorage::migrateLinks moving " << this->location / this->linkDirName << " into the index" << std::endl;
+
+  std::vector<std::pair<fileId, FilesystemEntry>> entries;
+  for (auto const& link : fs::directory_iterator(this->location / this->linkDirName)) {
+    std::error_code error;
+    auto const target = fs::read_symlink(link.path(), error);
+    auto const size = error ? 0 : fs::file_size(target, error);
+    if (error) {
+      std::cout << "FilesystemStorage::migrateLinks skipping " << link.path() << ": " << error.message() << std::endl;
+      continue;
+    }
+
+    FilesystemEntry entry;
+    entry.storeId = static_cast<std::uint32_t>(std::stoul(target.parent_path().filename().string()));
+    entry.size = size;
+    entry.name = target.filename().string();
+
+    Utility::Hashing::Digest digest;
+    auto const digestSize = ::getxattr(target.c_str(), digestAttributeName, digest.bytes.data(), digest.bytes.size());
+    if (digestSize == static_cast<ssize_t>(digest.bytes.size())) entry.digest = digest;
+
+    entries.emplace_back(static_cast<fileId>(std::stoul(link.path().filename().string())), std::move(entry));
+  }
+
+  // The links are only removed once the snapshot that replaces them is on disk
+  if (!index->insert(entries) || !index->snapshot()) {
+    std::cout << "FilesystemStorage::migrateLinks couldn't save the index, keeping the links" << std::endl;
+    return;
+  }
+  fs::remove_all(this->location / this->linkDirName);
+  std::cout << "FilesystemStorage::migrateLinks migrated " << entries.size() << " files" << std::endl;
+}
+
+std::vector<std::pair<fileId, fs::path>> FilesystemStorage::migrateBatch(const std::vector<fileId>& ids)
+{
+  std::vector<std::pair<fileId, FilesystemEntry>> linked;
+  std::set<fs::path> touchedStores;
+  for (auto const id : ids) {
+    auto const entry = index->find(id);
+    if (!entry.has_value() || entry->fannedOut) continue;
+
+    auto const from = pathOf(id, entry.value());
+    auto const store = fanOutStore(id);
+    auto const to = store / std::to_string(id);
+
+    // The old name stays until the index has the new one, so the file can be read under either in the meantime
+    auto linkedNow = ::link(from.c_str(), to.c_str()) == 0;
+    if (!linkedNow && errno == ENOENT && fs::exists(from)) {
+      std::error_code error;
+      fs::create_directories(store, error);
+      linkedNow = ::link(from.c_str(), to.c_str()) == 0;
+    }
+    else if (!linkedNow && errno == EEXIST) {
+      // Left by a migration that was interrupted before the index was updated
+      ::unlink(to.c_str());
+      linkedNow = ::link(from.c_str(), to.c_str()) == 0;
+    }
+    if (!linkedNow) {
+      std::cout << "FilesystemStorage::migrateBatch skipping " << from << ": " << std::strerror(errno) << std::endl;
+      continue;
+    }
+
+    auto moved = entry.value();
+    moved.storeId = static_cast<std::uint32_t>(id / storeFileThreshold);
+    moved.fannedOut = true;
+    linked.emplace_back(id, std::move(moved));
+    touchedStores.insert(store);
+  }
+  if (linked.empty()) return {};
+
+  // The index only points at the new names once they're on disk
+  for (auto const& store : touchedStores) {
+    Utility::syncDirectory(store.string());
+    Utility::syncDirectory(store.parent_path().string());
+  }
+
+  std::vector<std::pair<fileId, fs::path>> oldNames;
+  std::vector<std::pair<fileId, FilesystemEntry>> entries;
+
+  // Holds off remove() until the index is updated
+  std::lock_guard<std::mutex> storageLock(mutex);
+  for (auto& [id, moved] : linked) {
+    auto const entry = index->find(id);
+    if (!entry.has_value()) {
+      // Removed since it was linked, which only removed the old name
+      ::unlink(pathOf(id, moved).c_str());
+      continue;
+    }
+    oldNames.emplace_back(id, pathOf(id, entry.value()));
+    entries.emplace_back(id, std::move(moved));
+  }
+
+  if (!index->insert(entries)) {
+    for (auto const& [id, moved] : entries) ::unlink(pathOf(id, moved).c_str());
+    return {};
+  }
+  // Both names are kept unless the index is on disk
+  if (!index->sync()) return {};
+
+  return oldNames;
+}
+
+std::vector<std::pair<fileId, fs::path>> FilesystemStorage::removeOldNames(std::vector<std::pair<fileId, fs::path>> oldNames)
+{
+  std::vector<std::pair<fileId, fs::path>> reading;
+  for (auto& [id, path] : oldNames) {
+    // A StoredFile looked up before the index changed has the old name, and holds the file's lock until it's gone
+    std::unique_lock<std::shared_mutex> fileLock(fileMutexes[id], std::try_to_lock);
+    if (!fileLock.owns_lock()) {
+      reading.emplace_back(id, std::move(path));
+      continue;
+    }
+    ::unlink(path.c_str());
+  }
+  return reading;
+}
+
+std::size_t FilesystemStorage::migrateStores()
+{
+  if (!index) return 0;
+  std::lock_guard<std::mutex> migrationLock(migrationMutex);
+
+  std::vector<fileId> ids;
+  std::set<std::uint32_t> stores;
+  index->forEach([&](fileId id, const FilesystemEntry& entry) {
+    if (entry.fannedOut) return;
+    ids.push_back(id);
+    stores.insert(entry.storeId);
+  });
+  if (ids.empty()) return 0;
+
+  // In the order they were added, which empties the oldest stores first
+  std::sort(ids.begin(), ids.end());
+  std::cout << "FilesystemStorage::migrateStores moving " << ids.size() << " files from " << stores.size()
+            << " stores into " << this->location / fanOutDirName << std::endl;
+
+  std::size_t moved = 0;
+  std::vector<std::pair<fileId, fs::path>> oldNames;
+  for (std::size_t first = 0; first < ids.size() && !stopping; first += migrationBatchSize) {
+    std::vector<fileId> const batch(ids.begin() + first, ids.begin() + std::min(ids.size(), first + migrationBatchSize));
+    auto movedNow = migrateBatch(batch);
+    moved += movedNow.size();
+    oldNames.insert(oldNames.end(), std::make_move_iterator(movedNow.begin()), std::make_move_iterator(movedNow.end()));
+    oldNames = removeOldNames(std::move(oldNames));
+
+    std::this_thread::sleep_for(migrationPause);
+  }
+
+  // Files that were being read keep their old names until they aren't
+  while (!oldNames.empty() && !stopping) {
+    std::this_thread::sleep_for(migrationPause);
+    oldNames = removeOldNames(std::move(oldNames));
+  }
+  if (!oldNames.empty()) {
+    std::cout << "FilesystemStorage::migrateStores left " << oldNames.size() << " old names behind" << std::endl;
+  }
+
+  // Only stores that are empty now are removed
+  for (auto const store : stores) ::rmdir((this->location / "store" / std::to_string(store)).c_str());
+
+  std::cout << "FilesystemStorage::migrateStores moved " << moved << " files" << std::endl;
+  return moved;
+}
+
+std::shared_future<std::size_t> FilesystemStorage::startStoreMigration()
+{
+  std::lock_guard<std::mutex> storageLock(mutex);
+  if (migration.valid() && migration.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return migration;
+
+  migration = std::async(std::launch::async, [this] { return migrateStores(); }).share();
+  return migration;
 }
 
 FilesystemStorage::~FilesystemStorage() {
+  // A migration running in the background still uses the index
+  stopping = true;
+  if (migration.valid()) migration.wait();
+
+  if (!index) return;
+
+  // Nothing's in flight anymore, so the journal is left empty
+  if (journal) checkpointJournal();
+
+  // Closing cleanly gives back the rest of the lease
+  std::unique_lock<std::mutex> storageLock(mutex);
+  leasedUntil = fileUniqueId;
+  persist();
 }
 
 FilesystemStorage::FilesystemStorage(Size size, fs::path location, bool preallocated)
@@ -174,7 +923,9 @@ FilesystemStorage::FilesystemStorage(Size size, fs::path location, bool prealloc
     std::cout << "storeUniqueId: " << storeUniqueId << std::endl;
     auto nextDelim = idsAndSize.find(";", delim+1);
 
+    // Ids up to the end of the last lease may have been handed out, so the next one comes after it
     fileUniqueId = std::stoul(idsAndSize.substr(delim+1, nextDelim));
+    leasedUntil = fileUniqueId;
     std::cout << "fileUniqueId: " << fileUniqueId << std::endl;
     delim = nextDelim;
 
@@ -187,6 +938,17 @@ FilesystemStorage::FilesystemStorage(Size size, fs::path location, bool prealloc
     persist();
   }
 
+  index = std::make_unique<FilesystemIndex>(this->location);
+  if (preallocated && !index->loaded() && fs::exists(this->location / this->linkDirName)) migrateLinks();
+
+  journal = std::make_unique<FilesystemJournal>(this->location);
+  recover();
+
+  // META's size is only as recent as the last lease, the index has every file that was added or removed since
+  if (preallocated && index->loaded()) allocatedSize = std::make_unique<Size>(index->totalSize());
+
+  // Files from before the fan-out are moved into it in the background
+  if (preallocated) startStoreMigration();
 }
 
 }
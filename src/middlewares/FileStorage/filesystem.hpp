@@ -1,33 +1,181 @@
 #pragma once
 
-#include <map>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <mutex>
+#include "../../stripedlocks.hpp"
 #include "storage.hpp"
 #include "storedfile.hpp"
+#include "filesystemindex.hpp"
+#include "filesystemjournal.hpp"
 
 namespace TinyCDN::Middleware::FileStorage {
 
+//! How an upload's contents got into the store, from the cheapest to the most expensive
+enum class IngestMethod {
+  //! The upload was moved into the store
+  Rename,
+  //! The upload was hard linked into the store, where renaming it wasn't allowed
+  Link,
+  //! The store's file shares the upload's extents through FICLONE
+  Reflink,
+  //! The kernel copied the contents with copy_file_range, without them passing through user space
+  CopyFileRange,
+  //! The contents were read and written in user space, i.e. because the upload is on another filesystem
+  Copy
+};
+
+constexpr std::size_t ingestMethodCount = 5;
+
+const char* ingestMethodName(IngestMethod method);
+
+//! How many uploads, and how many of their bytes, each IngestMethod took in
+struct IngestStats {
+  std::array<std::uint64_t, ingestMethodCount> files{};
+  std::array<std::uint64_t, ingestMethodCount> bytes{};
+
+  inline std::uint64_t filesBy(IngestMethod method) const { return files[static_cast<std::size_t>(method)]; }
+  inline std::uint64_t bytesBy(IngestMethod method) const { return bytes[static_cast<std::size_t>(method)]; }
+};
+
+//! The points between the steps of add(), addBatch() and remove() where a crash leaves something for recovery to do
+enum class FilesystemStep {
+  //! The operation's intent is in the journal, nothing else has changed
+  Journaled,
+  //! An empty file was created at the new file's path
+  Claimed,
+  //! The upload's contents are in the new file
+  Ingested,
+  //! The new file is in the index, the upload may still be there
+  Indexed,
+  //! The removed file is out of the index, but still on disk
+  Erased
+};
+
 class FilesystemStorage : public FileStorage {
 private:
   std::ofstream META;
+  //! Where older versions kept a symlink to every file, named by its id
   static const fs::path linkDirName;
-  //! Saves META properties
+  //! Extended attribute on each stored file that holds its raw SHA-256 digest
+  static const char* const digestAttributeName;
+  //! Extended attribute on each stored file that holds the name it was uploaded with, so recovery can index it again
+  static const char* const nameAttributeName;
+  //! Saves META properties and syncs them to disk
   void persist();
 
+  //! Ids are handed out from leases of this many, so META is only rewritten when one runs out
+  static constexpr fileId idLeaseSize = 10000;
+  //! The last id of the current lease, which META records in place of the last id handed out
+  fileId leasedUntil = 0;
+  //! Hands out count consecutive ids and returns the first, extending the lease if they run past it. Only with mutex held
+  fileId leaseIds(fileId count);
+
   mutable std::mutex mutex;
 
+  //! The last of the numbered stores files were put in before the fan-out, which META still records
   std::atomic<fileId> storeUniqueId;
-  //std::map<fileId, std::unique_ptr<std::mutex>> storeMutexes;
-  std::map<fileId, std::shared_mutex> storeMutexes;
-  //! Once the store reaches this amount of files, another folder will get created
+  //! Files in a store of the fan-out. Ids fill their store in order, so no directory ever holds more than this
   static const int storeFileThreshold;
+  //! Stores are spread over this many buckets by a hash of their id, which keeps the buckets small as well
+  static constexpr std::uint64_t fanOut = 256;
+  //! The root of the fan-out, store/by-id/<bucket>/<storeId>/<id>. Numbered stores are never named like this
+  static const fs::path fanOutDirName;
+
+  //! The store directory in the fan-out that a new file with this id goes into
+  fs::path fanOutStore(fileId id) const;
+  //! Where the file the entry is for is
+  fs::path pathOf(fileId id, const FilesystemEntry& entry) const;
+  //! Creates an empty file at path for a new file to be ingested into, and the directories it's in if they're missing
+  static bool claim(const fs::path& path);
 
-  //std::map<fileId, std::unique_ptr<std::shared_mutex>> fileMutexes;
-  std::map<fileId, std::shared_mutex> fileMutexes;
+  //! Held shared by every StoredFile returned by lookup()
+  Utility::StripedLocks<1024> fileMutexes;
+
+  //! Where every file is, so looking one up doesn't touch the disk
+  std::unique_ptr<FilesystemIndex> index;
+  //! Moves the symlinks in links/ into a new index and removes them
+  void migrateLinks();
+
+  //! The adds and removes in flight, so a crash partway through one doesn't leave files the index doesn't know about
+  std::unique_ptr<FilesystemJournal> journal;
+  /*!
+   * \brief Resolves the operations a crash interrupted, going by what the index says happened
+   * An add that made it into the index only has its upload removed, if its name is still that upload. One that
+   * didn't is indexed again if its contents were taken in and the upload isn't there to add again: the index log isn't
+   * synced by add(), so its record can be lost after the id was given out, and the stored file is the only copy left.
+   * Any other add is undone. A remove is carried through.
+   * Only the journal's intents and the files they name are looked at, never the stores.
+   */
+  void recover();
+  //! An add's intent, with the identity of its upload
+  static FilesystemJournal::Intent addIntent(fileId id, const fs::path& path, const fs::path& upload);
+  //! Whether path is the file the intent's upload was when it was begun
+  static bool isUpload(const FilesystemJournal::Intent& intent, const fs::path& path);
+  //! Whether the intent's upload is still where it was, and not another upload under the same name
+  static bool holdsUpload(const FilesystemJournal::Intent& intent);
+  //! The entry for an add's file if its contents were taken in whole and are the only copy, nothing otherwise
+  std::optional<FilesystemEntry> entryOfIngested(const FilesystemJournal::Intent& intent) const;
+  //! Finishes the ids' intents, and checkpoints the journal once that's due
+  void finishJournaled(const std::vector<fileId>& ids);
+  //! Syncs the filesystem the storage is on, so what the finished intents did is durable, and checkpoints the journal
+  bool checkpointJournal();
+  inline void reached(FilesystemStep step) { if (afterStep) afterStep(step); }
+
+  //! Files moved into the fan-out at a time, between which the migration pauses for migrationPause
+  static constexpr std::size_t migrationBatchSize = 256;
+  static constexpr std::chrono::milliseconds migrationPause{10};
+  std::mutex migrationMutex;
+  std::shared_future<std::size_t> migration;
+  //! Set when closing, so a migration stops after the batch it's on
+  std::atomic<bool> stopping{false};
+  /*!
+   * \brief Moves a batch of files from numbered stores into the fan-out
+   * Each file is linked at its new path, the links are synced, and then the index is updated and synced, so a crash
+   * at any point leaves every file where the index says it is.
+   * \return The ids that were moved and their old names, which are left for removeOldNames()
+   */
+  std::vector<std::pair<fileId, fs::path>> migrateBatch(const std::vector<fileId>& ids);
+  //! Removes the old names of moved files, except those of files that are being read, which are returned
+  std::vector<std::pair<fileId, fs::path>> removeOldNames(std::vector<std::pair<fileId, fs::path>> oldNames);
 
-  fileId getUniqueStoreId();
   fileId getUniqueFileId();
 
+  /*!
+   * \brief Copies a file in 256kB blocks, hashing each block while it is in memory
+   * \return The digest of the copied contents, nothing if reading or writing failed
+   */
+  static std::optional<Utility::Hashing::Digest> copyHashed(const fs::path& from, const fs::path& to);
+  //! Reads a file to hash it
+  static std::optional<Utility::Hashing::Digest> hashFile(const fs::path& path);
+
+  struct Ingested {
+    Utility::Hashing::Digest digest;
+    IngestMethod method;
+    std::uintmax_t size;
+  };
+
+  /*!
+   * \brief Puts an upload's contents at to, which already exists, the cheapest way the filesystems allow
+   * An upload on the store's filesystem is hashed and then renamed, linked, cloned or copied by the kernel, so its
+   * contents are never written twice; anything else falls back to copyHashed(). The upload may be gone afterwards.
+   */
+  static std::optional<Ingested> ingest(const fs::path& from, const fs::path& to);
+  /*!
+   * \brief Undoes ingest() for an upload the index couldn't take, so the caller still has it to retry with
+   * An upload that was renamed or linked is only at stored, so it's moved back; one that was copied is still there.
+   * \return Whether the upload is where it was, and stored can go
+   */
+  static bool giveBack(const Ingested& ingested, const fs::path& stored, const fs::path& upload);
+
+  std::array<std::atomic<std::uint64_t>, ingestMethodCount> ingestedFiles{};
+  std::array<std::atomic<std::uint64_t>, ingestMethodCount> ingestedBytes{};
+  //! Counts an upload in ingestStats() and logs how it was taken in
+  void recordIngest(const fs::path& location, const Ingested& ingested);
+
 public:
 
   //! Creates a directory for stored files
@@ -37,9 +185,30 @@ public:
 
   std::unique_ptr<StoredFile> lookup(fileId id);
   std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file);
+  /*!
+   * \brief Adds the files with one id allocation, one META update, and one sync of their contents and directories
+   * Unlike add(), the batch is on disk when this returns, and only then are the uploads that were copied removed.
+   */
+  std::vector<std::unique_ptr<StoredFile>> addBatch(std::vector<std::unique_ptr<StoredFile>> files);
   void remove(std::unique_ptr<StoredFile> file);
 
+  IngestStats ingestStats() const;
+
+  //! Called after each FilesystemStep, so tests can stop the process partway through an operation
+  std::function<void(FilesystemStep)> afterStep;
+
+  /*!
+   * \brief Moves the files still in numbered stores, from before the fan-out, into it
+   * Goes through migrationBatchSize files at a time with a pause in between, so it can run alongside everything else.
+   * Files that are being read keep their old names as well until they aren't, since their readers may still open them.
+   * \return How many files were moved
+   */
+  std::size_t migrateStores();
+  //! Runs migrateStores() on its own thread, unless a migration is already running. Opening a storage starts one
+  std::shared_future<std::size_t> startStoreMigration();
+
   FilesystemStorage(Size allocatedSize, fs::path location, bool preallocated);
+  //! Stops a migration after the batch it's on, and leaves an empty journal
   ~FilesystemStorage();
 };
 
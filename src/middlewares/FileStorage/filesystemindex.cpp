@@ -0,0 +1,323 @@
+#include "filesystemindex.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../crc32c.hpp"
+
+using TinyCDN::Utility::operator""_mB;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+const fs::path FilesystemIndex::snapshotFileName = fs::path{"index"};
+const fs::path FilesystemIndex::logFileName = fs::path{"index.log"};
+
+namespace {
+std::uint32_t checksumOf(FilesystemIndexRecord record, std::string_view name) {
+  record.checksum = 0;
+  auto const crc = Utility::Hashing::Crc32c::of(&record, sizeof(record));
+  return Utility::Hashing::Crc32c::extend(crc, name.data(), name.size());
+}
+
+std::uint32_t checksumOf(FilesystemIndexHeader header) {
+  header.checksum = 0;
+  return Utility::Hashing::Crc32c::of(&header, sizeof(header));
+}
+
+//! Appends the record and the name to buffer, with the record's checksum filled in
+void encode(std::string& buffer, FilesystemIndexRecord record, std::string_view name) {
+  record.nameLength = static_cast<std::uint32_t>(name.size());
+  record.checksum = checksumOf(record, name);
+  buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  buffer.append(name);
+}
+
+void encodeInsert(std::string& buffer, fileId id, const FilesystemEntry& entry) {
+  FilesystemIndexRecord record;
+  record.type = FilesystemIndexRecord::Insert;
+  record.id = id;
+  record.storeId = entry.storeId;
+  record.size = entry.size;
+  if (entry.digest.has_value()) {
+    record.flags |= FilesystemIndexRecord::HasDigest;
+    record.digest = entry.digest->bytes;
+  }
+  if (entry.fannedOut) record.flags |= FilesystemIndexRecord::FannedOut;
+  encode(buffer, record, entry.name);
+}
+
+/*!
+ * \brief Calls fn(record, name) for the records in file from offset on, reading them 1MB at a time
+ * \return Where the last record that was whole and matched its checksum ends
+ */
+template <typename Function>
+std::uint64_t readRecords(const Utility::FileHandle& file, std::uint64_t offset, std::uint64_t limit, Function&& fn) {
+  std::vector<char> buffer(1_mB);
+  std::size_t begin = 0, end = 0;
+  std::uint64_t count = 0;
+
+  // Makes sure the buffer holds at least length bytes from begin on
+  auto const fill = [&](std::size_t length) {
+    if (end - begin >= length) return true;
+    std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+    end -= begin;
+    offset += begin;
+    begin = 0;
+    if (buffer.size() < length) buffer.resize(length);
+    while (end < length) {
+      auto const got = file.readAt(reinterpret_cast<unsigned char*>(buffer.data() + end), buffer.size() - end, offset + end);
+      if (got == 0) return false;
+      end += got;
+    }
+    return true;
+  };
+
+  while (count < limit && fill(sizeof(FilesystemIndexRecord))) {
+    FilesystemIndexRecord record;
+    std::memcpy(&record, buffer.data() + begin, sizeof(record));
+    if (!fill(sizeof(record) + record.nameLength)) break;
+
+    std::string_view const name(buffer.data() + begin + sizeof(record), record.nameLength);
+    if (checksumOf(record, name) != record.checksum) break;
+
+    fn(record, std::string(name));
+    begin += sizeof(record) + record.nameLength;
+    count++;
+  }
+  return offset + begin;
+}
+}
+
+FilesystemIndex::FilesystemIndex(fs::path directory) : directory(directory) {
+  load();
+  openLog();
+}
+
+FilesystemIndex::~FilesystemIndex() {
+  if (logged > 0) snapshot();
+}
+
+void FilesystemIndex::apply(const FilesystemIndexRecord& record, std::string name) {
+  if (record.type == FilesystemIndexRecord::Erase) {
+    entries.erase(static_cast<fileId>(record.id));
+    return;
+  }
+
+  FilesystemEntry entry;
+  entry.storeId = record.storeId;
+  entry.size = record.size;
+  if (record.flags & FilesystemIndexRecord::HasDigest) entry.digest = Utility::Hashing::Digest{record.digest};
+  entry.name = std::move(name);
+  entry.fannedOut = record.flags & FilesystemIndexRecord::FannedOut;
+
+  auto const [it, inserted] = entries.try_emplace(static_cast<fileId>(record.id), entry);
+  if (!inserted) it->second = std::move(entry);
+}
+
+void FilesystemIndex::load() {
+  auto const snapshotFile = Utility::FileHandle::open((directory / snapshotFileName).string());
+  if (snapshotFile) {
+    wasLoaded = true;
+
+    FilesystemIndexHeader header;
+    auto const valid = snapshotFile->readAt(reinterpret_cast<unsigned char*>(&header), sizeof(header), 0) == sizeof(header)
+      && header.magic == FilesystemIndexHeader::expectedMagic
+      && header.version == FilesystemIndexHeader::currentVersion
+      && header.checksum == checksumOf(header);
+
+    if (valid) {
+      logGeneration = header.logGeneration;
+      entries.reserve(header.count);
+
+      std::uint64_t count = 0;
+      readRecords(*snapshotFile, sizeof(header), header.count, [&](const FilesystemIndexRecord& record, std::string name) {
+        apply(record, std::move(name));
+        count++;
+      });
+      if (count != header.count) {
+        std::cout << "FilesystemIndex::load the snapshot is damaged, only " << count << " of " << header.count
+                  << " entries could be read" << std::endl;
+      }
+    }
+    else {
+      std::cout << "FilesystemIndex::load the snapshot's header is damaged: " << directory / snapshotFileName << std::endl;
+    }
+  }
+
+  // Logs from before the snapshot are only left over if removing them failed
+  std::vector<std::uint64_t> generations;
+  auto const prefix = logFileName.string() + ".";
+  for (auto const& file : fs::directory_iterator(directory)) {
+    auto const name = file.path().filename().string();
+    if (name.compare(0, prefix.size(), prefix) != 0) continue;
+
+    char* end = nullptr;
+    auto const generation = std::strtoull(name.c_str() + prefix.size(), &end, 10);
+    if (*end != '\0' || generation < logGeneration) continue;
+    generations.push_back(generation);
+  }
+  std::sort(generations.begin(), generations.end());
+
+  for (auto const generation : generations) {
+    wasLoaded = true;
+    logGeneration = generation;
+    logEnd = replay(logPath(generation));
+  }
+}
+
+std::uint64_t FilesystemIndex::replay(const fs::path& path) {
+  auto const file = Utility::FileHandle::open(path.string());
+  if (!file) return 0;
+
+  auto const end = readRecords(*file, 0, UINT64_MAX, [&](const FilesystemIndexRecord& record, std::string name) {
+    apply(record, std::move(name));
+    logged++;
+  });
+
+  if (end < file->size()) {
+    std::cout << "FilesystemIndex::replay dropping a torn record at " << end << " of " << path << std::endl;
+  }
+  return end;
+}
+
+bool FilesystemIndex::openLog() {
+  auto const fd = ::open(logPath(logGeneration).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cout << "FilesystemIndex::openLog couldn't open " << logPath(logGeneration) << std::endl;
+    log.reset();
+    return false;
+  }
+
+  // A torn record at the end is overwritten by the next one
+  ::ftruncate(fd, static_cast<off_t>(logEnd));
+  log = std::make_unique<Utility::FileHandle>(fd);
+  return true;
+}
+
+bool FilesystemIndex::append(const std::string& records) {
+  if (!log || !log->writeAt(records.data(), records.size(), logEnd)) return false;
+  logEnd += records.size();
+  return true;
+}
+
+std::optional<FilesystemEntry> FilesystemIndex::find(fileId id) const {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  auto const it = entries.find(id);
+  if (it == entries.end()) return {};
+  return it->second;
+}
+
+std::size_t FilesystemIndex::size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return entries.size();
+}
+
+std::uint64_t FilesystemIndex::totalSize() const {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  std::uint64_t total = 0;
+  for (auto const& [id, entry] : entries) total += entry.size;
+  return total;
+}
+
+bool FilesystemIndex::insert(const std::vector<std::pair<fileId, FilesystemEntry>>& inserted) {
+  std::string records;
+  for (auto const& [id, entry] : inserted) encodeInsert(records, id, entry);
+
+  bool due;
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!append(records)) return false;
+
+    for (auto const& [id, entry] : inserted) {
+      auto const [it, added] = entries.try_emplace(id, entry);
+      if (!added) it->second = entry;
+    }
+    logged += inserted.size();
+    due = logged >= snapshotInterval;
+  }
+
+  if (due) snapshot();
+  return true;
+}
+
+bool FilesystemIndex::insert(fileId id, const FilesystemEntry& entry) {
+  return insert(std::vector<std::pair<fileId, FilesystemEntry>>{{id, entry}});
+}
+
+bool FilesystemIndex::erase(fileId id) {
+  FilesystemIndexRecord record;
+  record.type = FilesystemIndexRecord::Erase;
+  record.id = id;
+  std::string records;
+  encode(records, record, {});
+
+  bool due;
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!append(records)) return false;
+
+    entries.erase(id);
+    logged++;
+    due = logged >= snapshotInterval;
+  }
+
+  if (due) snapshot();
+  return true;
+}
+
+bool FilesystemIndex::sync() {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return log && ::fdatasync(log->descriptor()) == 0;
+}
+
+bool FilesystemIndex::snapshot() {
+  std::unique_lock<std::mutex> snapshotLock(snapshotMutex, std::try_to_lock);
+  // Another thread is taking one already
+  if (!snapshotLock.owns_lock()) return true;
+
+  std::string records;
+  FilesystemIndexHeader header;
+  std::uint64_t previousGeneration;
+  {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (logged == 0 && fs::exists(directory / snapshotFileName)) return true;
+
+    records.reserve(entries.size() * (sizeof(FilesystemIndexRecord) + 32));
+    for (auto const& [id, entry] : entries) encodeInsert(records, id, entry);
+    header.count = entries.size();
+
+    // Changes from here on go to the next log, which the snapshot tells the next load to replay
+    previousGeneration = logGeneration;
+    logGeneration++;
+    logEnd = 0;
+    logged = 0;
+    header.logGeneration = logGeneration;
+    if (!openLog()) return false;
+  }
+  header.checksum = checksumOf(header);
+
+  auto const path = directory / snapshotFileName;
+  auto const partialPath = directory / (snapshotFileName.string() + ".saving");
+  auto const fd = ::open(partialPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  Utility::FileHandle file(fd);
+
+  auto const written = file.writeAt(&header, sizeof(header), 0)
+    && file.writeAt(records.data(), records.size(), sizeof(header))
+    && ::fdatasync(fd) == 0
+    && ::rename(partialPath.c_str(), path.c_str()) == 0;
+  if (!written) {
+    ::unlink(partialPath.c_str());
+    std::cout << "FilesystemIndex::snapshot failed writing " << path << std::endl;
+    return false;
+  }
+  Utility::syncDirectory(directory.string());
+
+  // The snapshot has everything the previous log had
+  ::unlink(logPath(previousGeneration).c_str());
+  return true;
+}
+}
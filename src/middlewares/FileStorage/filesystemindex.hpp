@@ -0,0 +1,144 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "../../idmap.hpp"
+#include "storage.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+//! Where a FilesystemStorage keeps a file: store/<storeId>/<name>, or store/by-id/<bucket>/<storeId>/<id> once it's fanned out
+struct FilesystemEntry {
+  std::uint32_t storeId = 0;
+  std::uint64_t size = 0;
+  std::optional<Utility::Hashing::Digest> digest;
+  //! The name the file was uploaded with
+  std::string name;
+  //! Whether the file is named by its id in the hashed fan-out, rather than by its name in a numbered store
+  bool fannedOut = false;
+};
+
+//! A change to a FilesystemIndex as it's logged, or an entry as it's snapshotted, followed by the name
+struct FilesystemIndexRecord {
+  enum Type : std::uint16_t {
+    Insert = 1,
+    Erase = 2
+  };
+  enum Flags : std::uint16_t {
+    HasDigest = 1 << 0,
+    FannedOut = 1 << 1
+  };
+
+  //! CRC32C of the rest of the record and the name
+  std::uint32_t checksum = 0;
+  std::uint16_t type = Insert;
+  std::uint16_t flags = 0;
+  std::uint32_t nameLength = 0;
+  std::uint32_t storeId = 0;
+  std::uint64_t id = 0;
+  std::uint64_t size = 0;
+  std::array<std::uint8_t, 32> digest{};
+};
+static_assert(sizeof(FilesystemIndexRecord) == 64, "FilesystemIndexRecord is part of the on-disk format");
+
+//! The first bytes of a FilesystemIndex snapshot, which are followed by count Insert records
+struct FilesystemIndexHeader {
+  static constexpr std::array<char, 8> expectedMagic = {'T', 'C', 'D', 'N', 'F', 'I', 'D', 'X'};
+  static constexpr std::uint32_t currentVersion = 1;
+
+  std::array<char, 8> magic = expectedMagic;
+  std::uint32_t version = currentVersion;
+  //! CRC32C of the header, with this field zeroed
+  std::uint32_t checksum = 0;
+  std::uint64_t count = 0;
+  //! The first log whose changes aren't in the snapshot
+  std::uint64_t logGeneration = 0;
+};
+static_assert(sizeof(FilesystemIndexHeader) == 32, "FilesystemIndexHeader is part of the on-disk format");
+
+/*!
+ * \brief The in-memory map from fileIds to where a FilesystemStorage keeps the files, so lookups never touch the disk
+ * Every change is appended to a log before it's applied, and every snapshotInterval changes the whole map is written
+ * to a snapshot and a new log is started. Opening the index loads the snapshot and replays the logs from the
+ * generation it names on, up to the first record that's torn or doesn't match its checksum.
+ */
+class FilesystemIndex {
+public:
+  static const fs::path snapshotFileName;
+  //! Logs are named <logFileName>.<generation>
+  static const fs::path logFileName;
+  //! Changes logged between snapshots
+  static constexpr std::uint64_t snapshotInterval = 100000;
+
+  std::optional<FilesystemEntry> find(fileId id) const;
+  std::size_t size() const;
+  //! The sizes of all the entries added up
+  std::uint64_t totalSize() const;
+  //! Whether there was a snapshot or a log to load
+  inline bool loaded() const noexcept { return wasLoaded; }
+
+  //! Calls fn(id, entry) for every entry, with changes held up until it's done, so fn mustn't change the index
+  template <typename Function>
+  void forEach(Function&& fn) const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (auto const& [id, entry] : entries) fn(id, entry);
+  }
+
+  //! Logs and applies the entries, taking a snapshot if one is due
+  bool insert(const std::vector<std::pair<fileId, FilesystemEntry>>& entries);
+  bool insert(fileId id, const FilesystemEntry& entry);
+  bool erase(fileId id);
+
+  //! Flushes the log to disk
+  bool sync();
+
+  /*!
+   * \brief Writes the whole map to a new snapshot and moves on to a new log
+   * The map is copied with changes held up, but written to disk while they carry on into the new log.
+   */
+  bool snapshot();
+
+  explicit FilesystemIndex(fs::path directory);
+  FilesystemIndex(const FilesystemIndex&) = delete;
+  //! Takes a snapshot if anything was logged since the last one
+  ~FilesystemIndex();
+
+private:
+  const fs::path directory;
+  bool wasLoaded = false;
+
+  mutable std::shared_mutex mutex;
+  Utility::Hashing::IdMap<fileId, FilesystemEntry, FileIdHasher> entries;
+  std::unique_ptr<Utility::FileHandle> log;
+  std::uint64_t logGeneration = 0;
+  std::uint64_t logEnd = 0;
+  std::uint64_t logged = 0;
+
+  //! Only one snapshot is written at a time
+  std::mutex snapshotMutex;
+
+  inline fs::path logPath(std::uint64_t generation) const {
+    return directory / (logFileName.string() + "." + std::to_string(generation));
+  }
+
+  void load();
+  //! Applies a log's records, and returns where its last good record ends
+  std::uint64_t replay(const fs::path& path);
+  //! Opens the log of the current generation for appending
+  bool openLog();
+  //! Appends the records to the log, with mutex held
+  bool append(const std::string& records);
+  void apply(const FilesystemIndexRecord& record, std::string name);
+};
+}
@@ -0,0 +1,200 @@
+#include "filesystemjournal.hpp"
+
+#include <array>
+#include <cstring>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../crc32c.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+const fs::path FilesystemJournal::fileName = fs::path{"journal"};
+
+namespace {
+//! The upload's device and inode, as they follow a record
+using UploadIdentity = std::array<std::uint64_t, 2>;
+
+std::uint32_t checksumOf(FilesystemJournalRecord record, std::string_view path, std::string_view upload,
+                         std::string_view identity) {
+  record.checksum = 0;
+  auto crc = Utility::Hashing::Crc32c::of(&record, sizeof(record));
+  crc = Utility::Hashing::Crc32c::extend(crc, path.data(), path.size());
+  crc = Utility::Hashing::Crc32c::extend(crc, upload.data(), upload.size());
+  return Utility::Hashing::Crc32c::extend(crc, identity.data(), identity.size());
+}
+
+void encode(std::string& buffer, const FilesystemJournal::Intent& intent) {
+  auto const path = intent.path.string();
+  auto const upload = intent.upload.string();
+  UploadIdentity const uploadIdentity{intent.uploadDevice, intent.uploadInode};
+  auto const identity = intent.uploadInode != 0
+    ? std::string_view(reinterpret_cast<const char*>(uploadIdentity.data()), sizeof(uploadIdentity))
+    : std::string_view();
+
+  FilesystemJournalRecord record;
+  record.type = intent.type;
+  record.flags = identity.empty() ? 0 : FilesystemJournalRecord::HasUploadIdentity;
+  record.id = intent.id;
+  record.pathLength = static_cast<std::uint32_t>(path.size());
+  record.uploadLength = static_cast<std::uint32_t>(upload.size());
+  record.checksum = checksumOf(record, path, upload, identity);
+
+  buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+  buffer.append(path);
+  buffer.append(upload);
+  buffer.append(identity);
+}
+}
+
+FilesystemJournal::FilesystemJournal(fs::path directory) : directory(directory) {
+  load();
+}
+
+void FilesystemJournal::load() {
+  auto const fd = ::open(path().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    std::cout << "FilesystemJournal::load couldn't open " << path() << std::endl;
+    return;
+  }
+  journal = std::make_unique<Utility::FileHandle>(fd);
+
+  // The journal only holds what was in flight, so it's read in one go
+  std::string buffer(journal->size(), '\0');
+  buffer.resize(journal->readAt(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size(), 0));
+
+  std::size_t offset = 0;
+  while (buffer.size() - offset >= sizeof(FilesystemJournalRecord)) {
+    FilesystemJournalRecord record;
+    std::memcpy(&record, buffer.data() + offset, sizeof(record));
+    auto const identityLength = (record.flags & FilesystemJournalRecord::HasUploadIdentity) ? sizeof(UploadIdentity) : 0;
+    auto const length = sizeof(record) + std::uint64_t{record.pathLength} + record.uploadLength + identityLength;
+    if (buffer.size() - offset < length) break;
+
+    std::string_view const path(buffer.data() + offset + sizeof(record), record.pathLength);
+    std::string_view const upload(path.data() + path.size(), record.uploadLength);
+    std::string_view const identity(upload.data() + upload.size(), identityLength);
+    if (checksumOf(record, path, upload, identity) != record.checksum) break;
+    if (record.type != FilesystemJournalRecord::Add && record.type != FilesystemJournalRecord::Remove) break;
+
+    Intent intent{static_cast<FilesystemJournalRecord::Type>(record.type), static_cast<fileId>(record.id),
+                  fs::path(std::string(path)), fs::path(std::string(upload))};
+    if (!identity.empty()) {
+      UploadIdentity uploadIdentity;
+      std::memcpy(uploadIdentity.data(), identity.data(), sizeof(uploadIdentity));
+      intent.uploadDevice = uploadIdentity[0];
+      intent.uploadInode = uploadIdentity[1];
+    }
+    leftOver.push_back(intent);
+    track(std::move(intent));
+    offset += length;
+  }
+
+  if (offset < buffer.size()) {
+    std::cout << "FilesystemJournal::load dropping a torn record at " << offset << " of " << path() << std::endl;
+    // Overwritten by the next intent otherwise, which would leave a mix of both
+    ::ftruncate(fd, static_cast<off_t>(offset));
+  }
+  end = offset;
+  syncedUpTo = offset;
+}
+
+void FilesystemJournal::track(Intent intent) {
+  auto const sequence = ++begun;
+  auto const [it, added] = running.try_emplace(intent.id, sequence);
+  if (!added) {
+    // Taken over by the new intent, i.e. a remove's file was moved before it got to it, but kept until a checkpoint
+    intents[it->second].finishedAt = ++finished;
+    it->second = sequence;
+  }
+  intents.emplace(sequence, Pending{std::move(intent)});
+}
+
+bool FilesystemJournal::begin(const std::vector<Intent>& begunNow) {
+  std::string records;
+  for (auto const& intent : begunNow) encode(records, intent);
+
+  std::uint64_t upTo;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!journal || !journal->writeAt(records.data(), records.size(), end)) return false;
+    end += records.size();
+    upTo = end;
+    for (auto const& intent : begunNow) track(intent);
+  }
+
+  std::lock_guard<std::mutex> syncLock(syncMutex);
+  // Synced along with someone else's intents while this waited
+  if (syncedUpTo >= upTo) return true;
+
+  std::uint64_t appended;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    appended = end;
+  }
+  if (::fdatasync(journal->descriptor()) != 0) return false;
+  syncedUpTo = appended;
+  return true;
+}
+
+bool FilesystemJournal::begin(const Intent& intent) {
+  return begin(std::vector<Intent>{intent});
+}
+
+void FilesystemJournal::finish(const std::vector<fileId>& ids) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto const id : ids) {
+    auto const it = running.find(id);
+    if (it == running.end()) continue;
+    intents[it->second].finishedAt = ++finished;
+    running.erase(id);
+  }
+}
+
+bool FilesystemJournal::checkpointDue() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return end >= checkpointSize;
+}
+
+std::uint64_t FilesystemJournal::mark() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return finished;
+}
+
+bool FilesystemJournal::checkpoint(std::uint64_t mark) {
+  // Nothing's appended or synced until the new journal replaces the old one
+  std::lock_guard<std::mutex> syncLock(syncMutex);
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::string records;
+  for (auto const& [sequence, pending] : intents) {
+    if (pending.finishedAt == 0 || pending.finishedAt > mark) encode(records, pending.intent);
+  }
+
+  auto const partialPath = directory / (fileName.string() + ".saving");
+  auto const fd = ::open(partialPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return false;
+  auto rewritten = std::make_unique<Utility::FileHandle>(fd);
+
+  auto const written = rewritten->writeAt(records.data(), records.size(), 0)
+    && ::fdatasync(fd) == 0
+    && ::rename(partialPath.c_str(), path().c_str()) == 0;
+  if (!written) {
+    ::unlink(partialPath.c_str());
+    std::cout << "FilesystemJournal::checkpoint failed writing " << path() << std::endl;
+    return false;
+  }
+  Utility::syncDirectory(directory.string());
+
+  for (auto it = intents.begin(); it != intents.end();) {
+    if (it->second.finishedAt != 0 && it->second.finishedAt <= mark) it = intents.erase(it);
+    else ++it;
+  }
+  journal = std::move(rewritten);
+  end = records.size();
+  syncedUpTo = end;
+  return true;
+}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "../../idmap.hpp"
+#include "storage.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+/*!
+ * \brief An operation a FilesystemStorage started, as it's journaled, followed by its path and its upload's
+ * An add's record is followed by the device and inode its upload was, if it has HasUploadIdentity.
+ */
+struct FilesystemJournalRecord {
+  enum Type : std::uint16_t {
+    Add = 1,
+    Remove = 2
+  };
+  enum Flags : std::uint16_t {
+    HasUploadIdentity = 1 << 0
+  };
+
+  //! CRC32C of the rest of the record, the paths and the upload's identity
+  std::uint32_t checksum = 0;
+  std::uint16_t type = Add;
+  std::uint16_t flags = 0;
+  std::uint32_t pathLength = 0;
+  std::uint32_t uploadLength = 0;
+  std::uint64_t id = 0;
+};
+static_assert(sizeof(FilesystemJournalRecord) == 24, "FilesystemJournalRecord is part of the on-disk format");
+
+/*!
+ * \brief The intents of the adds and removes a FilesystemStorage has in flight, so a crash partway through one can be undone or finished
+ * An operation's intent is appended and synced before it touches the disk, and it's finished once the index has its
+ * outcome. Finished intents are dropped by checkpoint(), which rewrites the journal with only those still in flight,
+ * so what's left for recovery is as long as the operations a crash could interrupt, however many files are stored.
+ */
+class FilesystemJournal {
+public:
+  static const fs::path fileName;
+  //! How far the journal grows before a checkpoint is due
+  static constexpr std::uint64_t checkpointSize = std::uint64_t{1} << 20;
+
+  struct Intent {
+    FilesystemJournalRecord::Type type;
+    fileId id;
+    //! Where the stored file is, or is going to be
+    fs::path path;
+    //! The upload an add takes the contents from, which it removes once the file's in the index
+    fs::path upload;
+    //! The device and inode the upload was when the add began, 0 if it's not known. Upload names are reused, so
+    //! only a file that's still this one is the add's upload
+    std::uint64_t uploadDevice = 0;
+    std::uint64_t uploadInode = 0;
+  };
+
+  //! Appends the intents and returns once they're on disk. Callers beginning at the same time share one sync
+  bool begin(const std::vector<Intent>& intents);
+  bool begin(const Intent& intent);
+  //! The operations on the ids are done, their intents are dropped at the next checkpoint()
+  void finish(const std::vector<fileId>& ids);
+
+  //! The intents that were in the journal when it was opened, in the order they were begun
+  inline const std::vector<Intent>& interrupted() const noexcept { return leftOver; }
+
+  bool checkpointDue() const;
+  //! Where the finished intents end, to be taken before what they did is synced, and passed to checkpoint() after
+  std::uint64_t mark() const;
+  /*!
+   * \brief Rewrites the journal with the intents that weren't finished by the mark
+   * Intents finished since are kept, what they did may not be on disk yet.
+   */
+  bool checkpoint(std::uint64_t mark);
+
+  explicit FilesystemJournal(fs::path directory);
+  FilesystemJournal(const FilesystemJournal&) = delete;
+
+private:
+  const fs::path directory;
+
+  struct Pending {
+    Intent intent;
+    //! When the intent was finished, counted in finish() calls, 0 while it's in flight
+    std::uint64_t finishedAt = 0;
+  };
+
+  mutable std::mutex mutex;
+  //! By when they were begun, so a checkpoint keeps them in order
+  std::map<std::uint64_t, Pending> intents;
+  //! The intent in flight for each id
+  Utility::Hashing::IdMap<fileId, std::uint64_t, FileIdHasher> running;
+  std::vector<Intent> leftOver;
+  std::uint64_t begun = 0;
+  std::uint64_t finished = 0;
+
+  std::unique_ptr<Utility::FileHandle> journal;
+  std::uint64_t end = 0;
+
+  //! Held while syncing, so callers that come in meanwhile wait for it and sync what they appended together
+  std::mutex syncMutex;
+  std::uint64_t syncedUpTo = 0;
+
+  inline fs::path path() const { return directory / fileName; }
+
+  //! Reads the intents back, up to the first record that's torn or doesn't match its checksum
+  void load();
+  //! Adds an intent to intents and running, with mutex held
+  void track(Intent intent);
+};
+}
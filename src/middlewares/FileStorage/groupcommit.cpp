@@ -0,0 +1,85 @@
+#include "groupcommit.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+GroupCommitter::GroupCommitter(FileStorage& storage, CommitWindow window)
+  : storage(storage), window(window), committer([this] { run(); }) {}
+
+GroupCommitter::~GroupCommitter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  committer.join();
+}
+
+std::future<std::unique_ptr<StoredFile>> GroupCommitter::submit(std::unique_ptr<StoredFile> file) {
+  std::promise<std::unique_ptr<StoredFile>> promise;
+  auto future = promise.get_future();
+
+  // Uploads from clients don't declare their size, so it's measured from the upload itself
+  auto size = file->size;
+  if (size == 0) {
+    std::error_code error;
+    auto const measured = fs::file_size(file->location, error);
+    if (!error) size = measured;
+  }
+
+  bool full;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending.empty()) windowStart = std::chrono::steady_clock::now();
+    pendingBytes += size;
+    pending.emplace_back(std::move(file), std::move(promise));
+    full = pending.size() == 1 || pending.size() >= window.files || pendingBytes >= window.bytes;
+  }
+  // The committer only needs waking for the first file, which starts the window, and for the one that fills it
+  if (full) wake.notify_one();
+  return future;
+}
+
+void GroupCommitter::flush() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // A request with nothing to flush would cut the next window short
+    if (pending.empty()) return;
+    flushRequested = true;
+  }
+  wake.notify_one();
+}
+
+void GroupCommitter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [this] { return stopping || !pending.empty(); });
+    if (pending.empty()) return;
+
+    wake.wait_until(lock, windowStart + window.delay, [this] {
+      return stopping || flushRequested || pending.size() >= window.files || pendingBytes >= window.bytes;
+    });
+
+    auto batch = std::move(pending);
+    pending.clear();
+    pendingBytes = 0;
+    flushRequested = false;
+    lock.unlock();
+
+    std::vector<std::unique_ptr<StoredFile>> files;
+    files.reserve(batch.size());
+    for (auto& entry : batch) files.push_back(std::move(entry.first));
+
+    try {
+      auto stored = storage.addBatch(std::move(files));
+      for (std::size_t i = 0; i < batch.size(); i++) {
+        batch[i].second.set_value(i < stored.size() ? std::move(stored[i]) : nullptr);
+      }
+    }
+    catch (...) {
+      for (auto& entry : batch) entry.second.set_exception(std::current_exception());
+    }
+
+    lock.lock();
+  }
+}
+}
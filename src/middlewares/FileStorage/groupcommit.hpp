@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "storage.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+using TinyCDN::Utility::operator""_mB;
+
+//! How long a GroupCommitter lets files gather before it commits them, whichever limit is reached first
+struct CommitWindow {
+  //! The longest the first file of a batch waits for others
+  std::chrono::microseconds delay{2000};
+  std::uintmax_t bytes = 4_mB;
+  std::size_t files = 1024;
+};
+
+/*!
+ * \brief Collects files submitted one at a time into batches for FileStorage::addBatch
+ * A batch is committed once its window is full or has run out, on the committer's own thread; files submitted while
+ * it's being committed gather in the next batch. Under load that makes batches as large as the storage is slow, and
+ * a lone upload waits for at most the window's delay.
+ */
+class GroupCommitter {
+public:
+  //! Queues file for the next batch. The future holds what addBatch returned for it
+  std::future<std::unique_ptr<StoredFile>> submit(std::unique_ptr<StoredFile> file);
+
+  //! Commits the files waiting for the window without waiting for it
+  void flush();
+
+  GroupCommitter(FileStorage& storage, CommitWindow window = {});
+  GroupCommitter(const GroupCommitter&) = delete;
+  //! Commits the files still waiting and stops the committer
+  ~GroupCommitter();
+
+private:
+  FileStorage& storage;
+  const CommitWindow window;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<std::pair<std::unique_ptr<StoredFile>, std::promise<std::unique_ptr<StoredFile>>>> pending;
+  std::uintmax_t pendingBytes = 0;
+  //! When the first of the pending files was submitted
+  std::chrono::steady_clock::time_point windowStart;
+  bool flushRequested = false;
+  bool stopping = false;
+
+  std::thread committer;
+
+  //! Waits for every window and commits its files, until stopping
+  void run();
+};
+}
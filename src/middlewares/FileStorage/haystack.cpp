@@ -1,16 +1,951 @@
 #include "haystack.hpp"
 
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../digest.hpp"
+#include "../../crc32c.hpp"
+
 
 namespace TinyCDN::Middleware::FileStorage {
 
+namespace {
+//! pwrite that retries until everything is written
+bool writeAt(int fd, const void* data, std::size_t length, std::uint64_t offset) {
+  auto const* bytes = static_cast<const char*>(data);
+  std::size_t done = 0;
+  while (done < length) {
+    auto const n = ::pwrite(fd, bytes + done, length - done, static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
 
-void Haystack::allocate() {
-  // create a file of the specified size with blank data
+//! A needle's header followed by its name and checksum table, as they are laid out in the volume file
+std::string headOf(const NeedleHeader& header, std::string_view name, const std::vector<std::uint32_t>& checksums) {
+  auto const checksumsLength = NeedleHeader::checksumCount(header.size) * sizeof(std::uint32_t);
+  std::string head(sizeof(NeedleHeader) + name.size() + checksumsLength, '\0');
+  std::memcpy(head.data(), &header, sizeof(NeedleHeader));
+  std::memcpy(head.data() + sizeof(NeedleHeader), name.data(), name.size());
+  std::memcpy(head.data() + sizeof(NeedleHeader) + name.size(), checksums.data(),
+              std::min<std::size_t>(checksumsLength, checksums.size() * sizeof(std::uint32_t)));
+  return head;
+}
+
+//! Reads the volume file from offset on, for files read without their checksums
+class VolumeRange : public Utility::ChunkSource {
+public:
+  VolumeRange(std::shared_ptr<const Utility::ChunkSource> volume, std::uintmax_t offset)
+    : volume(std::move(volume)), offset(offset) {}
+
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t position) const override {
+    return volume->readAt(buffer, length, offset + position);
+  }
+
+private:
+  std::shared_ptr<const Utility::ChunkSource> volume;
+  const std::uintmax_t offset;
+};
+
+//! Paces a copy to a number of bytes per second by sleeping whenever it gets ahead
+class Throttle {
+public:
+  explicit Throttle(std::uint64_t bytesPerSecond)
+    : bytesPerSecond(bytesPerSecond), start(std::chrono::steady_clock::now()) {}
+
+  void consumed(std::uint64_t bytes) {
+    if (bytesPerSecond == 0) return;
+    total += bytes;
+
+    auto const due = start + std::chrono::duration<double>(static_cast<double>(total) / bytesPerSecond);
+    std::this_thread::sleep_until(due);
+  }
+
+private:
+  const std::uint64_t bytesPerSecond;
+  const std::chrono::steady_clock::time_point start;
+  std::uint64_t total = 0;
+};
+
+//! Copies length bytes between two files in 256kB blocks
+bool copyRange(const Utility::ChunkSource& from, std::uint64_t fromOffset, int to, std::uint64_t toOffset,
+               std::uint64_t length, Throttle* throttle) {
+  std::vector<unsigned char> buffer(static_cast<std::size_t>(std::min<std::uint64_t>(length, 256_kB)));
+  for (std::uint64_t done = 0; done < length;) {
+    auto const amount = static_cast<std::size_t>(std::min<std::uint64_t>(buffer.size(), length - done));
+    if (from.readAt(buffer.data(), amount, fromOffset + done) != amount) return false;
+    if (!writeAt(to, buffer.data(), amount, toOffset + done)) return false;
+
+    done += amount;
+    if (throttle) throttle->consumed(amount);
+  }
+  return true;
+}
+
+HaystackIndexEntry entryOf(fileId id, const NeedleLocation& location) {
+  return HaystackIndexEntry{id, location.offset, location.size, location.flags, location.nameLength};
+}
+
+NeedleLocation locationOf(const HaystackIndexEntry& entry) {
+  return NeedleLocation{entry.offset, entry.size, entry.flags, entry.nameLength};
+}
+
+//! A volumeId for a new volume file
+std::uint64_t newVolumeId() {
+  static std::mutex mutex;
+  static std::mt19937_64 generator{std::random_device{}()};
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::uint64_t id;
+  do id = generator(); while (id == 0);
+  return id;
+}
+
+/*!
+ * \brief Computes a needle's checksum table from its contents as they are handed over block by block
+ * Blocks have to arrive in order, but don't have to line up with the checksum blocks.
+ */
+class ChecksumAccumulator {
+public:
+  void update(const void* data, std::size_t length) {
+    auto const* bytes = static_cast<const char*>(data);
+    while (length > 0) {
+      auto const amount = std::min<std::size_t>(length, NeedleHeader::checksumBlockSize - filled);
+      crc = Utility::Hashing::Crc32c::extend(crc, bytes, amount);
+      filled += amount;
+      bytes += amount;
+      length -= amount;
+
+      if (filled == NeedleHeader::checksumBlockSize) finishBlock();
+    }
+  }
+
+  std::vector<std::uint32_t> finish() {
+    if (filled > 0) finishBlock();
+    return std::move(checksums);
+  }
+
+private:
+  std::vector<std::uint32_t> checksums;
+  std::uint32_t crc = 0;
+  std::size_t filled = 0;
+
+  void finishBlock() {
+    checksums.push_back(crc);
+    crc = 0;
+    filled = 0;
+  }
 };
+}
+
+const fs::path Haystack::volumeFileName = fs::path{"haystack"};
+const fs::path Haystack::indexFileName = fs::path{"index"};
+
+HaystackNeedleSource::HaystackNeedleSource(std::shared_ptr<const Utility::ChunkSource> volume, const NeedleLocation& location)
+  : volume(std::move(volume)),
+    checksumsOffset(location.checksumsOffset()),
+    contentsOffset(location.contentsOffset()),
+    contentsSize(location.size),
+    verified(new std::atomic<bool>[NeedleHeader::checksumCount(location.size)]) {
+  for (std::uint64_t i = 0; i < NeedleHeader::checksumCount(contentsSize); i++) verified[i] = false;
+}
+
+void HaystackNeedleSource::readChecksums() const {
+  auto const count = static_cast<std::size_t>(NeedleHeader::checksumCount(contentsSize));
+  checksums.resize(count);
+
+  auto const length = count * sizeof(std::uint32_t);
+  if (volume->readAt(reinterpret_cast<unsigned char*>(checksums.data()), length, checksumsOffset) != length) {
+    // Without its checksums no block can be trusted, the first one stands for all of them
+    checksums.clear();
+  }
+}
+
+std::size_t HaystackNeedleSource::readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const {
+  if (offset >= contentsSize) return 0;
+  length = static_cast<std::size_t>(std::min<std::uintmax_t>(length, contentsSize - offset));
+
+  auto const read = volume->readAt(buffer, length, contentsOffset + offset);
+  if (read == 0) return 0;
+
+  std::call_once(checksumsRead, [this] { readChecksums(); });
+  if (checksums.empty()) throw CorruptBlockError(0);
+
+  auto const blockSize = std::uintmax_t{NeedleHeader::checksumBlockSize};
+  std::vector<unsigned char> whole;
+
+  for (auto block = offset / blockSize; block * blockSize < offset + read; block++) {
+    if (verified[block].load(std::memory_order_acquire)) continue;
+
+    auto const begin = block * blockSize;
+    auto const end = std::min(begin + blockSize, std::uintmax_t{contentsSize});
+
+    std::uint32_t crc;
+    if (begin >= offset && end <= offset + read) {
+      crc = Utility::Hashing::Crc32c::of(buffer + (begin - offset), static_cast<std::size_t>(end - begin));
+    }
+    else {
+      // Only part of the block was asked for, but its checksum covers all of it
+      whole.resize(static_cast<std::size_t>(end - begin));
+      if (volume->readAt(whole.data(), whole.size(), contentsOffset + begin) != whole.size()) throw CorruptBlockError(begin);
+      crc = Utility::Hashing::Crc32c::of(whole.data(), whole.size());
+    }
+
+    if (crc != checksums[static_cast<std::size_t>(block)]) throw CorruptBlockError(begin);
+    verified[block].store(true, std::memory_order_release);
+  }
+
+  return read;
+}
+
+HaystackReadCursor::Operation HaystackReadCursor::readBlocks(std::shared_ptr<const Utility::ChunkSource> contents) {
+  return [contents = std::move(contents)](std::uintmax_t position, std::size_t amount) {
+    HaystackBlock block{position, HaystackBlock::Storage(amount), 0, amount};
+
+    auto const read = contents->readAt(reinterpret_cast<unsigned char*>(block.storage.data()), amount, position);
+    if (read != amount) throw std::runtime_error("HaystackReadCursor: short read from the volume file");
+
+    return block;
+  };
+}
+
+HaystackReadWriteCursor::Operation HaystackReadWriteCursor::transformBlocks(std::shared_ptr<const Utility::ChunkSource> source,
+                                                                      std::shared_ptr<const HaystackTransformChain> transforms) {
+  return [source = std::move(source), transforms = std::move(transforms)](std::uintmax_t position, std::size_t amount) {
+    HaystackBlock block{position, HaystackBlock::Storage(amount), 0, amount};
+
+    auto const read = source->readAt(reinterpret_cast<unsigned char*>(block.storage.data()), amount, position);
+    if (read != amount) throw std::runtime_error("HaystackReadWriteCursor: short read from the source");
+
+    for (auto const& transform : *transforms) block = transform->apply(std::move(block));
+    return block;
+  };
+}
+
+HaystackWriteCursor::Operation HaystackWriteCursor::copyBlocks(std::shared_ptr<const Utility::ChunkSource> file,
+                                                              std::shared_ptr<const Utility::FileHandle> haystack,
+                                                              std::uintmax_t needleOffset) {
+  return [file = std::move(file), haystack = std::move(haystack), needleOffset](std::uintmax_t position, std::size_t amount) {
+    HaystackBlock block{position, HaystackBlock::Storage(amount), 0, amount};
+
+    auto const read = file->readAt(reinterpret_cast<unsigned char*>(block.storage.data()), amount, position);
+    if (read != amount) throw std::runtime_error("HaystackWriteCursor: short read from the file");
+
+    if (!writeAt(haystack->descriptor(), block.storage.data(), amount, needleOffset + position)) {
+      throw std::runtime_error("HaystackWriteCursor: failed writing to the volume file");
+    }
+
+    return block;
+  };
+}
+
+HaystackDirectWriteCursor::Operation HaystackDirectWriteCursor::copyNeedleBlocks(std::shared_ptr<const Utility::ChunkSource> file,
+                                                                                std::shared_ptr<const Utility::FileHandle> haystack,
+                                                                                std::uintmax_t needleOffset, std::string head,
+                                                                                std::uintmax_t contentsSize) {
+  return [file = std::move(file), haystack = std::move(haystack), needleOffset, head = std::move(head), contentsSize]
+    (std::uintmax_t position, std::size_t amount) {
+    // position and amount are relative to the needle here, and the storage starts out zeroed for the padding
+    HaystackBlock block;
+    block.storage.resize(amount);
+
+    if (position < head.size()) {
+      auto const headAmount = std::min<std::uintmax_t>(head.size() - position, amount);
+      std::memcpy(block.storage.data(), head.data() + position, headAmount);
+    }
+
+    auto const contentsBegin = std::max<std::uintmax_t>(position, head.size());
+    auto const contentsEnd = std::min<std::uintmax_t>(position + amount, head.size() + contentsSize);
+
+    block.position = contentsBegin - head.size();
+    block.begin = static_cast<std::size_t>(contentsBegin - position);
+
+    if (contentsBegin < contentsEnd) {
+      block.length = static_cast<std::size_t>(contentsEnd - contentsBegin);
+
+      auto const read = file->readAt(reinterpret_cast<unsigned char*>(block.storage.data() + block.begin), block.length, block.position);
+      if (read != block.length) throw std::runtime_error("HaystackDirectWriteCursor: short read from the file");
+    }
+
+    if (!writeAt(haystack->descriptor(), block.storage.data(), amount, needleOffset + position)) {
+      throw std::runtime_error("HaystackDirectWriteCursor: failed writing to the volume file");
+    }
+
+    return block;
+  };
+}
+
+fileId Haystack::getUniqueFileId() {
+  auto const id = ++fileUniqueId;
+
+  // Persist incremented id to the superblock
+  persist();
+  return id;
+}
+
+void Haystack::persist() {
+  HaystackSuperblock superblock;
+  superblock.size = this->size;
+  superblock.lastFileId = fileUniqueId;
+  superblock.needleAlignment = static_cast<std::uint32_t>(needleAlignment);
+  superblock.volumeId = volumeId;
+
+  writeAt(volume->descriptor(), &superblock, sizeof(superblock), 0);
+}
+
+bool Haystack::writeHeader(std::uint64_t offset, const NeedleHeader& header, std::string_view name,
+                           const std::vector<std::uint32_t>& checksums) {
+  std::vector<char> buffer(sizeof(NeedleHeader) + name.size() + checksums.size() * sizeof(std::uint32_t));
+  std::memcpy(buffer.data(), &header, sizeof(NeedleHeader));
+  std::memcpy(buffer.data() + sizeof(NeedleHeader), name.data(), name.size());
+  std::memcpy(buffer.data() + sizeof(NeedleHeader) + name.size(), checksums.data(), checksums.size() * sizeof(std::uint32_t));
+
+  return writeAt(volume->descriptor(), buffer.data(), buffer.size(), offset);
+}
+
+bool Haystack::writeFlags(std::uint64_t offset, std::uint32_t flags) {
+  return writeAt(volume->descriptor(), &flags, sizeof(flags), offset + offsetof(NeedleHeader, flags));
+}
+
+bool Haystack::writeDirect(std::uint64_t offset, const HaystackBlock::Storage& buffer) {
+  return writeAt(directVolume->descriptor(), buffer.data(), buffer.size(), offset);
+}
+
+void Haystack::openDirect() {
+  if (requestedWriteMode != WriteMode::Direct) return;
+
+  if (needleAlignment % HaystackDirectWriteCursor::alignment != 0) {
+    std::cout << "Haystack::openDirect needles aren't page-aligned, writing buffered: " << volumePath() << std::endl;
+    return;
+  }
+
+  auto const fd = ::open(volumePath().c_str(), O_RDWR | O_DIRECT | O_CLOEXEC);
+  if (fd < 0) {
+    std::cout << "Haystack::openDirect O_DIRECT isn't supported, writing buffered: " << std::strerror(errno) << std::endl;
+    return;
+  }
+  directVolume = std::make_shared<Utility::FileHandle>(fd);
+}
+
+void Haystack::allocate() {
+  fs::create_directories(this->location);
+
+  auto const fd = ::open(volumePath().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  volume = std::make_shared<Utility::FileHandle>(fd);
+
+  // Reserve the volume's blocks without writing them. Ranges nothing was written to read back as zeroes,
+  // which ends the needle scan.
+  if (::fallocate(fd, 0, 0, static_cast<off_t>(this->size)) != 0) {
+    // A sparse file gets its blocks as needles are written instead
+    std::cout << "Haystack::allocate fallocate failed, the volume file will be sparse: " << std::strerror(errno) << std::endl;
+    if (::ftruncate(fd, static_cast<off_t>(this->size)) != 0) {
+      volume.reset();
+      return;
+    }
+  }
+
+  // A snapshot left over from an earlier volume file wouldn't match the new volumeId anyway
+  fs::remove(indexPath());
+
+  fileUniqueId = 0;
+  needleAlignment = requestedWriteMode == WriteMode::Direct ? HaystackDirectWriteCursor::alignment : 8;
+  volumeId = newVolumeId();
+  writeOffset = dataOffset;
+  allocatedSize = std::make_unique<Size>(writeOffset);
+
+  persist();
+  openDirect();
+}
+
+void Haystack::load() {
+  auto const fd = ::open(volumePath().c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) return;
+  volume = std::make_shared<Utility::FileHandle>(fd);
 
+  HaystackSuperblock superblock;
+  auto const read = volume->readAt(reinterpret_cast<unsigned char*>(&superblock), sizeof(superblock), 0);
+  if (read != sizeof(superblock)
+      || superblock.magic != HaystackSuperblock::expectedMagic
+      || superblock.version != HaystackSuperblock::currentVersion
+      || superblock.needleAlignment < 8
+      || (superblock.needleAlignment & (superblock.needleAlignment - 1)) != 0) {
+    std::cout << "Haystack::load not a haystack: " << volumePath() << std::endl;
+    volume.reset();
+    return;
+  }
 
+  needleAlignment = superblock.needleAlignment;
+  volumeId = superblock.volumeId;
+  std::uint64_t lastFileId = superblock.lastFileId;
+  auto offset = dataOffset;
 
+  snapshot = HaystackIndexSnapshot::open(indexPath());
+  if (snapshot) {
+    auto const& saved = snapshot->describe();
+    if (volumeId != 0 && saved.volumeId == volumeId && saved.volumeEnd >= dataOffset && saved.volumeEnd <= this->size) {
+      offset = saved.volumeEnd;
+      lastFileId = std::max(lastFileId, saved.lastFileId);
+      deadBytes = saved.deadBytes;
+      liveCount = static_cast<std::size_t>(snapshot->size());
+    }
+    else {
+      std::cout << "Haystack::load the index snapshot is for another volume file, scanning: " << indexPath() << std::endl;
+      snapshot.reset();
+    }
+  }
 
+  writeOffset = scan(offset, lastFileId);
+  fileUniqueId = static_cast<fileId>(lastFileId);
+  allocatedSize = std::make_unique<Size>(writeOffset);
 
+  openDirect();
+}
+
+std::uint64_t Haystack::scan(std::uint64_t offset, std::uint64_t& lastFileId) {
+  // Needles are contiguous, so the first range without a needle header is where the next one goes
+  NeedleHeader header;
+  while (offset + sizeof(header) <= this->size) {
+    if (volume->readAt(reinterpret_cast<unsigned char*>(&header), sizeof(header), offset) != sizeof(header)) break;
+    if (header.magic != NeedleHeader::expectedMagic || header.blockSize != NeedleHeader::checksumBlockSize) break;
+
+    auto const length = needleLength(header.nameLength, header.size);
+    if (!(header.flags & (NeedleHeader::Pending | NeedleHeader::Deleted))) {
+      index.try_emplace(static_cast<fileId>(header.id), NeedleLocation{offset, header.size, header.flags, header.nameLength});
+      liveCount++;
+    }
+    else {
+      deadBytes += length;
+    }
+    lastFileId = std::max<std::uint64_t>(lastFileId, header.id);
+
+    offset += length;
+  }
+  return offset;
+}
+
+void Haystack::rebuildIndex(const std::shared_ptr<const HaystackIndexSnapshot>& corrupt) {
+  std::unique_lock<std::shared_mutex> volumeLock(volumeMutex);
+  std::lock_guard<std::mutex> appendLock(appendMutex);
+  std::unique_lock<std::shared_mutex> indexLock(indexMutex);
+  if (!corrupt || snapshot != corrupt) return;
+
+  std::cout << "Haystack::rebuildIndex the index snapshot is corrupt, scanning: " << volumePath() << std::endl;
+  fs::remove(indexPath());
+  snapshot.reset();
+  index.clear();
+  liveCount = 0;
+  deadBytes = 0;
+
+  // The flags in the volume file are up to date, removing a needle always writes them
+  std::uint64_t lastFileId = fileUniqueId;
+  scan(dataOffset, lastFileId);
+}
+
+std::optional<NeedleLocation> Haystack::locate(fileId id) const {
+  auto const search = index.find(id);
+  if (search != index.end()) {
+    if (search->second.flags & NeedleHeader::Deleted) return {};
+    return search->second;
+  }
+
+  if (!snapshot) return {};
+  auto const entry = snapshot->find(id);
+  if (!entry) return {};
+  return locationOf(*entry);
+}
+
+template <typename Function>
+void Haystack::forEachLocation(Function&& fn) const {
+  for (auto const& [id, location] : index) {
+    if (!(location.flags & NeedleHeader::Deleted)) fn(id, location);
+  }
+
+  if (!snapshot) return;
+  for (std::uint64_t i = 0; i < snapshot->size(); i++) {
+    auto const& entry = snapshot->entry(i);
+    if (!index.contains(static_cast<fileId>(entry.id))) fn(static_cast<fileId>(entry.id), locationOf(entry));
+  }
+}
+
+void Haystack::destroy() {
+  volume.reset();
+  directVolume.reset();
+  fs::remove_all(this->location);
+}
+
+std::unique_ptr<StoredFile> Haystack::lookup(fileId id) {
+  std::shared_ptr<Utility::FileHandle> volume;
+  std::optional<NeedleLocation> found;
+  for (auto attempt = 0;; attempt++) {
+    std::shared_ptr<const HaystackIndexSnapshot> corrupt;
+    {
+      std::shared_lock<std::shared_mutex> indexLock(indexMutex);
+      try {
+        found = locate(id);
+        volume = this->volume;
+      }
+      catch (const CorruptBlockError&) {
+        if (attempt > 0) return nullptr;
+        corrupt = snapshot;
+      }
+    }
+    if (!corrupt) break;
+    rebuildIndex(corrupt);
+  }
+  if (!found || !volume) return nullptr;
+  auto const location = *found;
+
+  // The header and the filename are read together
+  std::vector<char> buffer(sizeof(NeedleHeader) + location.nameLength);
+  auto const read = volume->readAt(reinterpret_cast<unsigned char*>(buffer.data()), buffer.size(), location.offset);
+  if (read != buffer.size()) return nullptr;
+
+  NeedleHeader header;
+  std::memcpy(&header, buffer.data(), sizeof(header));
+  // A needle removed after the snapshot was saved is only flagged in the volume file if the Haystack wasn't closed
+  if (header.magic != NeedleHeader::expectedMagic || header.id != id || (header.flags & NeedleHeader::Deleted)
+      || header.blockSize != NeedleHeader::checksumBlockSize) return nullptr;
+
+  auto stFile = std::make_unique<StoredFile>(
+    Size{location.size}, volumePath(), false, std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+
+  stFile->id = id;
+  stFile->position = std::make_pair(location.contentsOffset(), location.size);
+  stFile->name = std::string(buffer.data() + sizeof(NeedleHeader), location.nameLength);
+  stFile->contents = std::make_shared<HaystackNeedleSource>(volume, location);
+  stFile->digest = Utility::Hashing::Digest{header.digest};
+
+  return stFile;
+}
+
+std::unique_ptr<StoredFile> Haystack::add(std::unique_ptr<StoredFile> file) {
+  // A compaction can't swap the volume file while a needle is being written to it
+  std::shared_lock<std::shared_mutex> volumeLock(volumeMutex);
+  if (!volume) return nullptr;
+
+  auto const fd = ::open(file->location.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return nullptr;
+  auto const source = std::make_shared<Utility::FileHandle>(fd);
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  auto const name = file->filename().string();
+
+  NeedleHeader header;
+  header.flags = NeedleHeader::Pending;
+  header.size = source->size();
+  header.nameLength = static_cast<std::uint32_t>(name.size());
+
+  auto const length = needleLength(header.nameLength, header.size);
+  auto const headLength = sizeof(NeedleHeader) + name.size() + NeedleHeader::checksumCount(header.size) * sizeof(std::uint32_t);
+  auto const headPages = (headLength + HaystackDirectWriteCursor::alignment - 1) / HaystackDirectWriteCursor::alignment
+    * HaystackDirectWriteCursor::alignment;
+
+  auto const direct = directVolume != nullptr;
+  // O_DIRECT rewrites the head's pages as a whole from the first block, so the header and the name have to fit
+  // in the first page and the checksums in the first block
+  if (direct && (sizeof(NeedleHeader) + name.size() > HaystackDirectWriteCursor::alignment
+                 || headPages > HaystackDirectWriteCursor::defaultBlockSize)) return nullptr;
+
+  std::unique_lock<std::mutex> appendLock(appendMutex);
+  if (writeOffset + length > this->size) {
+    std::cout << "Haystack::add not enough space left for " << file->location << std::endl;
+    return nullptr;
+  }
+
+  auto const location = NeedleLocation{writeOffset, header.size, 0, header.nameLength};
+  header.id = getUniqueFileId();
+
+  // The pending header is written before the next needle can be reserved, so a scan can always step over this one
+  HaystackBlock::Storage headPage;
+  if (direct) {
+    auto const head = headOf(header, name, {});
+    headPage.resize(HaystackDirectWriteCursor::alignment);
+    std::copy(head.begin(), head.begin() + sizeof(NeedleHeader) + name.size(), headPage.begin());
+  }
+  if (!(direct ? writeDirect(location.offset, headPage) : writeHeader(location.offset, header, name))) return nullptr;
+
+  writeOffset += length;
+  allocatedSize = std::make_unique<Size>(writeOffset);
+  appendLock.unlock();
+
+  // The needle's space is lost until the next compaction, but the index rebuild has to skip it
+  auto const discard = [&] {
+    writeFlags(location.offset, NeedleHeader::Deleted);
+    deadBytes += length;
+    return nullptr;
+  };
+
+  // Hash and checksum the contents in order while the following blocks are still being copied into the needle
+  Utility::Hashing::Sha256 sha;
+  ChecksumAccumulator checksums;
+  try {
+    if (direct) {
+      HaystackDirectWriteCursor cursor(source, directVolume, location.offset, headOf(header, name, {}), location.size, length);
+      while (cursor.hasNext()) {
+        auto const block = cursor.next().get();
+        sha.update(block.data(), block.size());
+        checksums.update(block.data(), block.size());
+
+        // The head's pages are rewritten with the digest and checksums at the end, and hold the start of the contents too
+        if (block.position == 0) {
+          headPage.assign(block.storage.begin(), block.storage.begin() + static_cast<std::ptrdiff_t>(headPages));
+        }
+      }
+    }
+    else {
+      HaystackWriteCursor cursor(source, volume, location.contentsOffset(), location.size);
+      while (cursor.hasNext()) {
+        auto const block = cursor.next().get();
+        sha.update(block.data(), block.size());
+        checksums.update(block.data(), block.size());
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    std::cout << "Haystack::add " << e.what() << std::endl;
+    return discard();
+  }
+
+  auto const digest = sha.finish();
+  auto const table = checksums.finish();
+  header.flags = 0;
+  header.digest = digest.bytes;
+  if (direct) {
+    auto const head = headOf(header, name, table);
+    std::copy(head.begin(), head.end(), headPage.begin());
+    if (!writeDirect(location.offset, headPage)) return discard();
+  }
+  else if (!writeHeader(location.offset, header, name, table)) {
+    return discard();
+  }
+
+  {
+    std::unique_lock<std::shared_mutex> indexLock(indexMutex);
+    index.try_emplace(static_cast<fileId>(header.id), location);
+    liveCount++;
+  }
+
+  fs::remove(file->location);
+
+  auto stFile = std::make_unique<StoredFile>(
+    Size{location.size}, volumePath(), false, std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+
+  stFile->id = static_cast<fileId>(header.id);
+  stFile->position = std::make_pair(location.contentsOffset(), location.size);
+  stFile->name = name;
+  stFile->contents = std::make_shared<HaystackNeedleSource>(volume, location);
+  stFile->digest = digest;
+
+  return stFile;
+}
+
+void Haystack::remove(std::unique_ptr<StoredFile> file) {
+  if (!file->id.has_value()) return;
+  auto const id = file->id.value();
+
+  for (auto attempt = 0; attempt < 2; attempt++) {
+    std::shared_lock<std::shared_mutex> volumeLock(volumeMutex);
+    std::unique_lock<std::shared_mutex> indexLock(indexMutex);
+    if (!volume) return;
+
+    try {
+      auto location = locate(id);
+      if (!location) return;
+      auto const inSnapshot = snapshot && snapshot->find(id);
+  
+      location->flags |= NeedleHeader::Deleted;
+      writeFlags(location->offset, location->flags);
+      deadBytes += needleLength(location->nameLength, location->size);
+      liveCount--;
+  
+      // The snapshot still has the needle, so the index has to remember that it's gone
+      if (inSnapshot) index[id] = *location;
+      else index.erase(id);
+      return;
+    }
+    catch (const CorruptBlockError&) {
+      auto const corrupt = snapshot;
+      indexLock.unlock();
+      volumeLock.unlock();
+      rebuildIndex(corrupt);
+    }
+  }
+}
 
+HaystackReadCursor Haystack::read(const StoredFile& file, std::size_t blockSize, std::size_t maxInFlight) const {
+  if (file.contents) return HaystackReadCursor{file.contents, file.position ? file.position->second : 0, blockSize, maxInFlight};
+
+  // A file that didn't come from lookup() or add() is read unverified
+  auto const [offset, size] = file.position.value_or(std::make_pair(std::uintmax_t{0}, std::uintmax_t{0}));
+  std::shared_lock<std::shared_mutex> indexLock(indexMutex);
+  return HaystackReadCursor{std::make_shared<VolumeRange>(volume, offset), size, blockSize, maxInFlight};
+}
+
+std::size_t Haystack::fileCount() const {
+  std::shared_lock<std::shared_mutex> indexLock(indexMutex);
+  return liveCount;
+}
+
+std::uint64_t Haystack::compact(std::uint64_t bytesPerSecond) {
+  std::lock_guard<std::mutex> compactionLock(compactionMutex);
+
+  std::shared_ptr<Utility::FileHandle> source;
+  std::vector<std::pair<fileId, NeedleLocation>> live;
+  std::shared_ptr<const HaystackIndexSnapshot> corrupt;
+  do {
+    live.clear();
+    corrupt.reset();
+
+    std::shared_lock<std::shared_mutex> indexLock(indexMutex);
+    source = volume;
+    try {
+      forEachLocation([&](fileId id, const NeedleLocation& location) { live.emplace_back(id, location); });
+    }
+    catch (const CorruptBlockError&) {
+      corrupt = snapshot;
+      indexLock.unlock();
+      rebuildIndex(corrupt);
+    }
+  } while (corrupt);
+  if (!source) return 0;
+
+  // Copying in volume order reads the old volume file sequentially
+  auto const byOffset = [](const auto& a, const auto& b) { return a.second.offset < b.second.offset; };
+  std::sort(live.begin(), live.end(), byOffset);
+
+  auto const target = compactingVolumePath();
+  auto const fd = ::open(target.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return 0;
+  auto const compacted = std::make_shared<Utility::FileHandle>(fd);
+
+  auto const fail = [&](const char* reason) {
+    std::cout << "Haystack::compact " << reason << ": " << std::strerror(errno) << std::endl;
+    fs::remove(target);
+    return std::uint64_t{0};
+  };
+
+  if (::fallocate(fd, 0, 0, static_cast<off_t>(this->size)) != 0 && ::ftruncate(fd, static_cast<off_t>(this->size)) != 0) {
+    return fail("failed allocating the new volume file");
+  }
+
+  // Needles are copied as they are, the layout within a needle doesn't depend on where it starts
+  Utility::Hashing::IdMap<fileId, NeedleLocation, FileIdHasher> moved;
+  moved.reserve(live.size());
+  //! Needles the snapshot still had, but that were removed before the Haystack was last closed
+  Utility::Hashing::IdMap<fileId, bool, FileIdHasher> skipped;
+  std::uint64_t offset = dataOffset;
+  auto const copy = [&](fileId id, NeedleLocation location, Throttle* throttle) {
+    std::uint32_t flags;
+    if (source->readAt(reinterpret_cast<unsigned char*>(&flags), sizeof(flags), location.offset + offsetof(NeedleHeader, flags)) != sizeof(flags)) return false;
+    if (flags & NeedleHeader::Deleted) {
+      skipped.try_emplace(id, true);
+      return true;
+    }
+
+    auto const length = needleLength(location.nameLength, location.size);
+    if (!copyRange(*source, location.offset, fd, offset, length, throttle)) return false;
+
+    location.offset = offset;
+    moved.try_emplace(id, location);
+    offset += length;
+    return true;
+  };
+
+  Throttle throttle(bytesPerSecond);
+  for (auto const& [id, location] : live) {
+    if (!copy(id, location, &throttle)) return fail("failed copying a needle");
+  }
+
+  // From here on nothing is written to the old volume file
+  std::unique_lock<std::shared_mutex> volumeLock(volumeMutex);
+  std::unique_lock<std::mutex> appendLock(appendMutex);
+
+  // Catch up with what was added and removed while the needles were being copied. All of the snapshot was
+  // verified while the needles were listed, and only compactions and saveIndex() replace it
+  std::vector<std::pair<fileId, NeedleLocation>> added;
+  std::vector<fileId> removed;
+  std::uint64_t removedBytes = 0;
+  forEachLocation([&](fileId id, const NeedleLocation& location) {
+    if (!moved.contains(id) && !skipped.contains(id)) added.emplace_back(id, location);
+  });
+  for (auto const& [id, location] : moved) {
+    if (locate(id)) continue;
+    removed.push_back(id);
+    removedBytes += needleLength(location.nameLength, location.size);
+  }
+
+  std::sort(added.begin(), added.end(), byOffset);
+  for (auto const& [id, location] : added) {
+    if (!copy(id, location, nullptr)) return fail("failed copying a needle");
+  }
+  for (auto const id : removed) {
+    auto const& location = moved.find(id)->second;
+    std::uint32_t const flags = location.flags | NeedleHeader::Deleted;
+    if (!writeAt(fd, &flags, sizeof(flags), location.offset + offsetof(NeedleHeader, flags))) return fail("failed removing a needle");
+    moved.erase(id);
+  }
+
+  HaystackSuperblock superblock;
+  superblock.size = this->size;
+  superblock.lastFileId = fileUniqueId;
+  superblock.needleAlignment = static_cast<std::uint32_t>(needleAlignment);
+  superblock.volumeId = newVolumeId();
+  if (!writeAt(fd, &superblock, sizeof(superblock), 0)) return fail("failed writing the superblock");
+
+  // The new volume file has to be complete on disk before it can replace the old one
+  if (::fdatasync(fd) != 0) return fail("failed syncing the new volume file");
+  if (::rename(target.c_str(), volumePath().c_str()) != 0) return fail("failed replacing the volume file");
+  Utility::syncDirectory(this->location.string());
+
+  // Until the next snapshot is saved the whole index is kept in memory
+  auto const reclaimed = writeOffset > offset ? writeOffset - offset : 0;
+  {
+    std::unique_lock<std::shared_mutex> indexLock(indexMutex);
+    volume = compacted;
+    snapshot.reset();
+    index = std::move(moved);
+    liveCount = index.size();
+  }
+
+  volumeId = superblock.volumeId;
+  writeOffset = offset;
+  allocatedSize = std::make_unique<Size>(writeOffset);
+  directVolume.reset();
+  openDirect();
+
+  deadBytes = removedBytes;
+  reclaimedBytes += reclaimed;
+  compactions++;
+
+  appendLock.unlock();
+  volumeLock.unlock();
+  writeSnapshot();
+  return reclaimed;
+}
+
+bool Haystack::saveIndex() {
+  std::lock_guard<std::mutex> compactionLock(compactionMutex);
+  return writeSnapshot();
+}
+
+bool Haystack::writeSnapshot() {
+  // Waiting for the adds in progress makes every needle before volumeEnd either complete or flagged
+  std::shared_ptr<const HaystackIndexSnapshot> base;
+  std::vector<std::pair<fileId, NeedleLocation>> changes;
+  HaystackIndexHeader header;
+  {
+    std::unique_lock<std::shared_mutex> volumeLock(volumeMutex);
+    std::lock_guard<std::mutex> appendLock(appendMutex);
+    std::shared_lock<std::shared_mutex> indexLock(indexMutex);
+    if (!volume) return false;
+
+    base = snapshot;
+    changes.assign(index.begin(), index.end());
+    header.volumeId = volumeId;
+    header.volumeEnd = writeOffset;
+    header.lastFileId = fileUniqueId;
+    header.deadBytes = deadBytes;
+  }
+
+  // Nothing changed since the last snapshot, which is the usual case when a Haystack is closed
+  if (base && changes.empty()) {
+    auto const& saved = base->describe();
+    if (saved.volumeId == header.volumeId && saved.volumeEnd == header.volumeEnd
+        && saved.lastFileId == header.lastFileId && saved.deadBytes == header.deadBytes) return true;
+  }
+
+  std::sort(changes.begin(), changes.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  // Merge the changes into the last snapshot, a change replaces the snapshot's entry for the same id
+  HaystackIndexWriter writer(indexPath());
+  try {
+    auto const baseCount = base ? base->size() : 0;
+    std::uint64_t i = 0;
+    auto change = changes.begin();
+
+    while (i < baseCount || change != changes.end()) {
+      if (change == changes.end() || (i < baseCount && base->entry(i).id < change->first)) {
+        if (!writer.append(base->entry(i++))) return false;
+        continue;
+      }
+
+      if (i < baseCount && base->entry(i).id == change->first) i++;
+      if (!(change->second.flags & NeedleHeader::Deleted) && !writer.append(entryOf(change->first, change->second))) return false;
+      ++change;
+    }
+  }
+  catch (const CorruptBlockError&) {
+    // The rebuilt index doesn't have a snapshot to merge into
+    rebuildIndex(base);
+    return writeSnapshot();
+  }
+  if (!writer.finish(header)) return false;
+
+  auto saved = HaystackIndexSnapshot::open(indexPath());
+  if (!saved) return false;
+
+  // The changes that made it into the snapshot are served from it now
+  std::unique_lock<std::shared_mutex> indexLock(indexMutex);
+  for (auto const& [id, location] : changes) {
+    auto const current = index.find(id);
+    if (current == index.end()) {
+      // Removed after it was copied, and the new snapshot still has it
+      if (!(location.flags & NeedleHeader::Deleted)) {
+        index.try_emplace(id, NeedleLocation{location.offset, location.size, location.flags | NeedleHeader::Deleted, location.nameLength});
+      }
+    }
+    else if (current->second.offset == location.offset && current->second.flags == location.flags) {
+      index.erase(id);
+    }
+  }
+  snapshot = std::move(saved);
+  return true;
+}
+
+std::shared_future<std::uint64_t> Haystack::startCompaction(std::uint64_t bytesPerSecond) {
+  std::lock_guard<std::mutex> appendLock(appendMutex);
+  if (compaction.valid() && compaction.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return compaction;
+
+  compaction = std::async(std::launch::async, [this, bytesPerSecond] { return compact(bytesPerSecond); }).share();
+  return compaction;
+}
+
+HaystackStats Haystack::stats() const {
+  HaystackStats stats;
+  stats.deadBytes = deadBytes;
+  stats.reclaimedBytes = reclaimedBytes;
+  stats.compactions = compactions;
+
+  std::lock_guard<std::mutex> appendLock(appendMutex);
+  stats.liveBytes = writeOffset - dataOffset - std::min(writeOffset - dataOffset, stats.deadBytes);
+  return stats;
+}
+
+Haystack::~Haystack() {
+  // A compaction running in the background still uses the volume
+  if (compaction.valid()) compaction.wait();
+  if (volume) saveIndex();
+}
+
+Haystack::Haystack(Size size, fs::path location, bool preallocated, WriteMode writeMode)
+  : FileStorage(size, location, preallocated), requestedWriteMode(writeMode) {
+  if (!preallocated) {
+    allocate();
+  }
+  else {
+    load();
+  }
+}
 }
@@ -2,16 +2,28 @@
 
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <iterator>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
 
 #include <optional>
 #include <future>
 #include <experimental/filesystem>
 
 #include "storage.hpp"
+#include "haystackindex.hpp"
 
 #include "../../utility.hpp"
+#include "../../idmap.hpp"
+#include "../../executor.hpp"
 
 namespace fs = std::experimental::filesystem;
 using TinyCDN::Utility::Size;
@@ -20,196 +32,469 @@ using TinyCDN::Utility::operator""_kB;
 
 namespace TinyCDN::Middleware::FileStorage {
 
-//! A chunk of a Haystack's contents.
 /*!
+ * \brief The first bytes of a Haystack's volume file
+ * Fields are stored in host byte order; a volume file isn't meant to move between architectures.
+ */
+struct HaystackSuperblock {
+  static constexpr std::array<char, 8> expectedMagic = {'T', 'C', 'D', 'N', 'H', 'S', 'T', 'K'};
+  static constexpr std::uint32_t currentVersion = 1;
+
+  std::array<char, 8> magic = expectedMagic;
+  std::uint32_t version = currentVersion;
+  //! Needles start on multiples of this, a page for volumes written with O_DIRECT
+  std::uint32_t needleAlignment = 8;
+  //! The Haystack's size when it was allocated
+  std::uint64_t size = 0;
+  //! The last fileId handed out, so ids of removed needles are never reused
+  std::uint64_t lastFileId = 0;
+  //! Random, and new for every volume file a compaction writes, so an index snapshot can tell which one it's for
+  std::uint64_t volumeId = 0;
+};
 
-*/
-struct HaystackBlock {
-  //! The size of the buffer this block contains
-  const Size size;
-  //! Contents of the block (TODO should be static size)
-  std::string_view buffer;
+/*!
+ * \brief Precedes every file stored in a Haystack, followed by the filename, the checksums, and then the contents
+ * A needle is written with the Pending flag first, and only rewritten without it once its contents are complete,
+ * so a needle interrupted by a crash is skipped when the index is rebuilt.
+ * Every checksumBlockSize bytes of the contents have a CRC32C in the checksum table.
+ */
+struct NeedleHeader {
+  static constexpr std::uint32_t expectedMagic = 0x454C444E; // "NDLE"
+  static constexpr std::uint32_t checksumBlockSize = 256_kB;
 
-  HaystackBlock() : size(256_kB) {}
-  HaystackBlock(Size size) : size(size) {}
-  HaystackBlock(Size size, std::string_view buffer) : size(size), buffer(buffer) {}
+  //! The number of checksums for contents of size bytes
+  static inline std::uint64_t checksumCount(std::uint64_t size) noexcept {
+    return (size + checksumBlockSize - 1) / checksumBlockSize;
+  }
 
-  HaystackBlock& operator*() { return *this; }
+  enum Flags : std::uint32_t {
+    Pending = 1u << 0,
+    Deleted = 1u << 1
+  };
+
+  std::uint32_t magic = expectedMagic;
+  std::uint32_t flags = 0;
+  std::uint64_t id = 0;
+  //! Size of the contents
+  std::uint64_t size = 0;
+  std::uint32_t nameLength = 0;
+  //! The size of the blocks the checksums cover
+  std::uint32_t blockSize = checksumBlockSize;
+  //! SHA-256 of the contents
+  std::array<std::uint8_t, 32> digest{};
 };
+static_assert(sizeof(NeedleHeader) == 64, "NeedleHeader is part of the on-disk format");
+
+//! Where a needle lives in the volume file, as kept in a Haystack's in-memory index
+struct NeedleLocation {
+  //! Offset of the needle's header
+  std::uint64_t offset;
+  //! Size of the contents
+  std::uint64_t size;
+  std::uint32_t flags;
+  std::uint32_t nameLength;
+
+  inline std::uint64_t checksumsOffset() const noexcept {
+    return offset + sizeof(NeedleHeader) + nameLength;
+  }
 
-/*!
-  \brief A generic iterator class for operating on a Haystack
-  HaystackBlockType is the type used to deduce the return type of the iterator.
-  StreamType is supposed to be a stream-like interface such as std::ifstream or std::ofstream.
-  The iteration procedure returns a std::shared_future which guarantees an overloaded operation to execute on the current 256kB block.
-  The intention of the HaystackCursor is to allow multithreaded operation on the same Haystack.
-  However, currently there is little protection as in a lock or guard on the Haystack's contents.
-*/
-template <typename HaystackBlockType, typename StreamType>
-class HaystackCursor {
-  //inline HaystackBlock forward();
-  using iterator_category = std::forward_iterator_tag;
-  using iterator_type = HaystackBlock;
+  inline std::uint64_t contentsOffset() const noexcept {
+    return checksumsOffset() + NeedleHeader::checksumCount(size) * sizeof(std::uint32_t);
+  }
+};
 
+/*!
+ * \brief Reads a needle's contents and checks each block against its CRC32C the first time any of it is read
+ * The checksum table is only read once the contents are, so looking a file up stays a single pread.
+ * A block that doesn't match throws CorruptBlockError instead of returning its bytes.
+ */
+class HaystackNeedleSource : public Utility::ChunkSource {
 public:
-  std::size_t endBlock;
-  //! The current seek position of this cursor on the provided handle
-  std::size_t seekPosition;
+  //! Reads from offset within the contents, verifying every block the read touches that hasn't been verified yet
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override;
 
-  //! The input or output stream that operate() will use as its input or output
-  StreamType handle;
-  //! The absolute size of the Haystack, needed to prevent a potential buffer overflow error
-  const Size haystackSize;
-  //! The unexecuted haystack block operation of type HaystackBlockType
-  std::optional<std::shared_future<HaystackBlockType>>* futureBlock;
-
-  /*!
-  * \brief The operation that gets executed on the current block
-  * \param buffer An empty value that should be used as the output container
-  * \param forwardsAmount This will either be 256kB or smaller.
-  * A forwardsAmount <256kB would indicate this is either the only block, or the last of a series of blocks.
-  */
-  virtual void operate(std::string_view buffer, const std::size_t forwardsAmount);
+  inline std::uintmax_t size() const noexcept { return contentsSize; }
 
-  //! Returns an operation that will update the seekPosition after running an operation on the current block.
-  HaystackCursor<HaystackBlockType, StreamType> operator++() {
-    std::packaged_task<HaystackBlockType()> task([&]{
-      // If a file is < 256kB, it will be sent as a single HaystackBlock
-      // The final block will not have the fixed block size of 256kB.
-      std::string_view buffer;
+  HaystackNeedleSource(std::shared_ptr<const Utility::ChunkSource> volume, const NeedleLocation& location);
 
-      // haystack limit OR file limit?
-      // TODO specialize this per read/write cursor
-      auto const forwardsAmount = 256_kB > (haystackSize - seekPosition) ? 256_kB : (haystackSize - seekPosition);
+private:
+  std::shared_ptr<const Utility::ChunkSource> volume;
+  const std::uint64_t checksumsOffset;
+  const std::uint64_t contentsOffset;
+  const std::uint64_t contentsSize;
 
-      this->operate(buffer, forwardsAmount);
+  mutable std::once_flag checksumsRead;
+  mutable std::vector<std::uint32_t> checksums;
+  //! Set for every block once it has matched its checksum
+  std::unique_ptr<std::atomic<bool>[]> verified;
 
-      seekPosition += forwardsAmount;
+  void readChecksums() const;
+};
 
-      return HaystackBlockType{forwardsAmount, std::move(buffer)};
-    });
+//! A chunk of a needle's contents.
+struct HaystackBlock {
+  //! Page-aligned, so a block can be handed to O_DIRECT as is
+  using Storage = std::vector<char, Utility::AlignedAllocator<char, 4_kB>>;
+
+  //! Where the block's contents start within the needle's contents
+  std::uintmax_t position = 0;
+  //! The block as it was read or written, which for O_DIRECT writes also covers the needle's header and padding
+  Storage storage;
+  //! Where the contents start within storage
+  std::size_t begin = 0;
+  //! Length of the contents, at most the cursor's block size
+  std::size_t length = 0;
+
+  inline const char* data() const noexcept { return storage.data() + begin; }
+  inline char* data() noexcept { return storage.data() + begin; }
+  inline std::size_t size() const noexcept { return length; }
+  inline std::string_view buffer() const noexcept { return {data(), length}; }
+};
 
-    &futureBlock->emplace(task.get_future().share());
-    return *this;
+/*!
+  \brief A generic cursor for operating on a needle's contents one block at a time
+  HaystackBlockType is the type of the blocks the operation produces.
+  Operations run on an IOExecutor, up to maxInFlight blocks ahead of the consumer, and next() hands out
+  their std::shared_futures in block order. A block can therefore be copied or served while the following
+  ones are still being read or written, and many cursors can operate on the same Haystack at once.
+  The operation is shared with the submitted tasks instead of capturing the cursor, so moving a cursor is safe.
+*/
+template <typename HaystackBlockType>
+class HaystackCursor {
+public:
+  /*!
+  * \brief The operation that gets executed on a block
+  * Its arguments are where the block starts within the needle's contents, and the block's size.
+  * The size will either be blockSize or smaller. A size < blockSize would indicate this is either the only block,
+  * or the last of a series of blocks.
+  */
+  using Operation = std::function<HaystackBlockType(std::uintmax_t position, std::size_t amount)>;
+
+  //! Size of every block but the last one
+  const std::size_t blockSize;
+  //! Offset of the needle (or its contents) in the volume file, 0 for cursors that read through a HaystackNeedleSource
+  const std::uintmax_t needleOffset;
+  //! Size of the needle's contents, needed to prevent reading or writing past the needle
+  const std::uintmax_t needleSize;
+  //! How many blocks may be submitted before the consumer has taken the first of them
+  const std::size_t maxInFlight;
+  //! Where in the needle's contents the next block to submit starts
+  std::uintmax_t seekPosition = 0;
+
+  //! False once every block of the needle has been returned by next()
+  inline bool hasNext() const noexcept { return !inFlight.empty() || seekPosition < needleSize; }
+
+  //! The next block in order. The future holds the exception if the operation on it failed.
+  std::shared_future<HaystackBlockType> next() {
+    submit();
+    auto block = std::move(inFlight.front());
+    inFlight.pop_front();
+
+    // Keep the executor busy while the consumer handles this block
+    submit();
+    return block;
   }
 
-  std::optional<std::shared_future<HaystackBlockType>>& operator*() { return *futureBlock; }
-  // TODO make this compare HayStacks...
-  bool operator==(const HaystackCursor<HaystackBlockType, StreamType> rhs) const { return seekPosition == rhs.seekPosition; }
-  bool operator!=(const HaystackCursor<HaystackBlockType, StreamType> rhs) const { return seekPosition != rhs.seekPosition; }
-  bool operator<=(const HaystackCursor<HaystackBlockType, StreamType> rhs) const { return seekPosition <= rhs.seekPosition; }
-
-  HaystackCursor<HaystackBlockType, StreamType>(StreamType handle, std::size_t seekPosition, Size haystackSize)
-    : handle(handle), seekPosition(seekPosition), haystackSize(haystackSize)
+  HaystackCursor(std::uintmax_t needleOffset, std::uintmax_t needleSize, std::size_t blockSize, std::size_t maxInFlight,
+                 Utility::IOExecutor& executor, Operation operate)
+    : blockSize(blockSize), needleOffset(needleOffset), needleSize(needleSize),
+      maxInFlight(std::max<std::size_t>(1, maxInFlight)),
+      executor(executor), operate(std::make_shared<const Operation>(std::move(operate)))
   {}
 
-  virtual ~HaystackCursor<HaystackBlockType, StreamType>();
-
-};
+  HaystackCursor(HaystackCursor&&) = default;
+  HaystackCursor(const HaystackCursor&) = delete;
 
-class HaystackReadCursor : public HaystackCursor<const HaystackBlock, std::ifstream&> {
-  inline virtual void operate(std::string_view buffer, const std::size_t forwardsAmount) override {
-    handle.seekg(static_cast<long>(seekPosition));
-    handle.read(reinterpret_cast<char*>(&buffer), static_cast<std::streamsize>(seekPosition + forwardsAmount));
+  //! Waits for the blocks that were submitted but never taken, so nothing operates on the needle afterwards
+  virtual ~HaystackCursor() {
+    for (auto const& block : inFlight) block.wait();
   }
 
-public:
+private:
+  Utility::IOExecutor& executor;
+  std::shared_ptr<const Operation> operate;
+  std::deque<std::shared_future<HaystackBlockType>> inFlight;
+
+  void submit() {
+    while (inFlight.size() < maxInFlight && seekPosition < needleSize) {
+      // The final block will not have the fixed block size
+      auto const position = seekPosition;
+      auto const amount = static_cast<std::size_t>(std::min<std::uintmax_t>(blockSize, needleSize - seekPosition));
+      seekPosition += amount;
+
+      inFlight.push_back(executor.submit([operate = operate, position, amount]{
+        return (*operate)(position, amount);
+      }).share());
+    }
+  }
+};
 
-  HaystackReadCursor cbegin() const { return HaystackReadCursor{this->handle, 0, this->haystackSize}; }
-  HaystackReadCursor cend(std::size_t endPosition) const { return HaystackReadCursor{this->handle, endPosition, this->haystackSize}; }
+//! A HaystackCursor that reads a needle's contents, a block that fails its checksum holds a CorruptBlockError
+class HaystackReadCursor : public HaystackCursor<HaystackBlock> {
+  //! Reads blocks from the needle's contents
+  static Operation readBlocks(std::shared_ptr<const Utility::ChunkSource> contents);
 
-  HaystackReadCursor(std::ifstream& haystackHandle, std::size_t seekPosition, Size haystackSize)
-    : HaystackCursor<const HaystackBlock, std::ifstream&>(haystackHandle, seekPosition, haystackSize)
+public:
+  //! \param contents Usually a HaystackNeedleSource, read from the start of the contents
+  HaystackReadCursor(std::shared_ptr<const Utility::ChunkSource> contents, std::uintmax_t needleSize,
+                     std::size_t blockSize = 256_kB, std::size_t maxInFlight = 4,
+                     Utility::IOExecutor& executor = Utility::IOExecutor::shared())
+    : HaystackCursor<HaystackBlock>(0, needleSize, blockSize, maxInFlight, executor, readBlocks(std::move(contents)))
   {}
+};
 
+//! A HaystackCursor that copies a file's contents into a needle and returns every block it wrote
+class HaystackWriteCursor : public HaystackCursor<HaystackBlock> {
+  //! Reads blocks from file and writes them to the volume file
+  static Operation copyBlocks(std::shared_ptr<const Utility::ChunkSource> file,
+                              std::shared_ptr<const Utility::FileHandle> haystack, std::uintmax_t needleOffset);
 
+public:
+  HaystackWriteCursor(std::shared_ptr<const Utility::ChunkSource> file, std::shared_ptr<const Utility::FileHandle> haystack,
+                      std::uintmax_t needleOffset, std::uintmax_t needleSize, std::size_t blockSize = 256_kB,
+                      std::size_t maxInFlight = 4, Utility::IOExecutor& executor = Utility::IOExecutor::shared())
+    : HaystackCursor<HaystackBlock>(needleOffset, needleSize, blockSize, maxInFlight, executor,
+                                    copyBlocks(std::move(file), std::move(haystack), needleOffset))
+  {}
 };
 
-//! A HaystackCursor that takes an input stream and writes its contents to the Haystack
-class HaystackWriteCursor : public HaystackCursor<HaystackBlock, std::ofstream&> {
-  //! The input handle that will be written to the Haystack
-  std::ifstream& fileHandle;
-  //! The seekPosition equivalent for the current file. Starts at 0 to copy the entire file.
-  std::size_t fileSeekPosition = 0;
+/*!
+ * \brief A HaystackWriteCursor for volume files opened with O_DIRECT
+ * O_DIRECT needs aligned offsets, lengths and memory, so blocks cover the whole needle instead of only its contents:
+ * the first one starts with the header and name, and the last one is zero-padded to the needle's end.
+ * Each block's contents are still returned as its buffer().
+ */
+class HaystackDirectWriteCursor : public HaystackCursor<HaystackBlock> {
+  //! Lays out blocks of the needle in aligned buffers and writes them to the volume file
+  static Operation copyNeedleBlocks(std::shared_ptr<const Utility::ChunkSource> file,
+                                    std::shared_ptr<const Utility::FileHandle> haystack,
+                                    std::uintmax_t needleOffset, std::string head, std::uintmax_t contentsSize);
+
+public:
+  //! The alignment O_DIRECT writes need
+  static constexpr std::size_t alignment = 4_kB;
+  static constexpr std::size_t defaultBlockSize = 256_kB;
 
   /*!
-   * \brief operate Copies a file's contents to the provided HaystackBlock buffer.
-   * \param buffer The future HaystackBlock's buffer, i.e. its contents
-   * \param forwardsAmount How far to seek in the file's contents forwards after
+   * \param needleOffset Where the needle starts, aligned
+   * \param head The needle's header followed by its name and room for the checksums
+   * \param needleLength The space reserved for the needle, aligned
+   * \param blockSize Rounded down to the alignment
    */
-  inline virtual void operate(std::string_view buffer, const std::size_t forwardsAmount) override {
-    fileHandle.seekg(static_cast<long>(fileSeekPosition));
-    fileHandle.read(reinterpret_cast<char*>(&buffer), static_cast<std::streamsize>(forwardsAmount));
-    fileSeekPosition += forwardsAmount;
+  HaystackDirectWriteCursor(std::shared_ptr<const Utility::ChunkSource> file, std::shared_ptr<const Utility::FileHandle> haystack,
+                            std::uintmax_t needleOffset, std::string head, std::uintmax_t contentsSize,
+                            std::uintmax_t needleLength, std::size_t blockSize = defaultBlockSize,
+                            std::size_t maxInFlight = 4, Utility::IOExecutor& executor = Utility::IOExecutor::shared())
+    : HaystackCursor<HaystackBlock>(needleOffset, needleLength, std::max(alignment, blockSize / alignment * alignment),
+                                    maxInFlight, executor,
+                                    copyNeedleBlocks(std::move(file), std::move(haystack), needleOffset, std::move(head), contentsSize))
+  {}
+};
 
-    handle.seekp(static_cast<long>(seekPosition));
-    handle << buffer;
-  }
+//! Counters for how much of a Haystack's volume holds live needles
+struct HaystackStats {
+  //! Space taken by needles that can still be looked up
+  std::uint64_t liveBytes = 0;
+  //! Space taken by removed needles and needles whose write failed, which a compaction reclaims
+  std::uint64_t deadBytes = 0;
+  //! Space given back by all compactions since the Haystack was opened
+  std::uint64_t reclaimedBytes = 0;
+  std::uint64_t compactions = 0;
+};
 
+/*!
+ * \brief A step that rewrites every block streaming through a HaystackReadWriteCursor, like compressing or encrypting it
+ * apply() runs on the executor for several blocks at once, so a transform can't keep state from one block to the
+ * next; whatever it needs to know about a block's place in the stream is in its position.
+ */
+class HaystackTransform {
 public:
+  //! Returns the transformed block, keeping its position. Throws if the block can't be transformed
+  virtual HaystackBlock apply(HaystackBlock block) const = 0;
+
+  virtual ~HaystackTransform() = default;
+};
+
+//! Transforms applied one after the other
+using HaystackTransformChain = std::vector<std::shared_ptr<const HaystackTransform>>;
 
-  HaystackWriteCursor begin() const { return HaystackWriteCursor{this->fileHandle, this->handle, 0, this->haystackSize}; }
-  HaystackWriteCursor end(std::size_t endPosition) const { return HaystackWriteCursor{this->fileHandle, this->handle, endPosition, this->haystackSize}; }
+/*!
+ * \brief A HaystackCursor that runs every block of a source through a chain of transforms
+ * Every block is read and transformed by a task of its own, so while the consumer writes one block the ones after it
+ * are being transformed and read: with enough blocks in flight, ingest runs at the pace of its slowest stage rather
+ * than the sum of them. Blocks come out in order, with the position they had in the source and the size the last
+ * transform gave them.
+ */
+class HaystackReadWriteCursor : public HaystackCursor<HaystackBlock> {
+  //! Reads blocks from the source and applies the transforms to them
+  static Operation transformBlocks(std::shared_ptr<const Utility::ChunkSource> source,
+                                   std::shared_ptr<const HaystackTransformChain> transforms);
 
-  HaystackWriteCursor(std::ifstream& fileHandle, std::ofstream& haystackHandle, std::size_t seekPosition, Size haystackSize)
-    : HaystackCursor<HaystackBlock, std::ofstream&>(haystackHandle, seekPosition, haystackSize), fileHandle(fileHandle)
+public:
+  HaystackReadWriteCursor(std::shared_ptr<const Utility::ChunkSource> source, std::uintmax_t size,
+                          HaystackTransformChain transforms, std::size_t blockSize = 256_kB,
+                          std::size_t maxInFlight = 4, Utility::IOExecutor& executor = Utility::IOExecutor::shared())
+    : HaystackCursor<HaystackBlock>(0, size, blockSize, maxInFlight, executor,
+                                    transformBlocks(std::move(source),
+                                                    std::make_shared<const HaystackTransformChain>(std::move(transforms))))
   {}
 };
 
-// ReadWriteCursor - for video encoding, encryption etc.
 /*!
- * \brief The Haystack, a stucture of a fixed Size that allows storing multiple files within the same file.
+ * \brief The Haystack, a structure of a fixed Size that allows storing multiple files within the same file.
+ * Files are appended as needles to a single volume file that is allocated up front, and an in-memory index maps
+ * every fileId to its needle, so looking a file up takes one pread and no filesystem metadata operations.
+ * Removing a file only flags its needle as deleted; its space stays allocated until the Haystack is compacted.
+ * The index is rebuilt by scanning the needles when an existing Haystack is opened, unless there is an index snapshot.
+ *
+ * An index snapshot is an mmap'd file of the index sorted by id, saved by saveIndex() and when the Haystack is
+ * closed. Lookups search it in place, and only what changed since it was saved is kept in memory, so opening a
+ * Haystack that has one only scans the needles appended after it was saved.
+ *
+ * Compaction copies the live needles into a new volume file next to the old one and renames it over it once
+ * they're all copied. Files looked up before the swap keep reading the old volume file through their own handle,
+ * so reads never wait for a compaction or see a needle half copied.
+ *
+ * The volume file is reserved with fallocate, so allocating doesn't write any data. In the Direct write mode needles
+ * are page-aligned and written with O_DIRECT, so bulk ingestion bypasses the page cache that serves hot reads;
+ * reads always go through the page cache.
  */
-struct Haystack : FileStorage {
+class Haystack : public FileStorage {
 public:
-  // static size
-  std::ifstream inputHandle;
-  std::ofstream outputHandle;
-
-  const bool preallocated = false;
-
-  // NOTE: The haystack should have a 16-byte(?) META information block
-  // Actually this should be in a separate file
-  // It should hold the last unique id
+  //! The volume file inside location
+  static const fs::path volumeFileName;
+  //! The index snapshot inside location
+  static const fs::path indexFileName;
+  //! Where the first needle starts, the superblock gets the rest of the first page
+  static constexpr std::uint64_t dataOffset = 4_kB;
+
+  enum class WriteMode {
+    //! Needles go through the page cache and are aligned to 8 bytes
+    Buffered,
+    //! Needles are aligned to a page and written with O_DIRECT
+    Direct
+  };
+
+  //! Creates the volume file and writes a fresh superblock
   void allocate();
+  //! Deletes the Haystack's directory
+  void destroy();
 
+  std::unique_ptr<StoredFile> lookup(fileId id);
+  std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file);
+  void remove(std::unique_ptr<StoredFile> file);
 
-//  HaystackReadCursor cseek(std::size_t position) const {
-//    return HaystackReadCursor{this->outputHandle, position};
-//  }
+  //! A cursor over the contents of a file returned by lookup() or add(), which verifies their checksums
+  HaystackReadCursor read(const StoredFile& file, std::size_t blockSize = 256_kB, std::size_t maxInFlight = 4) const;
 
-  // TODO lock the input/output handles
-  HaystackWriteCursor write(std::ifstream& fileHandle, std::size_t position) {
-    return HaystackWriteCursor{fileHandle, this->outputHandle, position, this->getAllocatedSize()};
-  }
+  //! The number of files stored
+  std::size_t fileCount() const;
 
-//  ReadWriteHaystackCursor begin;
-//  ReadOnlyHaystackCursor cbegin;
-//  ReadWriteHaystackCursor end;
-//  ReadOnlyHaystackCursor cend;
+  /*!
+   * \brief Copies the live needles into a fresh volume file and swaps it in, giving back the space of removed ones
+   * Lookups and reads carry on while the needles are copied; adds and removes only wait while the needles added
+   * in the meantime are copied and the volume files are swapped.
+   * Needles removed after the index snapshot was saved by a process that didn't get to close the Haystack aren't
+   * counted in stats(), but they're reclaimed all the same.
+   * \param bytesPerSecond Limits the copying, 0 doesn't
+   * \return The bytes reclaimed, 0 if there was nothing to reclaim or the compaction failed
+   */
+  std::uint64_t compact(std::uint64_t bytesPerSecond = 0);
 
-  HaystackReadCursor read(std::size_t position) {
-    return HaystackReadCursor{this->inputHandle, position, this->getAllocatedSize()};
-  }
+  //! Runs compact() on its own thread, unless a compaction is already running
+  std::shared_future<std::uint64_t> startCompaction(std::uint64_t bytesPerSecond = 0);
 
-  inline void addFile(std::size_t position, std::ifstream file, Size fileSize) {
-    // addedFile
-    for (auto it = this->write(file, position); it <= it.end(position + fileSize); ++it) {
-      auto block = *it;
-      block.value().get();
-      // TODO verify hashed chunk
-    }
-  }
+  HaystackStats stats() const;
+
+  /*!
+   * \brief Writes the index to the index snapshot, so opening the Haystack doesn't have to scan the needles before this
+   * Waits for the adds in progress, and holds up new ones only while what changed since the last snapshot is copied.
+   */
+  bool saveIndex();
 
+  inline fs::path volumePath() const { return this->location / volumeFileName; }
+  //! Where a compaction writes the new volume file before it replaces the old one
+  inline fs::path compactingVolumePath() const { return this->location / (volumeFileName.string() + ".compacting"); }
+  inline fs::path indexPath() const { return this->location / indexFileName; }
 
-  Haystack(const Haystack&);
+  //! The mode writes actually use, which is Buffered if O_DIRECT wasn't available
+  inline WriteMode writeMode() const noexcept { return directVolume ? WriteMode::Direct : WriteMode::Buffered; }
 
-  inline Haystack(Size size, fs::path location, bool preallocated)
-    : FileStorage(size, location, preallocated) {
-    if (!preallocated) {
-      allocate();
-  }
+  //! The space a needle takes up in the volume file
+  inline std::uint64_t needleLength(std::uint64_t nameLength, std::uint64_t size) const noexcept {
+    auto const length = sizeof(NeedleHeader) + nameLength + NeedleHeader::checksumCount(size) * sizeof(std::uint32_t) + size;
+    return (length + needleAlignment - 1) / needleAlignment * needleAlignment;
   }
 
+  Haystack(const Haystack&) = delete;
+  /*!
+   * \param writeMode For a preallocated Haystack, Direct only takes effect if the volume was allocated with it
+   */
+  Haystack(Size size, fs::path location, bool preallocated, WriteMode writeMode = WriteMode::Buffered);
+  ~Haystack();
+
+private:
+  //! The volume file, opened for reading and writing. It's replaced by a compaction while indexMutex is held,
+  //! so it's copied out together with the index entries read from it
+  std::shared_ptr<Utility::FileHandle> volume;
+  //! The volume file opened with O_DIRECT, only in the Direct write mode
+  std::shared_ptr<Utility::FileHandle> directVolume;
+  //! The write mode the Haystack was opened with
+  const WriteMode requestedWriteMode;
+  //! Needles start on multiples of this, as recorded in the superblock
+  std::uint64_t needleAlignment = 8;
+  //! The volume file's volumeId, as recorded in the superblock
+  std::uint64_t volumeId = 0;
+
+  //! Serializes reserving space and ids for new needles, and starting compactions
+  mutable std::mutex appendMutex;
+  //! Where the next needle will be appended
+  std::uint64_t writeOffset = dataOffset;
+
+  mutable std::shared_mutex indexMutex;
+  //! The index as it was last saved, if it was saved for this volume file
+  std::shared_ptr<const HaystackIndexSnapshot> snapshot;
+  //! Needles added since the snapshot, and the snapshot's needles removed since with the Deleted flag
+  Utility::Hashing::IdMap<fileId, NeedleLocation, FileIdHasher> index;
+  //! The number of files in the snapshot and the index together
+  std::size_t liveCount = 0;
+
+  //! Held shared by add() and remove() for as long as they write to the volume, and exclusively by compact()
+  //! while it copies the last needles and swaps the volume files
+  std::shared_mutex volumeMutex;
+  //! Only one compaction or index snapshot runs at a time
+  std::mutex compactionMutex;
+  std::shared_future<std::uint64_t> compaction;
+
+  std::atomic<std::uint64_t> deadBytes{0};
+  std::atomic<std::uint64_t> reclaimedBytes{0};
+  std::atomic<std::uint64_t> compactions{0};
+
+  fileId getUniqueFileId();
+  //! Saves the superblock
+  void persist();
+  //! Opens the volume file and rebuilds the index from the snapshot and the needles after it
+  void load();
+  //! Adds the needles from offset on to the index
+  std::uint64_t scan(std::uint64_t offset, std::uint64_t& lastFileId);
+  //! saveIndex() while compactionMutex is held
+  bool writeSnapshot();
+  //! Drops a snapshot that failed its checksums and rebuilds the index by scanning, unless it was replaced already
+  void rebuildIndex(const std::shared_ptr<const HaystackIndexSnapshot>& corrupt);
+  //! Where id's needle is, from the index or the snapshot. Only with indexMutex held
+  std::optional<NeedleLocation> locate(fileId id) const;
+  //! Calls fn(id, location) for every file, in no particular order. Only with indexMutex held
+  template <typename Function>
+  void forEachLocation(Function&& fn) const;
+  //! Opens directVolume if the Direct write mode was requested and the volume supports it
+  void openDirect();
+
+  //! Writes a needle's header, name, and the checksums if there are any
+  bool writeHeader(std::uint64_t offset, const NeedleHeader& header, std::string_view name,
+                   const std::vector<std::uint32_t>& checksums = {});
+  //! Overwrites only a needle's flags
+  bool writeFlags(std::uint64_t offset, std::uint32_t flags);
+  //! Writes an aligned buffer through directVolume
+  bool writeDirect(std::uint64_t offset, const HaystackBlock::Storage& buffer);
 };
 }
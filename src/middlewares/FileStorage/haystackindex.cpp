@@ -0,0 +1,158 @@
+#include "haystackindex.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../crc32c.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+namespace {
+//! Where the chunk checksums start, after count entries
+std::uint64_t checksumsOffset(std::uint64_t count) {
+  return sizeof(HaystackIndexHeader) + count * sizeof(HaystackIndexEntry);
+}
+
+std::uint64_t chunkCount(std::uint64_t count) {
+  return (count + HaystackIndexSnapshot::entriesPerChunk - 1) / HaystackIndexSnapshot::entriesPerChunk;
+}
+
+std::uint32_t headerChecksum(HaystackIndexHeader header, const std::uint32_t* checksums, std::uint64_t chunks) {
+  header.checksum = 0;
+  auto const crc = Utility::Hashing::Crc32c::of(&header, sizeof(header));
+  return Utility::Hashing::Crc32c::extend(crc, checksums, chunks * sizeof(std::uint32_t));
+}
+}
+
+std::shared_ptr<const HaystackIndexSnapshot> HaystackIndexSnapshot::open(const fs::path& path) {
+  auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return nullptr;
+
+  struct stat st;
+  HaystackIndexHeader header;
+  auto const valid = ::fstat(fd, &st) == 0
+    && ::pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))
+    && header.magic == HaystackIndexHeader::expectedMagic
+    && header.version == HaystackIndexHeader::currentVersion
+    && header.entriesPerChunk == entriesPerChunk
+    && static_cast<std::uint64_t>(st.st_size) == checksumsOffset(header.count) + chunkCount(header.count) * sizeof(std::uint32_t);
+  if (!valid) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  auto* const mapping = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) return nullptr;
+
+  std::shared_ptr<HaystackIndexSnapshot> snapshot(new HaystackIndexSnapshot);
+  snapshot->header = header;
+  snapshot->mapping = mapping;
+  snapshot->mappingLength = static_cast<std::size_t>(st.st_size);
+
+  auto const* const bytes = static_cast<const char*>(mapping);
+  snapshot->entries = reinterpret_cast<const HaystackIndexEntry*>(bytes + sizeof(HaystackIndexHeader));
+  snapshot->checksums = reinterpret_cast<const std::uint32_t*>(bytes + checksumsOffset(header.count));
+
+  auto const chunks = chunkCount(header.count);
+  if (headerChecksum(header, snapshot->checksums, chunks) != header.checksum) {
+    std::cout << "HaystackIndexSnapshot::open checksum mismatch: " << path << std::endl;
+    return nullptr;
+  }
+
+  // Searches jump around the entries, reading ahead would only pull in pages no one asked for
+  ::madvise(mapping, snapshot->mappingLength, MADV_RANDOM);
+
+  snapshot->verified.reset(new std::atomic<bool>[chunks]);
+  for (std::uint64_t i = 0; i < chunks; i++) snapshot->verified[i] = false;
+
+  return snapshot;
+}
+
+void HaystackIndexSnapshot::verify(std::uint64_t i) const {
+  auto const chunk = i / entriesPerChunk;
+  if (verified[chunk].load(std::memory_order_acquire)) return;
+
+  auto const first = chunk * entriesPerChunk;
+  auto const length = std::min<std::uint64_t>(entriesPerChunk, header.count - first);
+  if (Utility::Hashing::Crc32c::of(entries + first, length * sizeof(HaystackIndexEntry)) != checksums[chunk]) {
+    throw CorruptBlockError(sizeof(HaystackIndexHeader) + first * sizeof(HaystackIndexEntry));
+  }
+  verified[chunk].store(true, std::memory_order_release);
+}
+
+const HaystackIndexEntry& HaystackIndexSnapshot::entry(std::uint64_t i) const {
+  verify(i);
+  return entries[i];
+}
+
+std::optional<HaystackIndexEntry> HaystackIndexSnapshot::find(std::uint64_t id) const {
+  std::uint64_t low = 0, high = header.count;
+  while (low < high) {
+    auto const middle = low + (high - low) / 2;
+    auto const& candidate = entry(middle);
+
+    if (candidate.id == id) return candidate;
+    if (candidate.id < id) low = middle + 1;
+    else high = middle;
+  }
+  return {};
+}
+
+HaystackIndexSnapshot::~HaystackIndexSnapshot() {
+  if (mapping) ::munmap(mapping, mappingLength);
+}
+
+HaystackIndexWriter::HaystackIndexWriter(fs::path path)
+  : path(path), partialPath(path.string() + ".saving") {
+  auto const fd = ::open(partialPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd >= 0) file = std::make_unique<Utility::FileHandle>(fd);
+  failed = !file;
+  chunk.reserve(HaystackIndexSnapshot::entriesPerChunk);
+}
+
+bool HaystackIndexWriter::writeChunk() {
+  auto const length = chunk.size() * sizeof(HaystackIndexEntry);
+  checksums.push_back(Utility::Hashing::Crc32c::of(chunk.data(), length));
+
+  failed = !file->writeAt(chunk.data(), length, checksumsOffset(count));
+  count += chunk.size();
+  chunk.clear();
+  return !failed;
+}
+
+bool HaystackIndexWriter::append(const HaystackIndexEntry& entry) {
+  if (failed) return false;
+
+  chunk.push_back(entry);
+  return chunk.size() < HaystackIndexSnapshot::entriesPerChunk || writeChunk();
+}
+
+bool HaystackIndexWriter::finish(HaystackIndexHeader header) {
+  if (failed || (!chunk.empty() && !writeChunk())) return false;
+
+  header.entriesPerChunk = HaystackIndexSnapshot::entriesPerChunk;
+  header.count = count;
+  header.checksum = headerChecksum(header, checksums.data(), checksums.size());
+
+  failed = !file->writeAt(checksums.data(), checksums.size() * sizeof(std::uint32_t), checksumsOffset(count))
+    || !file->writeAt(&header, sizeof(header), 0)
+    || ::fdatasync(file->descriptor()) != 0
+    || ::rename(partialPath.c_str(), path.c_str()) != 0;
+  if (failed) return false;
+
+  finished = true;
+  Utility::syncDirectory(path.parent_path().string());
+  return true;
+}
+
+HaystackIndexWriter::~HaystackIndexWriter() {
+  if (!finished) ::unlink(partialPath.c_str());
+}
+}
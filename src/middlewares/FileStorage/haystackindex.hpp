@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "storage.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+//! A needle in a Haystack's index snapshot
+struct HaystackIndexEntry {
+  std::uint64_t id;
+  //! Offset of the needle's header in the volume file
+  std::uint64_t offset;
+  //! Size of the contents
+  std::uint64_t size;
+  std::uint32_t flags;
+  std::uint32_t nameLength;
+};
+static_assert(sizeof(HaystackIndexEntry) == 32, "HaystackIndexEntry is part of the on-disk format");
+
+/*!
+ * \brief The first bytes of a Haystack's index snapshot
+ * The header is followed by the entries sorted by id, and then by a CRC32C for every entriesPerChunk entries.
+ */
+struct HaystackIndexHeader {
+  static constexpr std::array<char, 8> expectedMagic = {'T', 'C', 'D', 'N', 'H', 'I', 'D', 'X'};
+  static constexpr std::uint32_t currentVersion = 1;
+
+  std::array<char, 8> magic = expectedMagic;
+  std::uint32_t version = currentVersion;
+  std::uint32_t entriesPerChunk = 0;
+  //! The volumeId from the superblock of the volume file the entries point into
+  std::uint64_t volumeId = 0;
+  //! Where the volume file's needles ended when the snapshot was taken, the ones after it have to be scanned
+  std::uint64_t volumeEnd = 0;
+  std::uint64_t lastFileId = 0;
+  std::uint64_t deadBytes = 0;
+  std::uint64_t count = 0;
+  //! CRC32C of the header, with this field zeroed, followed by the chunk checksums
+  std::uint32_t checksum = 0;
+  std::uint32_t reserved = 0;
+};
+static_assert(sizeof(HaystackIndexHeader) == 64, "HaystackIndexHeader is part of the on-disk format");
+
+/*!
+ * \brief A Haystack's index as it was at some point, mmap'd and searched in place
+ * Opening a snapshot only checks its header and chunk checksums, so it takes the same time for any number of
+ * entries. Every chunk of entries is checked against its CRC32C the first time a search or an iteration touches it,
+ * and a chunk that doesn't match throws CorruptBlockError.
+ */
+class HaystackIndexSnapshot {
+public:
+  //! A page of entries per checksum, so verifying the chunk a search lands in doesn't read more than the search does
+  static constexpr std::uint32_t entriesPerChunk = 128;
+
+  /*!
+   * \brief Maps the snapshot at path
+   * \return nullptr if there is none or its header or chunk checksums don't match
+   */
+  static std::shared_ptr<const HaystackIndexSnapshot> open(const fs::path& path);
+
+  //! The entry for id, if the snapshot has one
+  std::optional<HaystackIndexEntry> find(std::uint64_t id) const;
+  //! The i-th entry in order of ids
+  const HaystackIndexEntry& entry(std::uint64_t i) const;
+
+  inline std::uint64_t size() const noexcept { return header.count; }
+  inline const HaystackIndexHeader& describe() const noexcept { return header; }
+
+  HaystackIndexSnapshot(const HaystackIndexSnapshot&) = delete;
+  ~HaystackIndexSnapshot();
+
+private:
+  HaystackIndexHeader header;
+  void* mapping = nullptr;
+  std::size_t mappingLength = 0;
+  const HaystackIndexEntry* entries = nullptr;
+  const std::uint32_t* checksums = nullptr;
+  //! Set for every chunk once it has matched its checksum
+  std::unique_ptr<std::atomic<bool>[]> verified;
+
+  HaystackIndexSnapshot() = default;
+  //! Throws CorruptBlockError unless the chunk holding entry i has been verified or matches its checksum
+  void verify(std::uint64_t i) const;
+};
+
+/*!
+ * \brief Streams entries in order of ids into a new index snapshot
+ * The snapshot is written next to path and only renamed over it once it's complete and on disk.
+ */
+class HaystackIndexWriter {
+public:
+  //! Entries have to be appended in increasing order of ids
+  bool append(const HaystackIndexEntry& entry);
+
+  //! Writes the checksums and the header, syncs the snapshot, and renames it into place
+  bool finish(HaystackIndexHeader header);
+
+  explicit HaystackIndexWriter(fs::path path);
+  HaystackIndexWriter(const HaystackIndexWriter&) = delete;
+  //! Removes the unfinished snapshot
+  ~HaystackIndexWriter();
+
+private:
+  const fs::path path;
+  const fs::path partialPath;
+  std::unique_ptr<Utility::FileHandle> file;
+  bool failed = false;
+  bool finished = false;
+
+  std::vector<HaystackIndexEntry> chunk;
+  std::vector<std::uint32_t> checksums;
+  std::uint64_t count = 0;
+
+  bool writeChunk();
+};
+}
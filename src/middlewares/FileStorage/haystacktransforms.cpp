@@ -0,0 +1,101 @@
+#include "haystacktransforms.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef TINYCDN_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef TINYCDN_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+namespace TinyCDN::Middleware::FileStorage {
+
+#ifdef TINYCDN_HAVE_ZSTD
+namespace {
+//! Contexts are expensive to create and can't be shared between threads, so every executor thread keeps its own
+ZSTD_CCtx* compressionContext() {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context{ZSTD_createCCtx(), ZSTD_freeCCtx};
+  return context.get();
+}
+
+ZSTD_DCtx* decompressionContext() {
+  thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context{ZSTD_createDCtx(), ZSTD_freeDCtx};
+  return context.get();
+}
+}
+
+HaystackBlock HaystackZstdCompressor::apply(HaystackBlock block) const {
+  HaystackBlock::Storage compressed(ZSTD_compressBound(block.size()));
+
+  auto const written = ZSTD_compressCCtx(compressionContext(), compressed.data(), compressed.size(),
+                                         block.data(), block.size(), level);
+  if (ZSTD_isError(written)) {
+    throw std::runtime_error(std::string("HaystackZstdCompressor: ") + ZSTD_getErrorName(written));
+  }
+
+  compressed.resize(written);
+  return HaystackBlock{block.position, std::move(compressed), 0, written};
+}
+
+HaystackBlock HaystackZstdDecompressor::apply(HaystackBlock block) const {
+  auto const size = ZSTD_getFrameContentSize(block.data(), block.size());
+  if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+    throw std::runtime_error("HaystackZstdDecompressor: block isn't a frame of known size");
+  }
+
+  HaystackBlock::Storage decompressed(size);
+  auto const read = ZSTD_decompressDCtx(decompressionContext(), decompressed.data(), decompressed.size(),
+                                        block.data(), block.size());
+  if (ZSTD_isError(read)) {
+    throw std::runtime_error(std::string("HaystackZstdDecompressor: ") + ZSTD_getErrorName(read));
+  }
+  if (read != size) throw std::runtime_error("HaystackZstdDecompressor: frame is shorter than it claims");
+
+  return HaystackBlock{block.position, std::move(decompressed), 0, read};
+}
+#endif
+
+#ifdef TINYCDN_HAVE_OPENSSL
+HaystackBlock HaystackAesCtrCipher::apply(HaystackBlock block) const {
+  constexpr std::size_t aesBlock = 16;
+
+  // The IV is the nonce followed by the big-endian index of the AES block the position falls into
+  std::array<unsigned char, aesBlock> iv{};
+  std::copy(nonce.begin(), nonce.end(), iv.begin());
+  auto counter = static_cast<std::uint64_t>(block.position / aesBlock);
+  for (int i = aesBlock - 1; i >= static_cast<int>(nonce.size()); i--, counter >>= 8) {
+    iv[static_cast<std::size_t>(i)] = static_cast<unsigned char>(counter & 0xFF);
+  }
+
+  std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> context{EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free};
+  if (!context || EVP_EncryptInit_ex(context.get(), EVP_aes_256_ctr(), nullptr, key.data(), iv.data()) != 1) {
+    throw std::runtime_error("HaystackAesCtrCipher: couldn't set up the cipher");
+  }
+
+  int length = 0;
+  // A position within an AES block starts partway into its keystream, so the bytes before it are thrown away
+  std::array<unsigned char, aesBlock> skipped{};
+  auto const skip = static_cast<int>(block.position % aesBlock);
+  if (skip > 0 && EVP_EncryptUpdate(context.get(), skipped.data(), &length, skipped.data(), skip) != 1) {
+    throw std::runtime_error("HaystackAesCtrCipher: couldn't skip into the keystream");
+  }
+
+  // CTR mode works in place, one call at a time so the lengths fit in an int
+  auto* data = reinterpret_cast<unsigned char*>(block.data());
+  for (std::size_t done = 0; done < block.size();) {
+    auto const amount = static_cast<int>(std::min<std::size_t>(block.size() - done, 1u << 30));
+    if (EVP_EncryptUpdate(context.get(), data + done, &length, data + done, amount) != 1) {
+      throw std::runtime_error("HaystackAesCtrCipher: couldn't encrypt the block");
+    }
+    done += static_cast<std::size_t>(amount);
+  }
+
+  return block;
+}
+#endif
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "haystack.hpp"
+
+namespace TinyCDN::Middleware::FileStorage {
+
+#ifdef TINYCDN_HAVE_ZSTD
+/*!
+ * \brief Compresses every block into a zstd frame of its own
+ * Frames are independent, so any block can be decompressed without the ones before it, and each frame records the
+ * size of the block it came from.
+ */
+class HaystackZstdCompressor : public HaystackTransform {
+  const int level;
+
+public:
+  HaystackBlock apply(HaystackBlock block) const override;
+
+  explicit HaystackZstdCompressor(int level = 3) : level(level) {}
+};
+
+//! Decompresses blocks written by HaystackZstdCompressor, each of them a single frame
+class HaystackZstdDecompressor : public HaystackTransform {
+public:
+  HaystackBlock apply(HaystackBlock block) const override;
+};
+#endif
+
+#ifdef TINYCDN_HAVE_OPENSSL
+/*!
+ * \brief Encrypts, or decrypts, blocks with AES-256 in counter mode
+ * The keystream at a block's position only depends on the key, the nonce and the position, so blocks can be
+ * transformed in any order and a range read at any offset can be decrypted on its own. Counter mode encrypts and
+ * decrypts the same way, and a block keeps its size.
+ */
+class HaystackAesCtrCipher : public HaystackTransform {
+public:
+  using Key = std::array<std::uint8_t, 32>;
+  //! Has to be unique for every needle encrypted with the same key
+  using Nonce = std::array<std::uint8_t, 8>;
+
+  HaystackBlock apply(HaystackBlock block) const override;
+
+  HaystackAesCtrCipher(const Key& key, const Nonce& nonce) : key(key), nonce(nonce) {}
+
+private:
+  const Key key;
+  const Nonce nonce;
+};
+#endif
+}
@@ -0,0 +1,355 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace TinyCDN::Middleware::FileStorage {
+
+//! A file's contents in its chunk, which stays the file's for as long as any Contents of it is around
+class MemoryStorage::Contents : public Utility::ChunkSource {
+public:
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override {
+    if (offset >= size) return 0;
+    auto const read = static_cast<std::size_t>(std::min<std::uintmax_t>(length, size - offset));
+    std::memcpy(buffer, data + offset, read);
+    return read;
+  }
+
+  std::optional<std::string_view> view() const override {
+    return std::string_view{reinterpret_cast<const char*>(data), static_cast<std::size_t>(size)};
+  }
+
+  Contents(MemoryStorage& storage, Items::iterator item, const unsigned char* data, std::uint64_t size)
+    : storage(storage), item(item), data(data), size(size) {}
+  ~Contents() override { storage.release(item); }
+
+private:
+  MemoryStorage& storage;
+  const Items::iterator item;
+  const unsigned char* const data;
+  const std::uint64_t size;
+};
+
+MemoryStorage::MemoryStorage(Size size, fs::path location, bool preallocated)
+  : FileStorage(size, location, preallocated), pageBudget(static_cast<std::size_t>(size / pageSize)) {
+  fileUniqueId = 0;
+
+  // Each class's chunks are a quarter larger than the last one's, rounded up to 8 bytes, up to a whole page
+  for (std::size_t chunkSize = smallestChunk;;) {
+    classes.emplace_back();
+    classes.back().chunkSize = chunkSize;
+    if (chunkSize >= pageSize) break;
+    chunkSize = std::min(pageSize, (chunkSize * 5 / 4 + 7) / 8 * 8);
+  }
+  pages.reserve(pageBudget);
+}
+
+void MemoryStorage::allocate() {}
+
+void MemoryStorage::destroy()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<Items::iterator> items;
+  for (auto const& [id, item] : index) items.push_back(item);
+  for (auto const item : items) drop(item);
+  allocatedSize = std::make_unique<Size>(0);
+}
+
+fileId MemoryStorage::getUniqueFileId()
+{
+  return ++fileUniqueId;
+}
+
+std::size_t MemoryStorage::classOf(std::uint64_t size) const
+{
+  auto const it = std::lower_bound(classes.begin(), classes.end(), size, [](const SizeClass& sizeClass, std::uint64_t size) {
+    return sizeClass.chunkSize < size;
+  });
+  return static_cast<std::size_t>(it - classes.begin());
+}
+
+void MemoryStorage::carve(std::uint32_t page, std::size_t sizeClass)
+{
+  pages[page].sizeClass = sizeClass;
+  auto& to = classes[sizeClass];
+  to.pages++;
+
+  // Backwards, so the chunks at the start of the page are handed out first
+  auto const chunks = static_cast<std::uint32_t>(pageSize / to.chunkSize);
+  for (auto chunk = chunks; chunk > 0; chunk--) to.freeChunks.emplace_back(page, chunk - 1);
+}
+
+std::optional<std::pair<std::uint32_t, std::uint32_t>> MemoryStorage::takeChunk(std::size_t sizeClass, bool evicting)
+{
+  auto& from = classes[sizeClass];
+
+  if (from.freeChunks.empty() && pages.size() < pageBudget) {
+    // Left uninitialized, every chunk is written before it's read
+    pages.push_back(Page{std::unique_ptr<unsigned char[]>(new unsigned char[pageSize]), sizeClass});
+    carve(static_cast<std::uint32_t>(pages.size() - 1), sizeClass);
+  }
+
+  if (from.freeChunks.empty() && evicting) {
+    // The least recently looked up file of the same size makes room
+    auto const victim = std::find_if(from.items.begin(), from.items.end(), [](const Item& item) { return evictable(item); });
+    if (victim != from.items.end()) {
+      drop(victim);
+      counters.evictions++;
+    }
+    else {
+      reassignPage(sizeClass);
+    }
+  }
+
+  if (from.freeChunks.empty()) return {};
+  auto const chunk = from.freeChunks.back();
+  from.freeChunks.pop_back();
+  return chunk;
+}
+
+bool MemoryStorage::reassignPage(std::size_t toClass)
+{
+  // The classes with the most pages give one up first
+  std::vector<std::size_t> donors;
+  for (std::size_t i = 0; i < classes.size(); i++) {
+    if (i != toClass && classes[i].pages > 0) donors.push_back(i);
+  }
+  std::sort(donors.begin(), donors.end(), [&](std::size_t a, std::size_t b) { return classes[a].pages > classes[b].pages; });
+
+  // Only a few of a class's least recently used pages are looked at, each one means going through the whole class
+  constexpr std::size_t candidatesPerClass = 8;
+
+  for (auto const donor : donors) {
+    auto& from = classes[donor];
+    std::size_t candidates = 0;
+    std::vector<std::uint32_t> tried;
+
+    for (auto it = from.items.begin(); it != from.items.end() && candidates < candidatesPerClass; ++it) {
+      if (!evictable(*it) || std::find(tried.begin(), tried.end(), it->page) != tried.end()) continue;
+      auto const page = it->page;
+      tried.push_back(page);
+      candidates++;
+
+      // The page can only go if every file on it can
+      std::vector<Items::iterator> onPage;
+      bool movable = true;
+      for (auto other = from.items.begin(); other != from.items.end(); ++other) {
+        if (other->page != page) continue;
+        if (!evictable(*other)) {
+          movable = false;
+          break;
+        }
+        onPage.push_back(other);
+      }
+      if (!movable) continue;
+
+      for (auto const item : onPage) {
+        drop(item);
+        counters.evictions++;
+      }
+      from.freeChunks.erase(std::remove_if(from.freeChunks.begin(), from.freeChunks.end(),
+                                           [page](const std::pair<std::uint32_t, std::uint32_t>& chunk) { return chunk.first == page; }),
+                            from.freeChunks.end());
+      from.pages--;
+      carve(page, toClass);
+      return true;
+    }
+  }
+  return false;
+}
+
+void MemoryStorage::drop(Items::iterator item)
+{
+  index.erase(item->id);
+  counters.files--;
+  counters.storedBytes -= item->size;
+
+  if (item->readers > 0) {
+    item->removed = true;
+    return;
+  }
+  auto& from = classes[item->sizeClass];
+  from.freeChunks.emplace_back(item->page, item->chunk);
+  from.items.erase(item);
+}
+
+void MemoryStorage::release(Items::iterator item)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (--item->readers > 0 || !item->removed) return;
+
+  auto& from = classes[item->sizeClass];
+  from.freeChunks.emplace_back(item->page, item->chunk);
+  from.items.erase(item);
+}
+
+MemoryStorage::Items::iterator MemoryStorage::store(fileId id, const std::vector<unsigned char>& contents, const StoredFile& file,
+                                                    bool kept, std::pair<std::uint32_t, std::uint32_t> chunk)
+{
+  auto const existing = index.find(id);
+  if (existing != index.end()) drop(existing->second);
+
+  std::memcpy(chunkAt(chunk.first, chunk.second), contents.data(), contents.size());
+
+  auto const sizeClass = pages[chunk.first].sizeClass;
+  auto& to = classes[sizeClass].items;
+  auto const item = to.insert(to.end(), Item{id, contents.size(), sizeClass, chunk.first, chunk.second, kept, 0, false,
+                                              file.digest, file.filename().string()});
+
+  index.try_emplace(id, item);
+  counters.files++;
+  counters.storedBytes += contents.size();
+  return item;
+}
+
+std::unique_ptr<StoredFile> MemoryStorage::storedFile(Items::iterator item)
+{
+  item->readers++;
+  auto stFile = std::make_unique<StoredFile>(Size{item->size}, this->location, false, std::unique_ptr<std::shared_lock<std::shared_mutex>>{});
+  stFile->id = item->id;
+  stFile->name = item->name;
+  stFile->digest = item->digest;
+  stFile->contents = std::make_shared<Contents>(*this, item, chunkAt(item->page, item->chunk), item->size);
+  return stFile;
+}
+
+std::uintmax_t MemoryStorage::sizeOf(const StoredFile& file)
+{
+  if (file.position.has_value()) return file.position->second;
+  if (file.size != 0 || file.contents) return file.size;
+  auto const handle = Utility::FileHandle::open(file.location.string());
+  return handle ? handle->size() : 0;
+}
+
+std::optional<std::vector<unsigned char>> MemoryStorage::readContents(const StoredFile& file)
+{
+  auto const size = sizeOf(file);
+  std::vector<unsigned char> contents(size);
+  std::size_t got = 0;
+
+  try {
+    if (file.contents) {
+      while (got < size) {
+        auto const read = file.contents->readAt(contents.data() + got, size - got, got);
+        if (read == 0) break;
+        got += read;
+      }
+    }
+    else {
+      auto const handle = Utility::FileHandle::open(file.location.string());
+      if (!handle) return {};
+      auto const begin = file.position.has_value() ? file.position->first : 0;
+      while (got < size) {
+        auto const read = handle->readAt(contents.data() + got, size - got, begin + got);
+        if (read == 0) break;
+        got += read;
+      }
+    }
+  }
+  catch (const std::exception&) {
+    // i.e. a CorruptBlockError, a copy of contents that don't check out isn't kept
+    return {};
+  }
+
+  if (got != size) return {};
+  return contents;
+}
+
+std::unique_ptr<StoredFile> MemoryStorage::lookup(fileId id)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto const it = index.find(id);
+  if (it == index.end()) {
+    counters.misses++;
+    return nullptr;
+  }
+  counters.hits++;
+
+  // Looked up last, evicted last
+  auto const item = it->second;
+  auto& items = classes[item->sizeClass].items;
+  items.splice(items.end(), items, item);
+
+  return storedFile(item);
+}
+
+std::unique_ptr<StoredFile> MemoryStorage::add(std::unique_ptr<StoredFile> file)
+{
+  auto const contents = classOf(sizeOf(*file)) < classes.size() ? readContents(*file) : std::nullopt;
+  if (!contents.has_value()) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters.rejections++;
+    return nullptr;
+  }
+  file->digest = Utility::Hashing::Sha256::of(contents->data(), contents->size());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  // What was added stays, so there's nothing to evict
+  auto const chunk = takeChunk(classOf(contents->size()), false);
+  if (!chunk.has_value()) {
+    counters.rejections++;
+    return nullptr;
+  }
+
+  auto const item = store(getUniqueFileId(), contents.value(), *file, true, chunk.value());
+  allocatedSize = std::make_unique<Size>(getAllocatedSize() + item->size);
+  auto stored = storedFile(item);
+  lock.unlock();
+
+  std::error_code error;
+  fs::remove(file->location, error);
+  std::cout << "MemoryStorage::add " << file->location << " as " << stored->id.value() << std::endl;
+  return stored;
+}
+
+void MemoryStorage::remove(std::unique_ptr<StoredFile> file)
+{
+  if (!file->id.has_value()) return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto const it = index.find(file->id.value());
+  if (it == index.end()) return;
+
+  auto const item = it->second;
+  if (item->kept) allocatedSize = std::make_unique<Size>(getAllocatedSize() - item->size);
+  drop(item);
+}
+
+bool MemoryStorage::cache(fileId id, const StoredFile& file)
+{
+  auto const sizeClass = classOf(sizeOf(file));
+  auto const contents = sizeClass < classes.size() ? readContents(file) : std::nullopt;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto const chunk = contents.has_value() ? takeChunk(sizeClass, true) : std::nullopt;
+  if (!chunk.has_value()) {
+    counters.rejections++;
+    return false;
+  }
+
+  store(id, contents.value(), file, false, chunk.value());
+  return true;
+}
+
+void MemoryStorage::evict(fileId id)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto const it = index.find(id);
+  if (it == index.end() || it->second->kept) return;
+  drop(it->second);
+}
+
+bool MemoryStorage::contains(fileId id) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return index.find(id) != index.end();
+}
+
+MemoryStats MemoryStorage::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto stats = counters;
+  stats.reservedBytes = pages.size() * pageSize;
+  return stats;
+}
+}
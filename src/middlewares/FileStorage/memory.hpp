@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../../idmap.hpp"
+#include "storage.hpp"
+#include "storedfile.hpp"
+
+using TinyCDN::Utility::operator""_mB;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+struct MemoryStats {
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  //! Cached files dropped to make room for others
+  std::uint64_t evictions = 0;
+  //! Files that weren't taken, because they're larger than a page or no room could be made for them
+  std::uint64_t rejections = 0;
+  std::uint64_t files = 0;
+  //! The sizes of the files in memory added up
+  std::uint64_t storedBytes = 0;
+  //! Pages taken from the budget so far, which is never more than the budget
+  std::uint64_t reservedBytes = 0;
+};
+
+/*!
+ * \brief Keeps files in memory, within a byte budget it never goes past
+ * Contents go into chunks carved out of pageSize pages, every page holding chunks of one size class and the classes
+ * 1.25x apart like memcached's slabs, so a file wastes less than a quarter of its chunk and freed chunks are reused
+ * without fragmenting anything. Pages are allocated as they're needed, up to size / pageSize of them; that's what the
+ * budget covers, the index of what's where is on top of it.
+ * On its own the storage keeps what's added, and refuses what doesn't fit. In front of a disk-backed storage (see
+ * TieredStorage) it takes copies of that storage's files with cache(), and makes room for one by evicting the least
+ * recently looked up copies of its class, or if the class has no pages, a page's worth from another class.
+ * A StoredFile from lookup() reads straight from its chunk, which isn't reused for as long as the StoredFile is around.
+ */
+class MemoryStorage : public FileStorage {
+public:
+  static constexpr std::size_t pageSize = 1_mB;
+  static constexpr std::size_t smallestChunk = 64;
+
+  //! Nothing's allocated until it's needed
+  void allocate();
+  //! Drops every file. Pages stay allocated, to be reused
+  void destroy();
+
+  std::unique_ptr<StoredFile> lookup(fileId id);
+  //! Reads the upload into memory and removes it, unless it's larger than a page or there's no room left for it
+  std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file);
+  void remove(std::unique_ptr<StoredFile> file);
+
+  /*!
+   * \brief Keeps a copy of a file another storage has, under that storage's id, evicting older copies to make room
+   * The contents are read through file.contents if it has them, or from its location and position otherwise.
+   * \return Whether the copy was taken
+   */
+  bool cache(fileId id, const StoredFile& file);
+  //! Drops the copy of a file, i.e. once it's removed from the storage it came from
+  void evict(fileId id);
+  //! Whether id is in memory, without it counting as a hit or a miss
+  bool contains(fileId id) const;
+
+  MemoryStats stats() const;
+
+  MemoryStorage(Size size, fs::path location, bool preallocated);
+  MemoryStorage(const MemoryStorage&) = delete;
+
+private:
+  class Contents;
+
+  struct Item {
+    fileId id;
+    std::uint64_t size;
+    std::size_t sizeClass;
+    std::uint32_t page;
+    std::uint32_t chunk;
+    //! Added rather than cached, so it's never evicted
+    bool kept;
+    //! Contents of StoredFiles that read from the chunk
+    std::uint32_t readers = 0;
+    //! Removed while it was being read, the last reader frees the chunk
+    bool removed = false;
+    std::optional<Utility::Hashing::Digest> digest;
+    std::optional<std::string> name;
+  };
+  //! Least recently looked up first
+  using Items = std::list<Item>;
+
+  struct SizeClass {
+    std::size_t chunkSize;
+    Items items;
+    //! Page and chunk of every free chunk in the class's pages
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> freeChunks;
+    std::size_t pages = 0;
+  };
+
+  struct Page {
+    std::unique_ptr<unsigned char[]> memory;
+    std::size_t sizeClass;
+  };
+
+  const std::size_t pageBudget;
+
+  mutable std::mutex mutex;
+  std::vector<SizeClass> classes;
+  std::vector<Page> pages;
+  Utility::Hashing::IdMap<fileId, Items::iterator, FileIdHasher> index;
+  MemoryStats counters;
+
+  fileId getUniqueFileId();
+
+  //! The smallest class whose chunks fit size bytes, classes.size() if none does
+  std::size_t classOf(std::uint64_t size) const;
+  inline unsigned char* chunkAt(std::uint32_t page, std::uint32_t chunk) const {
+    return pages[page].memory.get() + std::size_t{chunk} * classes[pages[page].sizeClass].chunkSize;
+  }
+  //! Splits a page into free chunks of the class
+  void carve(std::uint32_t page, std::size_t sizeClass);
+  /*!
+   * \brief Finds a free chunk for a file of the class, with mutex held
+   * Takes a new page while the budget allows, and after that, if evicting, makes room by evicting cached files.
+   */
+  std::optional<std::pair<std::uint32_t, std::uint32_t>> takeChunk(std::size_t sizeClass, bool evicting);
+  //! Evicts the cached files on a page of the class with the most pages, and gives the page to toClass
+  bool reassignPage(std::size_t toClass);
+  //! Whether the item can be evicted right now
+  static inline bool evictable(const Item& item) noexcept { return !item.kept && item.readers == 0 && !item.removed; }
+  //! Forgets the item, and frees its chunk unless it's being read from, which leaves that to its last reader
+  void drop(Items::iterator item);
+  //! Takes the contents in under id, with mutex held. Any file already under it is replaced
+  Items::iterator store(fileId id, const std::vector<unsigned char>& contents, const StoredFile& file, bool kept,
+                        std::pair<std::uint32_t, std::uint32_t> chunk);
+  //! A StoredFile that reads from the item's chunk, with mutex held
+  std::unique_ptr<StoredFile> storedFile(Items::iterator item);
+  //! Called by every Contents of an item once it's gone, the last one of a removed item frees its chunk
+  void release(Items::iterator item);
+
+  /*!
+   * \brief How many bytes a file's contents are
+   * Uploads from clients don't declare their size (see Client/client.cpp), so one without its own source is measured.
+   */
+  static std::uintmax_t sizeOf(const StoredFile& file);
+  //! Reads all of a file's contents, nothing if they can't be read in full
+  static std::optional<std::vector<unsigned char>> readContents(const StoredFile& file);
+};
+}
@@ -0,0 +1,215 @@
+#include "seekablezstd.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+
+#ifdef TINYCDN_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../../crc32c.hpp"
+#include "storage.hpp"
+
+using TinyCDN::Utility::operator""_mB;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+#ifdef TINYCDN_HAVE_ZSTD
+namespace {
+//! Contexts are expensive to create and can't be shared between threads, so every thread keeps its own
+ZSTD_CCtx* compressionContext() {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context{ZSTD_createCCtx(), ZSTD_freeCCtx};
+  return context.get();
+}
+
+ZSTD_DCtx* decompressionContext() {
+  thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context{ZSTD_createDCtx(), ZSTD_freeDCtx};
+  return context.get();
+}
+
+std::uint32_t checksumOf(SeekableZstdHeader header) {
+  header.checksum = 0;
+  return Utility::Hashing::Crc32c::of(&header, sizeof(header));
+}
+
+template <typename T>
+void append(std::string& buffer, T value) {
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T fieldAt(const unsigned char* bytes) {
+  T value;
+  std::memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+}
+
+std::optional<SeekableZstd::Written> SeekableZstd::compress(const Utility::ChunkSource& from, std::uint64_t size,
+                                                            const fs::path& to, std::uint32_t blockSize, int level) {
+  auto const fd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return {};
+  Utility::FileHandle const file(fd);
+
+  // Every frame carries a checksum of its block, so a damaged frame fails to decompress instead of decoding to other bytes
+  auto* const context = compressionContext();
+  ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+  ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, 1);
+
+  std::vector<unsigned char> block(blockSize);
+  std::vector<unsigned char> frame(ZSTD_compressBound(blockSize));
+  Utility::Hashing::Sha256 sha;
+
+  // Frames are gathered into large writes, the header is written over the space left for it at the end
+  std::string pending(sizeof(SeekableZstdHeader), '\0');
+  std::uint64_t flushed = 0;
+  std::string table;
+  std::uint32_t frames = 0;
+
+  auto const flush = [&] {
+    if (!file.writeAt(pending.data(), pending.size(), flushed)) return false;
+    flushed += pending.size();
+    pending.clear();
+    return true;
+  };
+
+  for (std::uint64_t position = 0; position < size; position += blockSize) {
+    auto const length = static_cast<std::size_t>(std::min<std::uint64_t>(blockSize, size - position));
+    if (from.readAt(block.data(), length, position) != length) return {};
+    sha.update(block.data(), length);
+
+    auto const compressed = ZSTD_compress2(context, frame.data(), frame.size(), block.data(), length);
+    if (ZSTD_isError(compressed)) return {};
+    pending.append(reinterpret_cast<const char*>(frame.data()), compressed);
+
+    append(table, static_cast<std::uint32_t>(compressed));
+    append(table, static_cast<std::uint32_t>(length));
+    frames++;
+
+    if (pending.size() >= 1_mB && !flush()) return {};
+  }
+
+  append(pending, seekTableMagic);
+  append(pending, static_cast<std::uint32_t>(table.size() + footerSize));
+  pending.append(table);
+  append(pending, frames);
+  // No checksums in the table, each frame checks its own
+  append(pending, std::uint8_t{0});
+  append(pending, seekableMagic);
+  if (!flush()) return {};
+
+  SeekableZstdHeader header;
+  header.blockSize = blockSize;
+  header.size = size;
+  auto const digest = sha.finish();
+  header.digest = digest.bytes;
+  header.checksum = checksumOf(header);
+  if (!file.writeAt(&header, sizeof(header), 0)) return {};
+
+  return Written{digest, flushed};
+}
+
+std::optional<SeekableZstdHeader> SeekableZstd::headerOf(const Utility::ChunkSource& source, std::uintmax_t offset) noexcept {
+  SeekableZstdHeader header;
+  try {
+    if (source.readAt(reinterpret_cast<unsigned char*>(&header), sizeof(header), offset) != sizeof(header)) return {};
+  }
+  catch (const std::exception&) {
+    return {};
+  }
+
+  auto const valid = header.magic == SeekableZstdHeader::skippableMagic
+    && header.tag == SeekableZstdHeader::expectedTag
+    && header.version == SeekableZstdHeader::currentVersion
+    && header.blockSize > 0
+    && header.checksum == checksumOf(header);
+  if (!valid) return {};
+  return header;
+}
+
+SeekableZstdSource::SeekableZstdSource(std::shared_ptr<const Utility::ChunkSource> stored, std::uintmax_t offset,
+                                       std::uintmax_t storedSize, const SeekableZstdHeader& header)
+  : stored(std::move(stored)),
+    offset(offset),
+    storedSize(storedSize),
+    blockSize(header.blockSize),
+    contentsSize(header.size) {}
+
+void SeekableZstdSource::readTable() const {
+  auto const count = blockCount();
+  auto const tableSize = 8 + std::uint64_t{count} * 8 + SeekableZstd::footerSize;
+  if (storedSize < sizeof(SeekableZstdHeader) + tableSize) return;
+
+  auto const tableAt = storedSize - tableSize;
+  std::vector<unsigned char> table(static_cast<std::size_t>(tableSize));
+  if (stored->readAt(table.data(), table.size(), offset + tableAt) != table.size()) return;
+
+  auto const* footer = table.data() + table.size() - SeekableZstd::footerSize;
+  auto const valid = fieldAt<std::uint32_t>(table.data()) == SeekableZstd::seekTableMagic
+    && fieldAt<std::uint32_t>(table.data() + 4) == tableSize - 8
+    && fieldAt<std::uint32_t>(footer) == count
+    && footer[4] == 0
+    && fieldAt<std::uint32_t>(footer + 5) == SeekableZstd::seekableMagic;
+  if (!valid) return;
+
+  std::vector<std::uint64_t> starts{sizeof(SeekableZstdHeader)};
+  for (std::size_t n = 0; n < count; n++) {
+    auto const* entry = table.data() + 8 + n * 8;
+    if (fieldAt<std::uint32_t>(entry + 4) != blockLength(n)) return;
+    starts.push_back(starts.back() + fieldAt<std::uint32_t>(entry));
+  }
+  if (starts.back() != tableAt) return;
+
+  frames = std::move(starts);
+}
+
+std::size_t SeekableZstdSource::decompress(std::size_t n, unsigned char* buffer) const {
+  thread_local std::vector<unsigned char> frame;
+  frame.resize(static_cast<std::size_t>(frames[n + 1] - frames[n]));
+  auto const position = std::uint64_t{n} * blockSize;
+
+  if (stored->readAt(frame.data(), frame.size(), offset + frames[n]) != frame.size()) throw CorruptBlockError(position);
+
+  auto const length = blockLength(n);
+  auto const read = ZSTD_decompressDCtx(decompressionContext(), buffer, length, frame.data(), frame.size());
+  if (ZSTD_isError(read) || read != length) throw CorruptBlockError(position);
+  return length;
+}
+
+std::size_t SeekableZstdSource::readAt(unsigned char* buffer, std::size_t length, std::uintmax_t position) const {
+  if (position >= contentsSize) return 0;
+
+  std::call_once(tableRead, [this] { readTable(); });
+  if (frames.empty()) throw CorruptBlockError(0);
+
+  std::size_t done = 0;
+  while (done < length && position + done < contentsSize) {
+    auto const at = position + done;
+    auto const n = static_cast<std::size_t>(at / blockSize);
+    auto const within = static_cast<std::size_t>(at % blockSize);
+    auto const whole = blockLength(n);
+    auto const amount = std::min(length - done, whole - within);
+
+    if (amount == whole) {
+      // Wanted whole, so there's no point keeping it
+      decompress(n, buffer + done);
+    }
+    else {
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      if (cachedBlock != n) {
+        cached.resize(blockSize);
+        cachedBlock.reset();
+        decompress(n, cached.data());
+        cachedBlock = n;
+      }
+      std::memcpy(buffer + done, cached.data() + within, amount);
+    }
+    done += amount;
+  }
+  return done;
+}
+#endif
+}
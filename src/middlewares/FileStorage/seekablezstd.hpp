@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+#include <experimental/filesystem>
+
+#include "../../utility.hpp"
+#include "../../digest.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+#ifdef TINYCDN_HAVE_ZSTD
+/*!
+ * \brief The first bytes of a file stored compressed, in a zstd skippable frame
+ * The contents follow as one zstd frame per blockSize bytes, and then the seek table of the zstd seekable format. So a
+ * stored file is still a zstd stream `zstd -d` decompresses, and a range read only decompresses the blocks it touches.
+ */
+struct SeekableZstdHeader {
+  static constexpr std::uint32_t skippableMagic = 0x184D2A50;
+  static constexpr std::array<char, 8> expectedTag = {'T', 'C', 'D', 'N', 'Z', 'S', 'T', 'D'};
+  static constexpr std::uint32_t currentVersion = 1;
+
+  std::uint32_t magic = skippableMagic;
+  //! Bytes of the header after this field, as a skippable frame gives its size
+  std::uint32_t frameSize = 64;
+  std::array<char, 8> tag = expectedTag;
+  std::uint32_t version = currentVersion;
+  //! Contents bytes in every frame but the last
+  std::uint32_t blockSize = 0;
+  //! Size of the contents before they were compressed
+  std::uint64_t size = 0;
+  //! SHA-256 of the contents before they were compressed
+  std::array<std::uint8_t, 32> digest{};
+  //! CRC32C of the header, so a file stored as it is doesn't pass for a compressed one by chance
+  std::uint32_t checksum = 0;
+  std::uint32_t reserved = 0;
+};
+static_assert(sizeof(SeekableZstdHeader) == 72, "SeekableZstdHeader is part of the on-disk format");
+
+//! Writes and recognizes contents stored in SeekableZstdHeader's format
+class SeekableZstd {
+public:
+  //! The zstd seekable format's seek table, a skippable frame that ends the file
+  static constexpr std::uint32_t seekTableMagic = 0x184D2A5E;
+  static constexpr std::uint32_t seekableMagic = 0x8F92EAB1;
+  //! The numFrames, descriptor and seekableMagic after the seek table's entries
+  static constexpr std::size_t footerSize = 9;
+
+  struct Written {
+    Utility::Hashing::Digest digest;
+    std::uint64_t compressedSize;
+  };
+
+  /*!
+   * \brief Compresses size bytes of from into a new file at to, a frame per blockSize bytes
+   * \return Nothing if from couldn't be read in full or to couldn't be written
+   */
+  static std::optional<Written> compress(const Utility::ChunkSource& from, std::uint64_t size, const fs::path& to,
+                                         std::uint32_t blockSize, int level);
+
+  //! The header at offset of source, nothing if there isn't a valid one
+  static std::optional<SeekableZstdHeader> headerOf(const Utility::ChunkSource& source, std::uintmax_t offset) noexcept;
+};
+
+/*!
+ * \brief Reads contents stored compressed, decompressing only the blocks a read touches
+ * The seek table is read the first time any of the contents are. The last block that was read in part is kept, so a
+ * ChunkedCursor with chunks smaller than a block only decompresses each block once.
+ * A seek table or a frame that doesn't match the header throws CorruptBlockError instead of returning its bytes.
+ */
+class SeekableZstdSource : public Utility::ChunkSource {
+public:
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override;
+
+  inline std::uintmax_t size() const noexcept { return contentsSize; }
+
+  //! The compressed file is the storedSize bytes of stored from offset on
+  SeekableZstdSource(std::shared_ptr<const Utility::ChunkSource> stored, std::uintmax_t offset, std::uintmax_t storedSize,
+                     const SeekableZstdHeader& header);
+
+private:
+  std::shared_ptr<const Utility::ChunkSource> stored;
+  const std::uintmax_t offset;
+  const std::uintmax_t storedSize;
+  const std::uint32_t blockSize;
+  const std::uint64_t contentsSize;
+
+  mutable std::once_flag tableRead;
+  //! Where every frame starts within the compressed file, and where the seek table does after the last one
+  mutable std::vector<std::uint64_t> frames;
+
+  mutable std::mutex cacheMutex;
+  mutable std::optional<std::size_t> cachedBlock;
+  mutable std::vector<unsigned char> cached;
+
+  //! Leaves frames empty if the seek table doesn't match the header
+  void readTable() const;
+  //! Decompresses block n into buffer, which has room for all of it, and returns its length
+  std::size_t decompress(std::size_t n, unsigned char* buffer) const;
+
+  inline std::size_t blockCount() const noexcept {
+    return static_cast<std::size_t>((contentsSize + blockSize - 1) / blockSize);
+  }
+  inline std::size_t blockLength(std::size_t n) const noexcept {
+    return static_cast<std::size_t>(std::min<std::uint64_t>(blockSize, contentsSize - std::uint64_t{n} * blockSize));
+  }
+};
+#endif
+}
@@ -8,5 +8,12 @@ FileStorage::FileStorage(Size size, fs::path location, bool preallocated)
   : allocatedSize(std::make_unique<Size>(0)), size(size), location(location), preallocated(preallocated) {
 }
 
+std::vector<std::unique_ptr<StoredFile>> FileStorage::addBatch(std::vector<std::unique_ptr<StoredFile>> files) {
+  std::vector<std::unique_ptr<StoredFile>> stored;
+  stored.reserve(files.size());
+  for (auto& file : files) stored.push_back(add(std::move(file)));
+  return stored;
+}
+
 FileStorage::~FileStorage() {};
 }
@@ -4,7 +4,11 @@
 #include <iostream>
 #include <fstream>
 #include <tuple>
+#include <string>
+#include <stdexcept>
+#include <vector>
 #include "../../utility.hpp"
+#include "../../hashing.hpp"
 #include "storedfile.hpp"
 
 using TinyCDN::Utility::Size;
@@ -13,6 +17,24 @@ namespace TinyCDN::Middleware::FileStorage {
 namespace File = TinyCDN::Middleware::File;
 
 using fileId = uint_fast32_t;
+
+//! Hashes fileIds for the IdMaps storage backends keep their indexes in
+struct FileIdHasher {
+  inline std::size_t operator()(fileId id) const noexcept {
+    return static_cast<std::size_t>(Utility::Hashing::IdHasher::mix(id));
+  }
+};
+
+//! Thrown when a stored file's contents no longer match the checksum they were stored with
+class CorruptBlockError : public std::runtime_error {
+public:
+  //! Where the corrupt block starts within the file's contents
+  const std::uintmax_t position;
+
+  inline explicit CorruptBlockError(std::uintmax_t position)
+    : std::runtime_error("stored contents are corrupt at " + std::to_string(position)), position(position) {}
+};
+
 // Storage backends should implement this abstract class
 class FileStorage {
 protected:
@@ -40,6 +62,12 @@ public:
 
   virtual std::unique_ptr<StoredFile> lookup(fileId id) = 0;
   virtual std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file) = 0;
+  /*!
+   * \brief Adds many files at once, so a backend can allocate their ids and sync them to disk together
+   * The default adds them one by one.
+   * \return The stored files in the order they were given, nullptr for the ones that couldn't be added
+   */
+  virtual std::vector<std::unique_ptr<StoredFile>> addBatch(std::vector<std::unique_ptr<StoredFile>> files);
   virtual void remove(std::unique_ptr<StoredFile> file) = 0;
 
   FileStorage(Size size, fs::path location, bool preallocated);
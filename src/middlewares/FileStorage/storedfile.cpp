@@ -1,4 +1,8 @@
 #include <optional>
+#include <fstream>
+#include <vector>
+#include <limits>
+#include <algorithm>
 
 #include "storedfile.hpp"
 #include "../../utility.hpp"
@@ -21,9 +25,77 @@ StoredFile::StoredFile(fs::path location, bool temporary, std::unique_ptr<std::s
 
 //! Helper method for deducing a file size
 Size StoredFile::getRealSize() {
+  if (position.has_value()) return Size{position->second};
+  // Contents of their own aren't necessarily what's at location, which may not even be a file
+  if (contents) return size;
   return Size{static_cast<uintmax_t>(fs::file_size(location))};
 }
 
+std::optional<std::string> StoredFile::etag() const {
+  if (!digest.has_value()) return {};
+  return "\"" + digest->str() + "\"";
+}
+
+bool StoredFile::verify() const {
+  if (!digest.has_value()) return true;
+
+  if (contents) {
+    Utility::Hashing::Sha256 sha;
+    std::vector<unsigned char> buffer(256_kB);
+    try {
+      for (std::uintmax_t offset = 0;;) {
+        auto const read = contents->readAt(buffer.data(), buffer.size(), offset);
+        if (read == 0) break;
+        sha.update(buffer.data(), read);
+        offset += read;
+      }
+    }
+    catch (const std::exception&) {
+      return false;
+    }
+    return sha.finish() == digest.value();
+  }
+
+  std::ifstream stream(this->location, std::ios::in | std::ios::binary);
+  if (!stream.is_open() || stream.bad()) return false;
+
+  // Only the file's own range of a shared location is hashed
+  auto remaining = std::numeric_limits<std::uintmax_t>::max();
+  if (position.has_value()) {
+    stream.seekg(static_cast<std::streamoff>(position->first));
+    remaining = position->second;
+  }
+
+  Utility::Hashing::Sha256 sha;
+  std::vector<char> buffer(256_kB);
+  while (stream && remaining > 0) {
+    auto const amount = std::min<std::uintmax_t>(buffer.size(), remaining);
+    stream.read(buffer.data(), static_cast<std::streamsize>(amount));
+    sha.update(buffer.data(), static_cast<std::size_t>(stream.gcount()));
+    remaining -= static_cast<std::uintmax_t>(stream.gcount());
+  }
+
+  return sha.finish() == digest.value();
+}
+
+std::optional<StoredFile::MappedContents> StoredFile::map(Utility::FileMapping::Access access) const {
+  if (contents) {
+    auto const bytes = contents->view();
+    if (!bytes.has_value()) return {};
+    return MappedContents{contents, bytes.value()};
+  }
+
+  auto const mapping = Utility::FileMapping::open(location.string());
+  if (!mapping) return {};
+
+  auto const offset = position.has_value() ? position->first : 0;
+  auto const length = position.has_value() ? position->second : mapping->size();
+  if (offset + length > mapping->size()) return {};
+
+  mapping->advise(offset, length, access);
+  return MappedContents{mapping, mapping->view()->substr(static_cast<std::size_t>(offset), static_cast<std::size_t>(length))};
+}
+
 template<typename StreamType>
 StreamType StoredFile::getStream() {}
 
@@ -3,11 +3,15 @@
 #include <mutex>
 #include <shared_mutex>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
 
 #include "../../utility.hpp"
+#include "../../digest.hpp"
 
 using TinyCDN::Utility::Size;
 namespace TinyCDN::Middleware::FileStorage {
@@ -23,9 +27,43 @@ struct StoredFile
   std::variant<std::unique_ptr<std::unique_lock<std::shared_mutex>>, std::unique_ptr<std::shared_lock<std::shared_mutex>>> lock;
 
   std::optional<fileId> id;
-  // std::optional<std::pair<std::size_t, std::size_t>> position;
+  //! Offset and size of the contents within location, for backends that keep many files in one (i.e. Haystack)
+  std::optional<std::pair<std::uintmax_t, std::uintmax_t>> position;
+  //! The original filename, for backends whose location doesn't carry it
+  std::optional<std::string> name;
+  //! The content type the file was uploaded as, for backends that store some kinds of content differently
+  std::optional<std::string> contentType;
+  //! Reads the contents relative to their start, for backends that check them while they're read
+  std::shared_ptr<const Utility::ChunkSource> contents;
+  //! SHA-256 of the contents, computed by the storage backend while the file was being stored
+  std::optional<Utility::Hashing::Digest> digest;
   Size getRealSize();
 
+  //! The name the file was uploaded with
+  inline fs::path filename() const {
+    return name.has_value() ? fs::path{name.value()} : location.filename();
+  }
+
+  //! A strong HTTP ETag (quoted digest), if the storage backend recorded a digest
+  std::optional<std::string> etag() const;
+
+  //! Re-hashes the contents and compares them to digest. Only a file with a digest that doesn't match fails.
+  bool verify() const;
+
+  //! A view of a file's contents, which source keeps valid for as long as it's held
+  struct MappedContents {
+    std::shared_ptr<const Utility::ChunkSource> source;
+    std::string_view bytes;
+  };
+
+  /*!
+   * \brief Returns a read-only view of the contents, without copying them
+   * Files read from their location share one Utility::FileMapping of it, which access tells the kernel how to read
+   * ahead. Files with a source of their own are viewed in place if the source has them in memory.
+   * \return Nothing if the contents can't be mapped, or have to be checked while they're read (i.e. a Haystack's)
+   */
+  std::optional<MappedContents> map(Utility::FileMapping::Access access = Utility::FileMapping::Access::Sequential) const;
+
   //! Safely returns a stream handle for the StoredFile
   template <typename StreamType>
   StreamType getStream();
@@ -34,7 +72,12 @@ struct StoredFile
     : size(f.size),
       temporary(f.temporary),
       location(f.location),
-      id(f.id)
+      id(f.id),
+      position(f.position),
+      name(f.name),
+      contentType(f.contentType),
+      contents(f.contents),
+      digest(f.digest)
   {};
 
   StoredFile(Size size, fs::path location, bool temporary, std::unique_ptr<std::unique_lock<std::shared_mutex>> lock);
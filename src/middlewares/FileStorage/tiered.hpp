@@ -0,0 +1,122 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+#include "../../stripedlocks.hpp"
+#include "memory.hpp"
+#include "storage.hpp"
+#include "storedfile.hpp"
+
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace TinyCDN::Middleware::FileStorage {
+
+/*!
+ * \brief A disk-backed storage with a MemoryStorage in front of it, so its small, hot files are served from memory
+ * Everything is written through to the backend before it's cached, so memory never has the only copy of a file. Files
+ * up to largestCached are cached when they're added and when a lookup misses, and a lookup that hits doesn't touch
+ * the backend or the filesystem at all. The memory tier's budget is separate from the backend's size.
+ */
+template <typename Backend>
+class TieredStorage : public FileStorage {
+public:
+  //! What a volume gets when it doesn't say
+  static constexpr std::size_t defaultMemoryBudget = 64_mB;
+  static constexpr std::size_t defaultLargestCached = 256_kB;
+
+  inline void allocate() {
+    backend->allocate();
+  }
+
+  inline void destroy() {
+    memory.destroy();
+    backend->destroy();
+  }
+
+  std::unique_ptr<StoredFile> lookup(fileId id) {
+    auto file = memory.lookup(id);
+    if (file) return file;
+
+    // Held until the copy is taken, so a remove can't come in between and leave a copy of a file that's gone
+    std::shared_lock<std::shared_mutex> lock(removals[id]);
+    file = backend->lookup(id);
+    if (file && file->size <= largestCached) memory.cache(id, *file);
+    return file;
+  }
+
+  std::unique_ptr<StoredFile> add(std::unique_ptr<StoredFile> file) {
+    auto stored = backend->add(std::move(file));
+    syncAllocatedSize();
+    if (stored) cacheStored(stored->id.value());
+    return stored;
+  }
+
+  std::vector<std::unique_ptr<StoredFile>> addBatch(std::vector<std::unique_ptr<StoredFile>> files) {
+    auto stored = backend->addBatch(std::move(files));
+    syncAllocatedSize();
+    for (auto const& file : stored) {
+      if (file) cacheStored(file->id.value());
+    }
+    return stored;
+  }
+
+  void remove(std::unique_ptr<StoredFile> file) {
+    if (!file->id.has_value()) return;
+    auto const id = file->id.value();
+    // It may be the memory tier's copy, the backend removes its own
+    file.reset();
+
+    std::unique_lock<std::shared_mutex> lock(removals[id]);
+    memory.evict(id);
+    auto stored = backend->lookup(id);
+    if (stored) backend->remove(std::move(stored));
+    syncAllocatedSize();
+  }
+
+  //! Hits and misses are those of the memory tier, every miss goes on to the backend
+  inline MemoryStats memoryStats() const { return memory.stats(); }
+  inline Backend& disk() noexcept { return *backend; }
+  inline MemoryStorage& front() noexcept { return memory; }
+
+  TieredStorage(Size size, fs::path location, bool preallocated,
+                Size memoryBudget = Size{defaultMemoryBudget}, std::uint64_t largestCached = defaultLargestCached)
+    : FileStorage(size, location, preallocated),
+      backend(std::make_unique<Backend>(size, location, preallocated)),
+      memory(memoryBudget, location, false),
+      largestCached(largestCached) {
+    syncAllocatedSize();
+  }
+
+private:
+  std::unique_ptr<Backend> backend;
+  MemoryStorage memory;
+  const std::uint64_t largestCached;
+
+  //! Held shared by lookups that cache what they found, and exclusively by removes
+  Utility::StripedLocks<256> removals;
+  std::mutex sizeMutex;
+
+  /*!
+   * \brief Caches an added file from the backend's copy of it
+   * Uploads from clients don't declare their size, the backend's lookup has the size of what it stored.
+   */
+  void cacheStored(fileId id) {
+    std::shared_lock<std::shared_mutex> lock(removals[id]);
+    auto const file = backend->lookup(id);
+    if (file && file->size <= largestCached) memory.cache(id, *file);
+  }
+
+  //! Ids are the backend's
+  inline fileId getUniqueFileId() { return 0; }
+
+  //! Space is only ever allocated by the backend
+  inline void syncAllocatedSize() {
+    std::lock_guard<std::mutex> lock(sizeMutex);
+    allocatedSize = std::make_unique<Size>(backend->getAllocatedSize());
+  }
+};
+}
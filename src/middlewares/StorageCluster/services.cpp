@@ -1,3 +1,5 @@
+#include "../FileStorage/asyncstorage.hpp"
+
 auto StoragFileUploadingService::uploadFile(
   std::unique_ptr<FileBucket> bucket,
   std::unique_ptr<FileStorage::StoredFile> tmpFile,
@@ -6,16 +8,20 @@ auto StoragFileUploadingService::uploadFile(
   std::vector<std::string> tags)
 -> std::future<std::tuple<FileBucketId, std::string>> {
   // TODO Ask master to store this file
-  auto storedFile = bucket->storage->add(std::move(tmpFile));
-
-  // TODO actually make this async
-  std::promise<std::tuple<FileBucketId, std::string>> test;
+  // Storages that compress by content type go by what the upload says it is
+  tmpFile->contentType = contentType;
+  auto storedFile = FileStorage::AsyncFileStorage(*bucket->storage).add(std::move(tmpFile));
 
   // Copy id and toss away unique_ptr
   auto const fbId = bucket->id;
   std::unique_lock lock(registry->mutex);
   registry->currentFileBuckets.push_back(std::move(bucket));
 
-  test.set_value({fbId, std::to_string(storedFile->id.value())});
-  return test.get_future();
+  // The add carries on in the background, this only waits for it once the id is asked for.
+  // A file the storage couldn't take has an empty id, the result ends up across the C interface where nothing can throw
+  return std::async(std::launch::deferred, [fbId, storedFile = std::move(storedFile)]() mutable {
+    auto const stored = storedFile.get();
+    if (!stored || !stored->id.has_value()) return std::make_tuple(fbId, std::string{});
+    return std::make_tuple(fbId, std::to_string(stored->id.value()));
+  });
 }
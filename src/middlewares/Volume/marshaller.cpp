@@ -1,15 +1,22 @@
+#include <charconv>
+
 #include "marshaller.hpp"
 #include "../../utility.hpp"
 
 namespace TinyCDN::Middleware::Volume {
 
-VolumeMarshaller::deserializeField(std::string field, std::string value)
+void VolumeCSVMarshaller::deserializeField(std::string_view field, std::string_view value)
 {
-
+  if (field == "id") {
+    params->id = value;
+  }
+  else if (field == "size") {
+    std::from_chars(value.data(), value.data() + value.size(), params->size);
+  }
 }
 
 template<typename T>
-std::unique_ptr<T> VolumeMarshaller::deserialize()
+std::unique_ptr<T> VolumeCSVMarshaller::deserialize()
 {
 
 }
@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <string>
+#include <string_view>
 
 #include "volume.hpp"
 
@@ -23,7 +24,7 @@ struct VolumeCSVMarshaller {
   std::unique_ptr<VolumeParams> params;
 
   //! Takes a Volume field and assigns it to its deduced conversion value
-  auto deserializeField(std::string field, std::string value);
+  void deserializeField(std::string_view field, std::string_view value);
 
   //! Creates a Volume instance by taking params and creating a Volume instance from it
   template <typename T>
@@ -3,12 +3,15 @@
 #include <vector>
 #include <memory>
 #include <shared_mutex>
-#include <unordered_map>
 #include <optional>
 
 #include "../../utility.hpp"
 #include "../../hashing.hpp"
+#include "../../idmap.hpp"
 #include "../FileStorage/filesystem.hpp"
+#include "../FileStorage/haystack.hpp"
+#include "../FileStorage/tiered.hpp"
+#include "../FileStorage/compressed.hpp"
 
 namespace TinyCDN::Middleware::Volume {
 
@@ -54,6 +57,20 @@ public:
     this->storage->destroy();
   }
 
+  /*!
+   * \brief Compresses files of the content types, i.e. those of the buckets assigned to the volume, from now on
+   * Only storages that compress do anything with them, the rest store every file as it is.
+   */
+  inline void enableCompression(const std::vector<std::string>& contentTypes) {
+#ifdef TINYCDN_HAVE_ZSTD
+    if constexpr (FileStorage::isCompressedStorage<storageType>) {
+      auto policy = this->storage->policy();
+      policy.enable(contentTypes);
+      this->storage->setPolicy(std::move(policy));
+    }
+#endif
+  }
+
   //! A file storage driver that provides methods to retrieve, modify, and delete files
   std::unique_ptr<storageType> storage;
 
@@ -65,11 +82,30 @@ public:
   // TODO delete default, volume constructors
 };
 
+//! A FilesystemStorage whose small, hot files are also kept in memory
+using TieredFilesystemStorage = FileStorage::TieredStorage<FileStorage::FilesystemStorage>;
+
+#ifdef TINYCDN_HAVE_ZSTD
+//! A FilesystemStorage that stores files of compressible content types compressed
+using CompressedFilesystemStorage = FileStorage::CompressedStorage<FileStorage::FilesystemStorage>;
+#endif
+
 //! All StorageVolume types
-using AnyStorageVolume = std::variant<StorageVolume<FileStorage::FilesystemStorage>>;
+using AnyStorageVolume = std::variant<StorageVolume<FileStorage::FilesystemStorage>,
+                                      StorageVolume<FileStorage::Haystack>,
+#ifdef TINYCDN_HAVE_ZSTD
+                                      StorageVolume<CompressedFilesystemStorage>,
+#endif
+                                      StorageVolume<TieredFilesystemStorage>>;
 // Could be any StorageVolume instance, or a non-existent value
 // Could use std::optional, but wrapping variant would make std::visit less usable
-using MaybeAnyStorageVolume = std::variant<std::monostate, StorageVolume<FileStorage::FilesystemStorage>>;
+using MaybeAnyStorageVolume = std::variant<std::monostate,
+                                           StorageVolume<FileStorage::FilesystemStorage>,
+                                           StorageVolume<FileStorage::Haystack>,
+#ifdef TINYCDN_HAVE_ZSTD
+                                           StorageVolume<CompressedFilesystemStorage>,
+#endif
+                                           StorageVolume<TieredFilesystemStorage>>;
 
 //class BackupVolume : Volume;
 
@@ -92,14 +128,15 @@ public:
     volumeMutexes.erase(id);
   };
 
-  std::unordered_map<VolumeId, std::unique_ptr<MaybeAnyStorageVolume>, IdHasher> volumes;
+  IdMap<VolumeId, std::unique_ptr<MaybeAnyStorageVolume>> volumes;
 
   inline StorageVolumeManager(uintmax_t size) : size(size) {}
 
 private:
   uintmax_t size;
 
-  std::unordered_map<VolumeId, std::shared_mutex, IdHasher> volumeMutexes;
+  //! std::shared_mutex can't be moved, so IdMap keeps each one behind a unique_ptr
+  IdMap<VolumeId, std::unique_ptr<std::shared_mutex>> volumeMutexes;
 };
 
 /*!
@@ -146,7 +183,7 @@ private:
   std::ofstream configFile;
 
   uintmax_t size;
-  std::unordered_map<FileBucketId, std::vector<VolumeId>, IdHasher> fbVolDb;
+  IdMap<FileBucketId, std::vector<VolumeId>> fbVolDb;
 
   //! Adds volume to fbVolDb and asynchronously persists the mapping to the disk
   void addVolumeToFileBucket(FileBucketId fbId, VolumeId volId);
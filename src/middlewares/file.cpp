@@ -8,6 +8,8 @@
 #include <string>
 #include <cinttypes>
 #include <future>
+#include <charconv>
+#include <string_view>
 
 #include <experimental/filesystem>
 namespace fs = std::experimental::filesystem;
@@ -128,24 +130,22 @@ FileBucketRegistryItem::FileBucketRegistryItem (std::unordered_map<std::string,
   }
 }
 
-auto FileBucketRegistryItemConverter::convertField(std::string field, std::string value) {
+void FileBucketRegistryItemConverter::convertField(std::string_view field, std::string_view value) {
   // TODO validate permissions etc.
   if (field == "virtualVolumeId") {
-    VolumeId id;
-    id = value;
-    params->virtualVolumeId = id;
+    params->virtualVolumeId = value;
   }
   else if (field == "id") {
-    FileBucketId id;
-    id = value;
-    params->id = id;
+    params->id = value;
   }
   else if (field == "size") {
-    char* nptr;
-    params->size = std::strtoumax(value.c_str(), &nptr, 10);
+    std::from_chars(value.data(), value.data() + value.size(), params->size);
   }
   else if (field == "types") {
-    params->types = Utility::fromCSV(value);
+    params->types.clear();
+    for (auto const type : Utility::CSVTokenizer(value)) {
+      params->types.emplace_back(type);
+    }
   }
 }
 
@@ -209,19 +209,21 @@ void FileBucketRegistry::registerItem(std::unique_ptr<FileBucket>& fb) {
 std::unique_ptr<FileBucket> FileBucketRegistryItem::convert(std::unique_ptr<FileBucketRegistryItemConverter>& converter) {
   // Extract contents of this registry item
   // For each field, try to find the persisted value of that field
+  std::string_view const contents(this->contents);
+
   for (auto field : {"id", "virtualVolumeId", "size", "types"}) {
     auto const assignment = this->assignmentToken(field);
-    auto const n = this->contents.find(assignment);
+    auto const n = contents.find(assignment);
     if (n == std::string::npos) {
       continue;
     }
-    auto const valueEnd = this->contents.find(";", n);
+    auto const valueEnd = contents.find(";", n);
     if (valueEnd == std::string::npos) {
       continue;
     }
 
     auto const len = n + assignment.length();
-    const auto value = this->contents.substr(len, valueEnd-len);
+    auto const value = contents.substr(len, valueEnd-len);
     std::cout << assignment << value << "\n";
     std::cout << std::flush;
     // TODO dispatch table...
@@ -256,14 +258,7 @@ void FileBucketRegistry::loadRegistry() {
 }
 
 FileBucketId FileBucketRegistry::getUniqueFileBucketId() {
-  auto* id64 = idGenerator(64);
-
-  FileBucketId output;
-  std::string s(id64);
-  output = s;
-
-  delete id64;
-  return output;
+  return idGenerator();
 }
 
 FileBucketRegistry::FileBucketRegistry(fs::path location, std::string registryFileName)
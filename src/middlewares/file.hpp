@@ -6,6 +6,7 @@
 #include <unordered_map>
 #include <map>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 #include <variant>
@@ -91,7 +92,7 @@ struct FileBucketRegistryItem {
  */
 class FileBucketRegistry {
 private:
-  PseudoRandomHexFactory idGenerator;
+  RandomIdFactory<FileBucketId> idGenerator;
 
 public:
   const std::string registryFileName;
@@ -123,6 +124,12 @@ public:
 
   FileBucketId getUniqueFileBucketId();
 
+  //! Fills [first, last) with unique FileBucketIds at once, for services that create buckets in batches
+  template <typename OutputIt>
+  inline void getUniqueFileBucketIds(OutputIt first, OutputIt last) const {
+    idGenerator(first, last);
+  }
+
   //! Safely returns a stream handle for the Registry
   // TODO: implement registry as a ring buffer
   template <typename StreamType>
@@ -174,7 +181,7 @@ struct FileBucketRegistryItemConverter {
   }
 
   //! Takes a FileBucket "field" (virtualVolumeId, id, size, or types) and assigns it to its deduced conversion value
-  auto convertField(std::string field, std::string value);
+  void convertField(std::string_view field, std::string_view value);
 
   //! Creates a FileBucket or FileBucketRegistryItem instance by taking params and creating a FileBucket instance from it
   template <typename T>
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <shared_mutex>
+
+#include "hashing.hpp"
+
+namespace TinyCDN::Utility {
+
+/*!
+ * \brief A fixed table of reader/writer locks that ids are spread over by their hash
+ * Ids that land on the same stripe share its lock, which only costs anything when one of them is being written to,
+ * in exchange for taking O(Stripes) memory however many ids there are and never changing shape, so finding an id's
+ * lock needs no lock of its own. Every stripe has a cache line to itself, so readers on different stripes don't
+ * bounce the same line between cores.
+ * Because of the sharing, a thread mustn't take a second lock from the same table while it holds one exclusively.
+ */
+template <std::size_t Stripes = 1024>
+class StripedLocks {
+  static_assert(Stripes > 0 && (Stripes & (Stripes - 1)) == 0, "Stripes has to be a power of two");
+
+  struct alignas(64) Stripe {
+    std::shared_mutex mutex;
+  };
+
+  std::array<Stripe, Stripes> stripes;
+
+public:
+  static constexpr std::size_t stripeCount = Stripes;
+
+  //! The lock shared by id and the ids on the same stripe
+  inline std::shared_mutex& operator[](std::uint64_t id) noexcept {
+    return stripes[stripeOf(id)].mutex;
+  }
+
+  //! Which stripe id lands on
+  static constexpr std::size_t stripeOf(std::uint64_t id) noexcept {
+    return static_cast<std::size_t>(Hashing::IdHasher::mix(id)) & (Stripes - 1);
+  }
+
+  StripedLocks() = default;
+  StripedLocks(const StripedLocks&) = delete;
+  StripedLocks& operator=(const StripedLocks&) = delete;
+};
+}
@@ -0,0 +1,132 @@
+#include <cerrno>
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/asyncstorage.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/middlewares/FileStorage/haystack.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+SCENARIO("A FileStorage is used through AsyncFileStorage") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-async-storage";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  fs::create_directories(root / "filesystem");
+
+  GIVEN("a FilesystemStorage") {
+    FilesystemStorage storage(Size{16_mB}, root / "filesystem", false);
+    AsyncFileStorage async(storage);
+
+    WHEN("files are added, looked up and read without waiting in between") {
+      std::vector<std::future<std::unique_ptr<StoredFile>>> added;
+      for (int i = 0; i < 16; i++) added.push_back(async.add(upload(uploads, std::to_string(i), std::string(1000 + i, 'a' + i))));
+      // The adds run side by side, so the ids don't go in the order they were submitted
+      std::vector<fileId> ids;
+      for (auto& file : added) ids.push_back(file.get()->id.value());
+
+      std::vector<std::future<std::unique_ptr<StoredFile>>> lookups;
+      for (auto const id : ids) lookups.push_back(async.lookup(id));
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (auto& lookup : lookups) files.push_back(lookup.get());
+
+      std::vector<std::string> buffers(16, std::string(2000, '\0'));
+      std::vector<std::future<std::size_t>> reads;
+      for (std::size_t i = 0; i < 16; i++) reads.push_back(async.read(*files[i], buffers[i].data(), buffers[i].size(), 0));
+
+      THEN("every read gets its file's contents") {
+	for (std::size_t i = 0; i < 16; i++) {
+	  REQUIRE( reads[i].get() == 1000 + i );
+	  REQUIRE( buffers[i].substr(0, 1000 + i) == std::string(1000 + i, 'a' + i) );
+	}
+      }
+      THEN("the files were handed over without the lock the lookup took on the executor") {
+	for (auto const& file : files) {
+	  REQUIRE( std::get<std::unique_ptr<std::shared_lock<std::shared_mutex>>>(file->lock) == nullptr );
+	}
+      }
+    }
+
+    WHEN("part of a file is read from an offset") {
+      async.add(upload(uploads, "digits", "0123456789")).get();
+      auto const file = async.lookup(1).get();
+      std::string buffer(4, '\0');
+      auto const read = async.read(*file, buffer.data(), buffer.size(), 6).get();
+
+      THEN("only that part is read") {
+	REQUIRE( read == 4 );
+	REQUIRE( buffer == "6789" );
+      }
+    }
+
+    WHEN("a file is removed") {
+      async.add(upload(uploads, "gone", "gone")).get();
+      async.remove(async.lookup(1).get()).get();
+
+      THEN("it can't be looked up anymore") {
+	REQUIRE( async.lookup(1).get() == nullptr );
+      }
+    }
+
+    WHEN("a file that's gone from the disk is read") {
+      async.add(upload(uploads, "missing", "missing")).get();
+      auto const file = async.lookup(1).get();
+      fs::remove(file->location);
+      char buffer[8];
+      auto read = async.read(*file, buffer, sizeof(buffer), 0);
+
+      THEN("the read fails") {
+	REQUIRE_THROWS_AS( read.get(), std::system_error );
+      }
+    }
+  }
+
+  GIVEN("a Haystack") {
+    Haystack storage(Size{4_mB}, root / "haystack", false);
+    AsyncFileStorage async(storage);
+    auto const contents = std::string(200_kB, 'h');
+    async.add(upload(uploads, "needle", contents)).get();
+    auto const file = async.lookup(1).get();
+
+    WHEN("a needle is read") {
+      std::string buffer(contents.size(), '\0');
+      auto const read = async.read(*file, buffer.data(), buffer.size(), 0).get();
+
+      THEN("its contents are read and checked") {
+	REQUIRE( read == contents.size() );
+	REQUIRE( buffer == contents );
+      }
+    }
+
+    WHEN("the needle's contents are corrupted before they're read") {
+      {
+	std::fstream volume(storage.volumePath(), std::ios::in | std::ios::out | std::ios::binary);
+	volume.seekp(static_cast<std::streamoff>(file->position->first + 100));
+	volume.put('x');
+      }
+      std::promise<std::int64_t> result;
+      std::string buffer(contents.size(), '\0');
+      async.read(*file, buffer.data(), buffer.size(), 0, [&](std::int64_t read) { result.set_value(read); });
+
+      THEN("the read completes with -EIO") {
+	REQUIRE( result.get_future().get() == -EIO );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
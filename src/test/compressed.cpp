@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/compressed.hpp"
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+#ifdef TINYCDN_HAVE_ZSTD
+namespace {
+//! JSON that repeats itself the way API responses do
+std::string jsonOf(std::size_t size) {
+  std::string json = "[";
+  for (std::size_t i = 0; json.size() < size; i++) {
+    json += "{\"id\":" + std::to_string(i) + ",\"name\":\"asset-" + std::to_string(i * 7919 % 1000) + "\",\"public\":true},";
+  }
+  json.resize(size);
+  return json;
+}
+
+//! Contents read out of memory, to sample without a file
+struct Bytes : Utility::ChunkSource {
+  std::string bytes;
+
+  explicit Bytes(std::string bytes) : bytes(std::move(bytes)) {}
+
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override {
+    if (offset >= bytes.size()) return 0;
+    auto const amount = std::min<std::size_t>(length, bytes.size() - offset);
+    std::copy_n(bytes.data() + offset, amount, buffer);
+    return amount;
+  }
+};
+}
+
+SCENARIO("A CompressionPolicy picks the files worth compressing") {
+  GIVEN("the default policy") {
+    CompressionPolicy policy;
+
+    THEN("text types are covered, whole or by their top-level type, and media types aren't") {
+      REQUIRE( policy.covers("application/json") );
+      REQUIRE( policy.covers("text/css") );
+      REQUIRE( policy.covers("Text/HTML; charset=utf-8") );
+      REQUIRE( policy.covers("image/svg+xml") );
+      REQUIRE( !policy.covers("image/png") );
+      REQUIRE( !policy.covers("textual/thing") );
+      REQUIRE( !policy.covers("") );
+    }
+
+    THEN("enabling a bucket's types adds those that aren't covered yet") {
+      auto const before = policy.contentTypes.size();
+      policy.enable({"text/plain", "image"});
+      REQUIRE( policy.contentTypes.size() == before + 1 );
+      REQUIRE( policy.covers("image/png") );
+    }
+
+    THEN("uploads without a content type go by their extension") {
+      REQUIRE( CompressionPolicy::contentTypeOf("app.JS") == "application/javascript" );
+      REQUIRE( CompressionPolicy::contentTypeOf("logo.png") == "image/png" );
+      REQUIRE( CompressionPolicy::contentTypeOf("README") == "application/octet-stream" );
+    }
+
+    THEN("samples of text have far less entropy than samples of compressed bytes") {
+      Bytes const text{jsonOf(1_mB)};
+      Bytes const media{imageOf(1_mB, 1)};
+      REQUIRE( CompressionPolicy::entropyOf(text, text.bytes.size()) < 6.0 );
+      REQUIRE( CompressionPolicy::entropyOf(media, media.bytes.size()) > policy.largestEntropy );
+    }
+  }
+}
+
+SCENARIO("A CompressedStorage stores compressible content types compressed") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-compressed";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  fs::create_directories(root / "storage");
+  auto const json = jsonOf(300_kB + 123);
+
+  GIVEN("a CompressedStorage over a FilesystemStorage, with JSON in it") {
+    CompressedStorage<FilesystemStorage> storage(Size{64_mB}, root / "storage", false);
+    auto const added = storage.add(upload(uploads, "assets.json", json, std::string{"application/json"}));
+    REQUIRE( added != nullptr );
+
+    THEN("it's read back as it was uploaded, and takes a fraction of the space") {
+      auto const found = storage.lookup(added->id.value());
+      REQUIRE( found->size == json.size() );
+      REQUIRE( contentsOf(*found) == json );
+      REQUIRE( found->filename() == "assets.json" );
+      REQUIRE( found->digest == Utility::Hashing::Sha256::of(json.data(), json.size()) );
+      REQUIRE( found->verify() );
+      REQUIRE( found->getRealSize() == json.size() );
+      REQUIRE( !fs::exists(uploads / "assets.json") );
+      REQUIRE( !fs::exists(uploads / ".assets.json.zst") );
+
+      REQUIRE( storage.getAllocatedSize() < json.size() / 4 );
+      auto const stats = storage.stats();
+      REQUIRE( stats.compressed == 1 );
+      REQUIRE( stats.uploadedBytes == json.size() );
+      REQUIRE( stats.ratio() > 4.0 );
+    }
+
+    THEN("range reads start and end anywhere, across blocks") {
+      auto const found = storage.lookup(added->id.value());
+      REQUIRE( contentsOf(*found, 64_kB - 10, 20) == json.substr(64_kB - 10, 20) );
+      REQUIRE( contentsOf(*found, 100_kB + 1, 150_kB) == json.substr(100_kB + 1, 150_kB) );
+      REQUIRE( contentsOf(*found, json.size() - 5) == json.substr(json.size() - 5) );
+      REQUIRE( contentsOf(*found, json.size()) == "" );
+
+      Utility::ChunkedCursor cursor(7_kB, 100_kB, 150_kB + 3, found->contents);
+      std::string read;
+      std::vector<unsigned char> buffer(7_kB);
+      while (!cursor.isLastChunk) {
+	cursor.nextChunk(buffer.data());
+	read.append(reinterpret_cast<const char*>(buffer.data()), cursor.forwardsAmount);
+      }
+      REQUIRE( read == json.substr(150_kB + 3, 100_kB) );
+    }
+
+    THEN("the backend's copy is a zstd stream with a seek table at the end") {
+      auto const raw = storage.uncompressed().lookup(added->id.value());
+      auto const bytes = contentsOf(raw->location);
+      std::uint32_t magic;
+      std::memcpy(&magic, bytes.data(), sizeof(magic));
+      REQUIRE( magic == SeekableZstdHeader::skippableMagic );
+      std::memcpy(&magic, bytes.data() + bytes.size() - sizeof(magic), sizeof(magic));
+      REQUIRE( magic == SeekableZstd::seekableMagic );
+    }
+
+    WHEN("its stored copy is damaged") {
+      auto const raw = storage.uncompressed().lookup(added->id.value());
+      {
+	std::fstream stream(raw->location, std::ios::in | std::ios::out | std::ios::binary);
+	stream.seekp(200);
+	stream.put('\x7f');
+      }
+
+      THEN("reading the block throws instead of returning the wrong bytes, and it doesn't verify") {
+	auto const found = storage.lookup(added->id.value());
+	REQUIRE_THROWS_AS( contentsOf(*found, 0, 10), CorruptBlockError );
+	REQUIRE( !found->verify() );
+      }
+    }
+
+    WHEN("it's removed") {
+      storage.remove(storage.lookup(added->id.value()));
+
+      THEN("it's gone") {
+	REQUIRE( storage.lookup(added->id.value()) == nullptr );
+	REQUIRE( storage.getAllocatedSize() == 0 );
+      }
+    }
+  }
+
+  GIVEN("a CompressedStorage and files that shouldn't be compressed") {
+    CompressedStorage<FilesystemStorage> storage(Size{64_mB}, root / "storage", false);
+    auto const image = imageOf(200_kB, 2);
+
+    THEN("an image is stored as it is, whatever it says it is") {
+      auto const png = storage.add(upload(uploads, "photo.png", image));
+      auto const mislabelled = storage.add(upload(uploads, "photo.txt", image, std::string{"text/plain"}));
+      auto const tiny = storage.add(upload(uploads, "tiny.json", "{}"));
+
+      for (auto const& added : {png.get(), mislabelled.get(), tiny.get()}) {
+	auto const found = storage.lookup(added->id.value());
+	REQUIRE( found->contents == nullptr );
+	REQUIRE( contentsOf(found->location) == contentsOf(storage.uncompressed().lookup(added->id.value())->location) );
+      }
+      REQUIRE( contentsOf(storage.lookup(png->id.value())->location) == image );
+
+      auto const stats = storage.stats();
+      REQUIRE( stats.skipped == 2 );
+      REQUIRE( stats.incompressible == 1 );
+      REQUIRE( stats.compressed == 0 );
+      REQUIRE( stats.ratio() == 1.0 );
+    }
+
+    THEN("an upload that starts like a compressed file is still read back byte for byte") {
+      auto const compressed = storage.add(upload(uploads, "data.json", json));
+      auto const lookalike = contentsOf(storage.uncompressed().lookup(compressed->id.value())->location);
+      auto const added = storage.add(upload(uploads, "download.bin", lookalike));
+
+      auto const found = storage.lookup(added->id.value());
+      REQUIRE( contentsOf(*found) == lookalike );
+      REQUIRE( found->verify() );
+    }
+  }
+
+  GIVEN("a policy that only compresses what a bucket's types name") {
+    CompressionPolicy policy;
+    policy.contentTypes = {};
+    CompressedStorage<FilesystemStorage> storage(Size{64_mB}, root / "storage", false, policy);
+
+    THEN("JSON is stored as it is until its type is enabled") {
+      auto const before = storage.add(upload(uploads, "a.json", json));
+      REQUIRE( storage.lookup(before->id.value())->contents == nullptr );
+
+      auto enabled = storage.policy();
+      enabled.enable({"application/json"});
+      storage.setPolicy(enabled);
+
+      auto const after = storage.add(upload(uploads, "b.json", json));
+      REQUIRE( contentsOf(*storage.lookup(after->id.value())) == json );
+      REQUIRE( storage.stats().compressed == 1 );
+    }
+  }
+
+  fs::remove_all(root);
+}
+#endif
@@ -0,0 +1,51 @@
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/crc32c.hpp"
+
+using namespace TinyCDN::Utility::Hashing;
+
+SCENARIO("CRC32C checksums are computed") {
+  GIVEN("the standard check input") {
+    std::string const input = "123456789";
+
+    THEN("every engine returns the standard check value") {
+      for (auto const engine : {Crc32c::Engine::Portable, Crc32c::Engine::Sse42, Crc32c::Engine::Sse42Pclmul}) {
+	if (engine != Crc32c::Engine::Portable && Crc32c::bestEngine() == Crc32c::Engine::Portable) continue;
+	REQUIRE( Crc32c::extend(engine, 0, input.data(), input.size()) == 0xE3069283 );
+      }
+      REQUIRE( Crc32c::of(input.data(), input.size()) == 0xE3069283 );
+      REQUIRE( Crc32c::of(nullptr, 0) == 0 );
+    }
+  }
+
+  GIVEN("buffers of many lengths and alignments") {
+    std::vector<std::uint8_t> data(3 * 8192 * 2 + 1000);
+    std::uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (auto& byte : data) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      byte = static_cast<std::uint8_t>(state >> 56);
+    }
+
+    THEN("the hardware engines agree with the portable one") {
+      if (Crc32c::bestEngine() == Crc32c::Engine::Portable) return;
+
+      for (std::size_t const offset : {0, 1, 7}) {
+	for (std::size_t const length : {0, 1, 8, 255, 768, 769, 3 * 256 * 5 + 3, 3 * 8192, 3 * 8192 + 3 * 256 + 17, 3 * 8192 * 2 + 900}) {
+	  auto const expected = Crc32c::extend(Crc32c::Engine::Portable, 0, data.data() + offset, length);
+	  REQUIRE( Crc32c::extend(Crc32c::Engine::Sse42, 0, data.data() + offset, length) == expected );
+	  REQUIRE( Crc32c::extend(Crc32c::Engine::Sse42Pclmul, 0, data.data() + offset, length) == expected );
+	}
+      }
+    }
+
+    THEN("extending a CRC over the rest of a buffer gives the CRC of the whole buffer") {
+      auto const whole = Crc32c::of(data.data(), data.size());
+      auto const first = Crc32c::of(data.data(), 12345);
+      REQUIRE( Crc32c::extend(first, data.data() + 12345, data.size() - 12345) == whole );
+    }
+  }
+}
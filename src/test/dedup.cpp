@@ -0,0 +1,287 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/dedup.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+SCENARIO("A DedupStorage stores each distinct chunk of contents once") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-dedup";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const image = imageOf(300_kB, 1);
+
+  GIVEN("a DedupStorage with an image in it") {
+    DedupStorage storage(Size{64_mB}, root / "storage", false);
+    auto const first = storage.add(upload(uploads, "logo.png", image));
+    REQUIRE( first != nullptr );
+
+    THEN("it's read back whole, and the upload is gone") {
+      auto const found = storage.lookup(first->id.value());
+      REQUIRE( contentsOf(*found) == image );
+      REQUIRE( found->filename() == "logo.png" );
+      REQUIRE( found->digest == Utility::Hashing::Sha256::of(image.data(), image.size()) );
+      REQUIRE( found->verify() );
+      REQUIRE( !fs::exists(uploads / "logo.png") );
+      REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+    }
+
+    THEN("a ChunkedCursor reads it in chunks that don't line up with the stored ones") {
+      auto const found = storage.lookup(first->id.value());
+      Utility::ChunkedCursor cursor(7_kB, 100_kB, 150_kB + 3, found->contents);
+      std::string read;
+      std::vector<unsigned char> buffer(7_kB);
+      while (!cursor.isLastChunk) {
+	cursor.nextChunk(buffer.data());
+	read.append(reinterpret_cast<const char*>(buffer.data()), cursor.forwardsAmount);
+      }
+      REQUIRE( read == image.substr(150_kB + 3, 100_kB) );
+    }
+
+    WHEN("it's uploaded again under another name") {
+      auto const second = storage.add(upload(uploads, "logo-copy.png", image));
+
+      THEN("both are there, but it's only stored once") {
+	REQUIRE( second->id != first->id );
+	REQUIRE( contentsOf(*storage.lookup(second->id.value())) == image );
+	REQUIRE( storage.lookup(second->id.value())->filename() == "logo-copy.png" );
+	REQUIRE( storage.stats().files == 2 );
+	REQUIRE( storage.stats().logicalBytes == 2 * 300_kB );
+	REQUIRE( storage.stats().storedBytes == 300_kB );
+	REQUIRE( storage.stats().ratio() == Approx(2.0) );
+	REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+      }
+
+      AND_WHEN("one of them is removed") {
+	storage.remove(storage.lookup(first->id.value()));
+
+	THEN("the other one still reads from the chunks they shared") {
+	  REQUIRE( storage.lookup(first->id.value()) == nullptr );
+	  REQUIRE( contentsOf(*storage.lookup(second->id.value())) == image );
+	  REQUIRE( storage.stats().storedBytes == 300_kB );
+	  REQUIRE( storage.stats().unreferencedBytes == 0 );
+	}
+
+	AND_WHEN("so is the other one, and the image is uploaded once more") {
+	  auto const reading = storage.lookup(second->id.value());
+	  storage.remove(storage.lookup(second->id.value()));
+	  REQUIRE( storage.stats().unreferencedBytes == 300_kB );
+	  auto const third = storage.add(upload(uploads, "logo.png", image));
+
+	  THEN("the chunks no file was made of are used again") {
+	  REQUIRE( contentsOf(*reading) == image );
+	  REQUIRE( contentsOf(*storage.lookup(third->id.value())) == image );
+	  REQUIRE( storage.stats().unreferencedBytes == 0 );
+	  REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+	  }
+	}
+      }
+    }
+
+    WHEN("an edited copy is uploaded, with bytes inserted near its start") {
+      auto edited = image;
+      edited.insert(1000, "edited");
+      auto const copy = storage.add(upload(uploads, "logo-edited.png", edited));
+
+      THEN("only the chunks around the edit are stored again") {
+	REQUIRE( contentsOf(*storage.lookup(copy->id.value())) == edited );
+	REQUIRE( storage.stats().storedBytes < 300_kB + 2 * Utility::Hashing::FastCdc::defaultMaxSize );
+      }
+    }
+
+    WHEN("files with contents in common are added in one batch") {
+      std::vector<std::unique_ptr<StoredFile>> batch;
+      for (int i = 0; i < 3; i++) batch.push_back(upload(uploads / std::to_string(i), "banner.png", imageOf(100_kB, 2)));
+      batch.push_back(upload(uploads, "missing.png", ""));
+      fs::remove(uploads / "missing.png");
+      auto const added = storage.addBatch(std::move(batch));
+
+      THEN("their chunks are only stored once, and a file that can't be read is left out") {
+	REQUIRE( added.size() == 4 );
+	for (int i = 0; i < 3; i++) REQUIRE( contentsOf(*storage.lookup(added[i]->id.value())) == imageOf(100_kB, 2) );
+	REQUIRE( added[3] == nullptr );
+	REQUIRE( storage.getAllocatedSize() == Size{400_kB} );
+      }
+    }
+
+    WHEN("4 threads add copies of it and read them back at once") {
+      std::vector<std::future<void>> threads;
+      for (int thread = 0; thread < 4; thread++) {
+	threads.push_back(std::async(std::launch::async, [&, thread] {
+	  for (int i = 0; i < 5; i++) {
+	    auto const added = storage.add(upload(uploads / std::to_string(thread), std::to_string(i), image));
+	    if (contentsOf(*storage.lookup(added->id.value())) != image) throw std::runtime_error("wrong contents");
+	  }
+	}));
+      }
+      for (auto& thread : threads) thread.get();
+
+      THEN("every copy is there, all of them made of the same chunks") {
+	REQUIRE( storage.stats().files == 21 );
+	REQUIRE( storage.stats().storedBytes == 300_kB );
+      }
+    }
+
+    WHEN("an empty file is added") {
+      auto const empty = storage.add(upload(uploads, "empty", ""));
+
+      THEN("it's stored without any chunks") {
+	REQUIRE( empty != nullptr );
+	REQUIRE( contentsOf(*storage.lookup(empty->id.value())).empty() );
+	REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+      }
+    }
+
+    WHEN("a file with new contents doesn't fit") {
+      auto const large = storage.add(upload(uploads, "large", imageOf(65_mB, 3)));
+
+      THEN("it's refused, and the storage is left as it was") {
+	REQUIRE( large == nullptr );
+	REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+	REQUIRE( contentsOf(*storage.lookup(first->id.value())) == image );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A DedupStorage is opened again from its recipes") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-dedup-reopen";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+
+  GIVEN("a DedupStorage with three files, one of them removed") {
+    {
+      DedupStorage storage(Size{64_mB}, location, false);
+      for (int i = 1; i <= 3; i++) storage.add(upload(uploads, "file" + std::to_string(i), imageOf(50_kB, i % 2)));
+      storage.remove(storage.lookup(3));
+    }
+
+    WHEN("it's opened again") {
+      DedupStorage storage(Size{64_mB}, location, true);
+      auto const added = storage.add(upload(uploads, "file4", "four"));
+
+      THEN("its files, their chunks and its ids carry on from where they were") {
+	REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(50_kB, 1) );
+	REQUIRE( contentsOf(*storage.lookup(2)) == imageOf(50_kB, 0) );
+	REQUIRE( storage.lookup(2)->filename() == "file2" );
+	REQUIRE( storage.lookup(2)->digest == Utility::Hashing::Sha256::of(imageOf(50_kB, 0).data(), 50_kB) );
+	REQUIRE( storage.lookup(3) == nullptr );
+	REQUIRE( added->id == fileId{4} );
+	REQUIRE( storage.stats().storedBytes == 100_kB + 4 );
+	REQUIRE( storage.stats().logicalBytes == 100_kB + 4 );
+      }
+    }
+
+    WHEN("a crash left a torn recipe and chunks no recipe refers to") {
+      std::ofstream(location / DedupStorage::recipesFileName, std::ios::binary | std::ios::app) << std::string(100, 'r');
+      std::ofstream(location / DedupStorage::chunksFileName, std::ios::binary | std::ios::app) << std::string(10_kB, 'c');
+      DedupStorage storage(Size{64_mB}, location, true);
+
+      THEN("they're cut off, and everything that was logged is there") {
+	REQUIRE( fs::file_size(location / DedupStorage::chunksFileName) == 100_kB );
+	REQUIRE( storage.getAllocatedSize() == Size{100_kB} );
+	REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(50_kB, 1) );
+	REQUIRE( storage.add(upload(uploads, "file4", "four")) != nullptr );
+	REQUIRE( contentsOf(*storage.lookup(4)) == "four" );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A DedupStorage gives back the space of chunks no file is made of when it's compacted") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-dedup-compact";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+
+  GIVEN("a DedupStorage with three files, the last two of them removed") {
+    std::string recipesBefore;
+    {
+      DedupStorage storage(Size{64_mB}, location, false);
+      for (int i = 1; i <= 3; i++) storage.add(upload(uploads, "file" + std::to_string(i), imageOf(100_kB, i)));
+      auto const reading = storage.lookup(2);
+      storage.remove(storage.lookup(2));
+      storage.remove(storage.lookup(3));
+      recipesBefore = contentsOf(location / DedupStorage::recipesFileName);
+
+      WHEN("it's compacted") {
+	auto const reclaimed = storage.compact();
+
+	THEN("the chunks file shrinks to the chunks of the file that's left, which still reads") {
+	  REQUIRE( reclaimed == 200_kB );
+	  REQUIRE( storage.getAllocatedSize() == Size{100_kB} );
+	  REQUIRE( fs::file_size(location / DedupStorage::chunksFileName) == 100_kB );
+	  REQUIRE( storage.stats().unreferencedBytes == 0 );
+	  REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(100_kB, 1) );
+	  REQUIRE( contentsOf(*reading) == imageOf(100_kB, 2) );
+	  REQUIRE( storage.compact() == 0 );
+	}
+      }
+    }
+
+    WHEN("it's opened again after a compaction") {
+      {
+	DedupStorage storage(Size{64_mB}, location, true);
+	REQUIRE( storage.compact() == 200_kB );
+      }
+      DedupStorage storage(Size{64_mB}, location, true);
+
+      THEN("the file that's left is there, and ids carry on past the removed ones") {
+	REQUIRE( storage.getAllocatedSize() == Size{100_kB} );
+	REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(100_kB, 1) );
+	REQUIRE( storage.lookup(2) == nullptr );
+	REQUIRE( storage.add(upload(uploads, "file4", "four"))->id == fileId{4} );
+      }
+    }
+
+    WHEN("a crash interrupted a compaction before its chunks file replaced the old one") {
+      std::ofstream(location / "chunks.compacting", std::ios::binary) << std::string(10_kB, 'c');
+      std::ofstream(location / "recipes.compacting", std::ios::binary) << std::string(100, 'r');
+      DedupStorage storage(Size{64_mB}, location, true);
+
+      THEN("the new files are dropped, and the storage is as it was") {
+	REQUIRE( !fs::exists(location / "chunks.compacting") );
+	REQUIRE( !fs::exists(location / "recipes.compacting") );
+	REQUIRE( storage.getAllocatedSize() == Size{300_kB} );
+	REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(100_kB, 1) );
+      }
+    }
+
+    WHEN("a crash interrupted a compaction between replacing the chunks file and the recipes file") {
+      {
+	DedupStorage storage(Size{64_mB}, location, true);
+	REQUIRE( storage.compact() == 200_kB );
+      }
+      fs::rename(location / DedupStorage::recipesFileName, location / "recipes.compacting");
+      std::ofstream(location / DedupStorage::recipesFileName, std::ios::binary) << recipesBefore;
+      DedupStorage storage(Size{64_mB}, location, true);
+
+      THEN("the compaction is carried through") {
+	REQUIRE( !fs::exists(location / "recipes.compacting") );
+	REQUIRE( storage.getAllocatedSize() == Size{100_kB} );
+	REQUIRE( contentsOf(*storage.lookup(1)) == imageOf(100_kB, 1) );
+	REQUIRE( storage.lookup(3) == nullptr );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
@@ -0,0 +1,50 @@
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/digest.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+
+SCENARIO("Contents are hashed with SHA-256") {
+  GIVEN("the FIPS 180-2 test messages") {
+    std::string const abc = "abc";
+    std::string const twoBlocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+
+    THEN("every available engine produces the published digests") {
+      std::vector<Sha256::Engine> engines{Sha256::Engine::Portable, Sha256::bestEngine()};
+
+      for (auto const engine : engines) {
+	Sha256 sha(engine);
+	sha.update(abc.data(), abc.size());
+	REQUIRE( sha.finish().str() == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" );
+
+	sha.reset();
+	REQUIRE( sha.finish().str() == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" );
+
+	sha.reset();
+	sha.update(twoBlocks.data(), twoBlocks.size());
+	REQUIRE( sha.finish().str() == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" );
+      }
+    }
+  }
+
+  GIVEN("a message fed in uneven pieces") {
+    std::string message(100000, '\0');
+    for (std::size_t i = 0; i < message.size(); i++) message[i] = static_cast<char>(i * 31);
+
+    Sha256 sha;
+    for (std::size_t offset = 0, step = 1; offset < message.size(); offset += step, step = step * 7 % 999 + 1) {
+      sha.update(message.data() + offset, std::min(step, message.size() - offset));
+    }
+
+    THEN("the digest matches hashing the message at once and survives a round trip through hex") {
+      auto const digest = sha.finish();
+      REQUIRE( digest == Sha256::of(message.data(), message.size()) );
+      REQUIRE( Digest::parse(digest.str()) == digest );
+      REQUIRE_FALSE( Digest::parse("not a digest").has_value() );
+    }
+  }
+}
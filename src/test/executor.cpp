@@ -0,0 +1,55 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/executor.hpp"
+
+using namespace TinyCDN::Utility;
+
+SCENARIO("Tasks run on an IOExecutor") {
+  GIVEN("an executor with 4 threads") {
+    auto executor = std::make_unique<IOExecutor>(4);
+    REQUIRE( executor->threadCount() == 4 );
+
+    WHEN("tasks that block are submitted") {
+      std::vector<std::future<int>> results;
+      auto const start = std::chrono::steady_clock::now();
+      for (int i = 0; i < 4; i++) {
+	results.push_back(executor->submit([i]{
+	  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	  return i;
+	}));
+      }
+
+      THEN("they run concurrently and their futures hold their results") {
+	for (int i = 0; i < 4; i++) REQUIRE( results[i].get() == i );
+	REQUIRE( std::chrono::steady_clock::now() - start < std::chrono::milliseconds(350) );
+      }
+    }
+
+    WHEN("a task throws") {
+      auto result = executor->submit([]() -> int { throw std::runtime_error("failed"); });
+
+      THEN("the exception is rethrown from its future") {
+	REQUIRE_THROWS_AS( result.get(), std::runtime_error );
+      }
+    }
+
+    WHEN("the executor is destroyed with tasks still queued") {
+      std::atomic<int> ran{0};
+      for (int i = 0; i < 32; i++) {
+	executor->submit([&ran]{ ran++; });
+      }
+      executor.reset();
+
+      THEN("every queued task ran first") {
+	REQUIRE( ran == 32 );
+      }
+    }
+  }
+}
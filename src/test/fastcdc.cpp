@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/fastcdc.hpp"
+
+using namespace TinyCDN::Utility::Hashing;
+
+namespace {
+std::vector<unsigned char> randomBytes(std::size_t length, std::uint64_t seed) {
+  std::vector<unsigned char> data(length);
+  auto state = seed;
+  for (auto& byte : data) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    byte = static_cast<unsigned char>(state >> 56);
+  }
+  return data;
+}
+
+//! Where each chunk of data ends
+std::vector<std::size_t> cutPoints(const FastCdc& chunker, const std::vector<unsigned char>& data) {
+  std::vector<std::size_t> ends;
+  for (std::size_t offset = 0; offset < data.size();) {
+    offset += chunker.cut(data.data() + offset, data.size() - offset);
+    ends.push_back(offset);
+  }
+  return ends;
+}
+}
+
+SCENARIO("Contents are cut into chunks by FastCDC") {
+  FastCdc const chunker;
+
+  GIVEN("4MB of random bytes") {
+    auto const data = randomBytes(4 << 20, 1);
+    auto const ends = cutPoints(chunker, data);
+
+    THEN("every chunk but the last is between the smallest and the largest size, and they're near the average") {
+      for (std::size_t i = 0; i < ends.size(); i++) {
+	auto const length = ends[i] - (i == 0 ? 0 : ends[i - 1]);
+	REQUIRE( length <= FastCdc::defaultMaxSize );
+	if (i + 1 < ends.size()) REQUIRE( length > FastCdc::defaultMinSize );
+      }
+      auto const average = data.size() / ends.size();
+      REQUIRE( average > FastCdc::defaultAverageSize / 2 );
+      REQUIRE( average < FastCdc::defaultAverageSize * 2 );
+    }
+
+    THEN("the same bytes are cut the same way again") {
+      REQUIRE( cutPoints(chunker, data) == ends );
+    }
+
+    WHEN("bytes are inserted near the start") {
+      auto edited = data;
+      edited.insert(edited.begin() + 1000, {'e', 'd', 'i', 't'});
+      auto const editedEnds = cutPoints(chunker, edited);
+
+      THEN("the cut points after the edit are the same, only shifted") {
+	std::size_t shared = 0;
+	for (auto const end : editedEnds) {
+	  if (std::binary_search(ends.begin(), ends.end(), end - 4)) shared++;
+	}
+	REQUIRE( shared + 2 >= ends.size() );
+      }
+    }
+  }
+
+  GIVEN("a buffer of a single repeated byte") {
+    std::vector<unsigned char> const data(200000, 'a');
+
+    THEN("it's cut at the largest size, with no cut points in it") {
+      REQUIRE( chunker.cut(data.data(), data.size()) == FastCdc::defaultMaxSize );
+    }
+  }
+
+  GIVEN("a buffer no larger than the smallest chunk") {
+    auto const data = randomBytes(FastCdc::defaultMinSize, 2);
+
+    THEN("it's a single chunk") {
+      REQUIRE( chunker.cut(data.data(), data.size()) == data.size() );
+      REQUIRE( chunker.cut(data.data(), 0) == 0 );
+    }
+  }
+}
@@ -0,0 +1,914 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/middlewares/FileStorage/groupcommit.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+//! Makes writes that grow a regular file fail, like a full disk would, until allowWrites()
+void failWrites() {
+  ::signal(SIGXFSZ, SIG_IGN);
+  struct rlimit limit;
+  ::getrlimit(RLIMIT_FSIZE, &limit);
+  limit.rlim_cur = 1;
+  ::setrlimit(RLIMIT_FSIZE, &limit);
+}
+
+void allowWrites() {
+  struct rlimit limit;
+  ::getrlimit(RLIMIT_FSIZE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  ::setrlimit(RLIMIT_FSIZE, &limit);
+  ::signal(SIGXFSZ, SIG_DFL);
+}
+
+//! Writes a file into a numbered store the way older versions did, with its digest in an extended attribute
+fs::path storedBefore(const fs::path& location, std::uint32_t storeId, const std::string& name, const std::string& contents) {
+  auto const path = location / "store" / std::to_string(storeId) / name;
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary) << contents;
+  auto const digest = Utility::Hashing::Sha256::of(contents.data(), contents.size());
+  ::setxattr(path.c_str(), "user.tinycdn.sha256", digest.bytes.data(), digest.bytes.size(), 0);
+  return path;
+}
+
+//! The names of the files in the storage's stores, wherever they are
+std::vector<std::string> storedNames(const fs::path& location) {
+  std::vector<std::string> names;
+  for (auto const& file : fs::recursive_directory_iterator(location / "store")) {
+    if (fs::is_regular_file(file.status())) names.push_back(file.path().filename().string());
+  }
+  return names;
+}
+
+//! The size of each of the index's logs, so the records logged after can be lost with loseIndexRecords()
+std::map<fs::path, std::uintmax_t> indexLogSizes(const fs::path& location) {
+  std::map<fs::path, std::uintmax_t> sizes;
+  for (auto const& file : fs::directory_iterator(location)) {
+    if (file.path().filename().string().rfind(FilesystemIndex::logFileName.string() + ".", 0) == 0) sizes[file.path()] = fs::file_size(file.path());
+  }
+  return sizes;
+}
+
+//! Takes the index's logs back to the sizes they had, like a crash before they were synced could
+void loseIndexRecords(const fs::path& location, const std::map<fs::path, std::uintmax_t>& sizes) {
+  for (auto const& [log, size] : indexLogSizes(location)) {
+    auto const before = sizes.find(log);
+    if (before == sizes.end()) fs::remove(log);
+    else fs::resize_file(log, before->second);
+  }
+}
+
+/*!
+ * \brief Opens the storage in a child process and runs fn on it, killing the child as soon as the storage reaches step
+ * The child exits without closing anything, which leaves the storage as a crash at that point would.
+ * \return Whether the step was reached
+ */
+bool crashAt(FilesystemStep step, const fs::path& location, std::function<void(FilesystemStorage&)> fn) {
+  auto const child = ::fork();
+  if (child == 0) {
+    {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+      storage.afterStep = [step](FilesystemStep reached) {
+	if (reached == step) ::_exit(0);
+      };
+      fn(storage);
+    }
+    ::_exit(1);
+  }
+
+  int status = 0;
+  ::waitpid(child, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+}
+
+SCENARIO("Files are added to a FilesystemStorage in batches") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-filesystem";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  fs::create_directories(root / "storage");
+
+  GIVEN("a new FilesystemStorage") {
+    FilesystemStorage storage(Size{16_mB}, root / "storage", false);
+
+    WHEN("a batch of files is added, two of them with the same name") {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 8; i++) files.push_back(upload(uploads / std::to_string(i), "file" + std::to_string(i), std::string(100 + i, 'a' + i)));
+      files.push_back(upload(uploads / "twin", "file0", "the other file0"));
+
+      auto const stored = storage.addBatch(std::move(files));
+
+      THEN("every file gets its own id and can be looked up") {
+	REQUIRE( stored.size() == 9 );
+	for (std::size_t i = 0; i < stored.size(); i++) {
+	  REQUIRE( stored[i] != nullptr );
+	  REQUIRE( stored[i]->id.value() == i + 1 );
+	  REQUIRE( stored[i]->digest.has_value() );
+	  REQUIRE( !stored[i]->temporary );
+	}
+	REQUIRE( contentsOf(storage.lookup(3)->location) == std::string(102, 'c') );
+	REQUIRE( contentsOf(storage.lookup(9)->location) == "the other file0" );
+	REQUIRE( stored[0]->location != stored[8]->location );
+	REQUIRE( storage.getAllocatedSize() == Size{8 * 100 + 28 + 15} );
+      }
+
+      THEN("the uploads are gone") {
+	for (int i = 0; i < 8; i++) REQUIRE( !fs::exists(uploads / std::to_string(i) / ("file" + std::to_string(i))) );
+      }
+
+      THEN("files added afterwards carry on from the batch's ids") {
+	auto const next = storage.add(upload(uploads, "after", "after"));
+	REQUIRE( next->id.value() == 10 );
+      }
+    }
+
+    WHEN("an upload in the batch is missing") {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      files.push_back(upload(uploads, "present", "present"));
+      files.push_back(std::make_unique<StoredFile>(Size{10}, uploads / "missing", true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{}));
+      files.push_back(upload(uploads, "also-present", "also present"));
+
+      auto const stored = storage.addBatch(std::move(files));
+
+      THEN("only that file fails, and its space isn't allocated") {
+	REQUIRE( stored.size() == 3 );
+	REQUIRE( stored[0] != nullptr );
+	REQUIRE( stored[1] == nullptr );
+	REQUIRE( stored[2] != nullptr );
+	REQUIRE( contentsOf(storage.lookup(stored[2]->id.value())->location) == "also present" );
+	REQUIRE( storage.getAllocatedSize() == Size{7 + 12} );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A GroupCommitter gathers uploads into batches") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-groupcommit";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  fs::create_directories(root / "storage");
+
+  GIVEN("a FilesystemStorage and a GroupCommitter with a window of 4 files") {
+    FilesystemStorage storage(Size{16_mB}, root / "storage", false);
+    CommitWindow window;
+    window.delay = std::chrono::seconds(10);
+    window.files = 4;
+
+    WHEN("uploads are submitted from several threads") {
+      std::vector<std::future<std::unique_ptr<StoredFile>>> futures;
+      {
+	GroupCommitter committer(storage, window);
+	std::vector<std::future<std::vector<std::future<std::unique_ptr<StoredFile>>>>> submitters;
+	for (int thread = 0; thread < 4; thread++) {
+	  submitters.push_back(std::async(std::launch::async, [&, thread] {
+	    std::vector<std::future<std::unique_ptr<StoredFile>>> submitted;
+	    for (int i = 0; i < 10; i++) {
+	      auto const name = std::to_string(thread) + "-" + std::to_string(i);
+	      submitted.push_back(committer.submit(upload(uploads, name, name)));
+	    }
+	    return submitted;
+	  }));
+	}
+	for (auto& submitter : submitters) {
+	  for (auto& future : submitter.get()) futures.push_back(std::move(future));
+	}
+      }
+
+      THEN("every one of them is stored by the time the committer is gone, with an id of its own") {
+	std::vector<bool> seen(41, false);
+	for (auto& future : futures) {
+	  REQUIRE( future.wait_for(std::chrono::seconds(0)) == std::future_status::ready );
+	  auto const file = future.get();
+	  REQUIRE( file != nullptr );
+	  REQUIRE( !seen[file->id.value()] );
+	  seen[file->id.value()] = true;
+	  REQUIRE( contentsOf(file->location) == file->filename().string() );
+	}
+      }
+    }
+
+    WHEN("fewer files than the window are submitted and flushed") {
+      GroupCommitter committer(storage, window);
+      auto first = committer.submit(upload(uploads, "lonely", "lonely"));
+      committer.flush();
+
+      THEN("they're committed without waiting for the window's delay") {
+	REQUIRE( first.wait_for(std::chrono::seconds(5)) == std::future_status::ready );
+	REQUIRE( first.get()->id.value() == 1 );
+      }
+    }
+
+    WHEN("the committer is flushed before anything is submitted") {
+      GroupCommitter committer(storage, window);
+      committer.flush();
+      auto first = committer.submit(upload(uploads, "lonely", "lonely"));
+
+      THEN("the next file still waits for its window") {
+	REQUIRE( first.wait_for(std::chrono::milliseconds(200)) == std::future_status::timeout );
+	committer.flush();
+	REQUIRE( first.wait_for(std::chrono::seconds(5)) == std::future_status::ready );
+      }
+    }
+
+    WHEN("an upload that doesn't declare its size fills the window's bytes") {
+      window.bytes = 100;
+      GroupCommitter committer(storage, window);
+      auto first = committer.submit(sizelessUpload(uploads, "large", std::string(200, 'l')));
+
+      THEN("it's committed without waiting for the window's delay") {
+	REQUIRE( first.wait_for(std::chrono::seconds(5)) == std::future_status::ready );
+	REQUIRE( contentsOf(first.get()->location) == std::string(200, 'l') );
+      }
+    }
+
+    WHEN("the window's delay runs out") {
+      window.delay = std::chrono::milliseconds(5);
+      GroupCommitter committer(storage, window);
+      auto first = committer.submit(upload(uploads, "lonely", "lonely"));
+
+      THEN("the files gathered so far are committed") {
+	REQUIRE( first.wait_for(std::chrono::seconds(5)) == std::future_status::ready );
+	REQUIRE( first.get() != nullptr );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("Uploads are taken into a FilesystemStorage without copying them where the filesystem allows") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-ingest";
+  fs::remove_all(root);
+  fs::create_directories(root / "storage");
+
+  GIVEN("a FilesystemStorage") {
+    FilesystemStorage storage(Size{16_mB}, root / "storage", false);
+
+    WHEN("an upload on the same filesystem is added") {
+      auto const contents = std::string(300_kB, 'z');
+      auto const stored = storage.add(upload(root / "uploads", "same", contents));
+
+      THEN("it's renamed into the store, with the digest of its contents") {
+	REQUIRE( stored != nullptr );
+	REQUIRE( contentsOf(stored->location) == contents );
+	REQUIRE( stored->digest == Utility::Hashing::Sha256::of(contents.data(), contents.size()) );
+	REQUIRE( !fs::exists(root / "uploads" / "same") );
+	REQUIRE( storage.ingestStats().filesBy(IngestMethod::Rename) == 1 );
+	REQUIRE( storage.ingestStats().bytesBy(IngestMethod::Rename) == contents.size() );
+      }
+    }
+
+    WHEN("a batch of uploads on the same filesystem is added") {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 4; i++) files.push_back(upload(root / "uploads", std::to_string(i), std::to_string(i)));
+      auto const stored = storage.addBatch(std::move(files));
+
+      THEN("they're all renamed") {
+	REQUIRE( storage.ingestStats().filesBy(IngestMethod::Rename) == 4 );
+	REQUIRE( contentsOf(stored[3]->location) == "3" );
+      }
+    }
+
+    WHEN("the index can't take uploads that were moved into the store") {
+      storage.afterStep = [](FilesystemStep step) {
+	if (step == FilesystemStep::Ingested) failWrites();
+      };
+      auto const stored = storage.add(upload(root / "uploads", "moved", "the only copy"));
+      allowWrites();
+
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 2; i++) files.push_back(upload(root / "uploads", "batch" + std::to_string(i), std::to_string(i)));
+      auto const batch = storage.addBatch(std::move(files));
+      allowWrites();
+      storage.afterStep = nullptr;
+
+      THEN("the adds fail, and the uploads are back for the caller to try again") {
+	REQUIRE( stored == nullptr );
+	REQUIRE( batch[0] == nullptr );
+	REQUIRE( batch[1] == nullptr );
+	REQUIRE( contentsOf(root / "uploads" / "moved") == "the only copy" );
+	REQUIRE( contentsOf(root / "uploads" / "batch1") == "1" );
+	REQUIRE( storedNames(root / "storage").empty() );
+	REQUIRE( storage.getAllocatedSize() == 0 );
+
+	auto const retried = storage.add(upload(root / "uploads", "moved", contentsOf(root / "uploads" / "moved")));
+	REQUIRE( retried != nullptr );
+	REQUIRE( contentsOf(retried->location) == "the only copy" );
+      }
+    }
+
+    // tmpfs is almost always another filesystem than the temporary directory
+    auto const otherFilesystem = fs::path{"/dev/shm"} / "tinycdn-test-ingest";
+    if (fs::exists(otherFilesystem.parent_path())) {
+      WHEN("an upload on another filesystem is added") {
+	fs::remove_all(otherFilesystem);
+	auto const stored = storage.add(upload(otherFilesystem, "other", "from elsewhere"));
+	fs::remove_all(otherFilesystem);
+
+	THEN("it's copied, unless it's on the same filesystem after all") {
+	  REQUIRE( stored != nullptr );
+	  REQUIRE( contentsOf(stored->location) == "from elsewhere" );
+	  REQUIRE( storage.ingestStats().filesBy(IngestMethod::Copy) + storage.ingestStats().filesBy(IngestMethod::Rename) == 1 );
+	}
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A FilesystemStorage finds its files through an index it keeps in memory") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-filesystem-index";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+  fs::create_directories(location);
+
+  GIVEN("a FilesystemStorage with a few files, one of them removed") {
+    {
+      FilesystemStorage storage(Size{16_mB}, location, false);
+      for (int i = 1; i <= 3; i++) storage.add(upload(uploads, "file" + std::to_string(i), std::string(i, 'a')));
+      storage.remove(storage.lookup(2));
+
+      THEN("there are no per-file links, and the removed file can't be looked up") {
+	REQUIRE( !fs::exists(location / "links") );
+	REQUIRE( storage.lookup(2) == nullptr );
+	REQUIRE( storage.lookup(4) == nullptr );
+	REQUIRE( storage.lookup(3)->size == Size{3} );
+      }
+    }
+
+    WHEN("it's opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the index is loaded from its snapshot") {
+	REQUIRE( fs::exists(location / FilesystemIndex::snapshotFileName) );
+	REQUIRE( contentsOf(storage.lookup(1)->location) == "a" );
+	REQUIRE( contentsOf(storage.lookup(3)->location) == "aaa" );
+	REQUIRE( storage.lookup(3)->digest == Utility::Hashing::Sha256::of("aaa", 3) );
+	REQUIRE( storage.lookup(2) == nullptr );
+      }
+    }
+
+    WHEN("a file is mapped") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+      auto mapped = storage.lookup(3)->map(Utility::FileMapping::Access::Random);
+
+      THEN("its contents are viewed in place, even once it's removed") {
+	REQUIRE( mapped.has_value() );
+	REQUIRE( mapped->bytes == "aaa" );
+	storage.remove(storage.lookup(3));
+	REQUIRE( mapped->bytes == "aaa" );
+      }
+    }
+  }
+
+  GIVEN("a FilesystemStorage from before the index, with a symlink in links/ for every file") {
+    fs::create_directories(location / "links");
+    fs::create_symlink(storedBefore(location, 1, "old1", "old one"), location / "links" / "1");
+    fs::create_symlink(storedBefore(location, 1, "old2", "old two"), location / "links" / "2");
+    std::ofstream(location / "META") << "1;2;14";
+
+    WHEN("it's opened") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the links are moved into the index and removed") {
+	REQUIRE( !fs::exists(location / "links") );
+	REQUIRE( contentsOf(storage.lookup(1)->location) == "old one" );
+	REQUIRE( storage.lookup(2)->size == Size{7} );
+	REQUIRE( storage.lookup(2)->digest == Utility::Hashing::Sha256::of("old two", 7) );
+	REQUIRE( storage.lookup(2)->filename() == "old2" );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A FilesystemStorage spreads its files over a hashed fan-out of small directories") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-fan-out";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+  fs::create_directories(location);
+
+  GIVEN("a new FilesystemStorage") {
+    FilesystemStorage storage(Size{64_mB}, location, false);
+
+    WHEN("more files than fit in one directory are added, many of them with the same name") {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 2500; i++) files.push_back(upload(uploads / std::to_string(i), "same" + std::to_string(i % 3), std::to_string(i)));
+      for (std::size_t first = 0; first < files.size(); first += 500) {
+	std::vector<std::unique_ptr<StoredFile>> batch;
+	for (std::size_t i = first; i < first + 500; i++) batch.push_back(std::move(files[i]));
+	storage.addBatch(std::move(batch));
+      }
+
+      THEN("no directory holds more than a thousand entries") {
+	std::size_t stored = 0;
+	for (auto const& path : fs::recursive_directory_iterator(location / "store")) {
+	  if (!fs::is_directory(path.path())) {
+	    stored++;
+	    continue;
+	  }
+	  auto const entries = std::distance(fs::directory_iterator(path.path()), fs::directory_iterator());
+	  REQUIRE( entries <= 1000 );
+	}
+	REQUIRE( stored == 2500 );
+      }
+
+      THEN("every file keeps the name it was uploaded with") {
+	REQUIRE( storage.lookup(1)->filename() == "same0" );
+	REQUIRE( storage.lookup(2500)->filename() == "same0" );
+	REQUIRE( contentsOf(storage.lookup(2500)->location) == "2499" );
+      }
+
+      THEN("a file's path only depends on its id") {
+	fs::create_directories(root / "other");
+	FilesystemStorage other(Size{64_mB}, root / "other", false);
+	auto const file = other.add(upload(uploads, "different", "different"));
+	REQUIRE( file->location.string().substr((root / "other").string().size()) == storage.lookup(1)->location.string().substr(location.string().size()) );
+      }
+    }
+  }
+
+  GIVEN("a FilesystemStorage from before the fan-out, with its files in numbered stores") {
+    {
+      FilesystemIndex index(location);
+      std::vector<std::pair<fileId, FilesystemEntry>> entries;
+      for (fileId id = 1; id <= 600; id++) {
+	auto const name = "file" + std::to_string(id % 7);
+	FilesystemEntry entry;
+	entry.storeId = static_cast<std::uint32_t>((id - 1) / 7 + 1);
+	entry.size = std::to_string(id).size();
+	entry.digest = Utility::Hashing::Sha256::of(std::to_string(id).data(), entry.size);
+	entry.name = name;
+	storedBefore(location, entry.storeId, name, std::to_string(id));
+	entries.emplace_back(id, std::move(entry));
+      }
+      index.insert(entries);
+    }
+    std::ofstream(location / "META") << "86;600;0";
+
+    WHEN("it's opened and the migration it starts has run") {
+      FilesystemStorage storage(Size{64_mB}, location, true);
+      // A file that's being read while it's moved keeps its old name until it isn't
+      auto held = storage.lookup(42);
+      auto const migration = storage.startStoreMigration();
+      held.reset();
+      migration.wait();
+
+      THEN("every file is in the fan-out, under the name it had") {
+	for (fileId id = 1; id <= 600; id++) {
+	  auto const file = storage.lookup(id);
+	  REQUIRE( file->location.string().compare(0, (location / "store" / "by-id").string().size(), (location / "store" / "by-id").string()) == 0 );
+	  REQUIRE( contentsOf(file->location) == std::to_string(id) );
+	  REQUIRE( file->filename() == "file" + std::to_string(id % 7) );
+	  REQUIRE( file->digest == Utility::Hashing::Sha256::of(std::to_string(id).data(), std::to_string(id).size()) );
+	}
+      }
+
+      THEN("the numbered stores are gone") {
+	REQUIRE( !fs::exists(location / "store" / "6" / "file0") );
+	REQUIRE( !fs::exists(location / "store" / "1") );
+	REQUIRE( !fs::exists(location / "store" / "86") );
+      }
+
+      THEN("files added afterwards go into the fan-out after them") {
+	auto const file = storage.add(upload(uploads, "new", "new"));
+	REQUIRE( file->id.value() == 601 );
+	REQUIRE( contentsOf(storage.lookup(601)->location) == "new" );
+      }
+
+    }
+
+    WHEN("it's opened again after the migration") {
+      {
+	FilesystemStorage storage(Size{64_mB}, location, true);
+	storage.startStoreMigration().wait();
+      }
+      FilesystemStorage storage(Size{64_mB}, location, true);
+
+      THEN("the moves were logged, so the files are where the index says") {
+	REQUIRE( contentsOf(storage.lookup(600)->location) == "600" );
+	REQUIRE( storage.lookup(600)->filename() == "file5" );
+      }
+    }
+
+    WHEN("a file is removed after the migration") {
+      FilesystemStorage storage(Size{64_mB}, location, true);
+      storage.startStoreMigration().wait();
+      auto const file = storage.lookup(5);
+      auto const path = file->location;
+      storage.remove(storage.lookup(5));
+
+      THEN("its new name is removed") {
+	REQUIRE( !fs::exists(path) );
+	REQUIRE( storage.lookup(5) == nullptr );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A FilesystemIndex survives restarts through its log and snapshots") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-index-log";
+  fs::remove_all(root);
+  fs::create_directories(root);
+
+  auto const entryFor = [](std::uint32_t storeId, std::string name) {
+    FilesystemEntry entry;
+    entry.storeId = storeId;
+    entry.size = name.size();
+    entry.name = std::move(name);
+    return entry;
+  };
+
+  GIVEN("an index with changes that were only logged") {
+    // A process that didn't get to close the index leaves only its log
+    auto const crashed = root / "crashed";
+    {
+      FilesystemIndex index(root);
+      index.insert(1, entryFor(1, "one"));
+      index.insert(2, entryFor(1, "two"));
+      index.erase(1);
+      index.insert(3, entryFor(2, "three"));
+      fs::create_directories(crashed);
+      for (auto const& file : fs::directory_iterator(root)) {
+	if (fs::is_regular_file(file.path())) fs::copy_file(file.path(), crashed / file.path().filename());
+      }
+    }
+
+    WHEN("the log is replayed") {
+      FilesystemIndex index(crashed);
+
+      THEN("the index is as it was") {
+	REQUIRE( index.loaded() );
+	REQUIRE( index.size() == 2 );
+	REQUIRE( !index.find(1).has_value() );
+	REQUIRE( index.find(2)->name == "two" );
+	REQUIRE( index.find(3)->storeId == 2 );
+      }
+    }
+
+    WHEN("the last record in the log is torn") {
+      auto const log = crashed / (FilesystemIndex::logFileName.string() + ".0");
+      fs::resize_file(log, fs::file_size(log) - 3);
+
+      FilesystemIndex index(crashed);
+
+      THEN("only the torn change is lost, and new changes are logged after the last whole one") {
+	REQUIRE( index.size() == 1 );
+	REQUIRE( !index.find(3).has_value() );
+	REQUIRE( index.insert(4, entryFor(3, "four")) );
+      }
+      AND_THEN("the new change is there when it's opened again") {
+	index.insert(4, entryFor(3, "four"));
+	FilesystemIndex reopened(crashed);
+	REQUIRE( reopened.find(4)->name == "four" );
+	REQUIRE( reopened.find(2)->name == "two" );
+      }
+    }
+  }
+
+  GIVEN("more changes than fit between two snapshots") {
+    {
+      FilesystemIndex index(root);
+      std::vector<std::pair<fileId, FilesystemEntry>> batch;
+      for (fileId id = 1; id <= FilesystemIndex::snapshotInterval + 10; id++) batch.emplace_back(id, entryFor(1, std::to_string(id)));
+      index.insert(batch);
+      index.insert(1, entryFor(1, "after the snapshot"));
+
+      THEN("a snapshot was taken and the log restarted") {
+	REQUIRE( fs::exists(root / FilesystemIndex::snapshotFileName) );
+	REQUIRE( !fs::exists(root / (FilesystemIndex::logFileName.string() + ".0")) );
+	REQUIRE( fs::file_size(root / (FilesystemIndex::logFileName.string() + ".1")) < 1_kB );
+      }
+    }
+
+    WHEN("it's opened again") {
+      FilesystemIndex index(root);
+
+      THEN("the snapshot and the log after it are loaded") {
+	REQUIRE( index.size() == FilesystemIndex::snapshotInterval + 10 );
+	REQUIRE( index.find(1)->name == "after the snapshot" );
+	REQUIRE( index.find(FilesystemIndex::snapshotInterval + 10)->name == std::to_string(FilesystemIndex::snapshotInterval + 10) );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A FilesystemStorage hands out ids from leases") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-id-lease";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+  auto const crashed = root / "crashed";
+  fs::create_directories(location);
+
+  GIVEN("a FilesystemStorage with three files") {
+    {
+      FilesystemStorage storage(Size{16_mB}, location, false);
+      for (int i = 1; i <= 3; i++) storage.add(upload(uploads, "file" + std::to_string(i), std::string(i, 'x')));
+
+      // A process that crashes leaves the files as they are at this point
+      fs::copy(location, crashed, fs::copy_options::recursive);
+    }
+
+    WHEN("it's opened again after closing cleanly") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+      auto const next = storage.add(upload(uploads, "next", "next"));
+
+      THEN("the ids carry on where they stopped") {
+	REQUIRE( next->id.value() == 4 );
+	REQUIRE( storage.getAllocatedSize() == Size{1 + 2 + 3 + 4} );
+      }
+    }
+
+    WHEN("it's opened again after crashing") {
+      FilesystemStorage storage(Size{16_mB}, crashed, true);
+      auto const next = storage.add(upload(uploads, "next", "next"));
+
+      THEN("the rest of the lease is skipped, so no id is handed out twice") {
+	REQUIRE( next->id.value() > 3 );
+	REQUIRE( next->id.value() != 4 );
+	REQUIRE( contentsOf(storage.lookup(3)->location) == "xxx" );
+      }
+      THEN("the allocated size is counted from the index") {
+	REQUIRE( storage.getAllocatedSize() == Size{1 + 2 + 3 + 4} );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("Files in a FilesystemStorage are looked up from many threads at once") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-concurrent-lookup";
+  fs::remove_all(root);
+  fs::create_directories(root / "storage");
+
+  GIVEN("a FilesystemStorage with 100 files") {
+    FilesystemStorage storage(Size{16_mB}, root / "storage", false);
+    for (int i = 1; i <= 100; i++) storage.add(upload(root / "uploads", std::to_string(i), std::to_string(i)));
+
+    WHEN("8 threads look them all up, holding on to some of them") {
+      std::vector<std::future<std::size_t>> threads;
+      for (int thread = 0; thread < 8; thread++) {
+	threads.push_back(std::async(std::launch::async, [&] {
+	  std::size_t found = 0;
+	  std::vector<std::unique_ptr<StoredFile>> held;
+	  for (int pass = 0; pass < 10; pass++) {
+	    for (fileId id = 1; id <= 100; id++) {
+	      auto file = storage.lookup(id);
+	      if (file && file->location.filename() == std::to_string(id)) found++;
+	      if (pass < 3 && id % 10 == 0) held.push_back(std::move(file));
+	    }
+	  }
+	  return found;
+	}));
+      }
+
+      THEN("every lookup finds its file") {
+	for (auto& thread : threads) REQUIRE( thread.get() == 1000 );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A FilesystemStorage recovers from a crash partway through an operation from its journal") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-journal";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+  fs::create_directories(location);
+  {
+    FilesystemStorage storage(Size{16_mB}, location, false);
+    storage.add(upload(uploads / "kept", "kept", "kept"));
+  }
+
+  // A copied upload is still there until the file is in the index, tmpfs is almost always another filesystem
+  auto const elsewhere = fs::exists("/dev/shm") ? fs::path{"/dev/shm"} / "tinycdn-test-journal" : uploads / "copied";
+  fs::remove_all(elsewhere);
+
+  std::vector<std::pair<FilesystemStep, std::string>> const interruptedAdds = {
+    {FilesystemStep::Journaled, "before anything was created"},
+    {FilesystemStep::Claimed, "after claiming its path"},
+    {FilesystemStep::Ingested, "after copying in its contents"}
+  };
+
+  for (auto const& [step, when] : interruptedAdds) {
+    GIVEN("a process that crashed adding a file " + when) {
+      REQUIRE( crashAt(step, location, [&](FilesystemStorage& storage) { storage.add(upload(elsewhere, "lost", "lost")); }) );
+
+      WHEN("the storage is opened again") {
+	FilesystemStorage storage(Size{16_mB}, location, true);
+
+	THEN("the add is undone, leaving nothing the index doesn't know about and the upload where it was") {
+	  REQUIRE( storage.lookup(2) == nullptr );
+	  REQUIRE( storedNames(location) == std::vector<std::string>{"1"} );
+	  REQUIRE( contentsOf(storage.lookup(1)->location) == "kept" );
+	  REQUIRE( contentsOf(elsewhere / "lost") == "lost" );
+	  REQUIRE( storage.getAllocatedSize() == Size{4} );
+	}
+	THEN("the journal is empty again") {
+	  REQUIRE( fs::file_size(location / FilesystemJournal::fileName) == 0 );
+	}
+      }
+    }
+  }
+
+  GIVEN("a process that crashed adding a batch after copying in its contents") {
+    REQUIRE( crashAt(FilesystemStep::Ingested, location, [&](FilesystemStorage& storage) {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 3; i++) files.push_back(upload(elsewhere / std::to_string(i), "lost", "lost"));
+      storage.addBatch(std::move(files));
+    }) );
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the whole batch is undone") {
+	for (fileId id = 2; id <= 4; id++) REQUIRE( storage.lookup(id) == nullptr );
+	REQUIRE( storedNames(location) == std::vector<std::string>{"1"} );
+	for (int i = 0; i < 3; i++) REQUIRE( contentsOf(elsewhere / std::to_string(i) / "lost") == "lost" );
+      }
+    }
+  }
+
+  GIVEN("a process that crashed adding a file after claiming its path, whose upload is gone since") {
+    REQUIRE( crashAt(FilesystemStep::Claimed, location, [&](FilesystemStorage& storage) { storage.add(upload(uploads, "pending.jpg", "pending")); }) );
+    fs::remove(uploads / "pending.jpg");
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the add is undone, since nothing says its contents were taken in") {
+	REQUIRE( storage.lookup(2) == nullptr );
+	REQUIRE( storedNames(location) == std::vector<std::string>{"1"} );
+	REQUIRE( storage.getAllocatedSize() == Size{4} );
+      }
+    }
+  }
+
+  GIVEN("a process that crashed after adding a file, with a new upload under its upload's name") {
+    REQUIRE( crashAt(FilesystemStep::Indexed, location, [&](FilesystemStorage& storage) {
+      storage.afterStep = nullptr;
+      if (!storage.add(upload(uploads, "0000001", "added"))) return;
+      // Upload servers reuse temporary names
+      std::ofstream(uploads / "0000001", std::ios::binary) << "next upload";
+      ::_exit(0);
+    }) );
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the add is kept, and the new upload is left alone") {
+	REQUIRE( contentsOf(storage.lookup(2)->location) == "added" );
+	REQUIRE( contentsOf(uploads / "0000001") == "next upload" );
+      }
+    }
+  }
+
+  GIVEN("a process that crashed adding a file after moving in its contents") {
+    REQUIRE( crashAt(FilesystemStep::Ingested, location, [&](FilesystemStorage& storage) { storage.add(upload(uploads, "moved", "moved")); }) );
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the file is indexed, since it's the only copy left") {
+	auto const found = storage.lookup(2);
+	REQUIRE( found != nullptr );
+	REQUIRE( contentsOf(found->location) == "moved" );
+	REQUIRE( found->filename() == "moved" );
+	REQUIRE( found->digest == Utility::Hashing::Sha256::of("moved", 5) );
+	REQUIRE( storage.getAllocatedSize() == Size{4 + 5} );
+	REQUIRE( fs::file_size(location / FilesystemJournal::fileName) == 0 );
+      }
+    }
+  }
+
+  GIVEN("a process that crashed after adding a file, before the index's record of it was synced") {
+    auto const logSizes = indexLogSizes(location);
+    REQUIRE( crashAt(FilesystemStep::Indexed, location, [&](FilesystemStorage& storage) {
+      // The crash comes once add() has returned, when the id may already be out there
+      storage.afterStep = nullptr;
+      if (storage.add(upload(uploads, "renamed.txt", "handed out"))) ::_exit(0);
+    }) );
+    loseIndexRecords(location, logSizes);
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the add is redone from the file it took in") {
+	auto const found = storage.lookup(2);
+	REQUIRE( found != nullptr );
+	REQUIRE( contentsOf(found->location) == "handed out" );
+	REQUIRE( found->filename() == "renamed.txt" );
+	REQUIRE( found->verify() );
+	REQUIRE( !fs::exists(uploads / "renamed.txt") );
+      }
+    }
+  }
+
+  GIVEN("a process that crashed adding a file after it was in the index") {
+    REQUIRE( crashAt(FilesystemStep::Indexed, location, [&](FilesystemStorage& storage) { storage.add(upload(elsewhere, "added", "added")); }) );
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+
+      THEN("the file is kept and its upload removed") {
+	REQUIRE( contentsOf(storage.lookup(2)->location) == "added" );
+	REQUIRE( !fs::exists(elsewhere / "added") );
+	REQUIRE( storage.getAllocatedSize() == Size{4 + 5} );
+      }
+    }
+  }
+
+  std::vector<std::pair<FilesystemStep, std::string>> const interruptedRemoves = {
+    {FilesystemStep::Journaled, "before it was taken out of the index"},
+    {FilesystemStep::Erased, "after it was taken out of the index"}
+  };
+
+  for (auto const& [step, when] : interruptedRemoves) {
+    GIVEN("a process that crashed removing a file " + when) {
+      REQUIRE( crashAt(step, location, [](FilesystemStorage& storage) { storage.remove(storage.lookup(1)); }) );
+
+      WHEN("the storage is opened again") {
+	FilesystemStorage storage(Size{16_mB}, location, true);
+
+	THEN("the remove is carried through") {
+	  REQUIRE( storage.lookup(1) == nullptr );
+	  REQUIRE( storedNames(location).empty() );
+	  REQUIRE( storage.getAllocatedSize() == Size{0} );
+	}
+      }
+    }
+  }
+
+  GIVEN("a torn intent at the end of the journal") {
+    std::ofstream(location / FilesystemJournal::fileName, std::ios::binary | std::ios::app) << std::string(10, 'x');
+
+    WHEN("the storage is opened again") {
+      FilesystemStorage storage(Size{16_mB}, location, true);
+      auto const added = storage.add(upload(uploads, "after", "after"));
+
+      THEN("the torn intent is dropped, and the journal carries on") {
+	REQUIRE( contentsOf(storage.lookup(1)->location) == "kept" );
+	REQUIRE( added != nullptr );
+	REQUIRE( contentsOf(added->location) == "after" );
+      }
+    }
+  }
+
+  GIVEN("more files added than fit in the journal before a checkpoint") {
+    FilesystemStorage storage(Size{64_mB}, location, true);
+    std::size_t added = 0;
+    // Every intent takes more than 100 bytes, with the paths in it
+    for (int batch = 0; added * 100 < FilesystemJournal::checkpointSize + 100000; batch++) {
+      std::vector<std::unique_ptr<StoredFile>> files;
+      for (int i = 0; i < 1000; i++) files.push_back(upload(uploads / std::to_string(batch), std::to_string(i), "churn"));
+      for (auto const& file : storage.addBatch(std::move(files))) added += file != nullptr;
+    }
+
+    THEN("checkpoints keep it from growing past that") {
+      REQUIRE( fs::file_size(location / FilesystemJournal::fileName) < FilesystemJournal::checkpointSize );
+      REQUIRE( contentsOf(storage.lookup(static_cast<fileId>(added + 1))->location) == "churn" );
+    }
+  }
+
+  fs::remove_all(elsewhere);
+  fs::remove_all(root);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <experimental/filesystem>
+
+#include "src/middlewares/FileStorage/storedfile.hpp"
+
+namespace fs = std::experimental::filesystem;
+
+//! Helpers shared by the storage tests
+namespace TinyCDN::Test {
+
+//! Writes contents to an upload named name in directory and returns a StoredFile for it that declares its size
+inline std::unique_ptr<Middleware::FileStorage::StoredFile> upload(const fs::path& directory, const std::string& name,
+                                                                   const std::string& contents,
+                                                                   std::optional<std::string> contentType = {}) {
+  fs::create_directories(directory);
+  auto const location = directory / name;
+  std::ofstream(location, std::ios::binary) << contents;
+  auto file = std::make_unique<Middleware::FileStorage::StoredFile>(
+    Size{contents.size()}, location, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{});
+  file->contentType = std::move(contentType);
+  return file;
+}
+
+//! Like upload, but its StoredFile declares a size of 0, the way the client builds uploads (see Client/client.cpp)
+inline std::unique_ptr<Middleware::FileStorage::StoredFile> sizelessUpload(const fs::path& directory, const std::string& name,
+                                                                           const std::string& contents) {
+  fs::create_directories(directory);
+  auto const location = directory / name;
+  std::ofstream(location, std::ios::binary) << contents;
+  return std::make_unique<Middleware::FileStorage::StoredFile>(location, true, std::unique_ptr<std::unique_lock<std::shared_mutex>>{});
+}
+
+//! Bytes that don't repeat, like a compressed image's
+inline std::string imageOf(std::size_t size, std::uint64_t seed) {
+  std::string image(size, '\0');
+  auto state = seed;
+  for (auto& byte : image) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    byte = static_cast<char>(state >> 56);
+  }
+  return image;
+}
+
+//! The whole file at path
+inline std::string contentsOf(const fs::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+}
+
+//! length bytes of a file from offset on, read through its own source if it has one and from its location otherwise
+inline std::string contentsOf(const Middleware::FileStorage::StoredFile& file, std::uintmax_t offset = 0,
+                              std::size_t length = std::string::npos) {
+  if (!file.contents) {
+    auto const contents = contentsOf(file.location);
+    return offset >= contents.size() ? std::string{} : contents.substr(static_cast<std::size_t>(offset), length);
+  }
+  if (offset >= file.size) return {};
+  std::string contents(std::min<std::uintmax_t>(length, file.size - offset), '\0');
+  contents.resize(file.contents->readAt(reinterpret_cast<unsigned char*>(contents.data()), contents.size(), offset));
+  return contents;
+}
+}
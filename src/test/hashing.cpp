@@ -41,9 +41,9 @@ SCENARIO("Random strings are generated") {
 	REQUIRE( strlen(hex32) == 32 );
 	REQUIRE( strlen(hex64) == 64 );
       }
-      delete hex8;
-      delete hex32;
-      delete hex64;
+      delete[] hex8;
+      delete[] hex32;
+      delete[] hex64;
     }
   }
   GIVEN("an Id instance") {
@@ -58,6 +58,31 @@ SCENARIO("Random strings are generated") {
 	REQUIRE( id.str() == "aabb" );
       }
     }
+
+    WHEN("an Id is assigned to a shorter hex string") {
+      id = "f";
+      THEN("the value is right-aligned and formatted with leading zeroes") {
+	REQUIRE( id.words()[0] == 0xf );
+	REQUIRE( id.str() == "000f" );
+      }
+    }
+
+    WHEN("an Id is assigned to a string that is not hex") {
+      THEN("std::invalid_argument is thrown") {
+	REQUIRE_THROWS_AS( id = "AXBB", std::invalid_argument );
+      }
+    }
+  }
+  GIVEN("a 128-bit Id literal") {
+    constexpr Id<128> id{"0123456789ABCDEFfedcba9876543210"};
+    static_assert(id.words()[1] == 0x0123456789abcdefull, "literal ids are parsed at compile time");
+    static_assert(id.words()[0] == 0xfedcba9876543210ull, "literal ids are parsed at compile time");
+
+    THEN("it formats back to the same lowercase hex string and compares by value") {
+      REQUIRE( id.str() == "0123456789abcdeffedcba9876543210" );
+      REQUIRE( id == Id<128>{id.str()} );
+      REQUIRE( id != Id<128>{} );
+    }
   }
   GIVEN("UUID4 factory") {
     UUID4Factory generator;
@@ -97,5 +122,19 @@ SCENARIO("Random strings are generated") {
 	REQUIRE( std::any_of(validChars.cbegin(), validChars.cend(), [&c](auto validChar){ return c == validChar; }) );
       }
     }
+
+    WHEN("a batch of UUID4s is generated") {
+      std::vector<UUID4> ids(64);
+      generator(ids.begin(), ids.end());
+
+      THEN("every UUID4 in the batch is distinct and has its version set") {
+	for (std::size_t i = 0; i < ids.size(); i++) {
+	  REQUIRE( ids[i].str()[14] == '4' );
+	  for (std::size_t j = i + 1; j < ids.size(); j++) {
+	    REQUIRE( ids[i] != ids[j] );
+	  }
+	}
+      }
+    }
   }
 }
@@ -0,0 +1,467 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/utility.hpp"
+#include "src/middlewares/FileStorage/haystack.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+std::string readAll(const Haystack& haystack, const StoredFile& file, std::size_t blockSize) {
+  std::string contents;
+  auto cursor = haystack.read(file, blockSize);
+  while (cursor.hasNext()) {
+    auto const block = cursor.next().get();
+    contents.append(block.buffer());
+  }
+  return contents;
+}
+
+//! Where a needle starts, given a file's contents offset
+std::uintmax_t needleOffset(const StoredFile& file) {
+  return file.position->first - sizeof(NeedleHeader) - file.filename().string().size()
+    - NeedleHeader::checksumCount(file.position->second) * sizeof(std::uint32_t);
+}
+
+std::string pattern(std::size_t size, char seed) {
+  std::string contents(size, '\0');
+  for (std::size_t i = 0; i < size; i++) contents[i] = static_cast<char>(seed + i % 251);
+  return contents;
+}
+}
+
+SCENARIO("Files are stored as needles in a Haystack") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-haystack";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+
+  GIVEN("a new 4mB Haystack") {
+    auto haystack = std::make_unique<Haystack>(Size{4_mB}, root / "volume", false);
+    REQUIRE( fs::file_size(haystack->volumePath()) == 4_mB );
+
+    auto const small = pattern(1000, 'a');
+    auto const large = pattern(600_kB, 'b');
+
+    WHEN("files are added") {
+      auto first = haystack->add(upload(uploads, "small.txt", small));
+      auto second = haystack->add(upload(uploads, "large.bin", large));
+      auto empty = haystack->add(upload(uploads, "empty", ""));
+
+      THEN("they get unique ids, their uploads are removed, and their contents can be read back") {
+	REQUIRE( first != nullptr );
+	REQUIRE( second != nullptr );
+	REQUIRE( empty != nullptr );
+	REQUIRE( first->id != second->id );
+	REQUIRE( !fs::exists(uploads / "small.txt") );
+	REQUIRE( haystack->fileCount() == 3 );
+
+	REQUIRE( readAll(*haystack, *first, 256_kB) == small );
+	REQUIRE( readAll(*haystack, *second, 256_kB) == large );
+	REQUIRE( readAll(*haystack, *second, 100_kB) == large );
+	REQUIRE( readAll(*haystack, *empty, 256_kB).empty() );
+	REQUIRE( first->verify() );
+      }
+
+      THEN("blocks read with many in flight arrive in order") {
+	auto cursor = haystack->read(*second, 4_kB, 16);
+	std::uintmax_t expected = 0;
+	std::string contents;
+	while (cursor.hasNext()) {
+	  auto const block = cursor.next().get();
+	  REQUIRE( block.position == expected );
+	  expected += block.size();
+	  contents.append(block.buffer());
+	}
+	REQUIRE( contents == large );
+      }
+
+      THEN("a cursor that is dropped early doesn't leave blocks behind") {
+	auto cursor = std::make_unique<HaystackReadCursor>(haystack->read(*second, 4_kB, 16));
+	REQUIRE( cursor->next().get().buffer() == std::string_view(large).substr(0, 4_kB) );
+	cursor.reset();
+      }
+
+      THEN("a lookup returns the needle's position, name and digest") {
+	auto found = haystack->lookup(second->id.value());
+	REQUIRE( found != nullptr );
+	REQUIRE( found->filename() == "large.bin" );
+	REQUIRE( found->getRealSize() == large.size() );
+	REQUIRE( found->position == second->position );
+	REQUIRE( found->etag() == second->etag() );
+	REQUIRE( found->verify() );
+	// The needle's checksums are only checked as it's read
+	REQUIRE( !found->map().has_value() );
+      }
+
+      THEN("a ChunkedCursor serves a needle straight out of the volume file") {
+	auto found = haystack->lookup(first->id.value());
+	auto source = Utility::FileHandle::open(found->location);
+	Utility::ChunkedCursor cursor(256, found->getRealSize(), found->position->first, source);
+
+	std::string served;
+	std::vector<unsigned char> buffer(256);
+	while (!cursor.isLastChunk) {
+	  cursor.nextChunk(buffer.data());
+	  served.append(reinterpret_cast<char*>(buffer.data()), cursor.forwardsAmount);
+	}
+	REQUIRE( served == small );
+      }
+
+      AND_WHEN("a byte of a file's contents is flipped on disk") {
+	auto const corruptAt = second->position->first + 300_kB;
+	{
+	  std::fstream volume(haystack->volumePath(), std::ios::in | std::ios::out | std::ios::binary);
+	  volume.seekg(static_cast<std::streamoff>(corruptAt));
+	  auto const byte = static_cast<char>(volume.get() ^ 0x01);
+	  volume.seekp(static_cast<std::streamoff>(corruptAt));
+	  volume.put(byte);
+	}
+	auto found = haystack->lookup(second->id.value());
+
+	THEN("reading the block it's in throws, and the other blocks still read") {
+	  auto cursor = haystack->read(*found, 256_kB);
+	  REQUIRE( cursor.next().get().buffer() == std::string_view(large).substr(0, 256_kB) );
+	  REQUIRE_THROWS_AS( cursor.next().get(), CorruptBlockError );
+	  REQUIRE( cursor.next().get().buffer() == std::string_view(large).substr(512_kB) );
+	}
+
+	THEN("reading any part of the block throws with the block's position") {
+	  std::vector<unsigned char> buffer(10);
+	  try {
+	    found->contents->readAt(buffer.data(), buffer.size(), 500_kB);
+	    FAIL( "the corrupt block was read" );
+	  }
+	  catch (const CorruptBlockError& e) {
+	    REQUIRE( e.position == 256_kB );
+	  }
+	}
+
+	THEN("it fails verification, and files around it don't") {
+	  REQUIRE( !found->verify() );
+	  REQUIRE( haystack->lookup(first->id.value())->verify() );
+	}
+      }
+
+      AND_WHEN("a file is removed") {
+	auto const removedId = first->id.value();
+	haystack->remove(std::move(first));
+
+	THEN("it can't be looked up anymore") {
+	  REQUIRE( haystack->lookup(removedId) == nullptr );
+	  REQUIRE( haystack->fileCount() == 2 );
+	}
+      }
+
+      AND_WHEN("the Haystack is opened again") {
+	auto const removedId = first->id.value();
+	haystack->remove(std::move(first));
+	auto const lastId = empty->id.value();
+	haystack.reset();
+	haystack = std::make_unique<Haystack>(Size{4_mB}, root / "volume", true);
+
+	THEN("the index is rebuilt without the removed file and ids aren't reused") {
+	  REQUIRE( haystack->fileCount() == 2 );
+	  REQUIRE( haystack->lookup(removedId) == nullptr );
+
+	  auto found = haystack->lookup(second->id.value());
+	  REQUIRE( found != nullptr );
+	  REQUIRE( readAll(*haystack, *found, 256_kB) == large );
+
+	  auto third = haystack->add(upload(uploads, "third", small));
+	  REQUIRE( third != nullptr );
+	  REQUIRE( third->id.value() > lastId );
+	}
+      }
+    }
+
+    WHEN("an upload is added under a name other than its upload's") {
+      auto file = upload(uploads, "0000001", small);
+      file->name = "logo.png";
+      auto const added = haystack->add(std::move(file));
+
+      THEN("its needle is named after the file") {
+	REQUIRE( added->filename() == "logo.png" );
+	REQUIRE( haystack->lookup(added->id.value())->filename() == "logo.png" );
+      }
+    }
+
+    WHEN("a file doesn't fit in the space that's left") {
+      auto const tooLarge = pattern(4_mB, 'c');
+
+      THEN("it isn't added") {
+	REQUIRE( haystack->add(upload(uploads, "too-large", tooLarge)) == nullptr );
+	REQUIRE( haystack->fileCount() == 0 );
+      }
+    }
+  }
+
+  GIVEN("a new Haystack that writes with O_DIRECT") {
+    auto haystack = std::make_unique<Haystack>(Size{4_mB}, root / "direct", false, Haystack::WriteMode::Direct);
+    REQUIRE( haystack->writeMode() == Haystack::WriteMode::Direct );
+
+    auto const small = pattern(1000, 'd');
+    auto const large = pattern(600_kB + 3, 'e');
+
+    WHEN("files are added") {
+      auto first = haystack->add(upload(uploads, "small.txt", small));
+      auto second = haystack->add(upload(uploads, "large.bin", large));
+
+      THEN("their needles are page-aligned and read back like buffered ones") {
+	REQUIRE( first != nullptr );
+	REQUIRE( second != nullptr );
+	REQUIRE( needleOffset(*second) % 4_kB == 0 );
+
+	REQUIRE( readAll(*haystack, *first, 256_kB) == small );
+	REQUIRE( readAll(*haystack, *second, 64_kB) == large );
+	REQUIRE( second->verify() );
+      }
+
+      AND_WHEN("the Haystack is opened again in the buffered write mode") {
+	haystack.reset();
+	haystack = std::make_unique<Haystack>(Size{4_mB}, root / "direct", true);
+
+	THEN("the needles are found, and new ones keep the volume's alignment") {
+	  REQUIRE( haystack->fileCount() == 2 );
+	  auto found = haystack->lookup(second->id.value());
+	  REQUIRE( found != nullptr );
+	  REQUIRE( found->filename() == "large.bin" );
+	  REQUIRE( found->etag() == second->etag() );
+
+	  auto third = haystack->add(upload(uploads, "third", small));
+	  REQUIRE( third != nullptr );
+	  REQUIRE( needleOffset(*third) % 4_kB == 0 );
+	  REQUIRE( readAll(*haystack, *third, 256_kB) == small );
+	}
+      }
+    }
+  }
+
+  GIVEN("a Haystack with a removed file between two others") {
+    auto haystack = std::make_unique<Haystack>(Size{4_mB}, root / "compacted", false);
+
+    auto const before = pattern(300_kB, 'f');
+    auto const removedContents = pattern(1_mB, 'g');
+    auto const after = pattern(200_kB + 7, 'h');
+
+    auto first = haystack->add(upload(uploads, "before", before));
+    auto removed = haystack->add(upload(uploads, "removed", removedContents));
+    auto last = haystack->add(upload(uploads, "after", after));
+    auto const removedLength = haystack->needleLength(7, removedContents.size());
+    haystack->remove(std::move(removed));
+
+    REQUIRE( haystack->stats().deadBytes == removedLength );
+
+    WHEN("it is compacted") {
+      auto const held = haystack->lookup(last->id.value());
+      auto const reclaimed = haystack->compact();
+
+      THEN("the removed needle's space is reclaimed and the other files moved up") {
+	REQUIRE( reclaimed == removedLength );
+	REQUIRE( haystack->fileCount() == 2 );
+
+	auto const stats = haystack->stats();
+	REQUIRE( stats.deadBytes == 0 );
+	REQUIRE( stats.reclaimedBytes == removedLength );
+	REQUIRE( stats.compactions == 1 );
+
+	auto moved = haystack->lookup(last->id.value());
+	REQUIRE( moved->position->first == last->position->first - removedLength );
+	REQUIRE( readAll(*haystack, *moved, 64_kB) == after );
+	REQUIRE( moved->verify() );
+	REQUIRE( readAll(*haystack, *haystack->lookup(first->id.value()), 64_kB) == before );
+	REQUIRE( !fs::exists(haystack->compactingVolumePath()) );
+      }
+
+      THEN("a file looked up before the compaction still reads from the old volume file") {
+	REQUIRE( readAll(*haystack, *held, 64_kB) == after );
+      }
+
+      THEN("compacting again has nothing to reclaim") {
+	REQUIRE( haystack->compact() == 0 );
+      }
+
+      AND_WHEN("the Haystack is opened again") {
+	auto const lastId = last->id.value();
+	haystack.reset();
+	haystack = std::make_unique<Haystack>(Size{4_mB}, root / "compacted", true);
+
+	THEN("it finds the compacted needles and doesn't reuse ids") {
+	  REQUIRE( haystack->fileCount() == 2 );
+	  REQUIRE( readAll(*haystack, *haystack->lookup(lastId), 64_kB) == after );
+
+	  auto next = haystack->add(upload(uploads, "next", before));
+	  REQUIRE( next != nullptr );
+	  REQUIRE( next->id.value() > lastId );
+	}
+      }
+    }
+
+    WHEN("files are read, added and removed while a throttled compaction runs") {
+      auto compaction = haystack->startCompaction(1_mB);
+
+      std::vector<std::unique_ptr<StoredFile>> added;
+      while (compaction.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready) {
+	REQUIRE( readAll(*haystack, *haystack->lookup(first->id.value()), 64_kB) == before );
+	if (added.size() < 4) added.push_back(haystack->add(upload(uploads, "during", after)));
+	if (last) haystack->remove(std::move(last));
+      }
+
+      THEN("nothing added or removed meanwhile is lost") {
+	// The file removed meanwhile is either left out or still copied and flagged, depending on when it was removed
+	REQUIRE( compaction.get() + haystack->stats().deadBytes == removedLength + haystack->needleLength(5, after.size()) );
+	REQUIRE( !added.empty() );
+	REQUIRE( haystack->fileCount() == 1 + added.size() );
+	for (auto const& file : added) {
+	  REQUIRE( file != nullptr );
+	  REQUIRE( readAll(*haystack, *haystack->lookup(file->id.value()), 64_kB) == after );
+	}
+      }
+    }
+  }
+
+  GIVEN("a Haystack whose index was saved before more files were added and removed") {
+    auto haystack = std::make_unique<Haystack>(Size{4_mB}, root / "snapshot", false);
+
+    auto const contents = pattern(10_kB, 'i');
+    std::vector<std::unique_ptr<StoredFile>> files;
+    for (int i = 0; i < 8; i++) files.push_back(haystack->add(upload(uploads, "saved" + std::to_string(i), contents)));
+    REQUIRE( haystack->saveIndex() );
+
+    auto const removedId = files[2]->id.value();
+    haystack->remove(std::move(files[2]));
+    auto tail = haystack->add(upload(uploads, "tail", contents));
+
+    THEN("lookups combine the snapshot with what changed since") {
+      REQUIRE( haystack->fileCount() == 8 );
+      REQUIRE( haystack->lookup(removedId) == nullptr );
+      REQUIRE( readAll(*haystack, *haystack->lookup(files[5]->id.value()), 4_kB) == contents );
+      REQUIRE( readAll(*haystack, *haystack->lookup(tail->id.value()), 4_kB) == contents );
+    }
+
+    WHEN("the Haystack crashes before it's closed") {
+      // The volume file and the snapshot as the process left them
+      fs::create_directories(root / "crashed");
+      fs::copy_file(haystack->volumePath(), root / "crashed" / Haystack::volumeFileName);
+      fs::copy_file(haystack->indexPath(), root / "crashed" / Haystack::indexFileName);
+      Haystack crashed(Size{4_mB}, root / "crashed", true);
+
+      THEN("the needles after the snapshot are replayed and removed ones stay removed") {
+	REQUIRE( crashed.lookup(tail->id.value()) != nullptr );
+	REQUIRE( crashed.lookup(removedId) == nullptr );
+	REQUIRE( readAll(crashed, *crashed.lookup(files[7]->id.value()), 4_kB) == contents );
+
+	auto next = crashed.add(upload(uploads, "next", contents));
+	REQUIRE( next->id.value() > tail->id.value() );
+      }
+
+      THEN("compacting it drops the needles that were removed") {
+	REQUIRE( crashed.stats().deadBytes == 0 );
+	REQUIRE( crashed.compact() == crashed.needleLength(6, contents.size()) );
+	REQUIRE( crashed.fileCount() == 8 );
+	REQUIRE( crashed.lookup(removedId) == nullptr );
+      }
+    }
+
+    AND_WHEN("it is closed and opened again") {
+      haystack.reset();
+      REQUIRE( fs::exists(root / "snapshot" / Haystack::indexFileName) );
+      haystack = std::make_unique<Haystack>(Size{4_mB}, root / "snapshot", true);
+
+      THEN("the index comes from the snapshot") {
+	REQUIRE( haystack->fileCount() == 8 );
+	REQUIRE( haystack->lookup(removedId) == nullptr );
+	REQUIRE( readAll(*haystack, *haystack->lookup(tail->id.value()), 4_kB) == contents );
+	REQUIRE( haystack->stats().deadBytes == haystack->needleLength(6, contents.size()) );
+      }
+    }
+
+    AND_WHEN("its snapshot is damaged") {
+      auto const indexPath = haystack->indexPath();
+      haystack.reset();
+      {
+	std::fstream index(indexPath, std::ios::in | std::ios::out | std::ios::binary);
+	index.seekp(sizeof(HaystackIndexHeader) + 8);
+	index.put('\x7f');
+      }
+      haystack = std::make_unique<Haystack>(Size{4_mB}, root / "snapshot", true);
+
+      THEN("the index is rebuilt from the volume file once a lookup runs into the damage") {
+	REQUIRE( haystack->lookup(files[0]->id.value()) != nullptr );
+	REQUIRE( !fs::exists(indexPath) );
+	REQUIRE( haystack->fileCount() == 8 );
+	REQUIRE( haystack->lookup(removedId) == nullptr );
+	REQUIRE( haystack->stats().deadBytes == haystack->needleLength(6, contents.size()) );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("An index snapshot is searched in place") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-haystackindex";
+  fs::remove_all(root);
+  fs::create_directories(root);
+  auto const path = root / "index";
+
+  GIVEN("a snapshot of a few chunks of entries") {
+    std::uint64_t const count = 3 * HaystackIndexSnapshot::entriesPerChunk + 5;
+    {
+      HaystackIndexWriter writer(path);
+      for (std::uint64_t id = 1; id <= count; id++) REQUIRE( writer.append(HaystackIndexEntry{2 * id, 64 * id, id, 0, 1}) );
+
+      HaystackIndexHeader header;
+      header.volumeId = 42;
+      header.volumeEnd = 64 * (count + 1);
+      REQUIRE( writer.finish(header) );
+    }
+    REQUIRE( !fs::exists(path.string() + ".saving") );
+
+    WHEN("it is opened") {
+      auto const snapshot = HaystackIndexSnapshot::open(path);
+
+      THEN("every entry is found, and ids in between aren't") {
+	REQUIRE( snapshot != nullptr );
+	REQUIRE( snapshot->size() == count );
+	REQUIRE( snapshot->describe().volumeId == 42 );
+	for (std::uint64_t id = 1; id <= count; id++) {
+	  auto const entry = snapshot->find(2 * id);
+	  REQUIRE( entry.has_value() );
+	  REQUIRE( entry->offset == 64 * id );
+	}
+	REQUIRE( !snapshot->find(3).has_value() );
+	REQUIRE( !snapshot->find(2 * count + 2).has_value() );
+      }
+    }
+
+    WHEN("an entry is damaged") {
+      {
+	std::fstream index(path, std::ios::in | std::ios::out | std::ios::binary);
+	index.seekp(static_cast<std::streamoff>(sizeof(HaystackIndexHeader) + sizeof(HaystackIndexEntry) * (count - 1)));
+	index.put('\x01');
+      }
+      auto const snapshot = HaystackIndexSnapshot::open(path);
+
+      THEN("only searches that touch its chunk throw") {
+	REQUIRE( snapshot != nullptr );
+	REQUIRE( snapshot->find(2)->offset == 64 );
+	REQUIRE_THROWS_AS( snapshot->find(2 * count), CorruptBlockError );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/haystacktransforms.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using TinyCDN::Utility::operator""_kB;
+
+namespace {
+//! Serves a string as a ChunkSource
+class StringSource : public Utility::ChunkSource {
+  const std::string contents;
+
+public:
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override {
+    if (offset >= contents.size()) return 0;
+    auto const amount = std::min<std::size_t>(length, contents.size() - offset);
+    std::memcpy(buffer, contents.data() + offset, amount);
+    return amount;
+  }
+
+  explicit StringSource(std::string contents) : contents(std::move(contents)) {}
+};
+
+//! XORs every byte with a key, which undoes itself
+class XorTransform : public HaystackTransform {
+  const char key;
+
+public:
+  HaystackBlock apply(HaystackBlock block) const override {
+    for (std::size_t i = 0; i < block.size(); i++) block.data()[i] ^= key;
+    return block;
+  }
+
+  explicit XorTransform(char key) : key(key) {}
+};
+
+//! Keeps only the first byte of every block, so blocks come out smaller than they went in
+class FirstByteTransform : public HaystackTransform {
+public:
+  HaystackBlock apply(HaystackBlock block) const override {
+    block.length = std::min<std::size_t>(block.length, 1);
+    return block;
+  }
+};
+
+//! Fails on the block at a given position
+class FailingTransform : public HaystackTransform {
+  const std::uintmax_t failAt;
+
+public:
+  HaystackBlock apply(HaystackBlock block) const override {
+    if (block.position == failAt) throw std::runtime_error("FailingTransform");
+    return block;
+  }
+
+  explicit FailingTransform(std::uintmax_t failAt) : failAt(failAt) {}
+};
+
+std::string randomContents(std::size_t size) {
+  std::string contents(size, '\0');
+  std::mt19937 random{42};
+  for (auto& c : contents) c = static_cast<char>(random());
+  return contents;
+}
+
+//! Runs contents through transforms and concatenates the blocks that come out
+std::string transformAll(const std::string& contents, HaystackTransformChain transforms, std::size_t blockSize,
+                         std::size_t maxInFlight = 4) {
+  HaystackReadWriteCursor cursor(std::make_shared<StringSource>(contents), contents.size(), std::move(transforms),
+                                 blockSize, maxInFlight);
+  std::string result;
+  while (cursor.hasNext()) result.append(cursor.next().get().buffer());
+  return result;
+}
+}
+
+SCENARIO("A HaystackReadWriteCursor runs blocks through a chain of transforms") {
+  GIVEN("100kB of contents") {
+    auto const contents = randomContents(100_kB);
+
+    WHEN("they're transformed without any transforms") {
+      THEN("they come out as they went in") {
+	REQUIRE( transformAll(contents, {}, 4_kB) == contents );
+      }
+    }
+
+    WHEN("they're transformed by a transform and then by its inverse") {
+      auto const xored = std::make_shared<XorTransform>('\x5a');
+
+      THEN("they come out as they went in, for any number of blocks in flight") {
+	REQUIRE( transformAll(contents, {xored}, 4_kB) != contents );
+	REQUIRE( transformAll(contents, {xored, xored}, 4_kB, 1) == contents );
+	REQUIRE( transformAll(contents, {xored, xored}, 4_kB, 16) == contents );
+      }
+    }
+
+    WHEN("a transform changes the size of the blocks") {
+      std::vector<std::uintmax_t> positions;
+      std::string const firsts = [&] {
+	HaystackReadWriteCursor cursor(std::make_shared<StringSource>(contents), contents.size(),
+				       {std::make_shared<FirstByteTransform>()}, 4_kB);
+	std::string result;
+	while (cursor.hasNext()) {
+	  auto const block = cursor.next().get();
+	  positions.push_back(block.position);
+	  result.append(block.buffer());
+	}
+	return result;
+      }();
+
+      THEN("blocks come out in order with their sizes and their positions in the source") {
+	REQUIRE( firsts.size() == 25 );
+	REQUIRE( positions.size() == 25 );
+	for (std::size_t i = 0; i < positions.size(); i++) {
+	  REQUIRE( positions[i] == i * 4_kB );
+	  REQUIRE( firsts[i] == contents[i * 4_kB] );
+	}
+      }
+    }
+
+    WHEN("a transform fails on one block") {
+      HaystackReadWriteCursor cursor(std::make_shared<StringSource>(contents), contents.size(),
+				     {std::make_shared<FailingTransform>(8_kB)}, 4_kB);
+
+      THEN("the blocks before it come out and the failing one throws") {
+	REQUIRE( cursor.next().get().position == 0 );
+	REQUIRE( cursor.next().get().position == 4_kB );
+	REQUIRE_THROWS_AS( cursor.next().get(), std::runtime_error );
+      }
+    }
+
+    WHEN("the source is shorter than the cursor expects") {
+      HaystackReadWriteCursor cursor(std::make_shared<StringSource>(contents.substr(0, 6_kB)), contents.size(), {}, 4_kB);
+
+      THEN("the short block throws") {
+	REQUIRE( cursor.next().get().size() == 4_kB );
+	REQUIRE_THROWS_AS( cursor.next().get(), std::runtime_error );
+      }
+    }
+  }
+}
+
+#ifdef TINYCDN_HAVE_ZSTD
+SCENARIO("Blocks are compressed with zstd") {
+  GIVEN("contents that compress well") {
+    std::string contents;
+    while (contents.size() < 1000_kB) contents += "tinycdn stores needles in haystacks; ";
+
+    WHEN("they're compressed") {
+      auto const compressor = std::make_shared<HaystackZstdCompressor>();
+      auto const decompressor = std::make_shared<HaystackZstdDecompressor>();
+
+      THEN("they shrink, and decompressing every block gives them back") {
+	REQUIRE( transformAll(contents, {compressor}, 64_kB).size() < contents.size() / 10 );
+	REQUIRE( transformAll(contents, {compressor, decompressor}, 64_kB) == contents );
+      }
+    }
+
+    WHEN("a block that isn't a zstd frame is decompressed") {
+      THEN("it throws") {
+	REQUIRE_THROWS_AS( transformAll(contents, {std::make_shared<HaystackZstdDecompressor>()}, 64_kB), std::runtime_error );
+      }
+    }
+  }
+}
+#endif
+
+#ifdef TINYCDN_HAVE_OPENSSL
+SCENARIO("Blocks are encrypted with AES-256 in counter mode") {
+  HaystackAesCtrCipher::Key key{};
+  for (std::size_t i = 0; i < key.size(); i++) key[i] = static_cast<std::uint8_t>(i * 7);
+  HaystackAesCtrCipher::Nonce const nonce{1, 2, 3, 4, 5, 6, 7, 8};
+  auto const cipher = std::make_shared<HaystackAesCtrCipher>(key, nonce);
+
+  GIVEN("100kB of contents encrypted in 4kB blocks") {
+    auto const contents = randomContents(100_kB);
+    auto const encrypted = transformAll(contents, {cipher}, 4_kB);
+
+    THEN("they don't look like the contents and keep their size") {
+      REQUIRE( encrypted.size() == contents.size() );
+      REQUIRE( encrypted != contents );
+    }
+
+    WHEN("they're decrypted in blocks of a different size") {
+      THEN("they come out as they went in") {
+	REQUIRE( transformAll(encrypted, {cipher}, 3_kB + 5) == contents );
+      }
+    }
+
+    WHEN("a range at an odd offset is decrypted on its own") {
+      std::uintmax_t const offset = 12345;
+      std::size_t const length = 777;
+      HaystackBlock block{offset, HaystackBlock::Storage(encrypted.begin() + offset, encrypted.begin() + offset + length), 0, length};
+      auto const decrypted = cipher->apply(std::move(block));
+
+      THEN("it matches the contents at that offset") {
+	REQUIRE( std::string(decrypted.buffer()) == contents.substr(offset, length) );
+      }
+    }
+
+    WHEN("they're decrypted with another nonce") {
+      HaystackAesCtrCipher::Nonce const other{8, 7, 6, 5, 4, 3, 2, 1};
+
+      THEN("they don't come out as they went in") {
+	REQUIRE( transformAll(encrypted, {std::make_shared<HaystackAesCtrCipher>(key, other)}, 4_kB) != contents );
+      }
+    }
+  }
+}
+#endif
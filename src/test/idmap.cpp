@@ -0,0 +1,77 @@
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/idmap.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility::Hashing;
+
+SCENARIO("Ids are stored in an IdMap") {
+  GIVEN("an empty IdMap and a batch of random Ids") {
+    IdMap<Id<64>, int> map;
+    std::vector<Id<64>> ids(5000);
+    RandomIdFactory<Id<64>>()(ids.begin(), ids.end());
+
+    REQUIRE( map.empty() );
+    REQUIRE( map.find(ids[0]) == map.end() );
+
+    WHEN("every Id is inserted") {
+      for (std::size_t i = 0; i < ids.size(); i++) {
+	REQUIRE( map.try_emplace(ids[i], static_cast<int>(i)).second );
+      }
+
+      THEN("every Id can be found with its value and inserting it again does nothing") {
+	REQUIRE( map.size() == ids.size() );
+	for (std::size_t i = 0; i < ids.size(); i++) {
+	  auto it = map.find(ids[i]);
+	  REQUIRE( it != map.end() );
+	  REQUIRE( it->second == static_cast<int>(i) );
+	  REQUIRE_FALSE( map.try_emplace(ids[i], -1).second );
+	}
+      }
+
+      AND_WHEN("every other Id is erased") {
+	for (std::size_t i = 0; i < ids.size(); i += 2) {
+	  REQUIRE( map.erase(ids[i]) == 1 );
+	}
+
+	THEN("only the erased Ids are missing and iteration visits the rest exactly once") {
+	  REQUIRE( map.size() == ids.size() / 2 );
+	  for (std::size_t i = 0; i < ids.size(); i++) {
+	    REQUIRE( map.contains(ids[i]) == (i % 2 == 1) );
+	  }
+
+	  std::size_t visited = 0;
+	  for (auto& kv : map) {
+	    REQUIRE( kv.second % 2 == 1 );
+	    REQUIRE( kv.first == ids[static_cast<std::size_t>(kv.second)] );
+	    visited++;
+	  }
+	  REQUIRE( visited == map.size() );
+	}
+      }
+    }
+  }
+
+  GIVEN("an IdMap of non-movable values behind unique_ptrs") {
+    IdMap<Id<64>, std::unique_ptr<std::shared_mutex>> mutexes;
+    Id<64> id{"a32b8963a2084ba7"};
+
+    WHEN("a mutex is created through operator[] and the map grows") {
+      mutexes[id] = std::make_unique<std::shared_mutex>();
+      auto* mutex = mutexes[id].get();
+      for (int i = 0; i < 100; i++) {
+	mutexes[RandomIdFactory<Id<64>>()()] = std::make_unique<std::shared_mutex>();
+      }
+
+      THEN("the mutex itself did not move") {
+	REQUIRE( mutexes[id].get() == mutex );
+      }
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <experimental/filesystem>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "include/catch.hpp"
+
+#include "src/ioqueue.hpp"
+
+using namespace TinyCDN::Utility;
+
+namespace fs = std::experimental::filesystem;
+
+SCENARIO("Reads and writes are carried out by an IOQueue") {
+  auto const path = fs::temp_directory_path() / "tinycdn-test-ioqueue";
+  fs::remove(path);
+  auto const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  REQUIRE( fd >= 0 );
+
+  // Both implementations have to behave the same, the io_uring one is only there if the kernel allows it
+  std::vector<std::unique_ptr<IOQueue>> queues;
+  queues.push_back(std::make_unique<ThreadPoolIOQueue>());
+  queues.push_back(IOQueue::create(4));
+
+  for (auto& queue : queues) {
+    GIVEN(std::string("a queue on ") + queue->name()) {
+      WHEN("a block is written, synced and read back") {
+	std::string const written(4096, 'q');
+	auto const wrote = queue->submit(IORequest{IORequest::Write, fd, const_cast<char*>(written.data()), written.size(), 8192}).get();
+	auto const synced = queue->submit(IORequest{IORequest::Sync, fd}).get();
+	std::string read(4096, '\0');
+	auto const got = queue->submit(IORequest{IORequest::Read, fd, read.data(), read.size(), 8192}).get();
+
+	THEN("each completes with what the system call would have returned") {
+	  REQUIRE( wrote == 4096 );
+	  REQUIRE( synced == 0 );
+	  REQUIRE( got == 4096 );
+	  REQUIRE( read == written );
+	}
+      }
+
+      WHEN("a read starts past the end of the file") {
+	char buffer[16];
+	auto const got = queue->submit(IORequest{IORequest::Read, fd, buffer, sizeof(buffer), 1 << 20}).get();
+
+	THEN("it reads nothing") {
+	  REQUIRE( got == 0 );
+	}
+      }
+
+      WHEN("a read is on a descriptor that isn't open") {
+	char buffer[16];
+	auto const got = queue->submit(IORequest{IORequest::Read, -1, buffer, sizeof(buffer), 0}).get();
+
+	THEN("it completes with -EBADF") {
+	  REQUIRE( got == -EBADF );
+	}
+      }
+
+      WHEN("many more reads are submitted than the queue keeps outstanding, from several threads") {
+	std::string const block(512, 'r');
+	queue->submit(IORequest{IORequest::Write, fd, const_cast<char*>(block.data()), block.size(), 0}).get();
+
+	std::atomic<std::size_t> completed{0};
+	std::atomic<std::int64_t> bytes{0};
+	std::vector<std::future<void>> submitters;
+	std::vector<std::vector<char>> buffers(4, std::vector<char>(64 * 512));
+	for (int thread = 0; thread < 4; thread++) {
+	  submitters.push_back(std::async(std::launch::async, [&, thread] {
+	    for (int i = 0; i < 64; i++) {
+	      queue->read(fd, buffers[thread].data() + i * 512, 512, 0, [&](std::int64_t result) {
+		bytes += result;
+		completed++;
+	      });
+	    }
+	  }));
+	}
+	for (auto& submitter : submitters) submitter.get();
+	while (completed < 256) std::this_thread::yield();
+
+	THEN("every one of them completes") {
+	  REQUIRE( bytes == 256 * 512 );
+	  for (auto const& buffer : buffers) REQUIRE( std::string(buffer.begin(), buffer.end()) == std::string(64 * 512, 'r') );
+	}
+      }
+    }
+  }
+
+  queues.clear();
+  ::close(fd);
+  fs::remove(path);
+}
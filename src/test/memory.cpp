@@ -0,0 +1,309 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/middlewares/FileStorage/filesystem.hpp"
+#include "src/middlewares/FileStorage/memory.hpp"
+#include "src/middlewares/FileStorage/tiered.hpp"
+#include "src/test/fixtures.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Middleware::FileStorage;
+using namespace TinyCDN::Test;
+using TinyCDN::Utility::operator""_kB;
+using TinyCDN::Utility::operator""_mB;
+
+namespace fs = std::experimental::filesystem;
+
+SCENARIO("A MemoryStorage keeps files in memory within its budget") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-memory";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+
+  GIVEN("a MemoryStorage with a budget of two pages") {
+    MemoryStorage storage(Size{2 * MemoryStorage::pageSize}, root / "memory", false);
+
+    WHEN("a file is added") {
+      auto const added = storage.add(upload(uploads, "favicon.ico", "an icon"));
+      auto const found = storage.lookup(added->id.value());
+
+      THEN("it's read from memory, and the upload is gone") {
+	REQUIRE( found != nullptr );
+	REQUIRE( found->contents != nullptr );
+	REQUIRE( contentsOf(*found) == "an icon" );
+	REQUIRE( found->filename() == "favicon.ico" );
+	REQUIRE( found->digest == Utility::Hashing::Sha256::of("an icon", 7) );
+	REQUIRE( !fs::exists(uploads / "favicon.ico") );
+	REQUIRE( storage.getAllocatedSize() == Size{7} );
+      }
+
+      THEN("it's mapped in place, from its chunk") {
+	auto const mapped = found->map();
+	REQUIRE( mapped.has_value() );
+	REQUIRE( mapped->bytes == "an icon" );
+	REQUIRE( mapped->source == found->contents );
+      }
+    }
+
+    WHEN("an upload that doesn't declare its size is added") {
+      auto const added = storage.add(sizelessUpload(uploads, "hello.txt", "hello world"));
+
+      THEN("all of it is kept, measured from the upload") {
+	REQUIRE( added != nullptr );
+	REQUIRE( added->size == 11 );
+	REQUIRE( contentsOf(*storage.lookup(added->id.value())) == "hello world" );
+	REQUIRE( storage.getAllocatedSize() == Size{11} );
+      }
+    }
+
+    WHEN("files are looked up that are there and that aren't") {
+      auto const added = storage.add(upload(uploads, "hit", "hit"));
+      storage.lookup(added->id.value());
+      storage.lookup(added->id.value());
+      storage.lookup(1000);
+
+      THEN("the hits and misses are counted") {
+	REQUIRE( storage.stats().hits == 2 );
+	REQUIRE( storage.stats().misses == 1 );
+      }
+    }
+
+    WHEN("more is added than the budget allows") {
+      std::vector<std::unique_ptr<StoredFile>> added;
+      for (int i = 0; i < 3; i++) added.push_back(storage.add(upload(uploads, std::to_string(i), std::string(600_kB, 'a' + i))));
+
+      THEN("what doesn't fit is refused, and nothing that was added is given up for it") {
+	REQUIRE( added[0] != nullptr );
+	REQUIRE( added[1] != nullptr );
+	REQUIRE( added[2] == nullptr );
+	REQUIRE( storage.stats().rejections == 1 );
+	REQUIRE( storage.stats().reservedBytes == 2 * MemoryStorage::pageSize );
+	REQUIRE( contentsOf(*storage.lookup(added[0]->id.value())) == std::string(600_kB, 'a') );
+      }
+
+      AND_WHEN("a file is removed") {
+	storage.remove(std::move(added[1]));
+	auto const replacement = storage.add(upload(uploads, "replacement", std::string(600_kB, 'r')));
+
+	THEN("its chunk is reused") {
+	  REQUIRE( replacement != nullptr );
+	  REQUIRE( contentsOf(*replacement) == std::string(600_kB, 'r') );
+	  REQUIRE( storage.stats().reservedBytes == 2 * MemoryStorage::pageSize );
+	}
+      }
+    }
+
+    WHEN("a file larger than a page is added") {
+      auto const added = storage.add(upload(uploads, "large", std::string(MemoryStorage::pageSize + 1, 'l')));
+
+      THEN("it's refused") {
+	REQUIRE( added == nullptr );
+	REQUIRE( storage.stats().reservedBytes == 0 );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("Copies cached in a MemoryStorage are evicted to make room") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-memory-cache";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+
+  auto const copyOf = [&](fileId id, std::size_t size) {
+    auto file = upload(uploads, std::to_string(id), std::string(size, static_cast<char>('a' + id % 26)));
+    file->id = id;
+    return file;
+  };
+
+  GIVEN("a MemoryStorage with a budget of one page, full of cached copies of one size") {
+    MemoryStorage storage(Size{MemoryStorage::pageSize}, root / "memory", false);
+    fileId cached = 0;
+    while (storage.stats().evictions == 0 && cached < 10000) {
+      cached++;
+      storage.cache(cached, *copyOf(cached, 10_kB));
+    }
+    // The last copy took the place of the first
+    REQUIRE( !storage.contains(1) );
+    REQUIRE( storage.stats().files == cached - 1 );
+
+    WHEN("one is looked up before another copy is cached") {
+      storage.lookup(2);
+      storage.cache(cached + 1, *copyOf(cached + 1, 10_kB));
+
+      THEN("the least recently looked up one is evicted instead") {
+	REQUIRE( storage.contains(2) );
+	REQUIRE( !storage.contains(3) );
+	REQUIRE( storage.contains(cached + 1) );
+	REQUIRE( storage.stats().evictions == 2 );
+      }
+    }
+
+    WHEN("a copy is being read when it's evicted and its chunk is needed") {
+      auto const reading = storage.lookup(2);
+      storage.evict(2);
+      for (fileId id = cached + 1; id < cached + 200; id++) storage.cache(id, *copyOf(id, 10_kB));
+
+      THEN("its contents stay as they were until it's done") {
+	REQUIRE( !storage.contains(2) );
+	REQUIRE( contentsOf(*reading) == std::string(10_kB, 'c') );
+      }
+    }
+
+    WHEN("a copy of another size is cached") {
+      auto const cachedLarge = storage.cache(100000, *copyOf(100000, 300_kB));
+
+      THEN("a page is taken from the other size for it, without going past the budget") {
+	REQUIRE( cachedLarge );
+	REQUIRE( contentsOf(*storage.lookup(100000)) == std::string(300_kB, 'a' + 100000 % 26) );
+	REQUIRE( storage.stats().files == 1 );
+	REQUIRE( storage.stats().reservedBytes == MemoryStorage::pageSize );
+      }
+    }
+  }
+
+  GIVEN("a MemoryStorage with a budget of 8 pages") {
+    MemoryStorage storage(Size{8 * MemoryStorage::pageSize}, root / "memory", false);
+
+    WHEN("copies of all sizes are cached") {
+      std::uint64_t peak = 0;
+      for (fileId id = 1; id <= 200; id++) {
+	storage.cache(id, *copyOf(id, (id * 7919) % 256_kB + 1));
+	peak = std::max(peak, storage.stats().reservedBytes);
+      }
+
+      THEN("the budget is never gone past") {
+	REQUIRE( peak <= 8 * MemoryStorage::pageSize );
+	REQUIRE( storage.stats().storedBytes <= 8 * MemoryStorage::pageSize );
+	REQUIRE( storage.stats().files > 0 );
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
+
+SCENARIO("A TieredStorage serves small files from memory in front of a FilesystemStorage") {
+  auto const root = fs::temp_directory_path() / "tinycdn-test-tiered";
+  fs::remove_all(root);
+  auto const uploads = root / "uploads";
+  auto const location = root / "storage";
+  fs::create_directories(location);
+
+  GIVEN("a TieredStorage with a small file and a large one") {
+    {
+      TieredStorage<FilesystemStorage> storage(Size{64_mB}, location, false, Size{4_mB}, 64_kB);
+      auto const small = storage.add(upload(uploads, "sprites.png", "sprites"));
+      auto const large = storage.add(upload(uploads, "video.mp4", std::string(100_kB, 'v')));
+
+      THEN("both are written through to the disk, and only the small one is kept in memory") {
+	REQUIRE( contentsOf(*storage.disk().lookup(small->id.value())) == "sprites" );
+	REQUIRE( contentsOf(*storage.disk().lookup(large->id.value())) == std::string(100_kB, 'v') );
+	REQUIRE( storage.front().contains(small->id.value()) );
+	REQUIRE( !storage.front().contains(large->id.value()) );
+	REQUIRE( storage.getAllocatedSize() == Size{7 + 100_kB} );
+      }
+
+      WHEN("they're looked up") {
+	auto const hit = storage.lookup(1);
+	auto const miss = storage.lookup(2);
+
+	THEN("the small one comes from memory and the large one from the disk") {
+	  REQUIRE( hit->contents != nullptr );
+	  REQUIRE( contentsOf(*hit) == "sprites" );
+	  REQUIRE( hit->filename() == "sprites.png" );
+	  REQUIRE( miss->contents == nullptr );
+	  REQUIRE( contentsOf(*miss) == std::string(100_kB, 'v') );
+	  REQUIRE( storage.memoryStats().hits == 1 );
+	  REQUIRE( storage.memoryStats().misses == 1 );
+	}
+      }
+
+      WHEN("the small one is removed") {
+	storage.remove(storage.lookup(1));
+
+	THEN("it's gone from memory and from the disk") {
+	  REQUIRE( !storage.front().contains(1) );
+	  REQUIRE( storage.lookup(1) == nullptr );
+	  REQUIRE( storage.disk().lookup(1) == nullptr );
+	  REQUIRE( storage.getAllocatedSize() == Size{100_kB} );
+	}
+      }
+    }
+
+    WHEN("it's opened again") {
+      TieredStorage<FilesystemStorage> storage(Size{64_mB}, location, true, Size{4_mB}, 64_kB);
+      auto const first = storage.lookup(1);
+      auto const second = storage.lookup(1);
+
+      THEN("the first lookup misses and caches the file, and the next one hits") {
+	REQUIRE( first->contents == nullptr );
+	REQUIRE( second->contents != nullptr );
+	REQUIRE( contentsOf(*second) == "sprites" );
+	REQUIRE( storage.memoryStats().misses == 1 );
+	REQUIRE( storage.memoryStats().hits == 1 );
+      }
+    }
+  }
+
+  GIVEN("a TieredStorage and uploads that don't declare their size") {
+    TieredStorage<FilesystemStorage> storage(Size{64_mB}, location, false, Size{4_mB}, 64_kB);
+    auto const small = storage.add(sizelessUpload(uploads, "sprites.png", "sprites"));
+    auto const large = storage.add(sizelessUpload(uploads, "video.mp4", std::string(100_kB, 'v')));
+    std::vector<std::unique_ptr<StoredFile>> batch;
+    batch.push_back(sizelessUpload(uploads / "batch", "icon.png", "icon"));
+    auto const batched = storage.addBatch(std::move(batch));
+
+    THEN("what's cached is the whole file, going by the size the backend stored") {
+      auto const hit = storage.lookup(small->id.value());
+      REQUIRE( hit->contents != nullptr );
+      REQUIRE( hit->size == 7 );
+      REQUIRE( contentsOf(*hit) == "sprites" );
+      REQUIRE( contentsOf(*storage.lookup(batched[0]->id.value())) == "icon" );
+      REQUIRE( storage.front().contains(batched[0]->id.value()) );
+      REQUIRE( !storage.front().contains(large->id.value()) );
+      REQUIRE( contentsOf(*storage.lookup(large->id.value())) == std::string(100_kB, 'v') );
+    }
+  }
+
+  GIVEN("a TieredStorage whose files are looked up while they're removed") {
+    TieredStorage<FilesystemStorage> storage(Size{64_mB}, location, false, Size{4_mB}, 64_kB);
+    for (int i = 1; i <= 50; i++) storage.add(upload(uploads / std::to_string(i), "file", std::to_string(i)));
+    storage.front().destroy();
+
+    WHEN("4 threads look them up while they're removed") {
+      std::vector<std::future<void>> readers;
+      for (int thread = 0; thread < 4; thread++) {
+	readers.push_back(std::async(std::launch::async, [&] {
+	  for (int pass = 0; pass < 20; pass++) {
+	    for (fileId id = 1; id <= 50; id++) {
+	      auto const file = storage.lookup(id);
+	      // A file looked up from the disk may have been unlinked by the time it's read
+	      auto const contents = file ? contentsOf(*file) : std::string{};
+	      if (!contents.empty() && contents != std::to_string(id)) throw std::runtime_error("wrong contents");
+	    }
+	  }
+	}));
+      }
+      for (fileId id = 1; id <= 50; id++) {
+	if (auto file = storage.lookup(id)) storage.remove(std::move(file));
+      }
+      for (auto& reader : readers) reader.get();
+
+      THEN("no copy is left of a removed file") {
+	for (fileId id = 1; id <= 50; id++) {
+	  REQUIRE( !storage.front().contains(id) );
+	  REQUIRE( storage.lookup(id) == nullptr );
+	}
+      }
+    }
+  }
+
+  fs::remove_all(root);
+}
@@ -0,0 +1,50 @@
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/stripedlocks.hpp"
+
+using namespace TinyCDN;
+
+SCENARIO("Ids share locks from a fixed table of stripes") {
+  GIVEN("a table of 64 stripes") {
+    auto const locks = std::make_unique<Utility::StripedLocks<64>>();
+
+    THEN("an id always gets the same lock") {
+      for (std::uint64_t id = 0; id < 1000; id++) REQUIRE( &(*locks)[id] == &(*locks)[id] );
+    }
+
+    THEN("consecutive ids are spread over every stripe, each on a cache line of its own") {
+      std::set<const std::shared_mutex*> used;
+      for (std::uint64_t id = 0; id < 1000; id++) used.insert(&(*locks)[id]);
+      REQUIRE( used.size() == 64 );
+
+      for (auto const* lock : used) REQUIRE( reinterpret_cast<std::uintptr_t>(lock) % 64 == 0 );
+    }
+
+    WHEN("many threads take ids' locks at once") {
+      std::vector<std::uint64_t> counters(64, 0);
+      std::vector<std::future<void>> threads;
+      for (int thread = 0; thread < 8; thread++) {
+	threads.push_back(std::async(std::launch::async, [&] {
+	  for (std::uint64_t id = 0; id < 10000; id++) {
+	    std::unique_lock<std::shared_mutex> lock((*locks)[id]);
+	    counters[Utility::StripedLocks<64>::stripeOf(id)]++;
+	  }
+	}));
+      }
+      for (auto& thread : threads) thread.get();
+
+      THEN("every id was counted under its stripe's lock") {
+	std::uint64_t total = 0;
+	for (auto const counter : counters) total += counter;
+	REQUIRE( total == 8 * 10000 );
+      }
+    }
+  }
+}
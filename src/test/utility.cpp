@@ -0,0 +1,210 @@
+#include <experimental/filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "include/catch.hpp"
+
+#include "src/utility.hpp"
+
+using namespace TinyCDN;
+using namespace TinyCDN::Utility;
+
+namespace fs = std::experimental::filesystem;
+
+SCENARIO("A file is served in chunks") {
+  GIVEN("a 100kB file and a ChunkedCursor with 32kB chunks") {
+    std::string const fileName = "chunked.bin";
+    std::string contents(100_kB, '\0');
+    for (std::size_t i = 0; i < contents.size(); i++) contents[i] = static_cast<char>(i / 1024);
+    {
+      std::ofstream file(fileName, std::ios::binary);
+      file << contents;
+    }
+
+    auto source = FileHandle::open(fileName);
+    REQUIRE( source != nullptr );
+    ChunkedCursor cursor(32_kB, contents.size(), 0, source);
+    std::vector<unsigned char> buffer(32_kB);
+
+    auto chunkIs = [&](std::size_t n) {
+      return std::equal(buffer.begin(), buffer.begin() + cursor.forwardsAmount, contents.begin() + n * 32_kB);
+    };
+
+    REQUIRE( cursor.numChunks == 4 );
+
+    WHEN("every chunk is read in order") {
+      std::size_t total = 0;
+      for (std::size_t n = 0; !cursor.isLastChunk; n++) {
+	cursor.nextChunk(buffer.data());
+	REQUIRE( chunkIs(n) );
+	total += cursor.forwardsAmount;
+      }
+
+      THEN("the chunks add up to the file and the last chunk holds the remainder") {
+	REQUIRE( total == contents.size() );
+	REQUIRE( cursor.forwardsAmount == 4_kB );
+      }
+    }
+
+    WHEN("the cursor steps back with prevChunk") {
+      cursor.nextChunk(buffer.data());
+      cursor.nextChunk(buffer.data());
+      cursor.prevChunk(buffer.data());
+
+      THEN("the chunk before the last one is read again") {
+	REQUIRE( cursor.forwardsAmount == 32_kB );
+	REQUIRE( chunkIs(0) );
+
+	cursor.prevChunk(buffer.data());
+	REQUIRE( cursor.forwardsAmount == 0 );
+      }
+    }
+
+    WHEN("the cursor seeks to the last chunk") {
+      REQUIRE( cursor.seekToChunk(3) );
+      REQUIRE_FALSE( cursor.seekToChunk(4) );
+      cursor.nextChunk(buffer.data());
+
+      THEN("only the last chunk is read") {
+	REQUIRE( cursor.isLastChunk );
+	REQUIRE( chunkIs(3) );
+      }
+    }
+
+    WHEN("the same file is opened again while the first handle is held") {
+      auto other = FileHandle::open(fileName);
+
+      THEN("both cursors share one descriptor") {
+	REQUIRE( other == source );
+      }
+    }
+
+    fs::remove(fileName);
+  }
+}
+
+SCENARIO("A file is mapped and read in place") {
+  GIVEN("a 100kB file mapped read-only") {
+    std::string const fileName = "mapped.bin";
+    std::string contents(100_kB, '\0');
+    for (std::size_t i = 0; i < contents.size(); i++) contents[i] = static_cast<char>(i / 1024);
+    std::ofstream(fileName, std::ios::binary) << contents;
+
+    auto mapping = FileMapping::open(fileName);
+    REQUIRE( mapping != nullptr );
+
+    THEN("its view holds the whole file, and reads copy from it") {
+      REQUIRE( mapping->size() == contents.size() );
+      REQUIRE( mapping->view().value() == contents );
+
+      std::vector<unsigned char> buffer(8_kB);
+      REQUIRE( mapping->readAt(buffer.data(), buffer.size(), 96_kB) == 4_kB );
+      REQUIRE( std::equal(buffer.begin(), buffer.begin() + 4_kB, contents.begin() + 96_kB) );
+      REQUIRE( mapping->readAt(buffer.data(), buffer.size(), 100_kB) == 0 );
+    }
+
+    WHEN("a ChunkedCursor views its chunks") {
+      mapping->advise(0, contents.size(), FileMapping::Access::Sequential);
+      ChunkedCursor cursor(32_kB, 40_kB, 60_kB, mapping);
+      auto const first = cursor.viewNextChunk();
+      auto const second = cursor.viewNextChunk();
+
+      THEN("they point into the mapping instead of being copied") {
+	REQUIRE( first.has_value() );
+	REQUIRE( first->data() == mapping->view()->data() + 60_kB );
+	REQUIRE( first.value() == std::string_view(contents).substr(60_kB, 32_kB) );
+	REQUIRE( second.value() == std::string_view(contents).substr(92_kB, 8_kB) );
+	REQUIRE( cursor.isLastChunk );
+	REQUIRE( cursor.viewNextChunk().value().empty() );
+      }
+    }
+
+    WHEN("it's mapped again while the first mapping is held") {
+      auto const other = FileMapping::open(fileName);
+
+      THEN("both share one mapping") {
+	REQUIRE( other == mapping );
+      }
+    }
+
+    WHEN("the file is replaced") {
+      fs::remove(fileName);
+      std::ofstream(fileName, std::ios::binary) << "replaced";
+      auto const other = FileMapping::open(fileName);
+
+      THEN("the new file is mapped, and the old mapping still holds the old contents") {
+	REQUIRE( other != mapping );
+	REQUIRE( other->view().value() == "replaced" );
+	REQUIRE( mapping->view().value() == contents );
+      }
+    }
+
+    WHEN("a ChunkedCursor reads from a source without a view") {
+      ChunkedCursor cursor(32_kB, contents.size(), 0, FileHandle::open(fileName));
+
+      THEN("there's nothing to view, and the cursor doesn't move") {
+	REQUIRE( !cursor.viewNextChunk().has_value() );
+	REQUIRE( cursor.currentChunkNum == 0 );
+      }
+    }
+
+    fs::remove(fileName);
+  }
+
+  GIVEN("an empty file") {
+    std::ofstream("empty.bin", std::ios::binary);
+
+    THEN("it's mapped as an empty view") {
+      auto const mapping = FileMapping::open("empty.bin");
+      REQUIRE( mapping != nullptr );
+      REQUIRE( mapping->view().value().empty() );
+    }
+
+    fs::remove("empty.bin");
+  }
+}
+
+SCENARIO("Values are converted to and from CSV") {
+  GIVEN("a list of types") {
+    std::vector<std::string> const types{"image", "", "video", "audio"};
+
+    WHEN("the list is written as a CSV") {
+      auto const csv = asCSV(types);
+
+      THEN("the values are comma-separated without a trailing comma and read back unchanged") {
+	REQUIRE( csv == "image,,video,audio" );
+	REQUIRE( fromCSV(csv) == types );
+      }
+    }
+
+    WHEN("the CSV is written into a buffer that is too small") {
+      char buffer[8];
+      auto const length = writeCSV(types, buffer, sizeof(buffer));
+
+      THEN("nothing is written and the required length is returned") {
+	REQUIRE( length == 18 );
+      }
+    }
+  }
+
+  GIVEN("CSVs written by the old asCSV") {
+    THEN("the trailing comma does not produce an empty value") {
+      REQUIRE( fromCSV("image,video,") == std::vector<std::string>{"image", "video"} );
+      REQUIRE( fromCSV("image") == std::vector<std::string>{"image"} );
+      REQUIRE( fromCSV("").empty() );
+    }
+  }
+
+  GIVEN("a CSVTokenizer over a string") {
+    std::string const csv = "a,bb,ccc";
+    std::vector<std::string_view> fields;
+    for (auto const field : CSVTokenizer(csv)) fields.push_back(field);
+
+    THEN("the fields point into the original string") {
+      REQUIRE( fields.size() == 3 );
+      REQUIRE( fields[1] == "bb" );
+      REQUIRE( fields[1].data() == csv.data() + 2 );
+    }
+  }
+}
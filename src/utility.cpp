@@ -3,58 +3,233 @@
 #include <vector>
 #include <memory>
 #include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "utility.hpp"
 
 namespace TinyCDN::Utility {
+
+std::shared_ptr<FileHandle> FileHandle::open(const std::string& path) {
+  static std::mutex cacheMutex;
+  static std::unordered_map<std::string, std::weak_ptr<FileHandle>> cache;
+
+  struct stat current;
+  if (::stat(path.c_str(), &current) != 0) return nullptr;
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+
+  if (auto cached = cache[path].lock()) {
+    struct stat opened;
+    if (::fstat(cached->fd, &opened) == 0 && opened.st_ino == current.st_ino && opened.st_dev == current.st_dev) {
+      return cached;
+    }
+  }
+
+  auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    cache.erase(path);
+    return nullptr;
+  }
+
+  auto handle = std::make_shared<FileHandle>(fd);
+  cache[path] = handle;
+
+  // Drop entries whose handles have all been released so the cache stays as small as the open set
+  if (cache.size() > 1024) {
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = it->second.expired() ? cache.erase(it) : std::next(it);
+    }
+  }
+
+  return handle;
+}
+
+std::size_t FileHandle::readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const {
+  std::size_t done = 0;
+  while (done < length) {
+    auto const n = ::pread(fd, buffer + done, length - done, static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    done += static_cast<std::size_t>(n);
+  }
+  return done;
+}
+
+bool FileHandle::writeAt(const void* data, std::size_t length, std::uintmax_t offset) const {
+  auto const* bytes = static_cast<const char*>(data);
+  std::size_t done = 0;
+  while (done < length) {
+    auto const n = ::pwrite(fd, bytes + done, length - done, static_cast<off_t>(offset + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+std::uintmax_t FileHandle::size() const {
+  struct stat st;
+  if (::fstat(fd, &st) != 0) return 0;
+  return static_cast<std::uintmax_t>(st.st_size);
+}
+
+FileHandle::~FileHandle() {
+  ::close(fd);
+}
+
+std::shared_ptr<FileMapping> FileMapping::open(const std::string& path) {
+  static std::mutex cacheMutex;
+  static std::unordered_map<std::string, std::weak_ptr<FileMapping>> cache;
+
+  struct stat current;
+  if (::stat(path.c_str(), &current) != 0) return nullptr;
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+
+  if (auto cached = cache[path].lock()) {
+    if (cached->inode == current.st_ino && cached->device == current.st_dev
+        && cached->length == static_cast<std::uintmax_t>(current.st_size)) {
+      return cached;
+    }
+  }
+
+  auto const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    cache.erase(path);
+    return nullptr;
+  }
+
+  // The mapping holds on to the file by itself, the descriptor is only needed to make it
+  struct stat opened;
+  void* data = nullptr;
+  auto const mapped = ::fstat(fd, &opened) == 0
+    && (opened.st_size == 0 || (data = ::mmap(nullptr, static_cast<std::size_t>(opened.st_size), PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED);
+  ::close(fd);
+  if (!mapped) {
+    cache.erase(path);
+    return nullptr;
+  }
+
+  auto mapping = std::make_shared<FileMapping>(static_cast<const char*>(data), static_cast<std::size_t>(opened.st_size),
+                                               opened.st_dev, opened.st_ino);
+  cache[path] = mapping;
+
+  if (cache.size() > 1024) {
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = it->second.expired() ? cache.erase(it) : std::next(it);
+    }
+  }
+
+  return mapping;
+}
+
+std::size_t FileMapping::readAt(unsigned char* buffer, std::size_t amount, std::uintmax_t offset) const {
+  if (offset >= length) return 0;
+  auto const read = static_cast<std::size_t>(std::min<std::uintmax_t>(amount, length - offset));
+  std::memcpy(buffer, data + offset, read);
+  return read;
+}
+
+void FileMapping::advise(std::uintmax_t offset, std::uintmax_t amount, Access access) const {
+  if (!data || offset >= length) return;
+
+  // madvise takes whole pages
+  static auto const pageSize = static_cast<std::uintmax_t>(::sysconf(_SC_PAGESIZE));
+  auto const begin = offset / pageSize * pageSize;
+  auto const end = std::min<std::uintmax_t>(length, offset + amount);
+  ::madvise(const_cast<char*>(data) + begin, static_cast<std::size_t>(end - begin),
+            access == Access::Sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+FileMapping::~FileMapping() {
+  if (data) ::munmap(const_cast<char*>(data), length);
+}
+
+void syncDirectory(const std::string& directory) {
+  auto const fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return;
+  ::fsync(fd);
+  ::close(fd);
+}
+
   extern "C" {
-    ChunkedCursor::~ChunkedCursor() {
-      handle.close();
+    ChunkedCursor::~ChunkedCursor() = default;
+
+    std::size_t ChunkedCursor::readChunk(std::size_t n, unsigned char* buffer) {
+      if (!source) return 0;
+
+      auto const length = n + 1 == numChunks ? lastChunkSize : bufferSize;
+      auto const offset = startPosition + n * bufferSize;
+
+      return source->readAt(buffer, length, offset);
     }
 
     void ChunkedCursor::prevChunk(unsigned char *buffer) {
-      // TODO
+      // currentChunkNum - 1 was returned last, so the previous chunk is currentChunkNum - 2
+      if (currentChunkNum < 2) {
+        forwardsAmount = 0;
+        return;
+      }
+
+      seekToChunk(currentChunkNum - 2);
+      nextChunk(buffer);
     }
 
     void ChunkedCursor::nextChunk(unsigned char *buffer) {
+      if (currentChunkNum >= numChunks) {
+        forwardsAmount = 0;
+        isLastChunk = true;
+        return;
+      }
+
+      forwardsAmount = readChunk(currentChunkNum, buffer);
+      isLastChunk = numChunks <= ++currentChunkNum;
+      seekPosition = startPosition + currentChunkNum * bufferSize;
+    }
+
+    std::optional<std::string_view> ChunkedCursor::viewNextChunk() {
+      auto const bytes = source ? source->view() : std::nullopt;
+      if (!bytes.has_value()) return {};
+
+      if (currentChunkNum >= numChunks) {
+        forwardsAmount = 0;
+        isLastChunk = true;
+        return std::string_view{};
+      }
+
+      auto const length = currentChunkNum + 1 == numChunks ? lastChunkSize : bufferSize;
+      auto const offset = startPosition + currentChunkNum * bufferSize;
+      auto const chunk = offset < bytes->size() ? bytes->substr(offset, length) : std::string_view{};
+
+      forwardsAmount = chunk.size();
       isLastChunk = numChunks <= ++currentChunkNum;
-      forwardsAmount = isLastChunk ? lastChunkSize : bufferSize;
+      seekPosition = startPosition + currentChunkNum * bufferSize;
+      return chunk;
+    }
 
-      handle.seekg(seekPosition);
+    bool ChunkedCursor::seekToChunk(std::size_t n) {
+      if (n >= numChunks) return false;
 
-      handle.read(reinterpret_cast<char*>(buffer), forwardsAmount * sizeof(char));
-      seekPosition += forwardsAmount;
+      currentChunkNum = n;
+      isLastChunk = false;
+      seekPosition = startPosition + n * bufferSize;
+      return true;
     }
   }
 
-std::vector<std::string> fromCSV(std::string csv) {
+std::vector<std::string> fromCSV(std::string_view csv) {
   std::vector<std::string> values;
 
-  // Check if there is only one value, or no value at all
-  if (csv.length() != 0) {
-    auto nextComma = csv.find(',');
-
-    if (nextComma == std::string::npos) {
-      // One value case
-      values.push_back(csv);
-    }
-    else {
-      // append head of CSV first
-      values.push_back(csv.substr(0, nextComma));
-      // initial value for next CSV
-      auto nextCSV = csv.substr(nextComma+1);
-      nextComma = nextCSV.find(',');
-
-      while(nextComma != std::string::npos) {
-        values.push_back(nextCSV.substr(nextComma));
-
-        nextCSV = nextCSV.substr(nextComma+1);
-        nextComma = nextCSV.find(',');
-      };
-
-      // append tail of CSV
-      values.push_back(nextCSV);
-    }
+  for (auto const field : CSVTokenizer(csv)) {
+    values.emplace_back(field);
   }
 
   return values;
@@ -3,55 +3,187 @@
 #include <vector>
 #include <string>
 #include <cstdint>
-#include <fstream>
-#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string_view>
+#include <iterator>
+#include <algorithm>
 
 namespace TinyCDN::Utility {
 
+//! Anything a ChunkedCursor can read chunks from at an absolute offset
+class ChunkSource {
+public:
+  //! Reads up to length bytes at offset into buffer and returns how many were read, 0 at the end or on error
+  virtual std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const = 0;
+  //! All of the bytes, for sources that have them in memory already, so they can be read without copying them
+  virtual std::optional<std::string_view> view() const { return {}; }
+
+  virtual ~ChunkSource() = default;
+};
+
+/*!
+ * \brief A read-only file descriptor shared by everything reading the same file
+ * Reads go through pread, which takes its own offset, so there is no stream state and any number of
+ * cursors can read from one FileHandle concurrently.
+ */
+class FileHandle : public ChunkSource {
+public:
+  /*!
+   * \brief Returns the open handle for path, opening it only if no one holds one yet
+   * A cached handle is only reused while path still names the same inode, so a replaced file is reopened.
+   * \return nullptr if the file can't be opened
+   */
+  static std::shared_ptr<FileHandle> open(const std::string& path);
+
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override;
+  //! Writes all of data at offset, for handles on files opened for writing
+  bool writeAt(const void* data, std::size_t length, std::uintmax_t offset) const;
+
+  inline int descriptor() const noexcept { return fd; }
+  std::uintmax_t size() const;
+
+  explicit FileHandle(int fd) : fd(fd) {}
+  FileHandle(const FileHandle&) = delete;
+  FileHandle& operator=(const FileHandle&) = delete;
+  ~FileHandle();
+
+private:
+  int fd;
+};
+
+/*!
+ * \brief A read-only mapping of a whole file, shared by everything reading the same file
+ * The bytes are read straight out of the page cache, through view() or readAt(). The mapping keeps the file's
+ * contents around after it's unlinked, but a file mustn't be truncated while it's mapped, as reading past its new end
+ * faults; storages only ever unlink or replace the files they map.
+ */
+class FileMapping : public ChunkSource {
+public:
+  //! How a range of the mapping is going to be read, so the kernel reads ahead or doesn't
+  enum class Access { Sequential, Random };
+
+  /*!
+   * \brief Returns the mapping of path, mapping it only if no one holds one yet
+   * Like FileHandle::open, a cached mapping is only reused while path still names the same inode, of the same size.
+   * \return nullptr if the file can't be opened or mapped
+   */
+  static std::shared_ptr<FileMapping> open(const std::string& path);
+
+  std::size_t readAt(unsigned char* buffer, std::size_t length, std::uintmax_t offset) const override;
+  inline std::optional<std::string_view> view() const override { return std::string_view{data, length}; }
+  inline std::uintmax_t size() const noexcept { return length; }
+
+  //! Tells the kernel how the bytes from offset on are going to be read, the advice is for the whole mapping's pages
+  void advise(std::uintmax_t offset, std::uintmax_t amount, Access access) const;
+
+  FileMapping(const char* data, std::size_t length, std::uint64_t device, std::uint64_t inode)
+    : data(data), length(length), device(device), inode(inode) {}
+  FileMapping(const FileMapping&) = delete;
+  FileMapping& operator=(const FileMapping&) = delete;
+  ~FileMapping();
+
+private:
+  //! nullptr for an empty file, which can't be mapped
+  const char* const data;
+  const std::size_t length;
+  const std::uint64_t device;
+  const std::uint64_t inode;
+};
+
+//! Makes renames and new files inside directory durable
+void syncDirectory(const std::string& directory);
+
 extern "C" {
+  /*!
+   * \brief Serves a file, or a byte range within one, as a sequence of fixed-size chunks
+   * Every chunk is a single readAt() on a shared ChunkSource, so chunks can be read in any order:
+   * seekToChunk() jumps for scrubbing or resumed downloads, and prevChunk() steps back.
+   */
   struct ChunkedCursor {
     std::size_t bufferSize;
     std::uintmax_t size;
+    //! Where the next nextChunk() reads from
     std::size_t seekPosition;
-    std::ifstream handle;
+    std::shared_ptr<const ChunkSource> source;
 
     std::size_t numChunks = 0;
     bool isLastChunk = false;
+    //! Length of the chunk returned by the last nextChunk()/prevChunk()
     std::size_t forwardsAmount = 0;
+    //! Index of the chunk the next nextChunk() returns
     size_t currentChunkNum = 0;
     std::size_t lastChunkSize;
 
-    inline ChunkedCursor(std::size_t bufferSize,
-                         std::uintmax_t size,
-                         std::size_t seekPosition)
-      : bufferSize(bufferSize),
-        size(size),
-        seekPosition(seekPosition),
-        numChunks(size / bufferSize + 1),
-        lastChunkSize(size % bufferSize) {
-    }
-
     inline ChunkedCursor(std::size_t bufferSize,
                          std::uintmax_t size,
                          std::size_t seekPosition,
-                         std::function<void(std::ifstream&)> setupStream)
+                         std::shared_ptr<const ChunkSource> source)
       : bufferSize(bufferSize),
         size(size),
         seekPosition(seekPosition),
-        numChunks(size / bufferSize + 1),
-        lastChunkSize(size % bufferSize) {
-      setupStream(handle);
+        source(std::move(source)),
+        numChunks(size == 0 ? 1 : (size + bufferSize - 1) / bufferSize),
+        lastChunkSize(size - (numChunks - 1) * bufferSize),
+        startPosition(seekPosition) {
     }
 
     ~ChunkedCursor();
 
+    //! Reads the chunk before the one last returned, forwardsAmount is 0 if there is none
     void prevChunk(unsigned char* buffer);
     void nextChunk(unsigned char* buffer);
+    /*!
+     * \brief Like nextChunk(), but returns the chunk where the source keeps it instead of copying it into a buffer
+     * The chunk stays valid for as long as the source does.
+     * \return Nothing, without moving on, if the source has no view() of its bytes
+     */
+    std::optional<std::string_view> viewNextChunk();
+    //! Makes chunk n the next one nextChunk() returns, returns false if n is past the last chunk
+    bool seekToChunk(std::size_t n);
+
+  private:
+    //! Offset of chunk 0 in the source
+    std::size_t startPosition;
+
+    //! Reads chunk n into buffer and returns its length
+    std::size_t readChunk(std::size_t n, unsigned char* buffer);
   };
 }
 
 typedef const uintmax_t Size;
 
+/*!
+ * \brief Allocates storage aligned to alignment bytes, i.e. page-aligned buffers for O_DIRECT
+ * \code std::vector<char, AlignedAllocator<char, 4096>> buffer(64_kB); \endcode
+ */
+template <typename T, std::size_t alignment>
+class AlignedAllocator {
+public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = AlignedAllocator<U, alignment>;
+  };
+
+  inline T* allocate(std::size_t n) {
+    return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{alignment}));
+  }
+
+  inline void deallocate(T* p, std::size_t) noexcept {
+    ::operator delete(p, std::align_val_t{alignment});
+  }
+
+  inline bool operator==(const AlignedAllocator&) const noexcept { return true; }
+  inline bool operator!=(const AlignedAllocator&) const noexcept { return false; }
+
+  AlignedAllocator() noexcept = default;
+  template <typename U>
+  inline AlignedAllocator(const AlignedAllocator<U, alignment>&) noexcept {}
+};
+
 constexpr std::size_t operator""_kB(unsigned long long v) {
   return 1024u * v;
 }
@@ -64,30 +196,114 @@ constexpr std::size_t operator""_gB(unsigned long long v) {
   return 1073741824 * v;
 }
 
+/*!
+ * \brief Splits a comma-separated string into fields without copying or allocating
+ * Each field is a std::string_view into the original buffer, which has to outlive the tokenizer.
+ * A single trailing comma, which asCSV used to write after the last value, doesn't produce an empty last field.
+ */
+class CSVTokenizer {
+public:
+  class iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+
+    inline reference operator*() const noexcept { return field; }
+    inline pointer operator->() const noexcept { return &field; }
+
+    inline iterator& operator++() noexcept {
+      next();
+      return *this;
+    }
+
+    inline bool operator==(const iterator& rhs) const noexcept { return position == rhs.position; }
+    inline bool operator!=(const iterator& rhs) const noexcept { return position != rhs.position; }
+
+    //! Starts at the first field of csv, or at the end for an empty csv
+    inline iterator(std::string_view csv, std::size_t position) noexcept : csv(csv), position(position) {
+      if (position < csv.size()) findField();
+    }
+
+  private:
+    std::string_view csv;
+    //! Where the current field starts, csv.size() once there are no more fields
+    std::size_t position;
+    std::string_view field;
+
+    inline void findField() noexcept {
+      auto comma = csv.find(',', position);
+      if (comma == std::string_view::npos) comma = csv.size();
+      field = csv.substr(position, comma - position);
+    }
+
+    inline void next() noexcept {
+      position += field.size() + 1;
+      // Also stops after a trailing comma
+      if (position >= csv.size()) {
+        position = csv.size();
+        return;
+      }
+      findField();
+    }
+  };
+
+  inline iterator begin() const noexcept { return iterator{csv, 0}; }
+  inline iterator end() const noexcept { return iterator{csv, csv.size()}; }
+
+  inline explicit CSVTokenizer(std::string_view csv) noexcept : csv(csv) {}
+
+private:
+  std::string_view csv;
+};
+
+//! The number of characters writeCSV needs for container
+template <typename t>
+inline std::size_t csvLength(const t& container) {
+  std::size_t length = 0;
+  for (auto const& elem : container) {
+    length += std::string_view(elem).size() + 1;
+  }
+  return length == 0 ? 0 : length - 1;
+}
+
+/*!
+ * \brief Writes container's values, comma-separated, into a caller-supplied buffer
+ * Nothing is written if the CSV doesn't fit, so callers can size the buffer with the return value and try again.
+ * \return The length of the CSV, which is the number of characters written if it is <= capacity
+ */
+template <typename t>
+inline std::size_t writeCSV(const t& container, char* out, std::size_t capacity) {
+  auto const length = csvLength(container);
+  if (length > capacity) return length;
+
+  bool first = true;
+  for (auto const& elem : container) {
+    if (!first) *out++ = ',';
+    first = false;
+
+    std::string_view const value(elem);
+    out = std::copy(value.begin(), value.end(), out);
+  }
+  return length;
+}
+
 /*! Takes a container and converts to a comma-separated string
  * Treats a comma'd string value as a container of string-convertible values.
  * Overload for specific types to create k-tuples from stored text
  * This is used to convert structures into a format that can be created at run-time by reading from a file.
  */
 template <typename t>
-inline std::string asCSV(t container) {
-  std::string csv;
-
-  // TODO optimize
-  if (container.size() == 1) {
-    csv.append(container[0]);
-    return csv;
-  }
-
-  for (auto elem : container) {
-    // TODO don't cast here, use a "statusfield"
-    csv.append(static_cast<std::string>(elem));
-    csv.append(",");
-  }
+inline std::string asCSV(const t& container) {
+  std::string csv(csvLength(container), ',');
+  writeCSV(container, csv.data(), csv.size());
   return csv;
 };
 
 /*! Takes a comma-separated string and outputs a vector of the string's values
+ * Use CSVTokenizer directly to avoid copying the values.
  */
-std::vector<std::string> fromCSV(std::string csv);
+std::vector<std::string> fromCSV(std::string_view csv);
 }